@@ -0,0 +1,347 @@
+/*
+    Yojimbo Benchmarks.
+
+    Copyright © 2016 - 2019, The Network Protocol Company, Inc.
+
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+        1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+        2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer 
+           in the documentation and/or other materials provided with the distribution.
+
+        3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived 
+           from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+    INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+    USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "yojimbo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include "shared.h"
+#include "netcode.h"
+
+using namespace yojimbo;
+
+/*
+    Wraps the TLSF allocator to track how many bytes each client slot actually uses.
+ */
+
+class BenchmarkAllocator : public TLSF_Allocator
+{
+public:
+
+    BenchmarkAllocator( void * memory, size_t bytes ) : TLSF_Allocator( memory, bytes )
+    {
+        currentBytes = 0;
+        peakBytes = 0;
+    }
+
+    void * Allocate( size_t size, const char * file, int line )
+    {
+        void * p = TLSF_Allocator::Allocate( size + 16, file, line );
+        if ( !p )
+            return NULL;
+        *( (size_t*) p ) = size;
+        currentBytes += size;
+        if ( currentBytes > peakBytes )
+            peakBytes = currentBytes;
+        return ( (uint8_t*) p ) + 16;
+    }
+
+    void Free( void * p, const char * file, int line )
+    {
+        if ( !p )
+            return;
+        uint8_t * block = ( (uint8_t*) p ) - 16;
+        currentBytes -= *( (size_t*) block );
+        TLSF_Allocator::Free( block, file, line );
+    }
+
+    size_t currentBytes;
+    size_t peakBytes;
+};
+
+class BenchmarkAdapter : public Adapter
+{
+public:
+
+    int numAllocators;
+    BenchmarkAllocator * allocators[NETCODE_MAX_CLIENTS+1];
+
+    BenchmarkAdapter()
+    {
+        numAllocators = 0;
+    }
+
+    Allocator * CreateAllocator( Allocator & allocator, void * memory, size_t bytes )
+    {
+        BenchmarkAllocator * benchmarkAllocator = YOJIMBO_NEW( allocator, BenchmarkAllocator, memory, bytes );
+        if ( numAllocators < NETCODE_MAX_CLIENTS + 1 )
+            allocators[numAllocators++] = benchmarkAllocator;
+        return benchmarkAllocator;
+    }
+
+    MessageFactory * CreateMessageFactory( Allocator & allocator )
+    {
+        return YOJIMBO_NEW( allocator, TestMessageFactory, allocator );
+    }
+
+    void ServerSendLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        // packets sent to loopback clients are dropped. the benchmark only measures the server side
+
+        (void) clientIndex;
+        (void) packetData;
+        (void) packetBytes;
+        (void) packetSequence;
+    }
+};
+
+double TickServer( Server & server, double & time, int numTicks, bool sendMessages )
+{
+    const double deltaTime = 1.0 / 60.0;
+
+    const double startTime = yojimbo_time();
+
+    for ( int i = 0; i < numTicks; ++i )
+    {
+        time += deltaTime;
+
+        server.AdvanceTime( time );
+        server.ReceivePackets();
+
+        if ( sendMessages )
+        {
+            for ( int clientIndex = 0; clientIndex < server.GetMaxClients(); ++clientIndex )
+            {
+                if ( !server.IsClientConnected( clientIndex ) || !server.CanSendMessage( clientIndex, 0 ) )
+                    continue;
+
+                TestMessage * message = (TestMessage*) server.CreateMessage( clientIndex, TEST_MESSAGE );
+                if ( !message )
+                    continue;
+
+                message->sequence = uint16_t( i );
+                server.SendMessage( clientIndex, 0, message );
+            }
+        }
+
+        server.SendPackets();
+    }
+
+    return ( yojimbo_time() - startTime ) / numTicks;
+}
+
+int BenchmarkBitpacker()
+{
+    printf( "\nbitpacker\n\n" );
+
+    const int NumValues = 64 * 1024;
+    const int NumIterations = 100;
+    const int BufferSize = NumValues * 4;
+
+    uint32_t * values = (uint32_t*) malloc( NumValues * sizeof( uint32_t ) );
+    uint32_t * readValues = (uint32_t*) malloc( NumValues * sizeof( uint32_t ) );
+    uint8_t * buffer = (uint8_t*) malloc( BufferSize );
+    uint8_t * arrayBuffer = (uint8_t*) malloc( BufferSize );
+
+    int result = 0;
+
+    const int bitsToTest[] = { 1, 5, 10, 16, 23, 32 };
+
+    for ( int j = 0; j < (int) ( sizeof( bitsToTest ) / sizeof( bitsToTest[0] ) ); ++j )
+    {
+        const int bits = bitsToTest[j];
+
+        for ( int i = 0; i < NumValues; ++i )
+            values[i] = uint32_t( rand() ) & uint32_t( ( 1ULL << bits ) - 1 );
+
+        double startTime = yojimbo_time();
+        for ( int iteration = 0; iteration < NumIterations; ++iteration )
+        {
+            BitWriter writer( buffer, BufferSize );
+            for ( int i = 0; i < NumValues; ++i )
+                writer.WriteBits( values[i], bits );
+            writer.FlushBits();
+        }
+        const double writeBitsTime = yojimbo_time() - startTime;
+
+        startTime = yojimbo_time();
+        for ( int iteration = 0; iteration < NumIterations; ++iteration )
+        {
+            BitWriter writer( arrayBuffer, BufferSize );
+            writer.WriteBitsArray( values, NumValues, bits );
+            writer.FlushBits();
+        }
+        const double writeBitsArrayTime = yojimbo_time() - startTime;
+
+        const int bytesWritten = ( NumValues * bits + 7 ) / 8;
+
+        if ( memcmp( buffer, arrayBuffer, bytesWritten ) != 0 )
+        {
+            printf( "error: WriteBitsArray output differs from WriteBits for %d bit values\n", bits );
+            result = 1;
+            break;
+        }
+
+        startTime = yojimbo_time();
+        for ( int iteration = 0; iteration < NumIterations; ++iteration )
+        {
+            BitReader reader( buffer, bytesWritten );
+            for ( int i = 0; i < NumValues; ++i )
+                readValues[i] = reader.ReadBits( bits );
+        }
+        const double readBitsTime = yojimbo_time() - startTime;
+
+        startTime = yojimbo_time();
+        for ( int iteration = 0; iteration < NumIterations; ++iteration )
+        {
+            BitReader reader( buffer, bytesWritten );
+            reader.ReadBitsArray( readValues, NumValues, bits );
+        }
+        const double readBitsArrayTime = yojimbo_time() - startTime;
+
+        if ( memcmp( values, readValues, NumValues * sizeof( uint32_t ) ) != 0 )
+        {
+            printf( "error: ReadBitsArray read different values for %d bit values\n", bits );
+            result = 1;
+            break;
+        }
+
+        const double nanosecondsPerValue = 1000000000.0 / ( double( NumValues ) * NumIterations );
+
+        printf( "%2d bits: write %.2fns -> %.2fns (%.1fx), read %.2fns -> %.2fns (%.1fx) per value\n", bits,
+            writeBitsTime * nanosecondsPerValue, writeBitsArrayTime * nanosecondsPerValue, writeBitsTime / writeBitsArrayTime,
+            readBitsTime * nanosecondsPerValue, readBitsArrayTime * nanosecondsPerValue, readBitsTime / readBitsArrayTime );
+    }
+
+    free( values );
+    free( readValues );
+    free( buffer );
+    free( arrayBuffer );
+
+    return result;
+}
+
+int BenchmarkServer( int numClients )
+{
+    printf( "\nserver with %d client slots\n\n", numClients );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.serverPerClientMemory = 1024 * 1024;
+    config.networkSimulator = false;
+
+    BenchmarkAdapter benchmarkAdapter;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, Address( "127.0.0.1", ServerPort ), config, benchmarkAdapter, time );
+
+    const double startTime = yojimbo_time();
+
+    server.Start( numClients );
+
+    if ( !server.IsRunning() )
+        return 1;
+
+    printf( "start: %.2fms\n", ( yojimbo_time() - startTime ) * 1000.0 );
+
+    const int NumTicks = 600;
+
+    double tickTime = TickServer( server, time, NumTicks, false );
+
+    printf( "tick with no clients connected: %.3fms\n", tickTime * 1000.0 );
+
+    for ( int clientIndex = 0; clientIndex < numClients; ++clientIndex )
+    {
+        server.ConnectLoopbackClient( clientIndex, uint64_t( clientIndex + 1 ), NULL );
+    }
+
+    tickTime = TickServer( server, time, NumTicks, true );
+
+    printf( "tick with %d clients connected: %.3fms (%.2fus per client)\n", server.GetNumConnectedClients(), tickTime * 1000.0, tickTime * 1000000.0 / numClients );
+
+    // the first allocator created is the global allocator. the rest belong to client slots
+
+    size_t peakBytes = 0;
+    size_t maxPeakBytes = 0;
+    for ( int i = 1; i < benchmarkAdapter.numAllocators; ++i )
+    {
+        peakBytes += benchmarkAdapter.allocators[i]->peakBytes;
+        maxPeakBytes = yojimbo_max( maxPeakBytes, benchmarkAdapter.allocators[i]->peakBytes );
+    }
+
+    const int numClientAllocators = benchmarkAdapter.numAllocators - 1;
+
+    if ( numClientAllocators > 0 )
+    {
+        printf( "per-client memory used: %.1fkb average, %.1fkb peak (of %dkb reserved)\n", 
+            peakBytes / 1024.0 / numClientAllocators, maxPeakBytes / 1024.0, config.serverPerClientMemory / 1024 );
+    }
+
+    for ( int clientIndex = 0; clientIndex < numClients; ++clientIndex )
+    {
+        server.DisconnectLoopbackClient( clientIndex );
+    }
+
+    server.Stop();
+
+    return 0;
+}
+
+int main( int argc, char * argv[] )
+{
+    printf( "\n[benchmark]\n" );
+
+    int numClients = 1024;
+
+    if ( argc == 2 )
+        numClients = atoi( argv[1] );
+
+    if ( numClients > NETCODE_MAX_CLIENTS )
+    {
+        printf( "\nnetcode.io supports up to %d clients. rebuild with a larger NETCODE_MAX_CLIENTS to benchmark %d clients\n", NETCODE_MAX_CLIENTS, numClients );
+        numClients = NETCODE_MAX_CLIENTS;
+    }
+
+    if ( numClients <= 0 )
+    {
+        printf( "error: number of clients must be positive\n" );
+        return 1;
+    }
+
+    if ( !InitializeYojimbo() )
+    {
+        printf( "error: failed to initialize Yojimbo!\n" );
+        return 1;
+    }
+
+    yojimbo_log_level( YOJIMBO_LOG_LEVEL_NONE );
+
+    srand( (unsigned int) time( NULL ) );
+
+    int result = BenchmarkBitpacker();
+
+    if ( result == 0 )
+        result = BenchmarkServer( numClients );
+
+    ShutdownYojimbo();
+
+    printf( "\n" );
+
+    return result;
+}
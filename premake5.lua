@@ -14,6 +14,7 @@ solution "Yojimbo"
     else
         includedirs { ".", "/usr/local/include", "netcode.io", "reliable.io" }
         targetdir "bin/"  
+        links { "pthread" }
     end
     rtti "Off"
     links { libs }
@@ -63,6 +64,14 @@ project "soak"
     files { "soak.cpp", "shared.h" }
     links { "yojimbo" }
 
+project "benchmark"
+    files { "benchmark.cpp", "shared.h" }
+    links { "yojimbo" }
+
+project "replay"
+    files { "replay.cpp", "shared.h" }
+    links { "yojimbo" }
+
 if not os.istarget "windows" then
 
     -- MacOSX and Linux.
@@ -103,6 +112,30 @@ if not os.istarget "windows" then
         end
     }
 
+    newaction
+    {
+        trigger     = "benchmark",
+        description = "Build and run benchmarks",     
+        execute = function ()
+            os.execute "test ! -e Makefile && premake5 gmake"
+            if os.execute "make -j32 benchmark" then
+                os.execute "./bin/benchmark"
+            end
+        end
+    }
+
+    newaction
+    {
+        trigger     = "replay",
+        description = "Build and run packet trace replay benchmark",
+        execute = function ()
+            os.execute "test ! -e Makefile && premake5 gmake"
+            if os.execute "make -j32 replay" then
+                os.execute "./bin/replay"
+            end
+        end
+    }
+
     newoption 
     {
         trigger     = "serverAddress",
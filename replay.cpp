@@ -0,0 +1,250 @@
+/*
+    Yojimbo Packet Replay.
+
+    Copyright © 2016 - 2019, The Network Protocol Company, Inc.
+
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+        1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+        2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer
+           in the documentation and/or other materials provided with the distribution.
+
+        3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived
+           from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+    INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+    USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "yojimbo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "shared.h"
+
+using namespace yojimbo;
+
+/*
+    Replays a packet trace written by PacketCapture into a fresh connection, as fast as possible.
+
+    This measures packet read and message receive. It does not measure ack processing: the fresh connection
+    never sent the packets the captured acks refer to, so the acks find nothing in flight.
+
+    The connection is created with the same config and message factory as the client and server examples.
+    To replay traces captured from your own game, change them to match your game's connection config and message factory.
+
+    With no trace file, a trace is generated first by sending messages and blocks between two connections with packet loss.
+*/
+
+const char * GeneratedTraceFilename = "replay_trace.bin";
+
+bool GenerateTrace( const char * filename, const ConnectionConfig & config )
+{
+    printf( "\ngenerating %s\n", filename );
+
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, config, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, config, time );
+
+    PacketCapture capture;
+    if ( !capture.Open( filename, config ) )
+        return false;
+
+    receiver.SetPacketCapture( &capture );
+
+    RandomGenerator random( 1 );
+
+    uint8_t * packetData = (uint8_t*) malloc( config.maxPacketSize );
+
+    const int NumIterations = 60 * 60;
+    const int PacketLossPercent = 5;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+    uint16_t numMessagesSent = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        for ( int j = random.NextInt( 0, 8 ); j > 0 && sender.CanSendMessage( 0 ); --j )
+        {
+            if ( random.NextInt( 0, 31 ) )
+            {
+                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+                if ( !message )
+                    break;
+                message->sequence = numMessagesSent++;
+                sender.SendMessage( 0, message );
+            }
+            else
+            {
+                TestBlockMessage * blockMessage = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+                if ( !blockMessage )
+                    break;
+                blockMessage->sequence = numMessagesSent++;
+                const int blockSize = random.NextInt( 1, 4 * 1024 );
+                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+                for ( int k = 0; k < blockSize; ++k )
+                    blockData[k] = uint8_t( k );
+                blockMessage->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+                sender.SendMessage( 0, blockMessage );
+            }
+        }
+
+        int packetBytes;
+
+        if ( sender.GeneratePacket( NULL, senderSequence, packetData, config.maxPacketSize, packetBytes ) && random.NextInt( 0, 99 ) >= PacketLossPercent )
+        {
+            receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes );
+            sender.ProcessAcks( &senderSequence, 1 );
+        }
+
+        if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, config.maxPacketSize, packetBytes ) && random.NextInt( 0, 99 ) >= PacketLossPercent )
+        {
+            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
+            receiver.ProcessAcks( &receiverSequence, 1 );
+        }
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+            receiver.ReleaseMessage( message );
+        }
+
+        time += 1.0 / 60.0;
+
+        sender.AdvanceTime( time );
+        receiver.AdvanceTime( time );
+
+        senderSequence++;
+        receiverSequence++;
+    }
+
+    receiver.SetPacketCapture( NULL );
+
+    free( packetData );
+
+    printf( "%" PRIu64 " records, %.1fkb\n", capture.GetNumRecords(), capture.GetBytesWritten() / 1024.0 );
+
+    return true;
+}
+
+int ReplayMain( const char * filename, int numIterations )
+{
+    ClientServerConfig config;
+
+    if ( !filename )
+    {
+        if ( !GenerateTrace( GeneratedTraceFilename, config ) )
+        {
+            printf( "error: failed to generate trace\n" );
+            return 1;
+        }
+        filename = GeneratedTraceFilename;
+    }
+
+    PacketReplay replay( GetDefaultAllocator() );
+
+    if ( !replay.Load( filename ) )
+    {
+        printf( "error: failed to load trace %s\n", filename );
+        return 1;
+    }
+
+    if ( replay.GetNumChannels() != config.numChannels || replay.GetMaxPacketSize() > config.maxPacketSize )
+    {
+        printf( "error: trace was captured with %d channels and %d byte packets. the replay connection has %d channels and %d byte packets\n",
+            replay.GetNumChannels(), replay.GetMaxPacketSize(), config.numChannels, config.maxPacketSize );
+        return 1;
+    }
+
+    const int numPackets = replay.GetNumRecords( PACKET_TRACE_RECEIVED );
+    const uint64_t packetBytes = replay.GetPacketBytes( PACKET_TRACE_RECEIVED );
+
+    printf( "\nreplaying %s: %d packets (%.1fkb), %d iterations\n", filename, numPackets, packetBytes / 1024.0, numIterations );
+    printf( "measuring packet read and message receive. the %d ack records are replayed but not measured: nothing they ack is in flight\n\n",
+        replay.GetNumRecords( PACKET_TRACE_ACKS ) );
+
+    double totalTime = 0.0;
+    double bestTime = 0.0;
+
+    for ( int i = 0; i < numIterations; ++i )
+    {
+        TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+        Connection connection( GetDefaultAllocator(), messageFactory, config, 0.0 );
+
+        const double startTime = yojimbo_time();
+
+        const int result = replay.Replay( connection );
+
+        const double replayTime = yojimbo_time() - startTime;
+
+        if ( result < 0 )
+        {
+            printf( "error: connection went into error state %d during replay\n", connection.GetErrorLevel() );
+            return 1;
+        }
+
+        totalTime += replayTime;
+        if ( i == 0 || replayTime < bestTime )
+            bestTime = replayTime;
+    }
+
+    if ( numPackets > 0 && bestTime > 0.0 )
+    {
+        printf( "average %.3fms, best %.3fms per replay\n", totalTime * 1000.0 / numIterations, bestTime * 1000.0 );
+        printf( "%.0f packets per second, %.1fmb per second, %.0fns per packet\n",
+            numPackets / bestTime, packetBytes / bestTime / ( 1024.0 * 1024.0 ), bestTime * 1000000000.0 / numPackets );
+    }
+
+    return 0;
+}
+
+int main( int argc, char * argv[] )
+{
+    printf( "\n[replay]\n" );
+
+    if ( argc > 3 )
+    {
+        printf( "usage: replay [trace file] [iterations]\n" );
+        return 1;
+    }
+
+    const char * filename = argc >= 2 ? argv[1] : NULL;
+
+    const int numIterations = argc == 3 ? atoi( argv[2] ) : 100;
+
+    if ( numIterations <= 0 )
+    {
+        printf( "error: number of iterations must be positive\n" );
+        return 1;
+    }
+
+    if ( !InitializeYojimbo() )
+    {
+        printf( "error: failed to initialize Yojimbo!\n" );
+        return 1;
+    }
+
+    yojimbo_log_level( YOJIMBO_LOG_LEVEL_NONE );
+
+    int result = ReplayMain( filename, numIterations );
+
+    ShutdownYojimbo();
+
+    printf( "\n" );
+
+    return result;
+}
@@ -39,11 +39,10 @@ void interrupt_handler( int /*dummy*/ )
 static const int UNRELIABLE_UNORDERED_CHANNEL = 0;
 static const int RELIABLE_ORDERED_CHANNEL = 1;
 
-int SoakMain()
+int SoakMain( uint64_t seed, const NetworkLinkProfile & uplinkProfile, const NetworkLinkProfile & downlinkProfile )
 {
-    srand( (unsigned int) time( NULL ) );
-
     ClientServerConfig config;
+    config.networkSimulatorSeed = seed;
     config.maxPacketSize = MaxPacketSize;
     config.clientMemory = 10 * 1024 * 1024;
     config.serverGlobalMemory = 10 * 1024 * 1024;
@@ -66,6 +65,8 @@ int SoakMain()
 
     server.Start( 1 );
 
+    server.SetLinkProfile( downlinkProfile );
+
     uint64_t clientId = 0;
     random_bytes( (uint8_t*) &clientId, 8 );
 
@@ -73,6 +74,8 @@ int SoakMain()
 
     client.InsecureConnect( privateKey, clientId, serverAddress );
 
+    client.SetLinkProfile( uplinkProfile );
+
     uint64_t numMessagesSentToServer = 0;
     uint64_t numMessagesSentToClient = 0;
     uint64_t numMessagesReceivedFromClient = 0;
@@ -316,10 +319,34 @@ int SoakMain()
     return 0;
 }
 
-int main()
+int main( int argc, char * argv[] )
 {
     printf( "\nsoak\n" );
 
+    // optional network link profiles for the client to server and server to client directions. see parse_network_link_profile
+    // if only the uplink profile is given, it is used for both directions. pass the seed printed by a previous run to repeat it
+
+    uint64_t seed = 0;
+    const char * profileFiles[2] = { NULL, NULL };
+    int numProfileFiles = 0;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        if ( strcmp( argv[i], "-seed" ) == 0 && i + 1 < argc && sscanf( argv[i+1], "%" SCNu64, &seed ) == 1 )
+        {
+            i++;
+        }
+        else if ( argv[i][0] != '-' && numProfileFiles < 2 )
+        {
+            profileFiles[numProfileFiles++] = argv[i];
+        }
+        else
+        {
+            printf( "usage: soak [-seed n] [uplink profile] [downlink profile]\n" );
+            return 1;
+        }
+    }
+
     if ( !InitializeYojimbo() )
     {
         printf( "error: failed to initialize Yojimbo!\n" );
@@ -328,9 +355,34 @@ int main()
 
     yojimbo_log_level( YOJIMBO_LOG_LEVEL_INFO );
 
-    srand( (unsigned int) time( NULL ) );
+    if ( seed == 0 )
+        seed = (uint64_t) time( NULL );
+
+    printf( "seed is %" PRIu64 "\n", seed );
+
+    srand( (unsigned int) seed );
+
+    NetworkLinkProfile uplinkProfile;
+    NetworkLinkProfile downlinkProfile;
+
+    if ( profileFiles[0] && !load_network_link_profile( profileFiles[0], uplinkProfile ) )
+    {
+        printf( "error: failed to load uplink profile %s\n", profileFiles[0] );
+        ShutdownYojimbo();
+        return 1;
+    }
+
+    if ( numProfileFiles == 1 )
+        downlinkProfile = uplinkProfile;
+
+    if ( profileFiles[1] && !load_network_link_profile( profileFiles[1], downlinkProfile ) )
+    {
+        printf( "error: failed to load downlink profile %s\n", profileFiles[1] );
+        ShutdownYojimbo();
+        return 1;
+    }
 
-    int result = SoakMain();
+    int result = SoakMain( seed, uplinkProfile, downlinkProfile );
 
     ShutdownYojimbo();
 
@@ -228,6 +228,55 @@ void test_bitpacker()
     check( reader.GetBitsRemaining() == bytesWritten * 8 - bitsWritten );
 }
 
+void test_bitpacker_array()
+{
+    const int BufferSize = 1024;
+    const int NumValues = 100;
+
+    uint8_t buffer[BufferSize];
+    uint8_t expected[BufferSize];
+
+    uint32_t values[NumValues];
+    uint32_t readValues[NumValues];
+
+    for ( int bits = 1; bits <= 32; ++bits )
+    {
+        for ( int i = 0; i < NumValues; ++i )
+            values[i] = uint32_t( ( uint64_t( i ) * 2654435761ULL ) & ( ( 1ULL << bits ) - 1 ) );
+
+        // write some odd number of bits first, so the array doesn't start on a word boundary
+
+        const int headBits = bits % 7 + 1;
+
+        memset( expected, 0, BufferSize );
+        BitWriter expectedWriter( expected, BufferSize );
+        expectedWriter.WriteBits( 1, headBits );
+        for ( int i = 0; i < NumValues; ++i )
+            expectedWriter.WriteBits( values[i], bits );
+        expectedWriter.WriteBits( 1, 1 );
+        expectedWriter.FlushBits();
+
+        memset( buffer, 0, BufferSize );
+        BitWriter writer( buffer, BufferSize );
+        writer.WriteBits( 1, headBits );
+        writer.WriteBitsArray( values, NumValues, bits );
+        writer.WriteBits( 1, 1 );
+        writer.FlushBits();
+
+        check( writer.GetBitsWritten() == expectedWriter.GetBitsWritten() );
+        check( writer.GetBytesWritten() == expectedWriter.GetBytesWritten() );
+        check( memcmp( buffer, expected, writer.GetBytesWritten() ) == 0 );
+
+        BitReader reader( buffer, writer.GetBytesWritten() );
+        check( reader.ReadBits( headBits ) == 1 );
+        memset( readValues, 0, sizeof( readValues ) );
+        reader.ReadBitsArray( readValues, NumValues, bits );
+        check( memcmp( readValues, values, sizeof( values ) ) == 0 );
+        check( reader.ReadBits( 1 ) == 1 );
+        check( reader.GetBitsRead() == writer.GetBitsWritten() );
+    }
+}
+
 void test_bits_required()
 {
     check( bits_required( 0, 0 ) == 0 );
@@ -389,6 +438,187 @@ void test_stream()
     check( readObject == writeObject );
 }
 
+const int NumArrayValues = 300;
+
+struct TestArrayObject : public Serializable
+{
+    int32_t ints[NumArrayValues];
+    uint32_t bits[NumArrayValues];
+    float floats[NumArrayValues];
+    bool perValue;
+
+    TestArrayObject()
+    {
+        memset( ints, 0, sizeof( ints ) );
+        memset( bits, 0, sizeof( bits ) );
+        memset( floats, 0, sizeof( floats ) );
+        perValue = false;
+    }
+
+    void Init()
+    {
+        for ( int i = 0; i < NumArrayValues; ++i )
+        {
+            ints[i] = random_int( -1000, 1000 );
+            bits[i] = (uint32_t) random_int( 0, 127 );
+            floats[i] = random_float( -110.0f, 110.0f );
+        }
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        if ( perValue )
+        {
+            for ( int i = 0; i < NumArrayValues; ++i )
+                serialize_int( stream, ints[i], -1000, 1000 );
+            for ( int i = 0; i < NumArrayValues; ++i )
+                serialize_bits( stream, bits[i], 7 );
+        }
+        else
+        {
+            serialize_int_array( stream, ints, NumArrayValues, -1000, 1000 );
+            serialize_bits_array( stream, bits, NumArrayValues, 7 );
+        }
+
+        serialize_quantized_float_array( stream, floats, NumArrayValues, -100.0f, 100.0f, 16 );
+
+        return true;
+    }
+
+    YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
+};
+
+void test_stream_arrays()
+{
+    const int BufferSize = 4096;
+
+    uint8_t buffer[BufferSize];
+    uint8_t perValueBuffer[BufferSize];
+
+    TestArrayObject writeObject;
+    writeObject.Init();
+
+    MeasureStream measureStream( GetDefaultAllocator() );
+    writeObject.Serialize( measureStream );
+
+    WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+    check( writeObject.Serialize( writeStream ) );
+    writeStream.Flush();
+
+    check( measureStream.GetBitsProcessed() == writeStream.GetBitsProcessed() );
+
+    // the array macros must write exactly the same bits as serializing one value at a time
+
+    writeObject.perValue = true;
+    WriteStream perValueWriteStream( GetDefaultAllocator(), perValueBuffer, BufferSize );
+    check( writeObject.Serialize( perValueWriteStream ) );
+    perValueWriteStream.Flush();
+    writeObject.perValue = false;
+
+    const int bytesWritten = writeStream.GetBytesProcessed();
+
+    check( perValueWriteStream.GetBytesProcessed() == bytesWritten );
+    check( memcmp( buffer, perValueBuffer, bytesWritten ) == 0 );
+
+    TestArrayObject readObject;
+    ReadStream readStream( GetDefaultAllocator(), buffer, bytesWritten );
+    check( readObject.Serialize( readStream ) );
+
+    check( memcmp( readObject.ints, writeObject.ints, sizeof( writeObject.ints ) ) == 0 );
+    check( memcmp( readObject.bits, writeObject.bits, sizeof( writeObject.bits ) ) == 0 );
+
+    const float resolution = 200.0f / 65535.0f;
+    for ( int i = 0; i < NumArrayValues; ++i )
+    {
+        const float clamped = yojimbo_max( -100.0f, yojimbo_min( 100.0f, writeObject.floats[i] ) );
+        check( readObject.floats[i] >= -100.0f );
+        check( readObject.floats[i] <= 100.0f );
+        check( fabs( readObject.floats[i] - clamped ) <= resolution * 0.5f + 0.0001f );
+    }
+
+    // reading fails if the stream runs out of data
+
+    ReadStream truncatedReadStream( GetDefaultAllocator(), buffer, bytesWritten / 2 );
+    check( !readObject.Serialize( truncatedReadStream ) );
+
+    // reading fails if an integer is outside [min,max], even though it fits in the bits for the range
+
+    uint32_t outOfRange[NumArrayValues];
+    for ( int i = 0; i < NumArrayValues; ++i )
+        outOfRange[i] = ( i == NumArrayValues - 1 ) ? 2047 : 0;
+
+    WriteStream outOfRangeWriteStream( GetDefaultAllocator(), buffer, BufferSize );
+    outOfRangeWriteStream.SerializeBitsArray( outOfRange, NumArrayValues, bits_required( -1000, 1000 ) );
+    outOfRangeWriteStream.Flush();
+
+    ReadStream outOfRangeReadStream( GetDefaultAllocator(), buffer, outOfRangeWriteStream.GetBytesProcessed() );
+    check( !serialize_int_array_internal( outOfRangeReadStream, readObject.ints, NumArrayValues, -1000, 1000 ) );
+}
+
+void test_relative_bits()
+{
+    const int BufferSize = 64;
+
+    uint8_t buffer[BufferSize];
+
+    // int relative buckets must cover every difference, with no gaps
+
+    check( IntRelativeBuckets[0].min == 1 );
+    for ( int i = 0; i < NumIntRelativeBuckets; ++i )
+    {
+        check( IntRelativeBuckets[i].bits == bits_required( IntRelativeBuckets[i].min, IntRelativeBuckets[i].max ) );
+        if ( i > 0 )
+            check( IntRelativeBuckets[i].min == IntRelativeBuckets[i-1].max + 1 );
+    }
+
+    // int relative
+
+    for ( uint32_t difference = 1; difference < 70000; ++difference )
+    {
+        const uint32_t previous = 1000;
+        uint32_t current = previous + difference;
+        WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+        check( serialize_int_relative_internal( writeStream, previous, current ) );
+        check( writeStream.GetBitsProcessed() == int_relative_bits( previous, current ) );
+        writeStream.Flush();
+
+        uint32_t readCurrent = 0;
+        ReadStream readStream( GetDefaultAllocator(), buffer, BufferSize );
+        check( serialize_int_relative_internal( readStream, previous, readCurrent ) );
+        check( readCurrent == current );
+    }
+
+    {
+        uint32_t previous = 0;
+        uint32_t current = 0xFFFFFFFF;
+        WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+        check( serialize_int_relative_internal( writeStream, previous, current ) );
+        check( writeStream.GetBitsProcessed() == int_relative_bits( previous, current ) );
+    }
+
+    // sequence relative, including wrap around
+
+    for ( int i = 0; i < 65536; i += 7 )
+    {
+        const uint16_t sequence1 = uint16_t( 65000 + i );
+        uint16_t sequence2 = uint16_t( sequence1 + 1 + ( i % 5000 ) );
+        WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+        check( serialize_sequence_relative_internal( writeStream, sequence1, sequence2 ) );
+        check( writeStream.GetBitsProcessed() == sequence_relative_bits( sequence1, sequence2 ) );
+    }
+
+    // ack relative, including wrap around
+
+    for ( int i = 1; i < 65536; i += 3 )
+    {
+        const uint16_t sequence = uint16_t( 100 + i * 13 );
+        uint16_t ack = uint16_t( sequence - ( i % 200 ) - 1 );
+        WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+        check( serialize_ack_relative_internal( writeStream, sequence, ack ) );
+        check( writeStream.GetBitsProcessed() == ack_relative_bits( sequence, ack ) );
+    }
+}
+
 bool parse_address( const char string[] )
 {
     Address address( string );
@@ -810,6 +1040,79 @@ void test_sequence_buffer()
         check( sequence_buffer.Find(i) == NULL );
 }
 
+struct TestWorkerThreadsData
+{
+    WorkerThreads * workerThreads;
+    int * itemCount;
+    int * threadIndex;
+    int total;
+};
+
+static void test_worker_threads_function( void * context, int threadIndex, int beginIndex, int endIndex )
+{
+    TestWorkerThreadsData * data = (TestWorkerThreadsData*) context;
+    for ( int i = beginIndex; i < endIndex; ++i )
+    {
+        data->itemCount[i]++;
+        data->threadIndex[i] = threadIndex;
+        data->workerThreads->Lock();
+        data->total += i;
+        data->workerThreads->Unlock();
+    }
+}
+
+void test_worker_threads()
+{
+    const int NumThreads = 3;
+    const int NumItems = 1000;
+
+    WorkerThreads workerThreads( GetDefaultAllocator(), NumThreads );
+
+    check( workerThreads.GetNumThreads() == NumThreads );
+
+    int itemCount[NumItems];
+    int threadIndex[NumItems];
+    memset( itemCount, 0, sizeof( itemCount ) );
+
+    TestWorkerThreadsData data;
+    data.workerThreads = &workerThreads;
+    data.itemCount = itemCount;
+    data.threadIndex = threadIndex;
+    data.total = 0;
+
+    const int NumIterations = 10;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        workerThreads.Run( test_worker_threads_function, &data, NumItems );
+    }
+
+    // every item is worked on once per run, and items are split into contiguous ranges across the calling thread and all worker threads
+
+    for ( int i = 0; i < NumItems; ++i )
+    {
+        check( itemCount[i] == NumIterations );
+        check( threadIndex[i] >= 0 );
+        check( threadIndex[i] <= NumThreads );
+        if ( i > 0 )
+            check( threadIndex[i] >= threadIndex[i-1] );
+    }
+
+    check( threadIndex[0] == 0 );
+    check( threadIndex[NumItems-1] == NumThreads );
+    check( data.total == NumIterations * ( NumItems * ( NumItems - 1 ) / 2 ) );
+
+    // fewer items than threads
+
+    memset( itemCount, 0, sizeof( itemCount ) );
+
+    workerThreads.Run( test_worker_threads_function, &data, 2 );
+
+    check( itemCount[0] == 1 );
+    check( itemCount[1] == 1 );
+    check( itemCount[2] == 0 );
+}
+
 void test_allocator_tlsf()
 {
     const int NumBlocks = 256;
@@ -860,236 +1163,1481 @@ void test_allocator_tlsf()
     free( memory );
 }
 
-void PumpConnectionUpdate( ConnectionConfig & connectionConfig, double & time, Connection & sender, Connection & receiver, uint16_t & senderSequence, uint16_t & receiverSequence, float deltaTime = 0.1f, int packetLossPercent = 90 )
+void test_allocator_tlsf_pooled()
 {
-    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    const int BudgetBytes = 1024 * 1024;
+    const int PageBytes = 64 * 1024;
+    const int MaxBytesPerAllocator = 768 * 1024;
+    const int BlockSize = 1024;
+    const int NumBlocks = MaxBytesPerAllocator / BlockSize;
+    const int LargeBlockSize = 256 * 1024;
 
-    int packetBytes;
-    if ( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
-    {
-        if ( random_int( 0, 100 ) >= packetLossPercent )
-        {
-            receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes );
-            sender.ProcessAcks( &senderSequence, 1 );
-        }
-    }
+    MemoryPool pool( GetDefaultAllocator(), BudgetBytes, PageBytes );
 
-    if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
     {
-        if ( random_int( 0, 100 ) >= packetLossPercent )
-        {
-            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
-            receiver.ProcessAcks( &receiverSequence, 1 );
-        }
-    }
-
-    time += deltaTime;
+        TLSF_PooledAllocator a( pool, MaxBytesPerAllocator );
+        TLSF_PooledAllocator b( pool, MaxBytesPerAllocator );
 
-    sender.AdvanceTime( time );
-    receiver.AdvanceTime( time );
+        check( a.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
+        check( b.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
+        check( a.GetCommittedBytes() == (size_t) PageBytes );
+        check( b.GetCommittedBytes() == (size_t) PageBytes );
+        check( pool.GetUsedBytes() == 2 * (size_t) PageBytes );
 
-    senderSequence++;
-    receiverSequence++;
-}
+        // allocations larger than a page get a chunk of their own
 
-void test_connection_reliable_ordered_messages()
-{
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
+        uint8_t * largeBlock = (uint8_t*) YOJIMBO_ALLOCATE( b, LargeBlockSize );
+        check( largeBlock );
+        memset( largeBlock, 1, LargeBlockSize );
+        check( b.GetCommittedBytes() > (size_t) LargeBlockSize );
+        YOJIMBO_FREE( b, largeBlock );
+        check( b.GetCommittedBytes() == (size_t) PageBytes );
 
-    double time = 100.0;
+        // a grows until it reaches its cap
 
-    ConnectionConfig connectionConfig;
- 
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+        uint8_t * blockData[NumBlocks];
+        memset( blockData, 0, sizeof( blockData ) );
 
-    const int NumMessagesSent = 64;
+        int stopIndex = 0;
 
-    for ( int i = 0; i < NumMessagesSent; ++i )
-    {
-        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-        check( message );
-        message->sequence = i;
-        sender.SendMessage( 0, message );
-    }
+        for ( int i = 0; i < NumBlocks; ++i )
+        {
+            blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( a, BlockSize );
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+            if ( !blockData[i] )
+            {
+                check( a.GetErrorLevel() == ALLOCATOR_ERROR_OUT_OF_MEMORY );
+                a.ClearError();
+                stopIndex = i;
+                break;
+            }
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+            memset( blockData[i], i + 10, BlockSize );
+        }
 
-    int numMessagesReceived = 0;
+        check( stopIndex > NumBlocks / 2 );
+        check( a.GetCommittedBytes() <= (size_t) MaxBytesPerAllocator );
+        check( pool.GetUsedBytes() <= (size_t) BudgetBytes );
 
-    const int NumIterations = 1000;
+        // b can't grow past what is left in the pool, even though it is below its cap
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+        uint8_t * tooLarge = (uint8_t*) YOJIMBO_ALLOCATE( b, BudgetBytes - MaxBytesPerAllocator );
+        check( !tooLarge );
+        check( b.GetErrorLevel() == ALLOCATOR_ERROR_OUT_OF_MEMORY );
+        b.ClearError();
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+        // once a frees its blocks, the chunks go back to the pool and b can use them
 
-        while ( true )
+        for ( int i = 0; i < NumBlocks; ++i )
         {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+            if ( blockData[i] )
+            {
+                for ( int j = 0; j < BlockSize; ++j )
+                    check( blockData[i][j] == uint8_t( i + 10 ) );
+            }
 
-            check( message->GetId() == (int) numMessagesReceived );
-            check( message->GetType() == TEST_MESSAGE );
+            YOJIMBO_FREE( a, blockData[i] );
+        }
 
-            TestMessage * testMessage = (TestMessage*) message;
+        // one empty page is kept in reserve, so growing across a chunk boundary again doesn't go back to the pool
 
-            check( testMessage->sequence == numMessagesReceived );
+        check( a.GetCommittedBytes() == 2 * (size_t) PageBytes );
 
-            ++numMessagesReceived;
+        const size_t poolUsedBytes = pool.GetUsedBytes();
 
-            messageFactory.ReleaseMessage( message );
+        for ( int i = 0; i < 8; ++i )
+        {
+            for ( int j = 0; j < PageBytes / BlockSize; ++j )
+            {
+                blockData[j] = (uint8_t*) YOJIMBO_ALLOCATE( a, BlockSize );
+                check( blockData[j] );
+            }
+
+            check( a.GetCommittedBytes() == 2 * (size_t) PageBytes );
+            check( pool.GetUsedBytes() == poolUsedBytes );
+
+            for ( int j = 0; j < PageBytes / BlockSize; ++j )
+                YOJIMBO_FREE( a, blockData[j] );
         }
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
+        check( a.GetCommittedBytes() == 2 * (size_t) PageBytes );
+
+        largeBlock = (uint8_t*) YOJIMBO_ALLOCATE( b, LargeBlockSize );
+        check( largeBlock );
+        YOJIMBO_FREE( b, largeBlock );
     }
 
-    check( numMessagesReceived == NumMessagesSent );
+    check( pool.GetUsedBytes() == 0 );
 }
 
-void test_connection_reliable_ordered_blocks()
+void test_random_generator()
 {
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
+    // the same seed and stream always generate the same numbers. different streams generate different numbers
 
-    double time = 100.0;
+    RandomGenerator a( 12345 );
+    RandomGenerator b( 12345 );
+    RandomGenerator c( 12345, 1 );
 
-    ConnectionConfig connectionConfig;
-    
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    int numDifferent = 0;
+    for ( int i = 0; i < 1000; ++i )
+    {
+        const uint32_t value = a.NextUint32();
+        check( value == b.NextUint32() );
+        if ( value != c.NextUint32() )
+            numDifferent++;
+    }
+    check( numDifferent > 990 );
 
-    const int NumMessagesSent = 32;
+    // reseeding restarts the sequence
 
-    for ( int i = 0; i < NumMessagesSent; ++i )
+    a.Seed( 12345 );
+    b.Seed( 12345 );
+    check( a.NextUint32() == b.NextUint32() );
+
+    // integers are in [a,b] and every value is generated. floats are in [a,b)
+
+    int counts[5];
+    memset( counts, 0, sizeof( counts ) );
+    for ( int i = 0; i < 1000; ++i )
     {
-        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-        check( message );
-        message->sequence = i;
-        const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-        for ( int j = 0; j < blockSize; ++j )
-            blockData[j] = i + j;
-        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-        sender.SendMessage( 0, message );
+        const int value = a.NextInt( -2, 2 );
+        check( value >= -2 );
+        check( value <= 2 );
+        counts[value+2]++;
     }
+    for ( int i = 0; i < 5; ++i )
+        check( counts[i] > 100 );
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
-
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    for ( int i = 0; i < 1000; ++i )
+    {
+        const float value = a.NextFloat( -1.0f, 1.0f );
+        check( value >= -1.0f );
+        check( value < 1.0f );
+    }
 
-    int numMessagesReceived = 0;
+    check( a.NextInt( 7, 7 ) == 7 );
+}
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+void test_network_simulator()
+{
+    double time = 100.0;
 
-    const int NumIterations = 10000;
+    const int NumPackets = 64;
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time, 16 );
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    networkSimulator.SetLatency( 100.0f );
 
-            check( message->GetId() == (int) numMessagesReceived );
+    check( networkSimulator.IsActive() );
 
-            check( message->GetType() == TEST_BLOCK_MESSAGE );
+    uint8_t packet[8];
 
-            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+    // packets are delivered in order of delivery time. packets with the same delivery time in the order they were sent
 
-            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+    for ( int i = 0; i < 16; ++i )
+    {
+        memset( packet, i, sizeof( packet ) );
+        networkSimulator.SendPacket( i % 4, packet, sizeof( packet ) );
+        if ( i == 7 )
+        {
+            time += 0.05;
+            networkSimulator.AdvanceTime( time );
+        }
+    }
 
-            const int blockSize = blockMessage->GetBlockSize();
+    check( networkSimulator.GetNumPackets() == 16 );
 
-            check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+    int to[NumPackets];
 
-            const uint8_t * blockData = blockMessage->GetBlockData();
+    check( networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to ) == 0 );
 
-            check( blockData );
+    time += 0.075;
+    networkSimulator.AdvanceTime( time );
 
+    int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+    check( numPackets == 8 );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        check( packetBytes[i] == sizeof( packet ) );
+        check( packetData[i][0] == i );
+        check( to[i] == i % 4 );
+        networkSimulator.FreePacket( packetData[i] );
+    }
+
+    // discarding packets for one client leaves the rest in delivery order
+
+    networkSimulator.DiscardClientPackets( 1 );
+
+    check( networkSimulator.GetNumPackets() == 6 );
+
+    time += 0.1;
+    networkSimulator.AdvanceTime( time );
+
+    numPackets = networkSimulator.ReceivePackets( 4, packetData, packetBytes, to );
+    check( numPackets == 4 );
+    numPackets += networkSimulator.ReceivePackets( NumPackets - 4, packetData + 4, packetBytes + 4, to + 4 );
+    check( numPackets == 6 );
+
+    const int expected[] = { 8, 10, 11, 12, 14, 15 };
+
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        check( packetData[i][0] == expected[i] );
+        check( to[i] != 1 );
+        networkSimulator.FreePacket( packetData[i] );
+    }
+
+    check( networkSimulator.GetNumPackets() == 0 );
+
+    // packets sent while the simulator is full are dropped and counted, instead of replacing packets in flight
+
+    for ( int i = 0; i < NumPackets + 10; ++i )
+    {
+        memset( packet, i, sizeof( packet ) );
+        networkSimulator.SendPacket( 0, packet, sizeof( packet ) );
+    }
+
+    check( networkSimulator.GetNumPackets() == NumPackets );
+    check( networkSimulator.GetNumOverflowPackets() == 10 );
+
+    time += 0.2;
+    networkSimulator.AdvanceTime( time );
+
+    numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+    check( numPackets == NumPackets );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        check( packetData[i][0] == i );
+        networkSimulator.FreePacket( packetData[i] );
+    }
+
+    // packet buffers are reused once the pool is warm. packets larger than the pooled buffers are allocated individually
+
+    check( networkSimulator.GetNumPacketBuffers() == NumPackets );
+
+    uint8_t largePacket[64];
+    memset( largePacket, 0xFF, sizeof( largePacket ) );
+    networkSimulator.SendPacket( 0, largePacket, sizeof( largePacket ) );
+    networkSimulator.SendPacket( 0, packet, sizeof( packet ) );
+
+    check( networkSimulator.GetNumPacketBuffers() == NumPackets );
+
+    time += 0.2;
+    networkSimulator.AdvanceTime( time );
+
+    numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+    check( numPackets == 2 );
+    check( packetBytes[0] == sizeof( largePacket ) );
+    check( memcmp( packetData[0], largePacket, sizeof( largePacket ) ) == 0 );
+    check( packetBytes[1] == sizeof( packet ) );
+    check( memcmp( packetData[1], packet, sizeof( packet ) ) == 0 );
+    for ( int i = 0; i < numPackets; ++i )
+        networkSimulator.FreePacket( packetData[i] );
+
+    // by default, packet buffers are large enough for every packet sent by a client or server with the default config
+
+    {
+        NetworkSimulator defaultSimulator( GetDefaultAllocator(), NumPackets, time );
+
+        defaultSimulator.SetLatency( 100.0f );
+
+        ClientServerConfig config;
+        uint8_t * fragmentPacket = (uint8_t*) alloca( config.packetFragmentSize );
+        memset( fragmentPacket, 0xFF, config.packetFragmentSize );
+        defaultSimulator.SendPacket( 0, fragmentPacket, config.packetFragmentSize );
+
+        check( defaultSimulator.GetNumPacketBuffers() == SimulatorPacketsPerSlab );
+
+        defaultSimulator.AdvanceTime( time + 0.2 );
+
+        numPackets = defaultSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+        check( numPackets == 1 );
+        check( packetBytes[0] == config.packetFragmentSize );
+        check( memcmp( packetData[0], fragmentPacket, config.packetFragmentSize ) == 0 );
+        defaultSimulator.FreePacket( packetData[0] );
+    }
+
+    // packets still in the simulator are freed when it is destroyed
+
+    networkSimulator.SendPacket( 200, packet, sizeof( packet ) );
+    networkSimulator.SendPacket( 200, largePacket, sizeof( largePacket ) );
+    check( networkSimulator.GetNumPackets() == 2 );
+}
+
+void test_network_simulator_link_profile()
+{
+    // profiles parse on top of existing values. a malformed profile leaves the profile untouched
+
+    const char * profileText = 
+        "# cable uplink\n"
+        "latency = 25\n"
+        "jitter = 5.5   # milliseconds\n"
+        "orderedJitter = true\n"
+        "\n"
+        "bandwidth = 2000\n"
+        "queueBytes = 16384\n"
+        "burstLossEnter = 1\n"
+        "burstLossExit = 25\n";
+
+    NetworkLinkProfile profile;
+    profile.packetLoss = 2.0f;
+
+    check( parse_network_link_profile( profileText, profile ) );
+    check( profile.latency == 25.0f );
+    check( profile.jitter == 5.5f );
+    check( profile.orderedJitter );
+    check( profile.packetLoss == 2.0f );
+    check( profile.bandwidth == 2000.0f );
+    check( profile.queueBytes == 16384 );
+    check( profile.packetOverheadBytes == 28 );
+    check( profile.burstLossEnter == 1.0f );
+    check( profile.burstLossExit == 25.0f );
+    check( profile.burstLoss == 100.0f );
+
+    check( !parse_network_link_profile( "latency = 50\nlatency = fast\n", profile ) );
+    check( !parse_network_link_profile( "speed = 10\n", profile ) );
+    check( !parse_network_link_profile( "latency 50\n", profile ) );
+    check( !parse_network_link_profile( "queueBytes = -1\n", profile ) );
+    check( profile.latency == 25.0f );
+
+    double time = 100.0;
+
+    const int NumPackets = 64;
+
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time, 128 );
+
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+    int to[NumPackets];
+
+    // packets queue behind the bandwidth limit of each to index. 80kbps is 10 bytes per millisecond, so each 100 byte packet (including overhead) takes 10ms
+
+    NetworkLinkProfile bandwidthProfile;
+    bandwidthProfile.bandwidth = 80.0f;
+    bandwidthProfile.queueBytes = 500;
+
+    networkSimulator.SetLinkProfile( bandwidthProfile );
+
+    check( networkSimulator.IsActive() );
+
+    uint8_t packet[100 - 28];
+
+    for ( int i = 0; i < 6; ++i )
+    {
+        memset( packet, i, sizeof( packet ) );
+        networkSimulator.SendPacket( 0, packet, sizeof( packet ) );
+    }
+
+    for ( int i = 0; i < 2; ++i )
+    {
+        memset( packet, 10 + i, sizeof( packet ) );
+        networkSimulator.SendPacket( 1, packet, sizeof( packet ) );
+    }
+
+    check( networkSimulator.GetNumPackets() == 7 );
+    check( networkSimulator.GetNumQueueDropPackets() == 1 );
+    check( networkSimulator.GetQueuedBytes( 0 ) == 500 );
+    check( networkSimulator.GetQueuedBytes( 1 ) == 200 );
+
+    time += 0.025;
+    networkSimulator.AdvanceTime( time );
+
+    int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+    check( numPackets == 4 );
+
+    const int expected[] = { 0, 10, 1, 11 };
+
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        check( packetData[i][0] == expected[i] );
+        networkSimulator.FreePacket( packetData[i] );
+    }
+
+    check( networkSimulator.GetQueuedBytes( 0 ) == 250 );
+    check( networkSimulator.GetQueuedBytes( 1 ) == 0 );
+
+    networkSimulator.DiscardPackets();
+
+    check( networkSimulator.GetQueuedBytes( 0 ) == 0 );
+
+    // ordered jitter varies latency without reordering packets
+
+    NetworkLinkProfile jitterProfile;
+    jitterProfile.latency = 100.0f;
+    jitterProfile.jitter = 50.0f;
+    jitterProfile.orderedJitter = true;
+
+    networkSimulator.SetLinkProfile( jitterProfile );
+
+    for ( int i = 0; i < 32; ++i )
+    {
+        memset( packet, i, sizeof( packet ) );
+        networkSimulator.SendPacket( 2, packet, sizeof( packet ) );
+        time += 0.001;
+        networkSimulator.AdvanceTime( time );
+    }
+
+    time += 1.0;
+    networkSimulator.AdvanceTime( time );
+
+    numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+    check( numPackets == 32 );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        check( packetData[i][0] == i );
+        networkSimulator.FreePacket( packetData[i] );
+    }
+
+    // once a link enters the burst loss bad state it loses packets until it exits
+
+    NetworkLinkProfile burstProfile;
+    burstProfile.burstLossEnter = 100.0f;
+    burstProfile.burstLossExit = 0.0f;
+
+    networkSimulator.SetLinkProfile( burstProfile );
+
+    check( networkSimulator.IsActive() );
+
+    for ( int i = 0; i < 16; ++i )
+        networkSimulator.SendPacket( 3, packet, sizeof( packet ) );
+
+    check( networkSimulator.GetNumPackets() == 0 );
+
+    // set latency and friends are a simple profile
+
+    networkSimulator.SetLinkProfile( NetworkLinkProfile() );
+
+    check( !networkSimulator.IsActive() );
+
+    networkSimulator.SetLatency( 50.0f );
+    networkSimulator.SetJitter( 10.0f );
+
+    check( networkSimulator.IsActive() );
+    check( networkSimulator.GetLinkProfile().latency == 50.0f );
+    check( networkSimulator.GetLinkProfile().jitter == 10.0f );
+    check( networkSimulator.GetLinkProfile().bandwidth == 0.0f );
+}
+
+void test_network_simulator_seed()
+{
+    // simulators with the same seed drop, delay and duplicate the same packets, whatever else calls rand()
+
+    const int NumPackets = 256;
+
+    NetworkLinkProfile profile;
+    profile.latency = 50.0f;
+    profile.jitter = 25.0f;
+    profile.packetLoss = 20.0f;
+    profile.duplicates = 10.0f;
+    profile.burstLossEnter = 5.0f;
+    profile.burstLossExit = 50.0f;
+
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+    int to[2][NumPackets];
+    uint8_t received[2][NumPackets];
+    int numPackets[2];
+
+    for ( int i = 0; i < 2; ++i )
+    {
+        double time = 100.0;
+
+        NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time, 16 );
+
+        networkSimulator.Seed( 1000 );
+        networkSimulator.SetLinkProfile( profile );
+
+        check( networkSimulator.GetSeed() == 1000 );
+
+        srand( i );
+
+        for ( int j = 0; j < 100; ++j )
+        {
+            uint8_t packet[4];
+            memset( packet, j, sizeof( packet ) );
+            networkSimulator.SendPacket( j % 4, packet, sizeof( packet ) );
+            time += 0.01;
+            networkSimulator.AdvanceTime( time );
+        }
+
+        time += 2.0;
+        networkSimulator.AdvanceTime( time );
+
+        numPackets[i] = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to[i] );
+
+        check( numPackets[i] > 0 );
+        check( numPackets[i] < 100 );
+
+        for ( int j = 0; j < numPackets[i]; ++j )
+        {
+            received[i][j] = packetData[j][0];
+            networkSimulator.FreePacket( packetData[j] );
+        }
+    }
+
+    check( numPackets[0] == numPackets[1] );
+    for ( int i = 0; i < numPackets[0]; ++i )
+    {
+        check( received[0][i] == received[1][i] );
+        check( to[0][i] == to[1][i] );
+    }
+}
+
+void PumpConnectionUpdate( ConnectionConfig & connectionConfig, double & time, Connection & sender, Connection & receiver, uint16_t & senderSequence, uint16_t & receiverSequence, float deltaTime = 0.1f, int packetLossPercent = 90 )
+{
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    int packetBytes;
+    if ( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+    {
+        if ( random_int( 0, 100 ) >= packetLossPercent )
+        {
+            receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes );
+            sender.ProcessAcks( &senderSequence, 1 );
+        }
+    }
+
+    if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+    {
+        if ( random_int( 0, 100 ) >= packetLossPercent )
+        {
+            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
+            receiver.ProcessAcks( &receiverSequence, 1 );
+        }
+    }
+
+    time += deltaTime;
+
+    sender.AdvanceTime( time );
+    receiver.AdvanceTime( time );
+
+    senderSequence++;
+    receiverSequence++;
+}
+
+void test_connection_reliable_ordered_messages()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+ 
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 64;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    int numMessagesReceived = 0;
+
+    const int NumIterations = 1000;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+            check( message->GetType() == TEST_MESSAGE );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == numMessagesReceived );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_reliable_ordered_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = i;
+        const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int j = 0; j < blockSize; ++j )
+            blockData[j] = i + j;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            const int blockSize = blockMessage->GetBlockSize();
+
+            check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+
+            const uint8_t * blockData = blockMessage->GetBlockData();
+
+            check( blockData );
+
+            for ( int j = 0; j < blockSize; ++j )
+            {
+                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+            }
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_reliable_ordered_blocks_zero_copy()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.channel[0].maxBlockSize = 4 * 1024;
+    connectionConfig.channel[0].zeroCopyBlockReceive = true;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = i;
+        const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int j = 0; j < blockSize; ++j )
+            blockData[j] = i + j;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+    }
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumIterations = 10000;
+
+    // hold on to the received messages, so each block must end up in its own buffer
+
+    Message * receivedMessages[NumMessagesSent];
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+            receivedMessages[numMessagesReceived++] = message;
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestBlockMessage * blockMessage = (TestBlockMessage*) receivedMessages[i];
+
+        check( blockMessage->sequence == uint16_t( i ) );
+
+        const int blockSize = blockMessage->GetBlockSize();
+
+        check( blockSize == 1 + ( ( i * 901 ) % 3333 ) );
+
+        const uint8_t * blockData = blockMessage->GetBlockData();
+
+        check( blockData );
+
+        for ( int j = 0; j < blockSize; ++j )
+        {
+            check( blockData[j] == uint8_t( i + j ) );
+        }
+
+        messageFactory.ReleaseMessage( blockMessage );
+    }
+}
+
+void test_connection_reliable_ordered_block_fragments_per_packet()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.maxPacketSize = 16 * 1024;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int BlockSize = 32 * connectionConfig.channel[0].blockFragmentSize + 100;
+
+    TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+    check( message );
+    message->sequence = 1000;
+    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), BlockSize );
+    for ( int j = 0; j < BlockSize; ++j )
+        blockData[j] = uint8_t( j * 7 );
+    message->AttachBlock( messageFactory.GetAllocator(), blockData, BlockSize );
+    sender.SendMessage( 0, message );
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    // with no packet loss, each packet carries as many fragments as fit, so the block arrives in a handful of packets
+
+    const int MaxIterations = 4;
+
+    Message * receivedMessage = NULL;
+
+    for ( int i = 0; i < MaxIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        receivedMessage = receiver.ReceiveMessage( 0 );
+        if ( receivedMessage )
+            break;
+    }
+
+    check( receivedMessage );
+    check( receivedMessage->GetType() == TEST_BLOCK_MESSAGE );
+
+    TestBlockMessage * blockMessage = (TestBlockMessage*) receivedMessage;
+
+    check( blockMessage->sequence == 1000 );
+    check( blockMessage->GetBlockSize() == BlockSize );
+
+    const uint8_t * receivedBlockData = blockMessage->GetBlockData();
+
+    for ( int j = 0; j < BlockSize; ++j )
+    {
+        check( receivedBlockData[j] == uint8_t( j * 7 ) );
+    }
+
+    messageFactory.ReleaseMessage( receivedMessage );
+}
+
+void test_connection_reliable_ordered_messages_behind_block()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int BlockSize = 64 * connectionConfig.channel[0].blockFragmentSize;
+
+    TestBlockMessage * blockMessage = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+    check( blockMessage );
+    blockMessage->sequence = 0;
+    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), BlockSize );
+    memset( blockData, 0, BlockSize );
+    blockMessage->AttachBlock( messageFactory.GetAllocator(), blockData, BlockSize );
+    sender.SendMessage( 0, blockMessage );
+
+    const int NumMessagesSent = 8;
+
+    for ( int i = 1; i <= NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+    }
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    // the messages queued behind the block ride along with its fragments, so they are ready as soon as the block arrives
+
+    const int NumIterations = 100;
+
+    int numMessagesReceived = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        Message * message = receiver.ReceiveMessage( 0 );
+        if ( !message )
+            continue;
+
+        check( message->GetType() == TEST_BLOCK_MESSAGE );
+        check( message->GetId() == 0 );
+        messageFactory.ReleaseMessage( message );
+        numMessagesReceived++;
+
+        while ( true )
+        {
+            message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+            check( message->GetId() == numMessagesReceived );
+            check( ( (TestMessage*) message )->sequence == numMessagesReceived );
+            messageFactory.ReleaseMessage( message );
+            numMessagesReceived++;
+        }
+
+        break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent + 1 );
+}
+
+void test_connection_reliable_ordered_packet_budget_with_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.channel[0].packetBudget = 3 * connectionConfig.channel[0].blockFragmentSize + 256;
+
+    const int PacketBudget = connectionConfig.channel[0].packetBudget;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int BlockSize = 16 * connectionConfig.channel[0].blockFragmentSize;
+
+    TestBlockMessage * blockMessage = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+    check( blockMessage );
+    blockMessage->sequence = 0;
+    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), BlockSize );
+    memset( blockData, 0, BlockSize );
+    blockMessage->AttachBlock( messageFactory.GetAllocator(), blockData, BlockSize );
+    sender.SendMessage( 0, blockMessage );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 1; i <= NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+    }
+
+    // fragments and the messages sent in the space left over by them must fit in the channel budget together
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumIterations = 100;
+
+    int numMessagesReceived = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        int packetBytes;
+
+        if ( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+        {
+            check( packetBytes <= PacketBudget + 32 );
+            receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes );
+            sender.ProcessAcks( &senderSequence, 1 );
+        }
+
+        if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+        {
+            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
+            receiver.ProcessAcks( &receiverSequence, 1 );
+        }
+
+        time += 0.1;
+
+        sender.AdvanceTime( time );
+        receiver.AdvanceTime( time );
+
+        senderSequence++;
+        receiverSequence++;
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == numMessagesReceived );
+            check( message->GetType() == ( numMessagesReceived == 0 ? TEST_BLOCK_MESSAGE : TEST_MESSAGE ) );
+            messageFactory.ReleaseMessage( message );
+            numMessagesReceived++;
+        }
+
+        if ( numMessagesReceived == NumMessagesSent + 1 )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent + 1 );
+}
+
+void test_reliable_ordered_channel_block_outside_receive_window()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    ChannelConfig channelConfig;
+
+    ReliableOrderedChannel channel( GetDefaultAllocator(), messageFactory, channelConfig, 0, 100.0 );
+
+    uint8_t fragmentData[64];
+    memset( fragmentData, 0, sizeof( fragmentData ) );
+
+    ChannelPacketData::BlockData fragment;
+    memset( &fragment, 0, sizeof( fragment ) );
+    fragment.messageType = TEST_BLOCK_MESSAGE;
+    fragment.numFragments = 1;
+    fragment.fragmentData = fragmentData;
+    fragment.fragmentSize = sizeof( fragmentData );
+
+    ChannelPacketData packetData;
+    packetData.Initialize();
+    packetData.blockMessage = 1;
+    packetData.block.numEntries = 1;
+    packetData.block.entries = &fragment;
+
+    // a block at the far end of the receive window is accepted
+
+    fragment.message = (BlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+    check( fragment.message );
+    fragment.messageId = uint16_t( channelConfig.messageReceiveQueueSize - 1 );
+    channel.ProcessPacketData( packetData, 0 );
+    check( channel.GetErrorLevel() == CHANNEL_ERROR_NONE );
+    messageFactory.ReleaseMessage( fragment.message );
+
+    // a block past the receive window is a desync, and must not take a receive block slot
+
+    fragment.message = (BlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+    check( fragment.message );
+    fragment.messageId = uint16_t( channelConfig.messageReceiveQueueSize );
+    channel.ProcessPacketData( packetData, 1 );
+    check( channel.GetErrorLevel() == CHANNEL_ERROR_DESYNC );
+    messageFactory.ReleaseMessage( fragment.message );
+}
+
+void test_connection_reliable_ordered_blocks_in_flight()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.maxPacketSize = 16 * 1024;
+    connectionConfig.channel[0].maxBlocksInFlight = 4;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 8;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = i;
+        const int blockSize = connectionConfig.channel[0].blockFragmentSize + 100 + i;
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int j = 0; j < blockSize; ++j )
+            blockData[j] = i + j;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+    }
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    // with no packet loss, fragments of four blocks go out together, so all eight blocks arrive well before one round trip per block
+
+    const int MaxIterations = 4;
+
+    int numMessagesReceived = 0;
+
+    for ( int i = 0; i < MaxIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            const int blockSize = blockMessage->GetBlockSize();
+            const int expectedBlockSize = connectionConfig.channel[0].blockFragmentSize + 100 + numMessagesReceived;
+            check( blockSize == expectedBlockSize );
+            const uint8_t * blockData = blockMessage->GetBlockData();
+            check( blockData );
+            for ( int j = 0; j < blockSize; ++j )
+            {
+                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+            }
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_reliable_ordered_messages_and_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+    
+    ConnectionConfig connectionConfig;
+    
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        if ( rand() % 2 )
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            sender.SendMessage( 0, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
             for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            sender.SendMessage( 0, message );
+        }
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+
+            switch ( message->GetType() )
+            {
+                case TEST_MESSAGE:
+                {
+                    TestMessage * testMessage = (TestMessage*) message;
+
+                    check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                    ++numMessagesReceived;
+                }
+                break;
+
+                case TEST_BLOCK_MESSAGE:
+                {
+                    TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+                    check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                    const int blockSize = blockMessage->GetBlockSize();
+
+                    check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+        
+                    const uint8_t * blockData = blockMessage->GetBlockData();
+
+                    check( blockData );
+
+                    for ( int j = 0; j < blockSize; ++j )
+                    {
+                        check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+                    }
+
+                    ++numMessagesReceived;
+                }
+                break;
+            }
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
+{
+    const int NumChannels = 2;
+
+    double time = 100.0;
+    
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = NumChannels;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[0].maxMessagesPerPacket = 8;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[1].maxMessagesPerPacket = 8;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    {
+        for ( int i = 0; i < NumMessagesSent; ++i )
+        {
+            if ( rand() % 2 )
+            {
+                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+                check( message );
+                message->sequence = i;
+                sender.SendMessage( channelIndex, message );
+            }
+            else
+            {
+                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+                check( message );
+                message->sequence = i;
+                const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+                for ( int j = 0; j < blockSize; ++j )
+                    blockData[j] = i + j;
+                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+                sender.SendMessage( channelIndex, message );
+            }
+        }
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 10000;
+
+    int numMessagesReceived[NumChannels];
+    memset( numMessagesReceived, 0, sizeof( numMessagesReceived ) );
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        {
+            while ( true )
             {
-                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+                Message * message = receiver.ReceiveMessage( channelIndex );
+                if ( !message )
+                    break;
+
+                check( message->GetId() == (int) numMessagesReceived[channelIndex] );
+
+                switch ( message->GetType() )
+                {
+                    case TEST_MESSAGE:
+                    {
+                        TestMessage * testMessage = (TestMessage*) message;
+
+                        check( testMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+
+                        ++numMessagesReceived[channelIndex];
+                    }
+                    break;
+
+                    case TEST_BLOCK_MESSAGE:
+                    {
+                        TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+                        check( blockMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+
+                        const int blockSize = blockMessage->GetBlockSize();
+
+                        check( blockSize == 1 + ( ( numMessagesReceived[channelIndex] * 901 ) % 3333 ) );
+            
+                        const uint8_t * blockData = blockMessage->GetBlockData();
+
+                        check( blockData );
+
+                        for ( int j = 0; j < blockSize; ++j )
+                        {
+                            check( blockData[j] == uint8_t( numMessagesReceived[channelIndex] + j ) );
+                        }
+
+                        ++numMessagesReceived[channelIndex];
+                    }
+                    break;
+                }
+
+                messageFactory.ReleaseMessage( message );
             }
+        }
 
-            ++numMessagesReceived;
+        bool receivedAllMessages = true;
 
-            messageFactory.ReleaseMessage( message );
+        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        {
+            if ( numMessagesReceived[channelIndex] != NumMessagesSent )
+            {
+                receivedAllMessages = false;
+                break;
+            }
         }
 
-        if ( numMessagesReceived == NumMessagesSent )
+        if ( receivedAllMessages )
             break;
     }
 
-    check( numMessagesReceived == NumMessagesSent );
+    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    {
+        check( numMessagesReceived[channelIndex] == NumMessagesSent );
+    }
 }
 
-void test_connection_reliable_ordered_messages_and_blocks()
+void test_connection_unreliable_unordered_messages()
 {
     TestMessageFactory messageFactory( GetDefaultAllocator() );
 
     double time = 100.0;
-    
+
     ConnectionConfig connectionConfig;
-    
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
 
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
     Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    const int NumMessagesSent = 32;
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
 
-    for ( int i = 0; i < NumMessagesSent; ++i )
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 256;
+
+    const int NumMessagesSent = 16;
+
+    for ( int j = 0; j < NumMessagesSent; ++j )
     {
-        if ( rand() % 2 )
-        {
-            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-            check( message );
-            message->sequence = i;
-            sender.SendMessage( 0, message );
-        }
-        else
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = j;
+        sender.SendMessage( 0, message );
+    }
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( true )
         {
-            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-            check( message );
-            message->sequence = i;
-            const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-            for ( int j = 0; j < blockSize; ++j )
-                blockData[j] = i + j;
-            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-            sender.SendMessage( 0, message );
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
         }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
     }
 
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_unreliable_unordered_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+    
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
     const int SenderPort = 10000;
     const int ReceiverPort = 10001;
 
     Address senderAddress( "::1", SenderPort );
     Address receiverAddress( "::1", ReceiverPort );
 
+    const int NumIterations = 256;
+
+    const int NumMessagesSent = 8;
+
+    for ( int j = 0; j < NumMessagesSent; ++j )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = j;
+        const int blockSize = 1 + ( j * 7 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int k = 0; k < blockSize; ++k )
+            blockData[k] = j + k;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+    }
+
     int numMessagesReceived = 0;
 
     uint16_t senderSequence = 0;
     uint16_t receiverSequence = 0;
 
-    const int NumIterations = 10000;
-
     for ( int i = 0; i < NumIterations; ++i )
     {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
 
         while ( true )
         {
@@ -1097,44 +2645,27 @@ void test_connection_reliable_ordered_messages_and_blocks()
             if ( !message )
                 break;
 
-            check( message->GetId() == (int) numMessagesReceived );
-
-            switch ( message->GetType() )
-            {
-                case TEST_MESSAGE:
-                {
-                    TestMessage * testMessage = (TestMessage*) message;
-
-                    check( testMessage->sequence == uint16_t( numMessagesReceived ) );
-
-                    ++numMessagesReceived;
-                }
-                break;
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
 
-                case TEST_BLOCK_MESSAGE:
-                {
-                    TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
 
-                    check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
 
-                    const int blockSize = blockMessage->GetBlockSize();
+            const int blockSize = blockMessage->GetBlockSize();
 
-                    check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
-        
-                    const uint8_t * blockData = blockMessage->GetBlockData();
+            check( blockSize == 1 + ( numMessagesReceived * 7 ) );
 
-                    check( blockData );
+            const uint8_t * blockData = blockMessage->GetBlockData();
 
-                    for ( int j = 0; j < blockSize; ++j )
-                    {
-                        check( blockData[j] == uint8_t( numMessagesReceived + j ) );
-                    }
+            check( blockData );
 
-                    ++numMessagesReceived;
-                }
-                break;
+            for ( int j = 0; j < blockSize; ++j )
+            {
+                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
             }
 
+            ++numMessagesReceived;
+
             messageFactory.ReleaseMessage( message );
         }
 
@@ -1142,75 +2673,122 @@ void test_connection_reliable_ordered_messages_and_blocks()
             break;
     }
 
-    check( numMessagesReceived == NumMessagesSent );
-}
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+struct TestFixedSizeMessage : public Message
+{
+    uint32_t value;
+    uint16_t sequence;
+
+    TestFixedSizeMessage()
+    {
+        value = 0;
+        sequence = 0;
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, value, 32 );
+        serialize_bits( stream, sequence, 16 );
+        return true;
+    }
+
+    YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
+
+    YOJIMBO_STATIC_SERIALIZED_BITS( 48 );
+};
+
+enum TestFixedSizeMessageType
+{
+    TEST_FIXED_SIZE_MESSAGE_VARIABLE,
+    TEST_FIXED_SIZE_MESSAGE_FIXED,
+    NUM_TEST_FIXED_SIZE_MESSAGE_TYPES
+};
+
+YOJIMBO_MESSAGE_FACTORY_START( TestFixedSizeMessageFactory, NUM_TEST_FIXED_SIZE_MESSAGE_TYPES );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_FIXED_SIZE_MESSAGE_VARIABLE, TestMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_FIXED_SIZE_MESSAGE_FIXED, TestFixedSizeMessage );
+YOJIMBO_MESSAGE_FACTORY_FINISH();
+
+void test_message_serialized_bits()
+{
+    TestFixedSizeMessageFactory messageFactory( GetDefaultAllocator() );
+
+    // variable sized messages are measured once and the result is cached
+
+    for ( int i = 0; i < 32; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_FIXED_SIZE_MESSAGE_VARIABLE );
+        check( message );
+        message->sequence = i;
+
+        MeasureStream measureStream( GetDefaultAllocator() );
+        message->SerializeInternal( measureStream );
+
+        check( message->GetFixedSerializedBits() == -1 );
+        check( message->GetSerializedBits( GetDefaultAllocator(), NULL ) == measureStream.GetBitsProcessed() );
+        check( message->GetSerializedBits( GetDefaultAllocator(), NULL ) == 16 + GetNumBitsForMessage( i ) );
+
+        messageFactory.ReleaseMessage( message );
+    }
+
+    // fixed size messages report their declared size
 
-void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
-{
-    const int NumChannels = 2;
+    TestFixedSizeMessage * fixedSizeMessage = (TestFixedSizeMessage*) messageFactory.CreateMessage( TEST_FIXED_SIZE_MESSAGE_FIXED );
+    check( fixedSizeMessage );
+    check( fixedSizeMessage->GetFixedSerializedBits() == 48 );
+    check( fixedSizeMessage->GetSerializedBits( GetDefaultAllocator(), NULL ) == 48 );
+    messageFactory.ReleaseMessage( fixedSizeMessage );
+
+    // mixed fixed and variable sized messages round trip over both channel types
 
     double time = 100.0;
-    
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
 
     ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = NumChannels;
+    connectionConfig.numChannels = 2;
     connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
-    connectionConfig.channel[0].maxMessagesPerPacket = 8;
-    connectionConfig.channel[1].type = CHANNEL_TYPE_RELIABLE_ORDERED;
-    connectionConfig.channel[1].maxMessagesPerPacket = 8;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
 
     Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-
     Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    const int NumMessagesSent = 32;
+    const int NumMessagesSent = 64;
 
-    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    for ( int channelIndex = 0; channelIndex < connectionConfig.numChannels; ++channelIndex )
     {
         for ( int i = 0; i < NumMessagesSent; ++i )
         {
-            if ( rand() % 2 )
+            if ( i % 2 )
             {
-                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+                TestFixedSizeMessage * message = (TestFixedSizeMessage*) messageFactory.CreateMessage( TEST_FIXED_SIZE_MESSAGE_FIXED );
                 check( message );
+                message->value = 0xDEADBEEF ^ i;
                 message->sequence = i;
                 sender.SendMessage( channelIndex, message );
             }
             else
             {
-                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_FIXED_SIZE_MESSAGE_VARIABLE );
                 check( message );
                 message->sequence = i;
-                const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-                for ( int j = 0; j < blockSize; ++j )
-                    blockData[j] = i + j;
-                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
                 sender.SendMessage( channelIndex, message );
             }
         }
     }
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
-
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
-
-    const int NumIterations = 10000;
-
-    int numMessagesReceived[NumChannels];
-    memset( numMessagesReceived, 0, sizeof( numMessagesReceived ) );
+    int numMessagesReceived[2] = { 0, 0 };
 
     uint16_t senderSequence = 0;
     uint16_t receiverSequence = 0;
 
+    const int NumIterations = 1000;
+
     for ( int i = 0; i < NumIterations; ++i )
     {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
 
-        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        for ( int channelIndex = 0; channelIndex < connectionConfig.numChannels; ++channelIndex )
         {
             while ( true )
             {
@@ -1218,123 +2796,321 @@ void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
                 if ( !message )
                     break;
 
-                check( message->GetId() == (int) numMessagesReceived[channelIndex] );
+                const int sequence = numMessagesReceived[channelIndex];
 
-                switch ( message->GetType() )
+                if ( sequence % 2 )
                 {
-                    case TEST_MESSAGE:
-                    {
-                        TestMessage * testMessage = (TestMessage*) message;
+                    check( message->GetType() == TEST_FIXED_SIZE_MESSAGE_FIXED );
+                    TestFixedSizeMessage * fixedMessage = (TestFixedSizeMessage*) message;
+                    check( fixedMessage->value == ( 0xDEADBEEF ^ sequence ) );
+                    check( fixedMessage->sequence == sequence );
+                }
+                else
+                {
+                    check( message->GetType() == TEST_FIXED_SIZE_MESSAGE_VARIABLE );
+                    TestMessage * testMessage = (TestMessage*) message;
+                    check( testMessage->sequence == sequence );
+                }
 
-                        check( testMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+                ++numMessagesReceived[channelIndex];
 
-                        ++numMessagesReceived[channelIndex];
-                    }
-                    break;
+                messageFactory.ReleaseMessage( message );
+            }
+        }
 
-                    case TEST_BLOCK_MESSAGE:
-                    {
-                        TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+        if ( numMessagesReceived[0] == NumMessagesSent && numMessagesReceived[1] == NumMessagesSent )
+            break;
+    }
 
-                        check( blockMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+    check( numMessagesReceived[0] == NumMessagesSent );
+    check( numMessagesReceived[1] == NumMessagesSent );
+}
 
-                        const int blockSize = blockMessage->GetBlockSize();
+const int NumSnapshotEntities = 64;
 
-                        check( blockSize == 1 + ( ( numMessagesReceived[channelIndex] * 901 ) % 3333 ) );
-            
-                        const uint8_t * blockData = blockMessage->GetBlockData();
+static const int32_t DefaultSnapshotPositions[NumSnapshotEntities] = { 0 };
 
-                        check( blockData );
+struct TestSnapshotMessage : public BaselineMessage
+{
+    int32_t position[NumSnapshotEntities];
+    uint32_t frame;
+    float heading;
+    int score;
 
-                        for ( int j = 0; j < blockSize; ++j )
-                        {
-                            check( blockData[j] == uint8_t( numMessagesReceived[channelIndex] + j ) );
-                        }
+    TestSnapshotMessage()
+    {
+        memset( position, 0, sizeof( position ) );
+        frame = 0;
+        heading = 0.0f;
+        score = 0;
+    }
 
-                        ++numMessagesReceived[channelIndex];
-                    }
-                    break;
-                }
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        const TestSnapshotMessage * baseline = (const TestSnapshotMessage*) GetBaseline();
 
-                messageFactory.ReleaseMessage( message );
-            }
+        serialize_int_array_delta( stream, position, baseline ? baseline->position : DefaultSnapshotPositions, NumSnapshotEntities, -1000, 1000 );
+        serialize_bits_delta( stream, frame, baseline ? baseline->frame : 0, 32 );
+        serialize_float_delta( stream, heading, baseline ? baseline->heading : 0.0f );
+        serialize_int_delta( stream, score, baseline ? baseline->score : 0, 0, 100 );
+
+        return true;
+    }
+
+    YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
+};
+
+enum TestSnapshotMessageType
+{
+    TEST_SNAPSHOT_MESSAGE,
+    TEST_OTHER_SNAPSHOT_MESSAGE,
+    NUM_TEST_SNAPSHOT_MESSAGE_TYPES
+};
+
+YOJIMBO_MESSAGE_FACTORY_START( TestSnapshotMessageFactory, NUM_TEST_SNAPSHOT_MESSAGE_TYPES );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_SNAPSHOT_MESSAGE, TestSnapshotMessage );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_OTHER_SNAPSHOT_MESSAGE, TestSnapshotMessage );
+YOJIMBO_MESSAGE_FACTORY_FINISH();
+
+void test_baseline_message_serialized_bits()
+{
+    TestSnapshotMessageFactory messageFactory( GetDefaultAllocator() );
+
+    TestSnapshotMessage * baseline = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+    TestSnapshotMessage * message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+
+    check( baseline );
+    check( message );
+
+    for ( int i = 0; i < NumSnapshotEntities; ++i )
+    {
+        baseline->position[i] = i;
+        message->position[i] = i;
+    }
+    message->position[0] = 1000;
+
+    // the cached size must follow the baseline, otherwise the channel budgets packets with a stale size
+
+    const int fullBits = message->GetSerializedBits( GetDefaultAllocator(), NULL );
+
+    message->SetBaseline( messageFactory, baseline, 0 );
+
+    const int deltaBits = message->GetSerializedBits( GetDefaultAllocator(), NULL );
+
+    check( deltaBits < fullBits );
+
+    message->ClearBaseline();
+
+    check( message->GetSerializedBits( GetDefaultAllocator(), NULL ) == fullBits );
+
+    messageFactory.ReleaseMessage( message );
+    messageFactory.ReleaseMessage( baseline );
+}
+
+void test_connection_baseline_messages()
+{
+    TestSnapshotMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    uint16_t sequence = 0;
+
+    int firstPacketBytes = 0;
+    int lastPacketBytes = 0;
+
+    const int NumIterations = 32;
+
+    // snapshots are sent in full until the first one is acked, then only the entity that changed is sent
+
+    for ( int i = 0; i < NumIterations + 2; ++i )
+    {
+        if ( i == NumIterations )
+        {
+            // the receiver loses its baselines. packets relative to them are dropped without an error
+
+            receiver.Reset();
         }
 
-        bool receivedAllMessages = true;
+        if ( i == NumIterations + 1 )
+        {
+            // after both sides reset, snapshots are sent in full again
 
-        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+            sender.Reset();
+        }
+
+        TestSnapshotMessage * message = (TestSnapshotMessage*) messageFactory.CreateMessage( TEST_SNAPSHOT_MESSAGE );
+        check( message );
+        for ( int j = 0; j < NumSnapshotEntities; ++j )
+            message->position[j] = ( j == i % NumSnapshotEntities ) ? i : j * 10;
+        message->frame = 1000 + i;
+        message->heading = 1.5f;
+        message->score = 50;
+
+        sender.SendMessage( 0, message );
+
+        int packetBytes = 0;
+        check( sender.GeneratePacket( NULL, sequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        check( packetBytes > 0 );
+
+        if ( i == NumIterations )
         {
-            if ( numMessagesReceived[channelIndex] != NumMessagesSent )
-            {
-                receivedAllMessages = false;
-                break;
-            }
+            check( !receiver.ProcessPacket( NULL, sequence, packetData, packetBytes ) );
+            check( receiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
+            check( receiver.GetBaselineStore()->GetNumMissingBaselines() == 1 );
+            check( receiver.ReceiveMessage( 0 ) == NULL );
+            sequence++;
+            continue;
         }
 
-        if ( receivedAllMessages )
-            break;
+        check( receiver.ProcessPacket( NULL, sequence, packetData, packetBytes ) );
+        sender.ProcessAcks( &sequence, 1 );
+
+        if ( i == 0 )
+            firstPacketBytes = packetBytes;
+        else if ( i < NumIterations )
+            lastPacketBytes = packetBytes;
+        else
+            check( packetBytes == firstPacketBytes );
+
+        TestSnapshotMessage * receivedMessage = (TestSnapshotMessage*) receiver.ReceiveMessage( 0 );
+        check( receivedMessage );
+        check( receivedMessage->GetType() == TEST_SNAPSHOT_MESSAGE );
+        check( receivedMessage->GetBaseline() == NULL );
+        for ( int j = 0; j < NumSnapshotEntities; ++j )
+            check( receivedMessage->position[j] == ( ( j == i % NumSnapshotEntities ) ? i : j * 10 ) );
+        check( receivedMessage->frame == uint32_t( 1000 + i ) );
+        check( receivedMessage->heading == 1.5f );
+        check( receivedMessage->score == 50 );
+        messageFactory.ReleaseMessage( receivedMessage );
+
+        check( receiver.ReceiveMessage( 0 ) == NULL );
+
+        sequence++;
     }
 
-    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    check( lastPacketBytes * 4 < firstPacketBytes );
+}
+
+void test_connection_baseline_messages_multiple_types()
+{
+    TestSnapshotMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    int firstPacketBytes = 0;
+    int lastPacketBytes = 0;
+
+    const int NumIterations = 32;
+
+    // each packet has one snapshot of each type. once the first packet is acked, both types are sent relative to their own baseline
+
+    for ( uint16_t sequence = 0; sequence < NumIterations; ++sequence )
     {
-        check( numMessagesReceived[channelIndex] == NumMessagesSent );
+        for ( int type = 0; type < NUM_TEST_SNAPSHOT_MESSAGE_TYPES; ++type )
+        {
+            TestSnapshotMessage * message = (TestSnapshotMessage*) messageFactory.CreateMessage( type );
+            check( message );
+            for ( int j = 0; j < NumSnapshotEntities; ++j )
+                message->position[j] = ( j == sequence % NumSnapshotEntities ) ? sequence : j * 10 + type;
+            message->frame = 1000 + sequence;
+            message->score = type;
+            sender.SendMessage( 0, message );
+        }
+
+        int packetBytes = 0;
+        check( sender.GeneratePacket( NULL, sequence, packetData, connectionConfig.maxPacketSize, packetBytes ) );
+        check( packetBytes > 0 );
+
+        check( receiver.ProcessPacket( NULL, sequence, packetData, packetBytes ) );
+        sender.ProcessAcks( &sequence, 1 );
+
+        if ( sequence == 0 )
+            firstPacketBytes = packetBytes;
+        else
+            lastPacketBytes = packetBytes;
+
+        for ( int type = 0; type < NUM_TEST_SNAPSHOT_MESSAGE_TYPES; ++type )
+        {
+            TestSnapshotMessage * receivedMessage = (TestSnapshotMessage*) receiver.ReceiveMessage( 0 );
+            check( receivedMessage );
+            check( receivedMessage->GetType() == type );
+            for ( int j = 0; j < NumSnapshotEntities; ++j )
+                check( receivedMessage->position[j] == ( ( j == sequence % NumSnapshotEntities ) ? sequence : j * 10 + type ) );
+            check( receivedMessage->frame == uint32_t( 1000 + sequence ) );
+            check( receivedMessage->score == type );
+            messageFactory.ReleaseMessage( receivedMessage );
+        }
+
+        check( receiver.ReceiveMessage( 0 ) == NULL );
     }
+
+    check( receiver.GetBaselineStore()->GetNumMissingBaselines() == 0 );
+    check( lastPacketBytes * 4 < firstPacketBytes );
 }
 
-void test_connection_unreliable_unordered_messages()
+void test_connection_packet_capture_replay()
 {
     TestMessageFactory messageFactory( GetDefaultAllocator() );
 
     double time = 100.0;
 
     ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = 1;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
 
     Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
     Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    const char * TraceFilename = "test_packet_trace.bin";
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    PacketCapture capture;
+    check( capture.Open( TraceFilename, connectionConfig ) );
 
-    const int NumIterations = 256;
+    receiver.SetPacketCapture( &capture );
 
-    const int NumMessagesSent = 16;
+    const int NumMessagesSent = 64;
 
-    for ( int j = 0; j < NumMessagesSent; ++j )
+    for ( int i = 0; i < NumMessagesSent; ++i )
     {
         TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
         check( message );
-        message->sequence = j;
+        message->sequence = i;
         sender.SendMessage( 0, message );
     }
 
     int numMessagesReceived = 0;
 
+    const int NumIterations = 1000;
+
     uint16_t senderSequence = 0;
     uint16_t receiverSequence = 0;
 
     for ( int i = 0; i < NumIterations; ++i )
     {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 50 );
 
         while ( true )
         {
             Message * message = receiver.ReceiveMessage( 0 );
             if ( !message )
                 break;
-
-            check( message->GetType() == TEST_MESSAGE );
-
-            TestMessage * testMessage = (TestMessage*) message;
-
-            check( testMessage->sequence == uint16_t( numMessagesReceived ) );
-
             ++numMessagesReceived;
-
             messageFactory.ReleaseMessage( message );
         }
 
@@ -1343,89 +3119,237 @@ void test_connection_unreliable_unordered_messages()
     }
 
     check( numMessagesReceived == NumMessagesSent );
+
+    receiver.SetPacketCapture( NULL );
+
+    const uint64_t numRecords = capture.GetNumRecords();
+    const int traceBytes = (int) capture.GetBytesWritten();
+
+    capture.Close();
+
+    check( numRecords > 0 );
+
+    // the trace holds every packet and ack the receiver saw
+
+    PacketReplay replay( GetDefaultAllocator() );
+
+    check( replay.Load( TraceFilename ) );
+
+    FILE * file = fopen( TraceFilename, "rb" );
+    check( file );
+    uint8_t * traceData = (uint8_t*) malloc( traceBytes );
+    check( fread( traceData, 1, traceBytes, file ) == (size_t) traceBytes );
+    fclose( file );
+    remove( TraceFilename );
+
+    check( replay.GetNumChannels() == connectionConfig.numChannels );
+    check( replay.GetMaxPacketSize() == connectionConfig.maxPacketSize );
+    check( uint64_t( replay.GetNumRecords( PACKET_TRACE_SENT ) + replay.GetNumRecords( PACKET_TRACE_RECEIVED ) + replay.GetNumRecords( PACKET_TRACE_ACKS ) ) == numRecords );
+    check( replay.GetNumRecords( PACKET_TRACE_RECEIVED ) > 0 );
+    check( replay.GetNumRecords( PACKET_TRACE_ACKS ) > 0 );
+    check( replay.GetPacketBytes( PACKET_TRACE_RECEIVED ) > 0 );
+
+    // replaying into a fresh connection processes the same packets without error, every time
+
+    for ( int i = 0; i < 2; ++i )
+    {
+        Connection replayReceiver( GetDefaultAllocator(), messageFactory, connectionConfig, 100.0 );
+        check( replay.Replay( replayReceiver ) == replay.GetNumRecords( PACKET_TRACE_RECEIVED ) );
+        check( replayReceiver.GetErrorLevel() == CONNECTION_ERROR_NONE );
+
+        Connection replaySender( GetDefaultAllocator(), messageFactory, connectionConfig, 100.0 );
+        check( replay.Replay( replaySender, PACKET_TRACE_SENT ) == replay.GetNumRecords( PACKET_TRACE_SENT ) );
+        check( replaySender.GetErrorLevel() == CONNECTION_ERROR_NONE );
+    }
+
+    // truncated or corrupt traces fail to load
+
+    check( replay.Load( traceData, traceBytes ) );
+    check( !replay.Load( traceData, traceBytes - 1 ) );
+    traceData[0] ^= 1;
+    check( !replay.Load( traceData, traceBytes ) );
+
+    free( traceData );
 }
 
-void test_connection_unreliable_unordered_blocks()
+struct TestStaticSizeObject
 {
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
+    uint32_t a;
+    int32_t b;
+    bool c;
 
-    double time = 100.0;
-    
-    ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = 1;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    TestStaticSizeObject()
+    {
+        a = 0;
+        b = 0;
+        c = false;
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, a, 20 );
+        serialize_int( stream, b, -10, 10 );
+        serialize_bool( stream, c );
+        return true;
+    }
+
+    YOJIMBO_STATIC_SERIALIZED_BITS( ( 20 + BitsRequired<-10,10>::result + 1 ) );
+};
+
+struct TestStaticSizeContainer
+{
+    int numObjects;
+    TestStaticSizeObject objects[8];
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_int( stream, numObjects, 0, 8 );
+        for ( int i = 0; i < numObjects; ++i )
+            serialize_object( stream, objects[i] );
+        return true;
+    }
+};
+
+void test_static_serialized_bits()
+{
+    check( HasStaticSerializedBits<TestStaticSizeObject>::result );
+    check( !HasStaticSerializedBits<TestStaticSizeContainer>::result );
+    check( !HasStaticSerializedBits<TestMessage>::result );
+
+    check( StaticSerializedBits<TestStaticSizeObject>::result == 26 );
+    check( StaticSerializedBits<TestStaticSizeContainer>::result == -1 );
+
+    TestStaticSizeObject object;
+    check( object.GetFixedSerializedBits() == 26 );
+
+    TestStaticSizeContainer container;
+    container.numObjects = 5;
+    for ( int i = 0; i < container.numObjects; ++i )
+    {
+        container.objects[i].a = i * 1000;
+        container.objects[i].b = i - 5;
+        container.objects[i].c = ( i & 1 ) != 0;
+    }
+
+    // measuring uses the static size of each object
 
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    MeasureStream measureStream( GetDefaultAllocator() );
+    check( container.Serialize( measureStream ) );
+    check( measureStream.GetBitsProcessed() == int( BitsRequired<0,8>::result ) + 5 * 26 );
 
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    // and it matches what is actually written
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    const int BufferSize = 256;
+    uint8_t buffer[BufferSize];
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+    check( container.Serialize( writeStream ) );
+    writeStream.Flush();
+    check( writeStream.GetBitsProcessed() == measureStream.GetBitsProcessed() );
 
-    const int NumIterations = 256;
+    TestStaticSizeContainer readContainer;
+    ReadStream readStream( GetDefaultAllocator(), buffer, BufferSize );
+    check( readContainer.Serialize( readStream ) );
+    check( readContainer.numObjects == container.numObjects );
+    for ( int i = 0; i < container.numObjects; ++i )
+    {
+        check( readContainer.objects[i].a == container.objects[i].a );
+        check( readContainer.objects[i].b == container.objects[i].b );
+        check( readContainer.objects[i].c == container.objects[i].c );
+    }
+}
 
-    const int NumMessagesSent = 8;
+class OutOfMemoryAllocator : public Allocator
+{
+public:
 
-    for ( int j = 0; j < NumMessagesSent; ++j )
+    void * Allocate( size_t size, const char * file, int line )
     {
-        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-        check( message );
-        message->sequence = j;
-        const int blockSize = 1 + ( j * 7 );
-        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-        for ( int k = 0; k < blockSize; ++k )
-            blockData[k] = j + k;
-        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-        sender.SendMessage( 0, message );
+        (void) size;
+        (void) file;
+        (void) line;
+        return NULL;
     }
 
-    int numMessagesReceived = 0;
+    void Free( void * p, const char * file, int line )
+    {
+        (void) p;
+        (void) file;
+        (void) line;
+    }
+};
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+void test_message_factory_pool()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
 
-    for ( int i = 0; i < NumIterations; ++i )
+    for ( int i = 0; i < NUM_TEST_MESSAGE_TYPES; ++i )
     {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+        for ( int j = 0; j < MESSAGE_POOL_NUM_COUNTERS; ++j )
+            check( messageFactory.GetPoolCounter( i, j ) == 0 );
+    }
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    // creating more messages than fit in one slab grows the pool
 
-            check( message->GetType() == TEST_BLOCK_MESSAGE );
+    const int NumMessages = MessagesPerPoolSlab + 1;
 
-            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+    Message * messages[NumMessages];
 
-            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+    for ( int i = 0; i < NumMessages; ++i )
+    {
+        messages[i] = messageFactory.CreateMessage( TEST_MESSAGE );
+        check( messages[i] );
+        check( messages[i]->GetType() == TEST_MESSAGE );
+    }
 
-            const int blockSize = blockMessage->GetBlockSize();
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == NumMessages );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_PEAK_MESSAGES_IN_USE ) == NumMessages );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_SLABS_ALLOCATED ) == 2 );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_FREE ) == 2 * MessagesPerPoolSlab - NumMessages );
+    check( messageFactory.GetPoolCounter( TEST_BLOCK_MESSAGE, MESSAGE_POOL_COUNTER_SLABS_ALLOCATED ) == 0 );
 
-            check( blockSize == 1 + ( numMessagesReceived * 7 ) );
+    // released messages go back to the pool and are reused without allocating
 
-            const uint8_t * blockData = blockMessage->GetBlockData();
+    Message * releasedMessage = messages[NumMessages/2];
+    messageFactory.ReleaseMessage( releasedMessage );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == NumMessages - 1 );
 
-            check( blockData );
+    messages[NumMessages/2] = messageFactory.CreateMessage( TEST_MESSAGE );
+    check( messages[NumMessages/2] == releasedMessage );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_SLABS_ALLOCATED ) == 2 );
 
-            for ( int j = 0; j < blockSize; ++j )
-            {
-                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
-            }
+    // messages with more than one reference are only returned to the pool when the last reference is released
 
-            ++numMessagesReceived;
+    messageFactory.AcquireMessage( messages[0] );
+    messageFactory.ReleaseMessage( messages[0] );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == NumMessages );
 
-            messageFactory.ReleaseMessage( message );
-        }
+    for ( int i = 0; i < NumMessages; ++i )
+        messageFactory.ReleaseMessage( messages[i] );
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
-    }
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == 0 );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_FREE ) == 2 * MessagesPerPoolSlab );
+    check( messageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_PEAK_MESSAGES_IN_USE ) == NumMessages );
 
-    check( numMessagesReceived == NumMessagesSent );
+    // block messages free their block when returned to the pool
+
+    BlockMessage * blockMessage = (BlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+    check( blockMessage );
+    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), 1024 );
+    memset( blockData, 0, 1024 );
+    blockMessage->AttachBlock( messageFactory.GetAllocator(), blockData, 1024 );
+    check( messageFactory.GetPoolCounter( TEST_BLOCK_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == 1 );
+    messageFactory.ReleaseMessage( blockMessage );
+    check( messageFactory.GetPoolCounter( TEST_BLOCK_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == 0 );
+    check( messageFactory.GetPoolCounter( TEST_BLOCK_MESSAGE, MESSAGE_POOL_COUNTER_SLABS_ALLOCATED ) == 1 );
+
+    // a message factory that can't allocate its pools starts in an error state and creates no messages
+
+    OutOfMemoryAllocator outOfMemoryAllocator;
+    TestMessageFactory outOfMemoryMessageFactory( outOfMemoryAllocator );
+    check( outOfMemoryMessageFactory.GetErrorLevel() == MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE );
+    check( outOfMemoryMessageFactory.CreateMessage( TEST_MESSAGE ) == NULL );
+    check( outOfMemoryMessageFactory.GetPoolCounter( TEST_MESSAGE, MESSAGE_POOL_COUNTER_MESSAGES_IN_USE ) == 0 );
 }
 
 void PumpClientServerUpdate( double & time, Client ** client, int numClients, Server ** server, int numServers, float deltaTime = 0.1f )
@@ -1876,6 +3800,111 @@ void test_client_server_start_stop_restart()
     }
 }
 
+void test_client_server_worker_threads()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+    config.serverWorkerThreads = 2;
+    config.serverParallelSend = true;
+    config.serverParallelReceive = true;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    const int NumClients = 8;
+
+    server.Start( NumClients );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+    while ( true )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) )
+            break;
+
+        if ( AllClientsConnected( NumClients, server, clients ) )
+            break;
+    }
+
+    check( AllClientsConnected( NumClients, server, clients ) );
+
+    const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+    for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+    {
+        SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
+        SendServerToClientMessages( server, clientIndex, NumMessagesSent );
+    }
+
+    int numMessagesReceivedFromClient[NumClients];
+    int numMessagesReceivedFromServer[NumClients];
+
+    memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
+    memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        bool allMessagesReceived = true;
+
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+
+            if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
+                allMessagesReceived = false;
+
+            int clientIndex = clients[j]->GetClientIndex();
+
+            ProcessClientToServerMessages( server, clientIndex, numMessagesReceivedFromClient[clientIndex] );
+
+            if ( numMessagesReceivedFromClient[clientIndex] != NumMessagesSent )
+                allMessagesReceived = false;
+        }
+
+        if ( allMessagesReceived )
+            break;
+    }
+
+    for ( int clientIndex = 0; clientIndex < NumClients; ++clientIndex )
+    {
+        check( numMessagesReceivedFromClient[clientIndex] == NumMessagesSent );
+        check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
+    }
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
+}
+
 void test_client_server_message_failed_to_serialize_reliable_ordered()
 {
     const uint64_t clientId = 1;
@@ -2168,6 +4197,183 @@ void test_client_server_message_receive_queue_overflow()
     server.Stop();
 }
 
+void test_client_server_client_out_of_memory()
+{
+    const uint64_t clientId = 1;
+
+    Address clientAddress( "0.0.0.0", ClientPort );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.serverPerClientMemory = 1024 * 1024;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( MaxClients );
+
+    Client client( GetDefaultAllocator(), clientAddress, config, adapter, time );
+
+    // the first time around, the client runs out of memory on the server and is kicked. the second time, it gets the next client resources and must stay connected
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        client.InsecureConnect( privateKey, clientId, serverAddress );
+
+        const int NumIterations = 10000;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            if ( client.ConnectionFailed() )
+                break;
+
+            if ( !client.IsConnecting() && client.IsConnected() && server.GetNumConnectedClients() == 1 )
+                break;
+        }
+
+        check( client.IsConnected() );
+        check( server.GetNumConnectedClients() == 1 );
+
+        const int clientIndex = client.GetClientIndex();
+
+        if ( iteration == 0 )
+        {
+            const int MaxBlocks = 64;
+            const int BlockBytes = 64 * 1024;
+
+            uint8_t * blocks[MaxBlocks];
+            int numBlocks = 0;
+
+            while ( numBlocks < MaxBlocks )
+            {
+                blocks[numBlocks] = server.AllocateBlock( clientIndex, BlockBytes );
+                if ( !blocks[numBlocks] )
+                    break;
+                numBlocks++;
+            }
+
+            check( numBlocks < MaxBlocks );
+
+            for ( int i = 0; i < numBlocks; ++i )
+                server.FreeBlock( clientIndex, blocks[i] );
+        }
+
+        for ( int i = 0; i < 100; ++i )
+        {
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+        }
+
+        if ( iteration == 0 )
+        {
+            check( !client.IsConnected() );
+            check( server.GetNumConnectedClients() == 0 );
+
+            // per-client calls on a slot with no client connected do nothing
+
+            check( server.CreateMessage( clientIndex, TEST_MESSAGE ) == NULL );
+            check( server.AllocateBlock( clientIndex, 1024 ) == NULL );
+            check( !server.CanSendMessage( clientIndex, 0 ) );
+            check( !server.HasMessagesToSend( clientIndex, 0 ) );
+            check( server.ReceiveMessage( clientIndex, 0 ) == NULL );
+        }
+        else
+        {
+            check( client.IsConnected() );
+            check( server.IsClientConnected( clientIndex ) );
+        }
+    }
+
+    client.Disconnect();
+
+    server.Stop();
+}
+
+class LimitedMessageFactoryAdapter : public TestAdapter
+{
+public:
+
+    int numMessageFactories;
+
+    explicit LimitedMessageFactoryAdapter( int _numMessageFactories ) : numMessageFactories( _numMessageFactories ) {}
+
+    MessageFactory * CreateMessageFactory( Allocator & allocator )
+    {
+        if ( numMessageFactories <= 0 )
+            return NULL;
+        numMessageFactories--;
+        return TestAdapter::CreateMessageFactory( allocator );
+    }
+};
+
+void test_client_server_client_create_failure()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.serverClientMemoryPool = 2 * config.serverPerClientMemory;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    // one message factory is created when the server starts to measure a client, and one for the first client. the second client fails to be created and is disconnected
+
+    LimitedMessageFactoryAdapter limitedAdapter( 2 );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, limitedAdapter, time );
+
+    server.Start( MaxClients );
+
+    const int NumClients = 2;
+
+    Client * clients[NumClients];
+    CreateClients( NumClients, clients, Address( "0.0.0.0", ClientPort ), config, adapter, time );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        clients[i]->InsecureConnect( privateKey, i + 1, serverAddress );
+
+        for ( int j = 0; j < 1000; ++j )
+        {
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, i + 1, servers, 1 );
+
+            if ( !clients[i]->IsConnecting() )
+                break;
+        }
+
+        for ( int j = 0; j < 100; ++j )
+        {
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, i + 1, servers, 1 );
+        }
+    }
+
+    check( clients[0]->IsConnected() );
+    check( !clients[1]->IsConnected() );
+    check( server.GetNumConnectedClients() == 1 );
+    check( server.IsClientConnected( clients[0]->GetClientIndex() ) );
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
+}
+
 void test_reliable_fragment_overflow_bug()
 {
     double time = 100.0;
@@ -2531,26 +4737,51 @@ int main()
 		RUN_TEST( test_base64 );
 #endif // #if YOJIMBO_WITH_MBEDTLS
         RUN_TEST( test_bitpacker );
+        RUN_TEST( test_bitpacker_array );
         RUN_TEST( test_bits_required );
         RUN_TEST( test_stream );
+        RUN_TEST( test_stream_arrays );
+        RUN_TEST( test_relative_bits );
         RUN_TEST( test_address );
         RUN_TEST( test_bit_array );
         RUN_TEST( test_sequence_buffer );
+        RUN_TEST( test_worker_threads );
         RUN_TEST( test_allocator_tlsf );
+        RUN_TEST( test_allocator_tlsf_pooled );
+        RUN_TEST( test_random_generator );
+        RUN_TEST( test_network_simulator );
+        RUN_TEST( test_network_simulator_link_profile );
+        RUN_TEST( test_network_simulator_seed );
 
         RUN_TEST( test_connection_reliable_ordered_messages );
         RUN_TEST( test_connection_reliable_ordered_blocks );
+        RUN_TEST( test_connection_reliable_ordered_blocks_zero_copy );
+        RUN_TEST( test_connection_reliable_ordered_block_fragments_per_packet );
+        RUN_TEST( test_connection_reliable_ordered_messages_behind_block );
+        RUN_TEST( test_connection_reliable_ordered_packet_budget_with_blocks );
+        RUN_TEST( test_reliable_ordered_channel_block_outside_receive_window );
+        RUN_TEST( test_connection_reliable_ordered_blocks_in_flight );
         RUN_TEST( test_connection_reliable_ordered_messages_and_blocks );
         RUN_TEST( test_connection_reliable_ordered_messages_and_blocks_multiple_channels );
         RUN_TEST( test_connection_unreliable_unordered_messages );
         RUN_TEST( test_connection_unreliable_unordered_blocks );
+        RUN_TEST( test_message_serialized_bits );
+        RUN_TEST( test_static_serialized_bits );
+        RUN_TEST( test_baseline_message_serialized_bits );
+        RUN_TEST( test_connection_baseline_messages );
+        RUN_TEST( test_connection_baseline_messages_multiple_types );
+        RUN_TEST( test_connection_packet_capture_replay );
+        RUN_TEST( test_message_factory_pool );
 
         RUN_TEST( test_client_server_messages );
         RUN_TEST( test_client_server_start_stop_restart );
+        RUN_TEST( test_client_server_worker_threads );
         RUN_TEST( test_client_server_message_failed_to_serialize_reliable_ordered );
         RUN_TEST( test_client_server_message_failed_to_serialize_unreliable_unordered );
         RUN_TEST( test_client_server_message_exhaust_stream_allocator );
         RUN_TEST( test_client_server_message_receive_queue_overflow );
+        RUN_TEST( test_client_server_client_out_of_memory );
+        RUN_TEST( test_client_server_client_create_failure );
         RUN_TEST( test_reliable_fragment_overflow_bug );
         RUN_TEST( test_single_message_type_reliable );
         RUN_TEST( test_single_message_type_reliable_blocks );
@@ -34,6 +34,26 @@
 #include <map>
 #endif // YOJIMBO_DEBUG_MEMORY_LEAKS
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if !defined( YOJIMBO_SSE2 ) && ( defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) )
+#define YOJIMBO_SSE2 1
+#endif // #if !defined( YOJIMBO_SSE2 ) && ...
+
+#if !defined( YOJIMBO_AVX2 ) && defined( __AVX2__ )
+#define YOJIMBO_AVX2 1
+#endif // #if !defined( YOJIMBO_AVX2 ) && defined( __AVX2__ )
+
+#if YOJIMBO_SSE2
+#include <emmintrin.h>
+#endif // #if YOJIMBO_SSE2
+
+#if YOJIMBO_AVX2
+#include <immintrin.h>
+#endif // #if YOJIMBO_AVX2
+
 static yojimbo::Allocator * g_defaultAllocator = NULL;
 
 namespace yojimbo
@@ -341,6 +361,257 @@ namespace yojimbo
 
         tlsf_free( m_tlsf, p );
     }
+
+    // =============================================
+
+    struct MemoryPoolData
+    {
+        std::mutex mutex;                                       ///< Protects the memory pool, which is shared between allocators on different threads.
+    };
+
+    MemoryPool::MemoryPool( Allocator & allocator, size_t budgetBytes, size_t pageBytes )
+    {
+        yojimbo_assert( pageBytes > 0 );
+        m_allocator = &allocator;
+        m_budgetBytes = budgetBytes;
+        m_pageBytes = pageBytes;
+        m_usedBytes = 0;
+        m_data = YOJIMBO_NEW( allocator, MemoryPoolData );
+        yojimbo_assert( m_data );
+    }
+
+    MemoryPool::~MemoryPool()
+    {
+        yojimbo_assert( m_usedBytes == 0 );
+        YOJIMBO_DELETE( *m_allocator, MemoryPoolData, m_data );
+    }
+
+    void * MemoryPool::AllocateChunk( size_t bytes, size_t & chunkBytes )
+    {
+        chunkBytes = RoundUpToPageSize( bytes );
+        std::lock_guard<std::mutex> lock( m_data->mutex );
+        if ( m_usedBytes + chunkBytes > m_budgetBytes )
+            return NULL;
+        void * chunk = YOJIMBO_ALLOCATE( *m_allocator, chunkBytes );
+        if ( !chunk )
+            return NULL;
+        m_usedBytes += chunkBytes;
+        return chunk;
+    }
+
+    void MemoryPool::FreeChunk( void * chunk, size_t chunkBytes )
+    {
+        yojimbo_assert( chunk );
+        std::lock_guard<std::mutex> lock( m_data->mutex );
+        yojimbo_assert( m_usedBytes >= chunkBytes );
+        m_usedBytes -= chunkBytes;
+        YOJIMBO_FREE( *m_allocator, chunk );
+    }
+
+    size_t MemoryPool::GetUsedBytes() const
+    {
+        std::lock_guard<std::mutex> lock( m_data->mutex );
+        return m_usedBytes;
+    }
+
+    // =============================================
+
+    struct PooledChunk
+    {
+        PooledChunk * next;                                     ///< The next chunk in the list.
+        uint8_t * start;                                        ///< Start of the memory added to the TLSF heap.
+        uint8_t * finish;                                       ///< End of the memory added to the TLSF heap.
+        pool_t pool;                                            ///< The TLSF pool for this chunk.
+        size_t bytes;                                           ///< Size of the chunk taken from the memory pool (bytes).
+        size_t usedBytes;                                       ///< Size of the TLSF blocks currently allocated from this chunk (bytes). The chunk is returned to the memory pool when this drops to zero.
+        bool control;                                           ///< True if the chunk holds the TLSF control structure. This chunk is kept until the allocator is destroyed.
+    };
+
+    TLSF_PooledAllocator::TLSF_PooledAllocator( MemoryPool & pool, size_t maxBytes )
+    {
+        SetErrorLevel( ALLOCATOR_ERROR_NONE );
+        m_pool = &pool;
+        m_maxBytes = maxBytes;
+        m_committedBytes = 0;
+        m_chunks = NULL;
+        m_numChunks = 0;
+        m_maxChunks = (int) yojimbo_max( maxBytes / pool.GetPageBytes(), (size_t) 1 );
+        m_numEmptyChunks = 0;
+        m_tlsf = NULL;
+        AddChunk( 0 );
+    }
+
+    TLSF_PooledAllocator::~TLSF_PooledAllocator()
+    {
+        if ( m_tlsf )
+        {
+            tlsf_destroy( m_tlsf );
+        }
+
+        // the chunk array lives in the control chunk, so free that chunk last
+
+        PooledChunk * controlChunk = NULL;
+        for ( int i = 0; i < m_numChunks; ++i )
+        {
+            if ( m_chunks[i]->control )
+                controlChunk = m_chunks[i];
+            else
+                m_pool->FreeChunk( m_chunks[i], m_chunks[i]->bytes );
+        }
+        if ( controlChunk )
+        {
+            m_pool->FreeChunk( controlChunk, controlChunk->bytes );
+        }
+        m_chunks = NULL;
+        m_numChunks = 0;
+        m_committedBytes = 0;
+    }
+
+    bool TLSF_PooledAllocator::AddChunk( size_t bytes )
+    {
+        const int AlignBytes = 8;
+
+        // TLSF rounds requests up to the next size class, which is up to 1/32 larger, before searching for a free block
+
+        size_t requiredBytes = sizeof( PooledChunk ) + AlignBytes + tlsf_pool_overhead() + tlsf_alloc_overhead() + bytes + bytes / 16 + AlignBytes;
+        if ( !m_tlsf )
+        {
+            requiredBytes += tlsf_size() + AlignBytes + sizeof( PooledChunk* ) * m_maxChunks + AlignBytes;
+        }
+
+        if ( m_committedBytes + m_pool->RoundUpToPageSize( requiredBytes ) > m_maxBytes || m_numChunks == m_maxChunks )
+            return false;
+
+        size_t chunkBytes;
+        uint8_t * memory = (uint8_t*) m_pool->AllocateChunk( requiredBytes, chunkBytes );
+        if ( !memory )
+            return false;
+
+        PooledChunk * chunk = (PooledChunk*) memory;
+        chunk->start = (uint8_t*) AlignPointerUp( memory + sizeof( PooledChunk ), AlignBytes );
+        chunk->finish = (uint8_t*) AlignPointerDown( memory + chunkBytes, AlignBytes );
+        chunk->control = false;
+        if ( !m_tlsf )
+        {
+            m_tlsf = tlsf_create( chunk->start );
+            yojimbo_assert( m_tlsf );
+            m_chunks = (PooledChunk**) AlignPointerUp( chunk->start + tlsf_size(), AlignBytes );
+            chunk->start = (uint8_t*) AlignPointerUp( m_chunks + m_maxChunks, AlignBytes );
+            chunk->control = true;
+        }
+        yojimbo_assert( chunk->start < chunk->finish );
+        chunk->pool = tlsf_add_pool( m_tlsf, chunk->start, chunk->finish - chunk->start );
+        yojimbo_assert( chunk->pool );
+        chunk->bytes = chunkBytes;
+        chunk->usedBytes = 0;
+
+        int index = m_numChunks;
+        while ( index > 0 && m_chunks[index-1]->start > chunk->start )
+        {
+            m_chunks[index] = m_chunks[index-1];
+            index--;
+        }
+        m_chunks[index] = chunk;
+        m_numChunks++;
+
+        if ( !chunk->control )
+            m_numEmptyChunks++;
+
+        m_committedBytes += chunkBytes;
+        return true;
+    }
+
+    void TLSF_PooledAllocator::ReleaseChunk( int index )
+    {
+        yojimbo_assert( index >= 0 );
+        yojimbo_assert( index < m_numChunks );
+        PooledChunk * chunk = m_chunks[index];
+        yojimbo_assert( !chunk->control );
+        yojimbo_assert( chunk->usedBytes == 0 );
+        tlsf_remove_pool( m_tlsf, chunk->pool );
+        memmove( m_chunks + index, m_chunks + index + 1, sizeof( PooledChunk* ) * ( m_numChunks - index - 1 ) );
+        m_numChunks--;
+        m_committedBytes -= chunk->bytes;
+        m_pool->FreeChunk( chunk, chunk->bytes );
+    }
+
+    int TLSF_PooledAllocator::FindChunk( void * p ) const
+    {
+        // find the last chunk that starts at or before p
+
+        int low = 0;
+        int high = m_numChunks;
+        while ( low < high )
+        {
+            const int middle = ( low + high ) / 2;
+            if ( m_chunks[middle]->start <= (uint8_t*) p )
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        const int index = low - 1;
+        if ( index < 0 || (uint8_t*) p >= m_chunks[index]->finish )
+            return -1;
+
+        return index;
+    }
+
+    void * TLSF_PooledAllocator::Allocate( size_t size, const char * file, int line )
+    {
+        void * p = m_tlsf ? tlsf_malloc( m_tlsf, size ) : NULL;
+
+        if ( !p && AddChunk( size ) )
+        {
+            p = tlsf_malloc( m_tlsf, size );
+        }
+
+        if ( !p )
+        {
+            SetErrorLevel( ALLOCATOR_ERROR_OUT_OF_MEMORY );
+            return NULL;
+        }
+
+        const int index = FindChunk( p );
+        yojimbo_assert( index >= 0 );
+        PooledChunk * chunk = m_chunks[index];
+        if ( chunk->usedBytes == 0 && !chunk->control )
+        {
+            yojimbo_assert( m_numEmptyChunks > 0 );
+            m_numEmptyChunks--;
+        }
+        chunk->usedBytes += tlsf_block_size( p );
+
+        TrackAlloc( p, size, file, line );
+
+        return p;
+    }
+
+    void TLSF_PooledAllocator::Free( void * p, const char * file, int line )
+    {
+        if ( !p )
+            return;
+
+        TrackFree( p, file, line );
+
+        const int index = FindChunk( p );
+        yojimbo_assert( index >= 0 );
+        PooledChunk * chunk = m_chunks[index];
+        yojimbo_assert( chunk->usedBytes >= tlsf_block_size( p ) );
+        chunk->usedBytes -= tlsf_block_size( p );
+
+        tlsf_free( m_tlsf, p );
+
+        if ( chunk->usedBytes == 0 && !chunk->control )
+        {
+            // keep one empty single page chunk in reserve. chunks sized for a large allocation go straight back, so they don't sit idle in the shared pool
+
+            if ( m_numEmptyChunks == 0 && chunk->bytes == m_pool->GetPageBytes() )
+                m_numEmptyChunks++;
+            else
+                ReleaseChunk( index );
+        }
+    }
 }
 
 // ---------------------------------------------------------------------------------
@@ -1109,7 +1380,11 @@ namespace yojimbo
         channelIndex = 0;
         blockMessage = 0;
         messageFailedToSerialize = 0;
+        ownsFragmentData = 0;
         message.numMessages = 0;
+        message.messages = NULL;
+        block.numEntries = 0;
+        block.entries = NULL;
         initialized = 1;
     }
 
@@ -1117,32 +1392,72 @@ namespace yojimbo
     {
         yojimbo_assert( initialized );
         Allocator & allocator = messageFactory.GetAllocator();
-        if ( !blockMessage )
+        if ( message.numMessages > 0 )
         {
-            if ( message.numMessages > 0 )
+            for ( int i = 0; i < message.numMessages; ++i )
             {
-                for ( int i = 0; i < message.numMessages; ++i )
+                if ( message.messages[i] )
                 {
-                    if ( message.messages[i] )
-                    {
-                        messageFactory.ReleaseMessage( message.messages[i] );
-                    }
+                    messageFactory.ReleaseMessage( message.messages[i] );
                 }
-                YOJIMBO_FREE( allocator, message.messages );
             }
+            YOJIMBO_FREE( allocator, message.messages );
         }
-        else
+        if ( blockMessage )
         {
-            if ( block.message )
+            for ( int i = 0; i < block.numEntries; ++i )
             {
-                messageFactory.ReleaseMessage( block.message );
-                block.message = NULL;
+                BlockData & fragment = block.entries[i];
+                if ( fragment.message )
+                {
+                    messageFactory.ReleaseMessage( fragment.message );
+                    fragment.message = NULL;
+                }
+                if ( ownsFragmentData )
+                {
+                    YOJIMBO_FREE( allocator, fragment.fragmentData );
+                }
             }
-            YOJIMBO_FREE( allocator, block.fragmentData );
+            YOJIMBO_FREE( allocator, block.entries );
         }
         initialized = 0;
     }
 
+    template <typename Stream> bool SerializeMessageBaseline( Stream & stream, MessageFactory & messageFactory, BaselineMessage * message )
+    {
+        bool hasBaseline = Stream::IsWriting && message->GetBaseline() != NULL;
+
+        serialize_bool( stream, hasBaseline );
+
+        if ( hasBaseline )
+        {
+            uint16_t baselineSequence = Stream::IsWriting ? message->GetBaselineSequence() : 0;
+
+            serialize_bits( stream, baselineSequence, 16 );
+
+            if ( Stream::IsReading )
+            {
+                BaselineStore * baselineStore = stream.GetBaselineStore();
+                if ( !baselineStore )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: no baseline store to read baseline message (SerializeMessageBaseline)\n" );
+                    return false;
+                }
+
+                Message * baseline = baselineStore->FindReceivedBaseline( baselineSequence, message->GetType() );
+                if ( !baseline )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "baseline %d for message type %d is not available (SerializeMessageBaseline)\n", baselineSequence, message->GetType() );
+                    return false;
+                }
+
+                message->SetBaseline( messageFactory, baseline, baselineSequence );
+            }
+        }
+
+        return true;
+    }
+
     template <typename Stream> bool SerializeOrderedMessages( Stream & stream, 
                                                               MessageFactory & messageFactory, 
                                                               int & numMessages, 
@@ -1220,6 +1535,12 @@ namespace yojimbo
 
                 yojimbo_assert( messages[i] );
 
+                if ( messages[i]->IsBaselineMessage() && !SerializeMessageBaseline( stream, messageFactory, (BaselineMessage*) messages[i] ) )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize baseline for message of type %d (SerializeOrderedMessages)\n", messageTypes[i] );
+                    return false;
+                }
+
                 if ( !messages[i]->SerializeInternal( stream ) )
                 {
                     yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize message of type %d (SerializeOrderedMessages)\n", messageTypes[i] );
@@ -1260,6 +1581,13 @@ namespace yojimbo
         return true;
     }
 
+    static int MeasureMessageBlock( BlockMessage * blockMessage, int maxBlockSize )
+    {
+        // closed form of SerializeMessageBlock with a measure stream: block size, worst case align, then the block bytes
+
+        return bits_required( 1, maxBlockSize ) + 7 + blockMessage->GetBlockSize() * 8;
+    }
+
     template <typename Stream> bool SerializeUnorderedMessages( Stream & stream, 
                                                                 MessageFactory & messageFactory, 
                                                                 int & numMessages, 
@@ -1325,6 +1653,12 @@ namespace yojimbo
 
                 yojimbo_assert( messages[i] );
 
+                if ( messages[i]->IsBaselineMessage() && !SerializeMessageBaseline( stream, messageFactory, (BaselineMessage*) messages[i] ) )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize baseline for message type %d (SerializeUnorderedMessages)\n", messageTypes[i] );
+                    return false;
+                }
+
                 if ( !messages[i]->SerializeInternal( stream ) )
                 {
                     yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize message type %d (SerializeUnorderedMessages)\n", messageTypes[i] );
@@ -1459,51 +1793,80 @@ namespace yojimbo
 
         serialize_bool( stream, blockMessage );
 
-        if ( !blockMessage )
+        if ( blockMessage )
         {
-            switch ( channelConfig.type )
+            if ( channelConfig.disableBlocks )
+                return false;
+
+            if ( Stream::IsReading )
+                ownsFragmentData = 1;
+
+            int numEntries = block.numEntries;
+
+            serialize_int( stream, numEntries, 1, channelConfig.maxFragmentsPerPacket );
+
+            if ( Stream::IsReading )
             {
-                case CHANNEL_TYPE_RELIABLE_ORDERED:
+                block.entries = (BlockData*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), sizeof( BlockData ) * numEntries );
+
+                if ( !block.entries )
                 {
-                    if ( !SerializeOrderedMessages( stream, messageFactory, message.numMessages, message.messages, channelConfig.maxMessagesPerPacket ) )
-                    {
-                        messageFailedToSerialize = 1;
-                        return true;
-                    }
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to allocate block fragments (ChannelPacketData::Serialize)\n" );
+                    return false;
                 }
-                break;
 
-                case CHANNEL_TYPE_UNRELIABLE_UNORDERED:
+                memset( block.entries, 0, sizeof( BlockData ) * numEntries );
+
+                block.numEntries = numEntries;
+            }
+
+            for ( int i = 0; i < block.numEntries; ++i )
+            {
+                if ( !SerializeBlockFragment( stream, messageFactory, block.entries[i], channelConfig ) )
+                    return false;
+            }
+        }
+
+        // regular messages follow any block fragments. on reliable-ordered channels they fill the space left in the packet while a block is being sent
+
+        switch ( channelConfig.type )
+        {
+            case CHANNEL_TYPE_RELIABLE_ORDERED:
+            {
+                if ( !SerializeOrderedMessages( stream, messageFactory, message.numMessages, message.messages, channelConfig.maxMessagesPerPacket ) )
                 {
-                    if ( !SerializeUnorderedMessages( stream, 
-                                                      messageFactory, 
-                                                      message.numMessages, 
-                                                      message.messages, 
-                                                      channelConfig.maxMessagesPerPacket, 
-                                                      channelConfig.maxBlockSize ) )
-                    {
-                        messageFailedToSerialize = 1;
-                        return true;
-                    }
+                    messageFailedToSerialize = 1;
+                    return true;
                 }
-                break;
             }
+            break;
 
-#if YOJIMBO_DEBUG_MESSAGE_BUDGET
-            if ( channelConfig.packetBudget > 0 )
+            case CHANNEL_TYPE_UNRELIABLE_UNORDERED:
             {
-                yojimbo_assert( stream.GetBitsProcessed() - startBits <= channelConfig.packetBudget * 8 );
+                if ( !SerializeUnorderedMessages( stream, 
+                                                  messageFactory, 
+                                                  message.numMessages, 
+                                                  message.messages, 
+                                                  channelConfig.maxMessagesPerPacket, 
+                                                  channelConfig.maxBlockSize ) )
+                {
+                    messageFailedToSerialize = 1;
+                    return true;
+                }
             }
-#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
+            break;
         }
-        else
-        {
-            if ( channelConfig.disableBlocks )
-                return false;
 
-            if ( !SerializeBlockFragment( stream, messageFactory, block, channelConfig ) )
-                return false;
+#if YOJIMBO_DEBUG_MESSAGE_BUDGET
+        // the first fragment of a block is always sent, so a packet holding just that one fragment may exceed the budget on its own
+
+        const bool singleFragment = blockMessage && block.numEntries == 1 && message.numMessages == 0;
+
+        if ( channelConfig.packetBudget > 0 && !singleFragment )
+        {
+            yojimbo_assert( stream.GetBitsProcessed() - startBits <= channelConfig.packetBudget * 8 );
         }
+#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
 
         return true;
     }
@@ -1544,6 +1907,14 @@ namespace yojimbo
         return m_counters[index];
     }
 
+    void Channel::ProcessAcks( const uint16_t * acks, int numAcks )
+    {
+        for ( int i = 0; i < numAcks; ++i )
+        {
+            ProcessAck( acks[i] );
+        }
+    }
+
     void Channel::ResetCounters()
     { 
         memset( m_counters, 0, sizeof( m_counters ) ); 
@@ -1583,16 +1954,25 @@ namespace yojimbo
         m_messageSendQueue = YOJIMBO_NEW( *m_allocator, SequenceBuffer<MessageSendQueueEntry>, *m_allocator, m_config.messageSendQueueSize );
         m_messageReceiveQueue = YOJIMBO_NEW( *m_allocator, SequenceBuffer<MessageReceiveQueueEntry>, *m_allocator, m_config.messageReceiveQueueSize );
         m_sentPacketMessageIds = (uint16_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint16_t ) * m_config.maxMessagesPerPacket * m_config.sentPacketBufferSize );
+        m_sentPacketBlockMessageIds = NULL;
+        m_sentPacketBlockFragmentIds = NULL;
+        m_sendBlocks = NULL;
+        m_receiveBlocks = NULL;
 
         if ( !config.disableBlocks )
         {
-            m_sendBlock = YOJIMBO_NEW( *m_allocator, SendBlockData, *m_allocator, m_config.GetMaxFragmentsPerBlock() ); 
-            m_receiveBlock = YOJIMBO_NEW( *m_allocator, ReceiveBlockData, *m_allocator, m_config.maxBlockSize, m_config.GetMaxFragmentsPerBlock() );
-        }
-        else
-        {
-            m_sendBlock = NULL;
-            m_receiveBlock = NULL;
+            yojimbo_assert( config.maxFragmentsPerPacket > 0 );
+            yojimbo_assert( config.maxBlocksInFlight > 0 );
+            m_sentPacketBlockMessageIds = (uint16_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint16_t ) * m_config.maxFragmentsPerPacket * m_config.sentPacketBufferSize );
+            m_sentPacketBlockFragmentIds = (uint16_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint16_t ) * m_config.maxFragmentsPerPacket * m_config.sentPacketBufferSize );
+            m_sendBlocks = (SendBlockData**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( SendBlockData* ) * m_config.maxBlocksInFlight );
+            m_receiveBlocks = (ReceiveBlockData**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( ReceiveBlockData* ) * m_config.maxBlocksInFlight );
+            Allocator & blockAllocator = m_config.zeroCopyBlockReceive ? m_messageFactory->GetAllocator() : *m_allocator;
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                m_sendBlocks[i] = YOJIMBO_NEW( *m_allocator, SendBlockData, *m_allocator, m_config.GetMaxFragmentsPerBlock() ); 
+                m_receiveBlocks[i] = YOJIMBO_NEW( *m_allocator, ReceiveBlockData, *m_allocator, blockAllocator, m_config.maxBlockSize, m_config.GetMaxFragmentsPerBlock() );
+            }
         }
 
         Reset();
@@ -1602,13 +1982,24 @@ namespace yojimbo
     {
         Reset();
 
-        YOJIMBO_DELETE( *m_allocator, SendBlockData, m_sendBlock );
-        YOJIMBO_DELETE( *m_allocator, ReceiveBlockData, m_receiveBlock );
+        if ( !m_config.disableBlocks )
+        {
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                YOJIMBO_DELETE( *m_allocator, SendBlockData, m_sendBlocks[i] );
+                YOJIMBO_DELETE( *m_allocator, ReceiveBlockData, m_receiveBlocks[i] );
+            }
+            YOJIMBO_FREE( *m_allocator, m_sendBlocks );
+            YOJIMBO_FREE( *m_allocator, m_receiveBlocks );
+        }
+
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<SentPacketEntry>, m_sentPackets );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<MessageSendQueueEntry>, m_messageSendQueue );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<MessageReceiveQueueEntry>, m_messageReceiveQueue );
         
         YOJIMBO_FREE( *m_allocator, m_sentPacketMessageIds );
+        YOJIMBO_FREE( *m_allocator, m_sentPacketBlockMessageIds );
+        YOJIMBO_FREE( *m_allocator, m_sentPacketBlockFragmentIds );
 
         m_sentPacketMessageIds = NULL;
     }
@@ -1620,6 +2011,7 @@ namespace yojimbo
         m_sendMessageId = 0;
         m_receiveMessageId = 0;
         m_oldestUnackedMessageId = 0;
+        m_numSendQueueBlocks = 0;
 
         for ( int i = 0; i < m_messageSendQueue->GetSize(); ++i )
         {
@@ -1639,18 +2031,18 @@ namespace yojimbo
         m_messageSendQueue->Reset();
         m_messageReceiveQueue->Reset();
 
-        if ( m_sendBlock )
-        {
-            m_sendBlock->Reset();
-        }
-
-        if ( m_receiveBlock )
+        if ( !m_config.disableBlocks )
         {
-            m_receiveBlock->Reset();
-            if ( m_receiveBlock->blockMessage )
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
             {
-                m_messageFactory->ReleaseMessage( m_receiveBlock->blockMessage );
-                m_receiveBlock->blockMessage = NULL;
+                m_sendBlocks[i]->Reset();
+
+                m_receiveBlocks[i]->Reset();
+                if ( m_receiveBlocks[i]->blockMessage )
+                {
+                    m_messageFactory->ReleaseMessage( m_receiveBlocks[i]->blockMessage );
+                    m_receiveBlocks[i]->blockMessage = NULL;
+                }
             }
         }
 
@@ -1710,12 +2102,12 @@ namespace yojimbo
         {
             yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() > 0 );
             yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() <= m_config.maxBlockSize );
+            m_numSendQueueBlocks++;
         }
 
-        MeasureStream measureStream( m_messageFactory->GetAllocator() );
-		measureStream.SetContext( context );
-        message->SerializeInternal( measureStream );
-        entry->measuredBits = measureStream.GetBitsProcessed();
+        entry->measuredBits = message->GetSerializedBits( m_messageFactory->GetAllocator(), context );
+        if ( message->IsBaselineMessage() )
+            entry->measuredBits += ((BaselineMessage*)message)->GetBaselineHeaderBits();
         m_counters[CHANNEL_COUNTER_MESSAGES_SENT]++;
         m_sendMessageId++;
     }
@@ -1746,44 +2138,55 @@ namespace yojimbo
     
     int ReliableOrderedChannel::GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
     {
+        (void) context;
+
         if ( !HasMessagesToSend() )
             return 0;
 
-        if ( SendingBlockMessage() )
-        {
-            if (m_config.blockFragmentSize * 8 > availableBits)
-                return 0;
+        packetData.Initialize();
+        packetData.channelIndex = GetChannelIndex();
 
-            uint16_t messageId;
-            uint16_t fragmentId;
-            int fragmentBytes;
-            int numFragments;
-            int messageType;
+        // fragments and messages share the channel packet budget. GetFragmentsToSend applies the budget itself, because the first fragment is sent even if it is larger than the budget
 
-            uint8_t * fragmentData = GetFragmentToSend( messageId, fragmentId, fragmentBytes, numFragments, messageType );
+        const int budgetBits = ( m_config.packetBudget > 0 ) ? yojimbo_min( m_config.packetBudget * 8, availableBits ) : availableBits;
 
-            if ( fragmentData )
-            {
-                const int fragmentBits = GetFragmentPacketData( packetData, messageId, fragmentId, fragmentData, fragmentBytes, numFragments, messageType );
-                AddFragmentPacketEntry( messageId, fragmentId, packetSequence );
-                return fragmentBits;
-            }
-        }
-        else
+        int numFragmentIds = 0;
+        uint16_t * fragmentMessageIds = NULL;
+        uint16_t * fragmentIds = NULL;
+        int fragmentBits = 0;
+
+        if ( m_numSendQueueBlocks > 0 && m_config.blockFragmentSize * 8 <= availableBits )
         {
-            int numMessageIds = 0;
-            uint16_t * messageIds = (uint16_t*) alloca( m_config.maxMessagesPerPacket * sizeof( uint16_t ) );
-            const int messageBits = GetMessagesToSend( messageIds, numMessageIds, availableBits, context );
+            fragmentMessageIds = (uint16_t*) alloca( m_config.maxFragmentsPerPacket * sizeof( uint16_t ) );
+            fragmentIds = (uint16_t*) alloca( m_config.maxFragmentsPerPacket * sizeof( uint16_t ) );
+            fragmentBits = GetFragmentsToSend( fragmentMessageIds, fragmentIds, numFragmentIds, availableBits );
 
-            if ( numMessageIds > 0 )
+            if ( numFragmentIds > 0 && !GetFragmentPacketData( packetData, fragmentMessageIds, fragmentIds, numFragmentIds ) )
             {
-                GetMessagePacketData( packetData, messageIds, numMessageIds );
-                AddMessagePacketEntry( messageIds, numMessageIds, packetSequence );
-                return messageBits;
+                // Not enough memory to allocate the fragment packet data
+                SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                return 0;
             }
         }
 
-        return 0;
+        // messages queued behind blocks are sent in the space left over by their fragments. the receiver holds them in the receive queue until the blocks arrive, so they are still delivered in order
+
+        int numMessageIds = 0;
+        uint16_t * messageIds = (uint16_t*) alloca( m_config.maxMessagesPerPacket * sizeof( uint16_t ) );
+        const int messageBits = GetMessagesToSend( messageIds, numMessageIds, budgetBits - fragmentBits );
+
+        if ( numMessageIds > 0 )
+            GetMessagePacketData( packetData, messageIds, numMessageIds );
+
+        if ( numMessageIds == 0 && numFragmentIds == 0 )
+            return 0;
+
+        AddMessagePacketEntry( messageIds, numMessageIds, packetSequence );
+
+        if ( numFragmentIds > 0 )
+            AddFragmentPacketEntry( fragmentMessageIds, fragmentIds, numFragmentIds, packetSequence );
+
+        return fragmentBits + ( numMessageIds > 0 ? messageBits : 0 );
     }
 
     bool ReliableOrderedChannel::HasMessagesToSend() const
@@ -1791,7 +2194,7 @@ namespace yojimbo
         return m_oldestUnackedMessageId != m_sendMessageId;
     }
 
-    int ReliableOrderedChannel::GetMessagesToSend( uint16_t * messageIds, int & numMessageIds, int availableBits, void *context )
+    int ReliableOrderedChannel::GetMessagesToSend( uint16_t * messageIds, int & numMessageIds, int availableBits )
     {
         yojimbo_assert( HasMessagesToSend() );
 
@@ -1821,7 +2224,14 @@ namespace yojimbo
                 continue;
 
             if ( entry->block )
+            {
+                // blocks being sent have their fragments sent separately
+
+                if ( FindSendBlock( messageId ) >= 0 )
+                    continue;
+
                 break;
+            }
             
             if ( entry->timeLastSent + m_config.messageResendTime <= m_time && availableBits >= (int) entry->measuredBits )
             {                
@@ -1833,10 +2243,7 @@ namespace yojimbo
                 }
                 else
                 {
-                    MeasureStream stream( GetDefaultAllocator() );
-                    stream.SetContext( context );
-                    serialize_sequence_relative_internal( stream, previousMessageId, messageId );
-                    messageBits += stream.GetBitsProcessed();
+                    messageBits += sequence_relative_bits( previousMessageId, messageId );
                 }
 
                 if ( usedBits + messageBits > availableBits )
@@ -1861,9 +2268,8 @@ namespace yojimbo
     void ReliableOrderedChannel::GetMessagePacketData( ChannelPacketData & packetData, const uint16_t * messageIds, int numMessageIds )
     {
         yojimbo_assert( messageIds );
+        yojimbo_assert( packetData.initialized );
 
-        packetData.Initialize();
-        packetData.channelIndex = GetChannelIndex();
         packetData.message.numMessages = numMessageIds;
         
         if ( numMessageIds == 0 )
@@ -1890,6 +2296,9 @@ namespace yojimbo
         {
             sentPacket->acked = 0;
             sentPacket->block = 0;
+            sentPacket->numBlockFragmentIds = 0;
+            sentPacket->blockMessageIds = NULL;
+            sentPacket->blockFragmentIds = NULL;
             sentPacket->timeSent = m_time;
             sentPacket->messageIds = &m_sentPacketMessageIds[ ( sequence % m_config.sentPacketBufferSize ) * m_config.maxMessagesPerPacket ];
             sentPacket->numMessageIds = numMessageIds;            
@@ -1958,25 +2367,53 @@ namespace yojimbo
 
         if ( packetData.blockMessage )
         {
-            ProcessPacketFragment( packetData.block.messageType, 
-                                   packetData.block.messageId, 
-                                   packetData.block.numFragments, 
-                                   packetData.block.fragmentId, 
-                                   packetData.block.fragmentData, 
-                                   packetData.block.fragmentSize, 
-                                   packetData.block.message );
-        }
-        else
-        {
-            ProcessPacketMessages( packetData.message.numMessages, packetData.message.messages );
+            for ( int i = 0; i < packetData.block.numEntries; ++i )
+            {
+                const ChannelPacketData::BlockData & fragment = packetData.block.entries[i];
+
+                ProcessPacketFragment( fragment.messageType, 
+                                       fragment.messageId, 
+                                       fragment.numFragments, 
+                                       fragment.fragmentId, 
+                                       fragment.fragmentData, 
+                                       fragment.fragmentSize, 
+                                       fragment.message );
+
+                if ( m_errorLevel != CHANNEL_ERROR_NONE )
+                    return;
+            }
         }
+
+        ProcessPacketMessages( packetData.message.numMessages, packetData.message.messages );
     }
 
     void ReliableOrderedChannel::ProcessAck( uint16_t ack )
+    {
+        if ( ProcessAckInternal( ack ) )
+            UpdateOldestUnackedMessageId();
+    }
+
+    void ReliableOrderedChannel::ProcessAcks( const uint16_t * acks, int numAcks )
+    {
+        bool removedMessages = false;
+
+        for ( int i = 0; i < numAcks; ++i )
+        {
+            if ( ProcessAckInternal( acks[i] ) )
+                removedMessages = true;
+        }
+
+        if ( removedMessages )
+            UpdateOldestUnackedMessageId();
+    }
+
+    bool ReliableOrderedChannel::ProcessAckInternal( uint16_t ack )
     {
         SentPacketEntry * sentPacketEntry = m_sentPackets->Find( ack );
         if ( !sentPacketEntry )
-            return;
+            return false;
+
+        bool removedMessages = false;
 
         yojimbo_assert( !sentPacketEntry->acked );
 
@@ -1990,30 +2427,42 @@ namespace yojimbo
                 yojimbo_assert( sendQueueEntry->message->GetId() == messageId );
                 m_messageFactory->ReleaseMessage( sendQueueEntry->message );
                 m_messageSendQueue->Remove( messageId );
-                UpdateOldestUnackedMessageId();
+                removedMessages = true;
             }
         }
 
-        if ( !m_config.disableBlocks && sentPacketEntry->block && m_sendBlock->active && m_sendBlock->blockMessageId == sentPacketEntry->blockMessageId )
+        if ( !m_config.disableBlocks && sentPacketEntry->block )
         {        
-            const int messageId = sentPacketEntry->blockMessageId;
-            const int fragmentId = sentPacketEntry->blockFragmentId;
-
-            if ( !m_sendBlock->ackedFragment->GetBit( fragmentId ) )
+            for ( int i = 0; i < (int) sentPacketEntry->numBlockFragmentIds; ++i )
             {
-                m_sendBlock->ackedFragment->SetBit( fragmentId );
-                m_sendBlock->numAckedFragments++;
-                if ( m_sendBlock->numAckedFragments == m_sendBlock->numFragments )
+                const uint16_t messageId = sentPacketEntry->blockMessageIds[i];
+                const int fragmentId = sentPacketEntry->blockFragmentIds[i];
+
+                const int sendBlockIndex = FindSendBlock( messageId );
+                if ( sendBlockIndex < 0 )
+                    continue;
+
+                SendBlockData * sendBlock = m_sendBlocks[sendBlockIndex];
+
+                if ( !sendBlock->ackedFragment->GetBit( fragmentId ) )
                 {
-                    m_sendBlock->active = false;
-                    MessageSendQueueEntry * sendQueueEntry = m_messageSendQueue->Find( messageId );
-                    yojimbo_assert( sendQueueEntry );
-                    m_messageFactory->ReleaseMessage( sendQueueEntry->message );
-                    m_messageSendQueue->Remove( messageId );
-                    UpdateOldestUnackedMessageId();
+                    sendBlock->ackedFragment->SetBit( fragmentId );
+                    sendBlock->numAckedFragments++;
+                    if ( sendBlock->numAckedFragments == sendBlock->numFragments )
+                    {
+                        sendBlock->active = false;
+                        MessageSendQueueEntry * sendQueueEntry = m_messageSendQueue->Find( messageId );
+                        yojimbo_assert( sendQueueEntry );
+                        m_messageFactory->ReleaseMessage( sendQueueEntry->message );
+                        m_messageSendQueue->Remove( messageId );
+                        m_numSendQueueBlocks--;
+                        removedMessages = true;
+                    }
                 }
             }
         }
+
+        return removedMessages;
     }
 
     void ReliableOrderedChannel::UpdateOldestUnackedMessageId()
@@ -2032,151 +2481,229 @@ namespace yojimbo
         yojimbo_assert( !sequence_greater_than( m_oldestUnackedMessageId, stopMessageId ) );
     }
 
-    bool ReliableOrderedChannel::SendingBlockMessage()
+    int ReliableOrderedChannel::FindSendBlock( uint16_t messageId ) const
     {
-        yojimbo_assert( HasMessagesToSend() );
-
-        MessageSendQueueEntry * entry = m_messageSendQueue->Find( m_oldestUnackedMessageId );
-
-        return entry ? entry->block : false;
+        for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+        {
+            if ( m_sendBlocks[i]->active && m_sendBlocks[i]->blockMessageId == messageId )
+                return i;
+        }
+        return -1;
     }
 
-    uint8_t * ReliableOrderedChannel::GetFragmentToSend( uint16_t & messageId, uint16_t & fragmentId, int & fragmentBytes, int & numFragments, int & messageType )
+    int ReliableOrderedChannel::GetFragmentsToSend( uint16_t * fragmentMessageIds, uint16_t * fragmentIds, int & numFragmentIds, int availableBits )
     {
-        MessageSendQueueEntry * entry = m_messageSendQueue->Find( m_oldestUnackedMessageId );
-
-        yojimbo_assert( entry );
-        yojimbo_assert( entry->block );
+        yojimbo_assert( m_numSendQueueBlocks > 0 );
 
-        BlockMessage * blockMessage = (BlockMessage*) entry->message;
+        numFragmentIds = 0;
 
-        yojimbo_assert( blockMessage );
+        const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
+        const int messageLimit = yojimbo_min( m_config.messageSendQueueSize, m_config.messageReceiveQueueSize );
 
-        messageId = blockMessage->GetId();
+        int usedBits = 0;
+        int numBlocks = 0;
 
-        const int blockSize = blockMessage->GetBlockSize();
+        // walk the first maxBlocksInFlight block messages in the send queue, oldest first
 
-        if ( !m_sendBlock->active )
+        for ( int i = 0; i < messageLimit; ++i )
         {
-            // start sending this block
+            const uint16_t messageId = m_oldestUnackedMessageId + i;
 
-            m_sendBlock->active = true;
-            m_sendBlock->blockSize = blockSize;
-            m_sendBlock->blockMessageId = messageId;
-            m_sendBlock->numFragments = (int) ceil( blockSize / float( m_config.blockFragmentSize ) );
-            m_sendBlock->numAckedFragments = 0;
+            if ( messageId == m_sendMessageId )
+                break;
 
-            const int MaxFragmentsPerBlock = m_config.GetMaxFragmentsPerBlock();
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
+            if ( !entry || !entry->block )
+                continue;
 
-            yojimbo_assert( m_sendBlock->numFragments > 0 );
-            yojimbo_assert( m_sendBlock->numFragments <= MaxFragmentsPerBlock );
+            BlockMessage * blockMessage = (BlockMessage*) entry->message;
 
-            m_sendBlock->ackedFragment->Clear();
+            yojimbo_assert( blockMessage );
 
-            for ( int i = 0; i < MaxFragmentsPerBlock; ++i )
-                m_sendBlock->fragmentSendTime[i] = -1.0;
-        }
+            int sendBlockIndex = FindSendBlock( messageId );
+
+            if ( sendBlockIndex < 0 )
+            {
+                // start sending this block
+
+                for ( int j = 0; j < m_config.maxBlocksInFlight; ++j )
+                {
+                    if ( !m_sendBlocks[j]->active )
+                    {
+                        sendBlockIndex = j;
+                        break;
+                    }
+                }
 
-        numFragments = m_sendBlock->numFragments;
+                yojimbo_assert( sendBlockIndex >= 0 );
 
-        // find the next fragment to send (there may not be one)
+                SendBlockData * sendBlock = m_sendBlocks[sendBlockIndex];
 
-        fragmentId = 0xFFFF;
+                const int blockSize = blockMessage->GetBlockSize();
 
-        for ( int i = 0; i < m_sendBlock->numFragments; ++i )
-        {
-            if ( !m_sendBlock->ackedFragment->GetBit( i ) && m_sendBlock->fragmentSendTime[i] + m_config.blockFragmentResendTime < m_time )
-            {
-                fragmentId = uint16_t( i );
-                break;
+                sendBlock->active = true;
+                sendBlock->blockSize = blockSize;
+                sendBlock->blockMessageId = messageId;
+                sendBlock->numFragments = (int) ceil( blockSize / float( m_config.blockFragmentSize ) );
+                sendBlock->numAckedFragments = 0;
+
+                yojimbo_assert( sendBlock->numFragments > 0 );
+                yojimbo_assert( sendBlock->numFragments <= m_config.GetMaxFragmentsPerBlock() );
+
+                sendBlock->ackedFragment->Clear();
+
+                sendBlock->sendQueueStart = 0;
+                sendBlock->sendQueueCount = 0;
+
+                for ( int j = 0; j < sendBlock->numFragments; ++j )
+                {
+                    sendBlock->fragmentSendTime[j] = -1.0;
+                    sendBlock->PushFragment( j );
+                }
             }
-        }
 
-        if ( fragmentId == 0xFFFF )
-            return NULL;
+            SendBlockData * sendBlock = m_sendBlocks[sendBlockIndex];
+
+            // find the fragments of this block to send (there may not be any). every fragment waits the same resend time after it is sent,
+            // so the send queue is ordered by when fragments are due and the search stops at the first fragment that is not due yet
 
-        // allocate and return a copy of the fragment data
+            while ( sendBlock->sendQueueCount > 0 )
+            {
+                const int j = sendBlock->PeekFragment();
 
-        messageType = blockMessage->GetType();
+                if ( sendBlock->ackedFragment->GetBit( j ) )
+                {
+                    sendBlock->PopFragment();
+                    continue;
+                }
 
-        fragmentBytes = m_config.blockFragmentSize;
-        
-        const int fragmentRemainder = blockSize % m_config.blockFragmentSize;
+                if ( sendBlock->fragmentSendTime[j] + m_config.blockFragmentResendTime >= m_time )
+                    break;
 
-        if ( fragmentRemainder && fragmentId == m_sendBlock->numFragments - 1 )
-            fragmentBytes = fragmentRemainder;
+                int fragmentBits = ConservativeFragmentHeaderBits + GetFragmentBytes( sendBlockIndex, j ) * 8;
 
-        uint8_t * fragmentData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), fragmentBytes );
+                if ( j == 0 )
+                    fragmentBits += entry->measuredBits + messageTypeBits;
 
-        if ( fragmentData )
-        {
-            memcpy( fragmentData, blockMessage->GetBlockData() + fragmentId * m_config.blockFragmentSize, fragmentBytes );
+                // the first fragment is always included. additional fragments must fit in the packet and the channel budget
 
-            m_sendBlock->fragmentSendTime[fragmentId] = m_time;
+                if ( numFragmentIds > 0 )
+                {
+                    if ( usedBits + fragmentBits > availableBits )
+                        return usedBits;
+
+                    if ( m_config.packetBudget > 0 && usedBits + fragmentBits > m_config.packetBudget * 8 )
+                        return usedBits;
+                }
+
+                usedBits += fragmentBits;
+                fragmentMessageIds[numFragmentIds] = messageId;
+                fragmentIds[numFragmentIds] = uint16_t( j );
+                numFragmentIds++;
+                sendBlock->fragmentSendTime[j] = m_time;
+                sendBlock->PopFragment();
+                sendBlock->PushFragment( j );
+
+                if ( numFragmentIds == m_config.maxFragmentsPerPacket )
+                    return usedBits;
+            }
+
+            if ( ++numBlocks == m_config.maxBlocksInFlight || numBlocks == m_numSendQueueBlocks )
+                break;
         }
 
-        return fragmentData;
+        return usedBits;
     }
 
-    int ReliableOrderedChannel::GetFragmentPacketData( ChannelPacketData & packetData, 
-                                                       uint16_t messageId, 
-                                                       uint16_t fragmentId, 
-                                                       uint8_t * fragmentData, 
-                                                       int fragmentSize, 
-                                                       int numFragments, 
-                                                       int messageType )
+    int ReliableOrderedChannel::GetFragmentBytes( int sendBlockIndex, int fragmentId ) const
     {
-        packetData.Initialize();
+        yojimbo_assert( sendBlockIndex >= 0 );
+        yojimbo_assert( sendBlockIndex < m_config.maxBlocksInFlight );
 
-        packetData.channelIndex = GetChannelIndex();
+        const SendBlockData * sendBlock = m_sendBlocks[sendBlockIndex];
 
-        packetData.blockMessage = 1;
+        yojimbo_assert( sendBlock->active );
+        yojimbo_assert( fragmentId >= 0 );
+        yojimbo_assert( fragmentId < sendBlock->numFragments );
 
-        packetData.block.fragmentData = fragmentData;
-        packetData.block.messageId = messageId;
-        packetData.block.fragmentId = fragmentId;
-        packetData.block.fragmentSize = fragmentSize;
-        packetData.block.numFragments = numFragments;
-        packetData.block.messageType = messageType;
+        if ( fragmentId == sendBlock->numFragments - 1 )
+            return sendBlock->blockSize - fragmentId * m_config.blockFragmentSize;
 
-        const int messageTypeBits = bits_required( 0, m_messageFactory->GetNumTypes() - 1 );
+        return m_config.blockFragmentSize;
+    }
+
+    bool ReliableOrderedChannel::GetFragmentPacketData( ChannelPacketData & packetData, const uint16_t * fragmentMessageIds, const uint16_t * fragmentIds, int numFragmentIds )
+    {
+        yojimbo_assert( fragmentMessageIds );
+        yojimbo_assert( fragmentIds );
+        yojimbo_assert( numFragmentIds > 0 );
+        yojimbo_assert( packetData.initialized );
 
-        int fragmentBits = ConservativeFragmentHeaderBits + fragmentSize * 8;
+        packetData.blockMessage = 1;
+
+        packetData.block.numEntries = 0;
+        packetData.block.entries = (ChannelPacketData::BlockData*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), sizeof( ChannelPacketData::BlockData ) * numFragmentIds );
+
+        if ( !packetData.block.entries )
+            return false;
 
-        if ( fragmentId == 0 )
+        for ( int i = 0; i < numFragmentIds; ++i )
         {
-            MessageSendQueueEntry * entry = m_messageSendQueue->Find( packetData.block.messageId );
+            const uint16_t messageId = fragmentMessageIds[i];
+            const int fragmentId = fragmentIds[i];
+
+            MessageSendQueueEntry * entry = m_messageSendQueue->Find( messageId );
 
             yojimbo_assert( entry );
             yojimbo_assert( entry->message );
 
-            packetData.block.message = (BlockMessage*) entry->message;
+            BlockMessage * blockMessage = (BlockMessage*) entry->message;
 
-            m_messageFactory->AcquireMessage( packetData.block.message );
+            const int sendBlockIndex = FindSendBlock( messageId );
 
-            fragmentBits += entry->measuredBits + messageTypeBits;
-        }
-        else
-        {
-            packetData.block.message = NULL;
+            yojimbo_assert( sendBlockIndex >= 0 );
+
+            ChannelPacketData::BlockData & fragment = packetData.block.entries[i];
+
+            fragment.fragmentData = blockMessage->GetBlockData() + fragmentId * m_config.blockFragmentSize;
+            fragment.messageId = messageId;
+            fragment.fragmentId = fragmentId;
+            fragment.fragmentSize = GetFragmentBytes( sendBlockIndex, fragmentId );
+            fragment.numFragments = m_sendBlocks[sendBlockIndex]->numFragments;
+            fragment.messageType = blockMessage->GetType();
+
+            if ( fragmentId == 0 )
+            {
+                fragment.message = blockMessage;
+                m_messageFactory->AcquireMessage( blockMessage );
+            }
+            else
+            {
+                fragment.message = NULL;
+            }
         }
 
-        return fragmentBits;
+        packetData.block.numEntries = numFragmentIds;
+
+        return true;
     }
 
-    void ReliableOrderedChannel::AddFragmentPacketEntry( uint16_t messageId, uint16_t fragmentId, uint16_t sequence )
+    void ReliableOrderedChannel::AddFragmentPacketEntry( const uint16_t * fragmentMessageIds, const uint16_t * fragmentIds, int numFragmentIds, uint16_t sequence )
     {
-        SentPacketEntry * sentPacket = m_sentPackets->Insert( sequence );
+        SentPacketEntry * sentPacket = m_sentPackets->Find( sequence );
         yojimbo_assert( sentPacket );
         if ( sentPacket )
         {
-            sentPacket->numMessageIds = 0;
-            sentPacket->messageIds = NULL;
-            sentPacket->timeSent = m_time;
-            sentPacket->acked = 0;
+            const int index = ( sequence % m_config.sentPacketBufferSize ) * m_config.maxFragmentsPerPacket;
             sentPacket->block = 1;
-            sentPacket->blockMessageId = messageId;
-            sentPacket->blockFragmentId = fragmentId;
+            sentPacket->blockMessageIds = &m_sentPacketBlockMessageIds[index];
+            sentPacket->blockFragmentIds = &m_sentPacketBlockFragmentIds[index];
+            sentPacket->numBlockFragmentIds = numFragmentIds;
+            for ( int i = 0; i < numFragmentIds; ++i )
+            {
+                sentPacket->blockMessageIds[i] = fragmentMessageIds[i];
+                sentPacket->blockFragmentIds[i] = fragmentIds[i];
+            }
         }
     }
 
@@ -2192,35 +2719,76 @@ namespace yojimbo
 
         if ( fragmentData )
         {
-            const uint16_t expectedMessageId = m_messageReceiveQueue->GetSequence();
-            if ( messageId != expectedMessageId )
-                return;
+            // blocks can complete out of order, and messages sent behind them may already be in the receive queue, so a block is not necessarily
+            // the most recent message received. ignore fragments of blocks that have already been received
+
+            ReceiveBlockData * receiveBlock = NULL;
 
-            // start receiving a new block
+            for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+            {
+                if ( m_receiveBlocks[i]->active && m_receiveBlocks[i]->messageId == messageId )
+                {
+                    receiveBlock = m_receiveBlocks[i];
+                    break;
+                }
+            }
 
-            if ( !m_receiveBlock->active )
+            if ( !receiveBlock )
             {
+                if ( sequence_less_than( messageId, m_receiveMessageId ) || m_messageReceiveQueue->Find( messageId ) )
+                    return;
+
+                const uint16_t maxMessageId = m_receiveMessageId + m_config.messageReceiveQueueSize - 1;
+
+                if ( sequence_greater_than( messageId, maxMessageId ) )
+                {
+                    // Did you forget to dequeue messages on the receiver?
+                    SetErrorLevel( CHANNEL_ERROR_DESYNC );
+                    return;
+                }
+
+                // start receiving a new block. if every slot is busy, drop the fragment. it will be resent
+
+                for ( int i = 0; i < m_config.maxBlocksInFlight; ++i )
+                {
+                    if ( !m_receiveBlocks[i]->active )
+                    {
+                        receiveBlock = m_receiveBlocks[i];
+                        break;
+                    }
+                }
+
+                if ( !receiveBlock )
+                    return;
+
                 yojimbo_assert( numFragments >= 0 );
                 yojimbo_assert( numFragments <= m_config.GetMaxFragmentsPerBlock() );
 
-                m_receiveBlock->active = true;
-                m_receiveBlock->numFragments = numFragments;
-                m_receiveBlock->numReceivedFragments = 0;
-                m_receiveBlock->messageId = messageId;
-                m_receiveBlock->blockSize = 0;
-                m_receiveBlock->receivedFragment->Clear();
+                if ( !receiveBlock->AllocateBlockData() )
+                {
+                    // Not enough memory to allocate the reassembly buffer
+                    SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                    return;
+                }
+
+                receiveBlock->active = true;
+                receiveBlock->numFragments = numFragments;
+                receiveBlock->numReceivedFragments = 0;
+                receiveBlock->messageId = messageId;
+                receiveBlock->blockSize = 0;
+                receiveBlock->receivedFragment->Clear();
             }
 
             // validate fragment
 
-            if ( fragmentId >= m_receiveBlock->numFragments )
+            if ( fragmentId >= receiveBlock->numFragments )
             {
                 // The fragment id is out of range.
                 SetErrorLevel( CHANNEL_ERROR_DESYNC );
                 return;
             }
 
-            if ( numFragments != m_receiveBlock->numFragments )
+            if ( numFragments != receiveBlock->numFragments )
             {
                 // The number of fragments is out of range.
                 SetErrorLevel( CHANNEL_ERROR_DESYNC );
@@ -2229,22 +2797,22 @@ namespace yojimbo
 
             // receive the fragment
 
-            if ( !m_receiveBlock->receivedFragment->GetBit( fragmentId ) )
+            if ( !receiveBlock->receivedFragment->GetBit( fragmentId ) )
             {
-                m_receiveBlock->receivedFragment->SetBit( fragmentId );
+                receiveBlock->receivedFragment->SetBit( fragmentId );
 
-                memcpy( m_receiveBlock->blockData + fragmentId * m_config.blockFragmentSize, fragmentData, fragmentBytes );
+                memcpy( receiveBlock->blockData + fragmentId * m_config.blockFragmentSize, fragmentData, fragmentBytes );
 
                 if ( fragmentId == 0 )
                 {
-                    m_receiveBlock->messageType = messageType;
+                    receiveBlock->messageType = messageType;
                 }
 
-                if ( fragmentId == m_receiveBlock->numFragments - 1 )
+                if ( fragmentId == receiveBlock->numFragments - 1 )
                 {
-                    m_receiveBlock->blockSize = ( m_receiveBlock->numFragments - 1 ) * m_config.blockFragmentSize + fragmentBytes;
+                    receiveBlock->blockSize = ( receiveBlock->numFragments - 1 ) * m_config.blockFragmentSize + fragmentBytes;
 
-                    if ( m_receiveBlock->blockSize > (uint32_t) m_config.maxBlockSize )
+                    if ( receiveBlock->blockSize > (uint32_t) m_config.maxBlockSize )
                     {
                         // The block size is outside range
                         SetErrorLevel( CHANNEL_ERROR_DESYNC );
@@ -2252,16 +2820,16 @@ namespace yojimbo
                     }
                 }
 
-                m_receiveBlock->numReceivedFragments++;
+                receiveBlock->numReceivedFragments++;
 
                 if ( fragmentId == 0 )
                 {
                     // save block message (sent with fragment 0)
-                    m_receiveBlock->blockMessage = blockMessage;
-                    m_messageFactory->AcquireMessage( m_receiveBlock->blockMessage );
+                    receiveBlock->blockMessage = blockMessage;
+                    m_messageFactory->AcquireMessage( receiveBlock->blockMessage );
                 }
 
-                if ( m_receiveBlock->numReceivedFragments == m_receiveBlock->numFragments )
+                if ( receiveBlock->numReceivedFragments == receiveBlock->numFragments )
                 {
                     // finished receiving block
 
@@ -2272,30 +2840,45 @@ namespace yojimbo
                         return;
                     }
 
-                    blockMessage = m_receiveBlock->blockMessage;
+                    blockMessage = receiveBlock->blockMessage;
 
                     yojimbo_assert( blockMessage );
 
-                    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), m_receiveBlock->blockSize );
+                    uint8_t * blockData;
 
-                    if ( !blockData )
+                    if ( m_config.zeroCopyBlockReceive )
                     {
-                        // Not enough memory to allocate block data
-                        SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
-                        return;
+                        blockData = receiveBlock->DetachBlockData();
                     }
+                    else
+                    {
+                        blockData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), receiveBlock->blockSize );
+
+                        if ( !blockData )
+                        {
+                            // Not enough memory to allocate block data
+                            SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                            return;
+                        }
 
-                    memcpy( blockData, m_receiveBlock->blockData, m_receiveBlock->blockSize );
+                        memcpy( blockData, receiveBlock->blockData, receiveBlock->blockSize );
+                    }
 
-                    blockMessage->AttachBlock( m_messageFactory->GetAllocator(), blockData, m_receiveBlock->blockSize );
+                    blockMessage->AttachBlock( m_messageFactory->GetAllocator(), blockData, receiveBlock->blockSize );
 
                     blockMessage->SetId( messageId );
 
                     MessageReceiveQueueEntry * entry = m_messageReceiveQueue->Insert( messageId );
-                    yojimbo_assert( entry );
+                    if ( !entry )
+                    {
+                        // For some reason we can't insert the block message in the receive queue. the receive block still holds the message, so it is released on reset
+                        SetErrorLevel( CHANNEL_ERROR_DESYNC );
+                        return;
+                    }
+
                     entry->message = blockMessage;
-                    m_receiveBlock->active = false;
-                    m_receiveBlock->blockMessage = NULL;
+                    receiveBlock->active = false;
+                    receiveBlock->blockMessage = NULL;
                 }
             }
         }
@@ -2359,7 +2942,6 @@ namespace yojimbo
     {
         yojimbo_assert( message );
         yojimbo_assert( CanSendMessage() );
-		(void)context;
 
         if ( GetErrorLevel() != CHANNEL_ERROR_NONE )
         {
@@ -2389,6 +2971,8 @@ namespace yojimbo
             yojimbo_assert( ((BlockMessage*)message)->GetBlockSize() <= m_config.maxBlockSize );
         }
 
+        message->GetSerializedBits( m_messageFactory->GetAllocator(), context );
+
         m_messageSendQueue->Push( message );
 
         m_counters[CHANNEL_COUNTER_MESSAGES_SENT]++;
@@ -2445,17 +3029,23 @@ namespace yojimbo
 
             yojimbo_assert( message );
 
-            MeasureStream measureStream( m_messageFactory->GetAllocator() );
-			measureStream.SetContext( context );
-            message->SerializeInternal( measureStream );
+            int messageBits = messageTypeBits + message->GetSerializedBits( m_messageFactory->GetAllocator(), context );
+
+            if ( message->IsBaselineMessage() )
+                messageBits += ((BaselineMessage*)message)->GetBaselineHeaderBits();
             
             if ( message->IsBlockMessage() )
             {
                 BlockMessage * blockMessage = (BlockMessage*) message;
+                const int blockBits = MeasureMessageBlock( blockMessage, m_config.maxBlockSize );
+#if YOJIMBO_DEBUG_MESSAGE_BUDGET
+                MeasureStream measureStream( m_messageFactory->GetAllocator() );
+                measureStream.SetContext( context );
                 SerializeMessageBlock( measureStream, *m_messageFactory, blockMessage, m_config.maxBlockSize );
+                yojimbo_assert( measureStream.GetBitsProcessed() == blockBits );
+#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
+                messageBits += blockBits;
             }
-
-            const int messageBits = messageTypeBits + measureStream.GetBitsProcessed();
             
             if ( usedBits + messageBits > availableBits )
             {
@@ -2521,109 +3111,355 @@ namespace yojimbo
 
 namespace yojimbo
 {
-    struct ConnectionPacket
+    void BaselineMessage::SetBaseline( MessageFactory & messageFactory, Message * baseline, uint16_t baselineSequence )
     {
-        int numChannelEntries;
-        ChannelPacketData * channelEntry;
-        MessageFactory * messageFactory;
+        yojimbo_assert( baseline );
+        yojimbo_assert( baseline != this );
+        yojimbo_assert( baseline->GetType() == GetType() );
+        messageFactory.AcquireMessage( baseline );
+        ClearBaseline();
+        m_messageFactory = &messageFactory;
+        m_baseline = baseline;
+        m_baselineSequence = baselineSequence;
+        ResetSerializedBits();
+    }
 
-        ConnectionPacket()
+    void BaselineMessage::ClearBaseline()
+    {
+        if ( m_baseline )
         {
-            messageFactory = NULL;
-            numChannelEntries = 0;
-            channelEntry = NULL;
+            yojimbo_assert( m_messageFactory );
+            m_messageFactory->ReleaseMessage( m_baseline );
+            m_baseline = NULL;
+            m_messageFactory = NULL;
+            ResetSerializedBits();
         }
+    }
 
-        ~ConnectionPacket()
+    // ------------------------------------------------------------------------------
+
+    BaselineStore::BaselineStore( Allocator & allocator, MessageFactory & messageFactory, int bufferSize )
+    {
+        yojimbo_assert( bufferSize > 0 );
+        m_allocator = &allocator;
+        m_messageFactory = &messageFactory;
+        m_bufferSize = bufferSize;
+        m_numTypes = messageFactory.GetNumTypes();
+        m_sentBaselines = (BaselineEntry*) YOJIMBO_ALLOCATE( allocator, sizeof( BaselineEntry ) * bufferSize );
+        m_receivedBaselines = (BaselineEntry*) YOJIMBO_ALLOCATE( allocator, sizeof( BaselineEntry ) * bufferSize );
+        m_ackedBaselines = (AckedBaseline*) YOJIMBO_ALLOCATE( allocator, sizeof( AckedBaseline ) * m_numTypes );
+        if ( m_sentBaselines )
+            memset( m_sentBaselines, 0, sizeof( BaselineEntry ) * bufferSize );
+        if ( m_receivedBaselines )
+            memset( m_receivedBaselines, 0, sizeof( BaselineEntry ) * bufferSize );
+        m_numMissingBaselines = 0;
+        Reset();
+    }
+
+    BaselineStore::~BaselineStore()
+    {
+        yojimbo_assert( m_allocator );
+        Reset();
+        for ( int i = 0; m_sentBaselines && i < m_bufferSize; ++i )
+            YOJIMBO_FREE( *m_allocator, m_sentBaselines[i].messages );
+        for ( int i = 0; m_receivedBaselines && i < m_bufferSize; ++i )
+            YOJIMBO_FREE( *m_allocator, m_receivedBaselines[i].messages );
+        YOJIMBO_FREE( *m_allocator, m_sentBaselines );
+        YOJIMBO_FREE( *m_allocator, m_receivedBaselines );
+        YOJIMBO_FREE( *m_allocator, m_ackedBaselines );
+        m_allocator = NULL;
+    }
+
+    void BaselineStore::Reset()
+    {
+        for ( int i = 0; m_sentBaselines && i < m_bufferSize; ++i )
         {
-            if ( messageFactory )
-            {
-                for ( int i = 0; i < numChannelEntries; ++i )
-                {
-                    channelEntry[i].Free( *messageFactory );
-                }
-                YOJIMBO_FREE( messageFactory->GetAllocator(), channelEntry );
-                messageFactory = NULL;
-            }        
+            ClearEntry( m_sentBaselines[i], 0 );
+            m_sentBaselines[i].valid = false;
+        }
+        for ( int i = 0; m_receivedBaselines && i < m_bufferSize; ++i )
+        {
+            ClearEntry( m_receivedBaselines[i], 0 );
+            m_receivedBaselines[i].valid = false;
         }
+        if ( m_ackedBaselines )
+            memset( m_ackedBaselines, 0, sizeof( AckedBaseline ) * m_numTypes );
+        m_hasSentPacket = false;
+        m_sentPacketSequence = 0;
+    }
 
-        bool AllocateChannelData( MessageFactory & _messageFactory, int numEntries )
+    void BaselineStore::ClearEntry( BaselineEntry & entry, uint16_t sequence )
+    {
+        for ( int i = 0; i < entry.numMessages; ++i )
+            m_messageFactory->ReleaseMessage( entry.messages[i] );
+        entry.numMessages = 0;
+        entry.sequence = sequence;
+        entry.valid = true;
+        entry.acked = false;
+    }
+
+    void BaselineStore::AddEntryMessage( BaselineEntry & entry, Message * message )
+    {
+        yojimbo_assert( message );
+        yojimbo_assert( message->IsBaselineMessage() );
+
+        m_messageFactory->AcquireMessage( message );
+
+        for ( int i = 0; i < entry.numMessages; ++i )
         {
-            yojimbo_assert( numEntries > 0 );
-            yojimbo_assert( numEntries <= MaxChannels );
-            messageFactory = &_messageFactory;
-            Allocator & allocator = messageFactory->GetAllocator();
-            channelEntry = (ChannelPacketData*) YOJIMBO_ALLOCATE( allocator, sizeof( ChannelPacketData ) * numEntries );
-            if ( channelEntry == NULL )
-                return false;
-            for ( int i = 0; i < numEntries; ++i )
+            if ( entry.messages[i]->GetType() == message->GetType() )
             {
-                channelEntry[i].Initialize();
+                m_messageFactory->ReleaseMessage( entry.messages[i] );
+                entry.messages[i] = message;
+                return;
             }
-            numChannelEntries = numEntries;
-            return true;
         }
 
-        template <typename Stream> bool Serialize( Stream & stream, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig )
+        if ( entry.numMessages == entry.maxMessages )
         {
-            const int numChannels = connectionConfig.numChannels;
-            serialize_int( stream, numChannelEntries, 0, connectionConfig.numChannels );
-#if YOJIMBO_DEBUG_MESSAGE_BUDGET
-            yojimbo_assert( stream.GetBitsProcessed() <= ConservativePacketHeaderBits );
-#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
-            if ( numChannelEntries > 0 )
+            const int maxMessages = entry.maxMessages > 0 ? entry.maxMessages * 2 : 4;
+            Message ** messages = (Message**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( Message* ) * maxMessages );
+            if ( !messages )
             {
-                if ( Stream::IsReading )
-                {
-                    if ( !AllocateChannelData( messageFactory, numChannelEntries ) )
-                    {
-                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to allocate channel data (ConnectionPacket)\n" );
-                        return false;
-                    }
-                    for ( int i = 0; i < numChannelEntries; ++i )
-                    {
-                        yojimbo_assert( channelEntry[i].messageFailedToSerialize == 0 );
-                    }
-                }
-                for ( int i = 0; i < numChannelEntries; ++i )
-                {
-                    yojimbo_assert( channelEntry[i].messageFailedToSerialize == 0 );
-                    if ( !channelEntry[i].SerializeInternal( stream, messageFactory, connectionConfig.channel, numChannels ) )
-                    {
-                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize channel %d\n", i );
-                        return false;
-                    }
-                }
+                // the baseline is not kept. on the send side new messages of this type are sent without a baseline, on the receive side packets relative to it are dropped until the sender moves on
+                m_messageFactory->ReleaseMessage( message );
+                return;
             }
-            return true;
+            if ( entry.numMessages > 0 )
+                memcpy( messages, entry.messages, sizeof( Message* ) * entry.numMessages );
+            YOJIMBO_FREE( *m_allocator, entry.messages );
+            entry.messages = messages;
+            entry.maxMessages = maxMessages;
         }
 
-        bool SerializeInternal( ReadStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
-        {
-            return Serialize( stream, _messageFactory, connectionConfig );
-        }
+        entry.messages[entry.numMessages++] = message;
+    }
 
-        bool SerializeInternal( WriteStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+    Message * BaselineStore::FindEntryMessage( const BaselineEntry & entry, int messageType ) const
+    {
+        for ( int i = 0; i < entry.numMessages; ++i )
         {
-            return Serialize( stream, _messageFactory, connectionConfig );            
+            if ( entry.messages[i]->GetType() == messageType )
+                return entry.messages[i];
         }
+        return NULL;
+    }
 
-        bool SerializeInternal( MeasureStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+    void BaselineStore::AddSentPacket( uint16_t packetSequence )
+    {
+        if ( !m_hasSentPacket || sequence_greater_than( packetSequence, m_sentPacketSequence ) )
         {
-            return Serialize( stream, _messageFactory, connectionConfig );            
+            m_hasSentPacket = true;
+            m_sentPacketSequence = packetSequence;
         }
 
-    private:
+        if ( m_sentBaselines )
+            ClearEntry( m_sentBaselines[packetSequence % m_bufferSize], packetSequence );
+    }
 
-        ConnectionPacket( const ConnectionPacket & other );
+    void BaselineStore::AddSentBaseline( uint16_t packetSequence, Message * message )
+    {
+        if ( !m_sentBaselines )
+            return;
 
-        const ConnectionPacket & operator = ( const ConnectionPacket & other );
-    };
+        BaselineEntry & entry = m_sentBaselines[packetSequence % m_bufferSize];
+        yojimbo_assert( entry.valid && entry.sequence == packetSequence );
 
-    // ------------------------------------------------------------------------------
+        AddEntryMessage( entry, message );
+    }
 
-    Connection::Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time ) 
-        : m_connectionConfig( connectionConfig )
+    void BaselineStore::ProcessAcks( const uint16_t * acks, int numAcks )
+    {
+        if ( !m_sentBaselines || !m_ackedBaselines )
+            return;
+
+        for ( int i = 0; i < numAcks; ++i )
+        {
+            BaselineEntry & entry = m_sentBaselines[acks[i] % m_bufferSize];
+            if ( !entry.valid || entry.sequence != acks[i] || entry.acked )
+                continue;
+            entry.acked = true;
+            for ( int j = 0; j < entry.numMessages; ++j )
+            {
+                const int messageType = entry.messages[j]->GetType();
+                yojimbo_assert( messageType < m_numTypes );
+                AckedBaseline & ackedBaseline = m_ackedBaselines[messageType];
+                if ( !ackedBaseline.valid || sequence_greater_than( acks[i], ackedBaseline.sequence ) )
+                {
+                    ackedBaseline.valid = true;
+                    ackedBaseline.sequence = acks[i];
+                }
+            }
+        }
+    }
+
+    Message * BaselineStore::GetAckedBaseline( int messageType, uint16_t & baselineSequence )
+    {
+        yojimbo_assert( messageType >= 0 );
+        yojimbo_assert( messageType < m_numTypes );
+
+        if ( !m_ackedBaselines || !m_ackedBaselines[messageType].valid )
+            return NULL;
+
+        const uint16_t ackedSequence = m_ackedBaselines[messageType].sequence;
+
+        // the other side only keeps the last buffer size packets worth of baselines. 
+        // only use baselines within half of that, so the message is read long before the baseline is overwritten, even with packets arriving out of order
+
+        const uint16_t age = m_sentPacketSequence - ackedSequence;
+        if ( age >= m_bufferSize / 2 )
+            return NULL;
+
+        const BaselineEntry & entry = m_sentBaselines[ackedSequence % m_bufferSize];
+        if ( !entry.valid || entry.sequence != ackedSequence || !entry.acked )
+            return NULL;
+
+        Message * baseline = FindEntryMessage( entry, messageType );
+        if ( !baseline )
+            return NULL;
+
+        baselineSequence = ackedSequence;
+
+        return baseline;
+    }
+
+    void BaselineStore::AddReceivedPacket( uint16_t packetSequence )
+    {
+        if ( m_receivedBaselines )
+            ClearEntry( m_receivedBaselines[packetSequence % m_bufferSize], packetSequence );
+    }
+
+    void BaselineStore::AddReceivedBaseline( uint16_t packetSequence, Message * message )
+    {
+        if ( !m_receivedBaselines )
+            return;
+
+        BaselineEntry & entry = m_receivedBaselines[packetSequence % m_bufferSize];
+        yojimbo_assert( entry.valid && entry.sequence == packetSequence );
+
+        AddEntryMessage( entry, message );
+    }
+
+    Message * BaselineStore::FindReceivedBaseline( uint16_t baselineSequence, int messageType )
+    {
+        const BaselineEntry * entry = m_receivedBaselines ? &m_receivedBaselines[baselineSequence % m_bufferSize] : NULL;
+        Message * baseline = ( entry && entry->valid && entry->sequence == baselineSequence ) ? FindEntryMessage( *entry, messageType ) : NULL;
+        if ( !baseline )
+        {
+            m_numMissingBaselines++;
+            return NULL;
+        }
+        return baseline;
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    struct ConnectionPacket
+    {
+        int numChannelEntries;
+        ChannelPacketData * channelEntry;
+        MessageFactory * messageFactory;
+
+        ConnectionPacket()
+        {
+            messageFactory = NULL;
+            numChannelEntries = 0;
+            channelEntry = NULL;
+        }
+
+        ~ConnectionPacket()
+        {
+            if ( messageFactory )
+            {
+                for ( int i = 0; i < numChannelEntries; ++i )
+                {
+                    channelEntry[i].Free( *messageFactory );
+                }
+                YOJIMBO_FREE( messageFactory->GetAllocator(), channelEntry );
+                messageFactory = NULL;
+            }        
+        }
+
+        bool AllocateChannelData( MessageFactory & _messageFactory, int numEntries )
+        {
+            yojimbo_assert( numEntries > 0 );
+            yojimbo_assert( numEntries <= MaxChannels );
+            messageFactory = &_messageFactory;
+            Allocator & allocator = messageFactory->GetAllocator();
+            channelEntry = (ChannelPacketData*) YOJIMBO_ALLOCATE( allocator, sizeof( ChannelPacketData ) * numEntries );
+            if ( channelEntry == NULL )
+                return false;
+            for ( int i = 0; i < numEntries; ++i )
+            {
+                channelEntry[i].Initialize();
+            }
+            numChannelEntries = numEntries;
+            return true;
+        }
+
+        template <typename Stream> bool Serialize( Stream & stream, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig )
+        {
+            const int numChannels = connectionConfig.numChannels;
+            serialize_int( stream, numChannelEntries, 0, connectionConfig.numChannels );
+#if YOJIMBO_DEBUG_MESSAGE_BUDGET
+            yojimbo_assert( stream.GetBitsProcessed() <= ConservativePacketHeaderBits );
+#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
+            if ( numChannelEntries > 0 )
+            {
+                if ( Stream::IsReading )
+                {
+                    if ( !AllocateChannelData( messageFactory, numChannelEntries ) )
+                    {
+                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to allocate channel data (ConnectionPacket)\n" );
+                        return false;
+                    }
+                    for ( int i = 0; i < numChannelEntries; ++i )
+                    {
+                        yojimbo_assert( channelEntry[i].messageFailedToSerialize == 0 );
+                    }
+                }
+                for ( int i = 0; i < numChannelEntries; ++i )
+                {
+                    yojimbo_assert( channelEntry[i].messageFailedToSerialize == 0 );
+                    if ( !channelEntry[i].SerializeInternal( stream, messageFactory, connectionConfig.channel, numChannels ) )
+                    {
+                        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize channel %d\n", i );
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        bool SerializeInternal( ReadStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+        {
+            return Serialize( stream, _messageFactory, connectionConfig );
+        }
+
+        bool SerializeInternal( WriteStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+        {
+            return Serialize( stream, _messageFactory, connectionConfig );            
+        }
+
+        bool SerializeInternal( MeasureStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+        {
+            return Serialize( stream, _messageFactory, connectionConfig );            
+        }
+
+    private:
+
+        ConnectionPacket( const ConnectionPacket & other );
+
+        const ConnectionPacket & operator = ( const ConnectionPacket & other );
+    };
+
+    // ------------------------------------------------------------------------------
+
+    Connection::Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time ) 
+        : m_connectionConfig( connectionConfig )
     {
         m_allocator = &allocator;
         m_messageFactory = &messageFactory;
@@ -2631,6 +3467,7 @@ namespace yojimbo
         memset( m_channel, 0, sizeof( m_channel ) );
         yojimbo_assert( m_connectionConfig.numChannels >= 1 );
         yojimbo_assert( m_connectionConfig.numChannels <= MaxChannels );
+        int sentPacketBufferSize = 1;
         for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
         {
             switch ( m_connectionConfig.channel[channelIndex].type )
@@ -2644,6 +3481,7 @@ namespace yojimbo
                                                            m_connectionConfig.channel[channelIndex],
                                                            channelIndex, 
                                                            time ); 
+                    sentPacketBufferSize = yojimbo_max( sentPacketBufferSize, m_connectionConfig.channel[channelIndex].sentPacketBufferSize );
                 }
                 break;
 
@@ -2663,6 +3501,12 @@ namespace yojimbo
                     yojimbo_assert( !"unknown channel type" );
             }
         }
+        m_sentPacketChannels = YOJIMBO_NEW( *m_allocator, SequenceBuffer<uint64_t>, *m_allocator, sentPacketBufferSize );
+        m_baselineStore = NULL;
+        if ( m_connectionConfig.baselineBufferSize > 0 )
+            m_baselineStore = YOJIMBO_NEW( *m_allocator, BaselineStore, *m_allocator, messageFactory, m_connectionConfig.baselineBufferSize );
+        m_packetCapture = NULL;
+        m_time = time;
     }
 
     Connection::~Connection()
@@ -2673,6 +3517,8 @@ namespace yojimbo
         {
             YOJIMBO_DELETE( *m_allocator, Channel, m_channel[i] );
         }
+        YOJIMBO_DELETE( *m_allocator, SequenceBuffer<uint64_t>, m_sentPacketChannels );
+        YOJIMBO_DELETE( *m_allocator, BaselineStore, m_baselineStore );
         m_allocator = NULL;
     }
 
@@ -2683,6 +3529,9 @@ namespace yojimbo
         {
             m_channel[i]->Reset();
         }
+        m_sentPacketChannels->Reset();
+        if ( m_baselineStore )
+            m_baselineStore->Reset();
     }
 
     bool Connection::CanSendMessage( int channelIndex ) const
@@ -2702,6 +3551,18 @@ namespace yojimbo
     {
         yojimbo_assert( channelIndex >= 0 );
         yojimbo_assert( channelIndex < m_connectionConfig.numChannels );
+        yojimbo_assert( message );
+
+        // baselines are only used on unreliable channels. reliable channels resend messages for an unbounded time, so the baseline could be gone on the other side by then
+
+        if ( m_baselineStore && message->IsBaselineMessage() && m_connectionConfig.channel[channelIndex].type == CHANNEL_TYPE_UNRELIABLE_UNORDERED )
+        {
+            uint16_t baselineSequence = 0;
+            Message * baseline = m_baselineStore->GetAckedBaseline( message->GetType(), baselineSequence );
+            if ( baseline )
+                ( (BaselineMessage*) message )->SetBaseline( *m_messageFactory, baseline, baselineSequence );
+        }
+
         return m_channel[channelIndex]->SendMessage( message, context );
     }
 
@@ -2718,6 +3579,34 @@ namespace yojimbo
         m_messageFactory->ReleaseMessage( message );
     }
 
+    static void ClearPacketBaselines( ConnectionPacket & packet, BaselineStore & baselineStore, uint16_t packetSequence, bool sent )
+    {
+        // once a packet is written or read, baseline messages no longer need their baselines. every baseline message in the packet becomes a baseline itself
+
+        if ( sent )
+            baselineStore.AddSentPacket( packetSequence );
+        else
+            baselineStore.AddReceivedPacket( packetSequence );
+
+        for ( int i = 0; i < packet.numChannelEntries; ++i )
+        {
+            const ChannelPacketData & channelData = packet.channelEntry[i];
+            if ( channelData.blockMessage )
+                continue;
+            for ( int j = 0; j < channelData.message.numMessages; ++j )
+            {
+                Message * message = channelData.message.messages[j];
+                if ( !message || !message->IsBaselineMessage() )
+                    continue;
+                ( (BaselineMessage*) message )->ClearBaseline();
+                if ( sent )
+                    baselineStore.AddSentBaseline( packetSequence, message );
+                else
+                    baselineStore.AddReceivedBaseline( packetSequence, message );
+            }
+        }
+    }
+
     static int WritePacket( void * context, 
                             MessageFactory & messageFactory, 
                             const ConnectionConfig & connectionConfig, 
@@ -2752,6 +3641,8 @@ namespace yojimbo
     {
         ConnectionPacket packet;
 
+        uint64_t sentPacketChannels = 0;
+
         if ( m_connectionConfig.numChannels > 0 )
         {
             int numChannelsWithData = 0;
@@ -2770,6 +3661,8 @@ namespace yojimbo
                     availableBits -= packetDataBits;
                     channelHasData[channelIndex] = true;
                     numChannelsWithData++;
+                    if ( m_connectionConfig.channel[channelIndex].type == CHANNEL_TYPE_RELIABLE_ORDERED )
+                        sentPacketChannels |= uint64_t(1) << channelIndex;
                 }
             }
 
@@ -2794,14 +3687,25 @@ namespace yojimbo
             }
         }
 
+        uint64_t * sentPacketChannelsEntry = m_sentPacketChannels->Insert( packetSequence );
+        if ( sentPacketChannelsEntry )
+            *sentPacketChannelsEntry = sentPacketChannels;
+
         packetBytes = WritePacket( context, *m_messageFactory, m_connectionConfig, packet, packetData, maxPacketBytes );
 
+        if ( m_packetCapture && packetBytes > 0 )
+            m_packetCapture->CapturePacket( PACKET_TRACE_SENT, m_time, packetSequence, packetData, packetBytes );
+
+        if ( m_baselineStore )
+            ClearPacketBaselines( packet, *m_baselineStore, packetSequence, true );
+
         return true;
     }
 
     static bool ReadPacket( void * context, 
                             MessageFactory & messageFactory, 
                             const ConnectionConfig & connectionConfig, 
+                            BaselineStore * baselineStore,
                             ConnectionPacket & packet, 
                             const uint8_t * buffer, 
                             int bufferSize )
@@ -2812,6 +3716,8 @@ namespace yojimbo
         ReadStream stream( messageFactory.GetAllocator(), buffer, bufferSize );
         
         stream.SetContext( context );
+
+        stream.SetBaselineStore( baselineStore );
         
         if ( !packet.SerializeInternal( stream, messageFactory, connectionConfig ) )
         {
@@ -2832,6 +3738,9 @@ namespace yojimbo
 
     bool Connection::ProcessPacket( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes )
     {
+        if ( m_packetCapture )
+            m_packetCapture->CapturePacket( PACKET_TRACE_RECEIVED, m_time, packetSequence, packetData, packetBytes );
+
         if ( m_errorLevel != CONNECTION_ERROR_NONE )
         {
             yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "failed to read packet because connection is in error state\n" );
@@ -2840,13 +3749,26 @@ namespace yojimbo
 
         ConnectionPacket packet;
 
-        if ( !ReadPacket( context, *m_messageFactory, m_connectionConfig, packet, packetData, packetBytes ) )
+        const uint64_t numMissingBaselines = m_baselineStore ? m_baselineStore->GetNumMissingBaselines() : 0;
+
+        if ( !ReadPacket( context, *m_messageFactory, m_connectionConfig, m_baselineStore, packet, packetData, packetBytes ) )
         {
+            if ( m_baselineStore && m_baselineStore->GetNumMissingBaselines() != numMissingBaselines )
+            {
+                // the baseline is too old. drop the packet without acking it, and the sender stops using that baseline soon enough
+
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "dropped packet %d because a message baseline is no longer available\n", packetSequence );
+                return false;
+            }
+
             yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to read packet\n" );
             m_errorLevel = CONNECTION_ERROR_READ_PACKET_FAILED;
             return false;            
         }
 
+        if ( m_baselineStore )
+            ClearPacketBaselines( packet, *m_baselineStore, packetSequence, false );
+
         for ( int i = 0; i < packet.numChannelEntries; ++i )
         {
             const int channelIndex = packet.channelEntry[i].channelIndex;
@@ -2865,17 +3787,56 @@ namespace yojimbo
 
     void Connection::ProcessAcks( const uint16_t * acks, int numAcks )
     {
+        // only pass acks to the channels that included data in the acked packets
+
+        if ( numAcks <= 0 )
+            return;
+
+        if ( m_packetCapture )
+            m_packetCapture->CaptureAcks( m_time, acks, numAcks );
+
+        if ( m_baselineStore )
+            m_baselineStore->ProcessAcks( acks, numAcks );
+
+        uint64_t * ackChannels = (uint64_t*) alloca( sizeof( uint64_t ) * numAcks );
+
+        uint64_t allAckChannels = 0;
+
         for ( int i = 0; i < numAcks; ++i )
         {
-            for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
+            const uint64_t * sentPacketChannels = m_sentPacketChannels->Find( acks[i] );
+            ackChannels[i] = sentPacketChannels ? *sentPacketChannels : 0;
+            allAckChannels |= ackChannels[i];
+            m_sentPacketChannels->Remove( acks[i] );
+        }
+
+        if ( !allAckChannels )
+            return;
+
+        uint16_t * channelAcks = (uint16_t*) alloca( sizeof( uint16_t ) * numAcks );
+
+        for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
+        {
+            const uint64_t channelBit = uint64_t(1) << channelIndex;
+
+            if ( !( allAckChannels & channelBit ) )
+                continue;
+
+            int numChannelAcks = 0;
+
+            for ( int i = 0; i < numAcks; ++i )
             {
-                m_channel[channelIndex]->ProcessAck( acks[i] );
+                if ( ackChannels[i] & channelBit )
+                    channelAcks[numChannelAcks++] = acks[i];
             }
+
+            m_channel[channelIndex]->ProcessAcks( channelAcks, numChannelAcks );
         }
     }
 
     void Connection::AdvanceTime( double time )
     {
+        m_time = time;
         for ( int i = 0; i < m_connectionConfig.numChannels; ++i )
         {
             m_channel[i]->AdvanceTime( time );
@@ -2903,62 +3864,538 @@ namespace yojimbo
 
 namespace yojimbo
 {
-    BaseClient::BaseClient( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time ) : m_config( config )
-    {
-        m_allocator = &allocator;
-        m_adapter = &adapter;
-        m_time = time;
-        m_context = NULL;
-        m_clientMemory = NULL;
-        m_clientAllocator = NULL;
-        m_endpoint = NULL;
-        m_connection = NULL;
-        m_messageFactory = NULL;
-        m_networkSimulator = NULL;
-        m_clientState = CLIENT_STATE_DISCONNECTED;
-        m_clientIndex = -1;
-        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( allocator, config.maxPacketSize );
-    }
+    const int PacketTraceHeaderBytes = 16;
+    const int PacketTraceMaxVarintBytes = 9;
+    const int PacketTraceAcksPerChunk = 256;
 
-    BaseClient::~BaseClient()
+    PacketCapture::PacketCapture()
     {
-        // IMPORTANT: Please disconnect the client before destroying it
-        yojimbo_assert( m_clientState <= CLIENT_STATE_DISCONNECTED );
-        YOJIMBO_FREE( *m_allocator, m_packetBuffer );
-        m_allocator = NULL;
+        m_file = NULL;
+        m_time = 0;
+        m_numRecords = 0;
+        m_bytesWritten = 0;
     }
 
-    void BaseClient::Disconnect()
+    PacketCapture::~PacketCapture()
     {
-        SetClientState( CLIENT_STATE_DISCONNECTED );
+        Close();
     }
 
-    void BaseClient::AdvanceTime( double time )
+    bool PacketCapture::Open( const char * filename, const ConnectionConfig & connectionConfig )
     {
-        m_time = time;
-        if ( m_endpoint )
-        {
-            m_connection->AdvanceTime( time );
-            if ( m_connection->GetErrorLevel() != CONNECTION_ERROR_NONE )
-            {
-                yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "connection error. disconnecting client\n" );
-                Disconnect();
-                return;
-            }
-            reliable_endpoint_update( m_endpoint, m_time );
-            int numAcks;
-            const uint16_t * acks = reliable_endpoint_get_acks( m_endpoint, &numAcks );
-            m_connection->ProcessAcks( acks, numAcks );
-            reliable_endpoint_clear_acks( m_endpoint );
-        }
-        NetworkSimulator * networkSimulator = GetNetworkSimulator();
-        if ( networkSimulator )
+        yojimbo_assert( filename );
+
+        Close();
+
+        m_file = fopen( filename, "wb" );
+        if ( !m_file )
         {
-            networkSimulator->AdvanceTime( time );
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: could not create packet trace %s\n", filename );
+            return false;
         }
+
+        m_time = 0;
+        m_numRecords = 0;
+        m_bytesWritten = 0;
+
+        WriteUint32( PacketTraceMagic );
+        WriteUint32( PacketTraceVersion );
+        WriteUint32( (uint32_t) connectionConfig.numChannels );
+        WriteUint32( (uint32_t) connectionConfig.maxPacketSize );
+
+        return IsOpen();
     }
 
-    void BaseClient::SetLatency( float milliseconds )
+    void PacketCapture::Close()
+    {
+        if ( !m_file )
+            return;
+
+        fclose( m_file );
+        m_file = NULL;
+    }
+
+    void PacketCapture::CapturePacket( PacketTraceRecordType type, double time, uint16_t packetSequence, const uint8_t * packetData, int packetBytes )
+    {
+        yojimbo_assert( type == PACKET_TRACE_SENT || type == PACKET_TRACE_RECEIVED );
+        yojimbo_assert( packetData );
+        yojimbo_assert( packetBytes > 0 );
+
+        if ( !m_file )
+            return;
+
+        WriteRecordHeader( type, time );
+        WriteUint16( packetSequence );
+        WriteVarint( (uint64_t) packetBytes );
+        WriteBytes( packetData, packetBytes );
+    }
+
+    void PacketCapture::CaptureAcks( double time, const uint16_t * acks, int numAcks )
+    {
+        yojimbo_assert( acks );
+        yojimbo_assert( numAcks > 0 );
+
+        if ( !m_file )
+            return;
+
+        WriteRecordHeader( PACKET_TRACE_ACKS, time );
+        WriteVarint( (uint64_t) numAcks );
+
+        uint8_t buffer[PacketTraceAcksPerChunk*2];
+        for ( int i = 0; i < numAcks; i += PacketTraceAcksPerChunk )
+        {
+            const int numChunkAcks = yojimbo_min( numAcks - i, PacketTraceAcksPerChunk );
+            for ( int j = 0; j < numChunkAcks; ++j )
+            {
+                buffer[j*2] = uint8_t( acks[i+j] );
+                buffer[j*2+1] = uint8_t( acks[i+j] >> 8 );
+            }
+            WriteBytes( buffer, numChunkAcks * 2 );
+        }
+    }
+
+    void PacketCapture::WriteRecordHeader( PacketTraceRecordType type, double time )
+    {
+        // time is written as microseconds since the previous record. time going backwards is written as no time passing
+
+        const uint64_t microseconds = time > 0.0 ? uint64_t( time * 1000000.0 + 0.5 ) : 0;
+        const uint64_t delta = microseconds > m_time ? microseconds - m_time : 0;
+        m_time += delta;
+
+        const uint8_t recordType = uint8_t( type );
+        WriteBytes( &recordType, 1 );
+        WriteVarint( delta );
+
+        m_numRecords++;
+    }
+
+    void PacketCapture::WriteVarint( uint64_t value )
+    {
+        uint8_t buffer[PacketTraceMaxVarintBytes];
+        const int bytes = yojimbo_put_varint( buffer, value );
+        WriteBytes( buffer, bytes );
+    }
+
+    void PacketCapture::WriteUint16( uint16_t value )
+    {
+        uint8_t buffer[2];
+        buffer[0] = uint8_t( value );
+        buffer[1] = uint8_t( value >> 8 );
+        WriteBytes( buffer, 2 );
+    }
+
+    void PacketCapture::WriteUint32( uint32_t value )
+    {
+        uint8_t buffer[4];
+        buffer[0] = uint8_t( value );
+        buffer[1] = uint8_t( value >> 8 );
+        buffer[2] = uint8_t( value >> 16 );
+        buffer[3] = uint8_t( value >> 24 );
+        WriteBytes( buffer, 4 );
+    }
+
+    void PacketCapture::WriteBytes( const uint8_t * data, int bytes )
+    {
+        if ( !m_file )
+            return;
+
+        if ( fwrite( data, 1, bytes, m_file ) != (size_t) bytes )
+        {
+            // stop capturing rather than write a corrupt trace
+
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to write packet trace. capture stopped\n" );
+            Close();
+            return;
+        }
+
+        m_bytesWritten += bytes;
+    }
+
+    /// A record read from a packet trace.
+
+    struct PacketTraceRecord
+    {
+        int type;                                               ///< The record type. See PacketTraceRecordType.
+        uint64_t timeDelta;                                     ///< Time since the previous record (microseconds).
+        uint16_t packetSequence;                                ///< Packet sequence number. Packet records only.
+        const uint8_t * packetData;                             ///< Packet data. Packet records only.
+        int packetBytes;                                        ///< Packet size (bytes). Packet records only.
+        const uint8_t * ackData;                                ///< Acks as little endian uint16 values. Ack records only.
+        int numAcks;                                            ///< Number of acks. Ack records only.
+    };
+
+    /// Bounds checked reads from packet trace data.
+
+    struct PacketTraceReader
+    {
+        const uint8_t * data;                                   ///< The next byte to read.
+        const uint8_t * end;                                    ///< One past the last byte of the trace.
+
+        PacketTraceReader( const uint8_t * begin, const uint8_t * finish ) : data( begin ), end( finish ) {}
+
+        bool ReadBytes( const uint8_t * & bytes, uint64_t numBytes )
+        {
+            if ( numBytes > uint64_t( end - data ) )
+                return false;
+            bytes = data;
+            data += numBytes;
+            return true;
+        }
+
+        bool ReadUint16( uint16_t & value )
+        {
+            const uint8_t * bytes;
+            if ( !ReadBytes( bytes, 2 ) )
+                return false;
+            value = uint16_t( bytes[0] | ( bytes[1] << 8 ) );
+            return true;
+        }
+
+        bool ReadUint32( uint32_t & value )
+        {
+            const uint8_t * bytes;
+            if ( !ReadBytes( bytes, 4 ) )
+                return false;
+            value = uint32_t( bytes[0] ) | ( uint32_t( bytes[1] ) << 8 ) | ( uint32_t( bytes[2] ) << 16 ) | ( uint32_t( bytes[3] ) << 24 );
+            return true;
+        }
+
+        bool ReadVarint( uint64_t & value )
+        {
+            // the varint decoder reads up to 9 bytes, so near the end of the trace decode from a zero padded copy
+
+            uint8_t buffer[PacketTraceMaxVarintBytes];
+            memset( buffer, 0, sizeof( buffer ) );
+            const int available = (int) yojimbo_min( end - data, (ptrdiff_t) PacketTraceMaxVarintBytes );
+            memcpy( buffer, data, available );
+            const int bytes = yojimbo_get_varint( buffer, &value );
+            if ( bytes > available )
+                return false;
+            data += bytes;
+            return true;
+        }
+
+        bool ReadRecord( PacketTraceRecord & record, int maxPacketSize )
+        {
+            const uint8_t * type;
+            if ( !ReadBytes( type, 1 ) || type[0] >= PACKET_TRACE_NUM_RECORD_TYPES )
+                return false;
+
+            memset( &record, 0, sizeof( record ) );
+            record.type = type[0];
+
+            if ( !ReadVarint( record.timeDelta ) )
+                return false;
+
+            uint64_t value = 0;
+
+            if ( record.type == PACKET_TRACE_ACKS )
+            {
+                if ( !ReadVarint( value ) || value == 0 || value > uint64_t( end - data ) / 2 )
+                    return false;
+                record.numAcks = (int) value;
+                return ReadBytes( record.ackData, value * 2 );
+            }
+
+            if ( !ReadUint16( record.packetSequence ) || !ReadVarint( value ) || value == 0 || value > uint64_t( maxPacketSize ) )
+                return false;
+            record.packetBytes = (int) value;
+            return ReadBytes( record.packetData, value );
+        }
+    };
+
+    PacketReplay::PacketReplay( Allocator & allocator )
+    {
+        m_allocator = &allocator;
+        m_data = NULL;
+        m_packetBuffer = NULL;
+        Clear();
+    }
+
+    PacketReplay::~PacketReplay()
+    {
+        Clear();
+        m_allocator = NULL;
+    }
+
+    void PacketReplay::Clear()
+    {
+        YOJIMBO_FREE( *m_allocator, m_data );
+        YOJIMBO_FREE( *m_allocator, m_packetBuffer );
+        m_bytes = 0;
+        m_numChannels = 0;
+        m_maxPacketSize = 0;
+        memset( m_numRecords, 0, sizeof( m_numRecords ) );
+        memset( m_packetBytes, 0, sizeof( m_packetBytes ) );
+    }
+
+    bool PacketReplay::Load( const char * filename )
+    {
+        yojimbo_assert( filename );
+
+        Clear();
+
+        FILE * file = fopen( filename, "rb" );
+        if ( !file )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: could not open packet trace %s\n", filename );
+            return false;
+        }
+
+        fseek( file, 0, SEEK_END );
+        const long fileBytes = ftell( file );
+        fseek( file, 0, SEEK_SET );
+
+        if ( fileBytes < PacketTraceHeaderBytes || fileBytes > 0x7FFFFFFF )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: packet trace %s has invalid size\n", filename );
+            fclose( file );
+            return false;
+        }
+
+        m_data = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, fileBytes );
+        if ( !m_data )
+        {
+            fclose( file );
+            return false;
+        }
+
+        m_bytes = (int) fileBytes;
+
+        const bool readOK = fread( m_data, 1, m_bytes, file ) == (size_t) m_bytes;
+
+        fclose( file );
+
+        if ( !readOK )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to read packet trace %s\n", filename );
+            Clear();
+            return false;
+        }
+
+        return Validate();
+    }
+
+    bool PacketReplay::Load( const uint8_t * data, int bytes )
+    {
+        yojimbo_assert( data );
+
+        Clear();
+
+        if ( bytes < PacketTraceHeaderBytes )
+            return false;
+
+        m_data = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, bytes );
+        if ( !m_data )
+            return false;
+
+        memcpy( m_data, data, bytes );
+        m_bytes = bytes;
+
+        return Validate();
+    }
+
+    bool PacketReplay::Validate()
+    {
+        // check the whole trace up front, so replay doesn't have to
+
+        PacketTraceReader reader( m_data, m_data + m_bytes );
+
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t numChannels = 0;
+        uint32_t maxPacketSize = 0;
+
+        const bool readHeader = reader.ReadUint32( magic ) && reader.ReadUint32( version ) && reader.ReadUint32( numChannels ) && reader.ReadUint32( maxPacketSize );
+
+        if ( !readHeader || magic != PacketTraceMagic || version != PacketTraceVersion || numChannels < 1 || numChannels > MaxChannels || maxPacketSize < 1 || maxPacketSize > 0x7FFFFFFF )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: packet trace header is invalid\n" );
+            Clear();
+            return false;
+        }
+
+        m_numChannels = (int) numChannels;
+        m_maxPacketSize = (int) maxPacketSize;
+
+        while ( reader.data < reader.end )
+        {
+            PacketTraceRecord record;
+            if ( !reader.ReadRecord( record, m_maxPacketSize ) )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: packet trace record at byte %d is invalid\n", int( reader.data - m_data ) );
+                Clear();
+                return false;
+            }
+            m_numRecords[record.type]++;
+            m_packetBytes[record.type] += record.packetBytes;
+        }
+
+        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, ( m_maxPacketSize + 3 ) & ~3 );
+        if ( !m_packetBuffer )
+        {
+            Clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    int PacketReplay::Replay( Connection & connection, PacketTraceRecordType type, void * context )
+    {
+        yojimbo_assert( m_data );
+        yojimbo_assert( m_packetBuffer );
+        yojimbo_assert( type == PACKET_TRACE_SENT || type == PACKET_TRACE_RECEIVED );
+
+        PacketTraceReader reader( m_data + PacketTraceHeaderBytes, m_data + m_bytes );
+
+        uint64_t time = 0;
+        uint64_t connectionTime = 0;
+        bool advancedTime = false;
+        int numPackets = 0;
+
+        while ( reader.data < reader.end )
+        {
+            PacketTraceRecord record;
+            const bool result = reader.ReadRecord( record, m_maxPacketSize );
+            yojimbo_assert( result );
+            (void) result;
+
+            time += record.timeDelta;
+
+            const bool isPacket = record.type == type;
+            const bool isAcks = record.type == PACKET_TRACE_ACKS && type == PACKET_TRACE_RECEIVED;
+
+            if ( !isPacket && !isAcks )
+                continue;
+
+            if ( !advancedTime || time != connectionTime )
+            {
+                connection.AdvanceTime( time / 1000000.0 );
+                connectionTime = time;
+                advancedTime = true;
+            }
+
+            if ( isAcks )
+            {
+                uint16_t acks[PacketTraceAcksPerChunk];
+                for ( int i = 0; i < record.numAcks; i += PacketTraceAcksPerChunk )
+                {
+                    const int numChunkAcks = yojimbo_min( record.numAcks - i, PacketTraceAcksPerChunk );
+                    for ( int j = 0; j < numChunkAcks; ++j )
+                        acks[j] = uint16_t( record.ackData[(i+j)*2] | ( record.ackData[(i+j)*2+1] << 8 ) );
+                    connection.ProcessAcks( acks, numChunkAcks );
+                }
+            }
+            else
+            {
+                memcpy( m_packetBuffer, record.packetData, record.packetBytes );
+
+                connection.ProcessPacket( context, record.packetSequence, m_packetBuffer, record.packetBytes );
+
+                for ( int channelIndex = 0; channelIndex < m_numChannels; ++channelIndex )
+                {
+                    while ( true )
+                    {
+                        Message * message = connection.ReceiveMessage( channelIndex );
+                        if ( !message )
+                            break;
+                        connection.ReleaseMessage( message );
+                    }
+                }
+
+                numPackets++;
+            }
+
+            if ( connection.GetErrorLevel() != CONNECTION_ERROR_NONE )
+                return -1;
+        }
+
+        return numPackets;
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    const int SimulatorReceiveBatchSize = 64;
+
+    static int GetSimulatorPacketBufferBytes( const ClientServerConfig & config )
+    {
+        // the largest packet the reliable endpoint sends: either a whole packet below the fragment threshold, or a single fragment
+
+        return yojimbo_max( yojimbo_min( config.maxPacketSize, config.fragmentPacketsAbove ), config.packetFragmentSize ) + SimulatorPacketHeaderBytes;
+    }
+
+    static uint64_t GetNetworkSimulatorSeed( const ClientServerConfig & config )
+    {
+        uint64_t seed = config.networkSimulatorSeed;
+        if ( seed == 0 )
+        {
+            random_bytes( (uint8_t*) &seed, sizeof( seed ) );
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "network simulator seed is %" PRIu64 "\n", seed );
+        }
+        return seed;
+    }
+
+    BaseClient::BaseClient( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time ) : m_config( config )
+    {
+        m_allocator = &allocator;
+        m_adapter = &adapter;
+        m_time = time;
+        m_context = NULL;
+        m_clientMemory = NULL;
+        m_clientAllocator = NULL;
+        m_endpoint = NULL;
+        m_connection = NULL;
+        m_packetCapture = NULL;
+        m_messageFactory = NULL;
+        m_networkSimulator = NULL;
+        m_clientState = CLIENT_STATE_DISCONNECTED;
+        m_clientIndex = -1;
+        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( allocator, config.maxPacketSize );
+    }
+
+    BaseClient::~BaseClient()
+    {
+        // IMPORTANT: Please disconnect the client before destroying it
+        yojimbo_assert( m_clientState <= CLIENT_STATE_DISCONNECTED );
+        YOJIMBO_FREE( *m_allocator, m_packetBuffer );
+        m_allocator = NULL;
+    }
+
+    void BaseClient::Disconnect()
+    {
+        SetClientState( CLIENT_STATE_DISCONNECTED );
+    }
+
+    void BaseClient::AdvanceTime( double time )
+    {
+        m_time = time;
+        if ( m_endpoint )
+        {
+            m_connection->AdvanceTime( time );
+            if ( m_connection->GetErrorLevel() != CONNECTION_ERROR_NONE )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "connection error. disconnecting client\n" );
+                Disconnect();
+                return;
+            }
+            reliable_endpoint_update( m_endpoint, m_time );
+            int numAcks;
+            const uint16_t * acks = reliable_endpoint_get_acks( m_endpoint, &numAcks );
+            m_connection->ProcessAcks( acks, numAcks );
+            reliable_endpoint_clear_acks( m_endpoint );
+        }
+        NetworkSimulator * networkSimulator = GetNetworkSimulator();
+        if ( networkSimulator )
+        {
+            networkSimulator->AdvanceTime( time );
+        }
+    }
+
+    void BaseClient::SetLatency( float milliseconds )
     {
         if ( m_networkSimulator )
         {
@@ -2990,6 +4427,23 @@ namespace yojimbo
         }
     }
 
+    void BaseClient::SetLinkProfile( const NetworkLinkProfile & profile )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetLinkProfile( profile );
+        }
+    }
+
+    void BaseClient::SetPacketCapture( PacketCapture * capture )
+    {
+        m_packetCapture = capture;
+        if ( m_connection )
+        {
+            m_connection->SetPacketCapture( capture );
+        }
+    }
+
     void BaseClient::SetClientState( ClientState clientState )
     {
         m_clientState = clientState;
@@ -3007,9 +4461,11 @@ namespace yojimbo
         m_messageFactory = m_adapter->CreateMessageFactory( *m_clientAllocator );
         m_connection = YOJIMBO_NEW( *m_clientAllocator, Connection, *m_clientAllocator, *m_messageFactory, m_config, m_time );
         yojimbo_assert( m_connection );
+        m_connection->SetPacketCapture( m_packetCapture );
         if ( m_config.networkSimulator )
         {
-            m_networkSimulator = YOJIMBO_NEW( *m_clientAllocator, NetworkSimulator, *m_clientAllocator, m_config.maxSimulatorPackets, m_time );
+            m_networkSimulator = YOJIMBO_NEW( *m_clientAllocator, NetworkSimulator, *m_clientAllocator, m_config.maxSimulatorPackets, m_time, GetSimulatorPacketBufferBytes( m_config ) );
+            m_networkSimulator->Seed( GetNetworkSimulatorSeed( m_config ), 0 );
         }
         reliable_config_t reliable_config;
         reliable_default_config( &reliable_config );
@@ -3307,13 +4763,18 @@ namespace yojimbo
             NetworkSimulator * networkSimulator = GetNetworkSimulator();
             if ( networkSimulator && networkSimulator->IsActive() )
             {
-                uint8_t ** packetData = (uint8_t**) alloca( sizeof( uint8_t*) * m_config.maxSimulatorPackets );
-                int * packetBytes = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
-                int numPackets = networkSimulator->ReceivePackets( m_config.maxSimulatorPackets, packetData, packetBytes, NULL );
-                for ( int i = 0; i < numPackets; ++i )
+                uint8_t * packetData[SimulatorReceiveBatchSize];
+                int packetBytes[SimulatorReceiveBatchSize];
+                while ( true )
                 {
-                    netcode_client_send_packet( m_client, (uint8_t*) packetData[i], packetBytes[i] );
-                    YOJIMBO_FREE( networkSimulator->GetAllocator(), packetData[i] );
+                    int numPackets = networkSimulator->ReceivePackets( SimulatorReceiveBatchSize, packetData, packetBytes, NULL );
+                    for ( int i = 0; i < numPackets; ++i )
+                    {
+                        netcode_client_send_packet( m_client, (uint8_t*) packetData[i], packetBytes[i] );
+                        networkSimulator->FreePacket( packetData[i] );
+                    }
+                    if ( numPackets < SimulatorReceiveBatchSize )
+                        break;
                 }
             }
         }
@@ -3442,16 +4903,25 @@ namespace yojimbo
         m_maxClients = 0;
         m_globalMemory = NULL;
         m_globalAllocator = NULL;
-        for ( int i = 0; i < MaxClients; ++i )
-        {
-            m_clientMemory[i] = NULL;
-            m_clientAllocator[i] = NULL;
-            m_clientMessageFactory[i] = NULL;
-            m_clientConnection[i] = NULL;
-            m_clientEndpoint[i] = NULL;
-        }
+        m_clientMemory = NULL;
+        m_clientAllocator = NULL;
+        m_clientMessageFactory = NULL;
+        m_clientConnection = NULL;
+        m_clientEndpoint = NULL;
+        m_activeClients = NULL;
+        m_activeClientIndex = NULL;
+        m_numFreeClients = 0;
+        m_clientMemoryPool = NULL;
+        m_clientBaseMemoryBytes = 0;
+        m_freeClientMemory = NULL;
+        m_freeClientAllocator = NULL;
+        m_freeClientMessageFactory = NULL;
+        m_freeClientConnection = NULL;
         m_networkSimulator = NULL;
         m_packetBuffer = NULL;
+        m_workerThreads = NULL;
+        m_workerPacketBuffer = NULL;
+        m_numActiveClients = 0;
     }
 
     BaseServer::~BaseServer()
@@ -3470,81 +4940,115 @@ namespace yojimbo
     void BaseServer::Start( int maxClients )
     {
         Stop();
+        yojimbo_assert( maxClients > 0 );
         m_running = true;
         m_maxClients = maxClients;
         yojimbo_assert( !m_globalMemory );
         yojimbo_assert( !m_globalAllocator );
+        m_clientMemory = (uint8_t**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint8_t* ) * maxClients );
+        m_clientAllocator = (Allocator**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( Allocator* ) * maxClients );
+        m_clientMessageFactory = (MessageFactory**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( MessageFactory* ) * maxClients );
+        m_clientConnection = (Connection**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( Connection* ) * maxClients );
+        m_clientEndpoint = (reliable_endpoint_t**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( reliable_endpoint_t* ) * maxClients );
+        m_activeClients = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * maxClients );
+        m_activeClientIndex = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * maxClients );
+        m_freeClientMemory = (uint8_t**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint8_t* ) * maxClients );
+        m_freeClientAllocator = (Allocator**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( Allocator* ) * maxClients );
+        m_freeClientMessageFactory = (MessageFactory**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( MessageFactory* ) * maxClients );
+        m_freeClientConnection = (Connection**) YOJIMBO_ALLOCATE( *m_allocator, sizeof( Connection* ) * maxClients );
+        yojimbo_assert( m_clientMemory && m_clientAllocator && m_clientMessageFactory && m_clientConnection && m_clientEndpoint && m_activeClients && m_activeClientIndex );
+        yojimbo_assert( m_freeClientMemory && m_freeClientAllocator && m_freeClientMessageFactory && m_freeClientConnection );
+        m_numActiveClients = 0;
+        m_numFreeClients = 0;
+        if ( m_config.serverClientMemoryPool > 0 )
+        {
+            m_clientMemoryPool = YOJIMBO_NEW( *m_allocator, MemoryPool, *m_allocator, m_config.serverClientMemoryPool, m_config.serverClientMemoryPageSize );
+            yojimbo_assert( m_clientMemoryPool );
+            m_clientBaseMemoryBytes = MeasureClientBaseMemoryBytes();
+        }
+        else
+        {
+            m_clientBaseMemoryBytes = 0;
+        }
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            // per-client resources are created when a client connects. see ActivateClient
+            m_clientMemory[i] = NULL;
+            m_clientAllocator[i] = NULL;
+            m_clientMessageFactory[i] = NULL;
+            m_clientConnection[i] = NULL;
+            m_clientEndpoint[i] = NULL;
+            m_activeClientIndex[i] = -1;
+        }
         m_globalMemory = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverGlobalMemory );
         m_globalAllocator = m_adapter->CreateAllocator( *m_allocator, m_globalMemory, m_config.serverGlobalMemory );
         yojimbo_assert( m_globalAllocator );
         if ( m_config.networkSimulator )
         {
-            m_networkSimulator = YOJIMBO_NEW( *m_globalAllocator, NetworkSimulator, *m_globalAllocator, m_config.maxSimulatorPackets, m_time );
+            m_networkSimulator = YOJIMBO_NEW( *m_globalAllocator, NetworkSimulator, *m_globalAllocator, m_config.maxSimulatorPackets, m_time, GetSimulatorPacketBufferBytes( m_config ) );
+            m_networkSimulator->Seed( GetNetworkSimulatorSeed( m_config ), 1 );
         }
-        for ( int i = 0; i < m_maxClients; ++i )
+        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize );
+        if ( m_config.serverWorkerThreads > 0 )
         {
-            yojimbo_assert( !m_clientMemory[i] );
-            yojimbo_assert( !m_clientAllocator[i] );
-            
-            m_clientMemory[i] = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverPerClientMemory );
-            m_clientAllocator[i] = m_adapter->CreateAllocator( *m_allocator, m_clientMemory[i], m_config.serverPerClientMemory );
-            yojimbo_assert( m_clientAllocator[i] );
-            
-            m_clientMessageFactory[i] = m_adapter->CreateMessageFactory( *m_clientAllocator[i] );
-            yojimbo_assert( m_clientMessageFactory[i] );
-            
-            m_clientConnection[i] = YOJIMBO_NEW( *m_clientAllocator[i], Connection, *m_clientAllocator[i], *m_clientMessageFactory[i], m_config, m_time );
-            yojimbo_assert( m_clientConnection[i] );
-
-            reliable_config_t reliable_config;
-            reliable_default_config( &reliable_config );
-            strcpy( reliable_config.name, "server endpoint" );
-            reliable_config.context = (void*) this;
-            reliable_config.index = i;
-            reliable_config.max_packet_size = m_config.maxPacketSize;
-            reliable_config.fragment_above = m_config.fragmentPacketsAbove;
-            reliable_config.max_fragments = m_config.maxPacketFragments;
-            reliable_config.fragment_size = m_config.packetFragmentSize; 
-            reliable_config.ack_buffer_size = m_config.ackedPacketsBufferSize;
-            reliable_config.received_packets_buffer_size = m_config.receivedPacketsBufferSize;
-            reliable_config.fragment_reassembly_buffer_size = m_config.packetReassemblyBufferSize;
-            reliable_config.transmit_packet_function = BaseServer::StaticTransmitPacketFunction;
-            reliable_config.process_packet_function = BaseServer::StaticProcessPacketFunction;
-            reliable_config.allocator_context = &GetGlobalAllocator();
-            reliable_config.allocate_function = BaseServer::StaticAllocateFunction;
-            reliable_config.free_function = BaseServer::StaticFreeFunction;
-            m_clientEndpoint[i] = reliable_endpoint_create( &reliable_config, m_time );
-            reliable_endpoint_reset( m_clientEndpoint[i] );
+            m_workerThreads = YOJIMBO_NEW( *m_globalAllocator, WorkerThreads, *m_globalAllocator, m_config.serverWorkerThreads );
+            m_workerPacketBuffer = (uint8_t**) YOJIMBO_ALLOCATE( *m_globalAllocator, sizeof( uint8_t* ) * ( m_config.serverWorkerThreads + 1 ) );
+            m_workerPacketBuffer[0] = m_packetBuffer;
+            for ( int i = 1; i <= m_config.serverWorkerThreads; ++i )
+            {
+                m_workerPacketBuffer[i] = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize );
+            }
         }
-        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize );
     }
 
     void BaseServer::Stop()
     {
         if ( IsRunning() )
         {
+            if ( m_workerThreads )
+            {
+                for ( int i = 1; i <= m_workerThreads->GetNumThreads(); ++i )
+                {
+                    YOJIMBO_FREE( *m_globalAllocator, m_workerPacketBuffer[i] );
+                }
+                YOJIMBO_FREE( *m_globalAllocator, m_workerPacketBuffer );
+                YOJIMBO_DELETE( *m_globalAllocator, WorkerThreads, m_workerThreads );
+            }
             YOJIMBO_FREE( *m_globalAllocator, m_packetBuffer );
             yojimbo_assert( m_globalMemory );
             yojimbo_assert( m_globalAllocator );
             YOJIMBO_DELETE( *m_globalAllocator, NetworkSimulator, m_networkSimulator );
             for ( int i = 0; i < m_maxClients; ++i )
             {
-                yojimbo_assert( m_clientMemory[i] );
-                yojimbo_assert( m_clientAllocator[i] );
-                yojimbo_assert( m_clientMessageFactory[i] );
-                yojimbo_assert( m_clientEndpoint[i] );
-                reliable_endpoint_destroy( m_clientEndpoint[i] ); m_clientEndpoint[i] = NULL;
-                YOJIMBO_DELETE( *m_clientAllocator[i], Connection, m_clientConnection[i] );
-                YOJIMBO_DELETE( *m_clientAllocator[i], MessageFactory, m_clientMessageFactory[i] );
-                YOJIMBO_DELETE( *m_allocator, Allocator, m_clientAllocator[i] );
-                YOJIMBO_FREE( *m_allocator, m_clientMemory[i] );
+                DeactivateClient( i );
+            }
+            for ( int i = 0; i < m_numFreeClients; ++i )
+            {
+                YOJIMBO_DELETE( *m_freeClientAllocator[i], Connection, m_freeClientConnection[i] );
+                YOJIMBO_DELETE( *m_freeClientAllocator[i], MessageFactory, m_freeClientMessageFactory[i] );
+                YOJIMBO_DELETE( *m_allocator, Allocator, m_freeClientAllocator[i] );
+                YOJIMBO_FREE( *m_allocator, m_freeClientMemory[i] );
             }
+            m_numFreeClients = 0;
+            YOJIMBO_DELETE( *m_allocator, MemoryPool, m_clientMemoryPool );
+            YOJIMBO_FREE( *m_allocator, m_freeClientMemory );
+            YOJIMBO_FREE( *m_allocator, m_freeClientAllocator );
+            YOJIMBO_FREE( *m_allocator, m_freeClientMessageFactory );
+            YOJIMBO_FREE( *m_allocator, m_freeClientConnection );
+            YOJIMBO_FREE( *m_allocator, m_clientMemory );
+            YOJIMBO_FREE( *m_allocator, m_clientAllocator );
+            YOJIMBO_FREE( *m_allocator, m_clientMessageFactory );
+            YOJIMBO_FREE( *m_allocator, m_clientConnection );
+            YOJIMBO_FREE( *m_allocator, m_clientEndpoint );
+            YOJIMBO_FREE( *m_allocator, m_activeClients );
+            YOJIMBO_FREE( *m_allocator, m_activeClientIndex );
             YOJIMBO_DELETE( *m_allocator, Allocator, m_globalAllocator );
             YOJIMBO_FREE( *m_allocator, m_globalMemory );
         }
         m_running = false;
         m_maxClients = 0;
         m_packetBuffer = NULL;
+        m_numActiveClients = 0;
     }
 
     void BaseServer::AdvanceTime( double time )
@@ -3552,8 +5056,11 @@ namespace yojimbo
         m_time = time;
         if ( IsRunning() )
         {
-            for ( int i = 0; i < m_maxClients; ++i )
+            // walk the active client list backwards, so disconnecting a client (which removes it from the list) doesn't skip anyone
+
+            for ( int j = m_numActiveClients - 1; j >= 0; --j )
             {
+                const int i = m_activeClients[j];
                 m_clientConnection[i]->AdvanceTime( time );
                 if ( m_clientConnection[i]->GetErrorLevel() != CONNECTION_ERROR_NONE )
                 {
@@ -3607,11 +5114,33 @@ namespace yojimbo
         }
     }
 
+    void BaseServer::SetLinkProfile( const NetworkLinkProfile & profile )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetLinkProfile( profile );
+        }
+    }
+
+    void BaseServer::SetPacketCapture( int clientIndex, PacketCapture * capture )
+    {
+        // captures the connection of the client in this slot until it disconnects
+
+        yojimbo_assert( IsRunning() );
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( m_clientConnection[clientIndex] )
+        {
+            m_clientConnection[clientIndex]->SetPacketCapture( capture );
+        }
+    }
+
     Message * BaseServer::CreateMessage( int clientIndex, int type )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientMessageFactory[clientIndex] );
+        if ( !m_clientMessageFactory[clientIndex] )
+            return NULL;
         return m_clientMessageFactory[clientIndex]->CreateMessage( type );
     }
 
@@ -3619,7 +5148,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientAllocator[clientIndex] );
+        if ( !m_clientAllocator[clientIndex] )
+            return NULL;
         return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientAllocator[clientIndex], bytes );
     }
 
@@ -3631,6 +5161,8 @@ namespace yojimbo
         yojimbo_assert( block );
         yojimbo_assert( bytes > 0 );
         yojimbo_assert( message->IsBlockMessage() );
+        if ( !m_clientAllocator[clientIndex] )
+            return;
         BlockMessage * blockMessage = (BlockMessage*) message;
         blockMessage->AttachBlock( *m_clientAllocator[clientIndex], block, bytes );
     }
@@ -3639,6 +5171,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
+        if ( !m_clientAllocator[clientIndex] )
+            return;
         YOJIMBO_FREE( *m_clientAllocator[clientIndex], block );
     }
 
@@ -3646,7 +5180,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
+        if ( !m_clientConnection[clientIndex] )
+            return false;
         return m_clientConnection[clientIndex]->CanSendMessage( channelIndex );
     }
 
@@ -3654,7 +5189,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
+        if ( !m_clientConnection[clientIndex] )
+            return false;
         return m_clientConnection[clientIndex]->HasMessagesToSend( channelIndex );
     }
 
@@ -3662,7 +5198,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
+        if ( !m_clientConnection[clientIndex] )
+            return;
         return m_clientConnection[clientIndex]->SendMessage( channelIndex, message, GetContext() );
     }
 
@@ -3670,7 +5207,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
+        if ( !m_clientConnection[clientIndex] )
+            return NULL;
         return m_clientConnection[clientIndex]->ReceiveMessage( channelIndex );
     }
 
@@ -3678,7 +5216,8 @@ namespace yojimbo
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
+        if ( !m_clientConnection[clientIndex] )
+            return;
         m_clientConnection[clientIndex]->ReleaseMessage( message );
     }
 
@@ -3701,12 +5240,212 @@ namespace yojimbo
         }
     }
 
-    MessageFactory & BaseServer::GetClientMessageFactory( int clientIndex ) 
+    uint8_t * BaseServer::GetWorkerPacketBuffer( int threadIndex )
+    {
+        yojimbo_assert( m_workerThreads );
+        yojimbo_assert( threadIndex >= 0 );
+        yojimbo_assert( threadIndex <= m_workerThreads->GetNumThreads() );
+        return m_workerPacketBuffer[threadIndex];
+    }
+
+    size_t BaseServer::MeasureClientBaseMemoryBytes()
+    {
+        // create a client's allocator, message factory and connection once from a scratch memory pool, so there is a measurement before the first client is created
+
+        MemoryPool scratchPool( *m_allocator, m_config.serverPerClientMemory, m_config.serverClientMemoryPageSize );
+
+        Allocator * allocator = m_adapter->CreatePooledAllocator( *m_allocator, scratchPool, m_config.serverPerClientMemory );
+        yojimbo_assert( allocator );
+
+        MessageFactory * messageFactory = m_adapter->CreateMessageFactory( *allocator );
+        yojimbo_assert( messageFactory );
+
+        Connection * connection = YOJIMBO_NEW( *allocator, Connection, *allocator, *messageFactory, m_config, m_time );
+        yojimbo_assert( connection );
+
+        const size_t bytes = scratchPool.GetUsedBytes();
+
+        YOJIMBO_DELETE( *allocator, Connection, connection );
+        YOJIMBO_DELETE( *allocator, MessageFactory, messageFactory );
+        YOJIMBO_DELETE( *m_allocator, Allocator, allocator );
+
+        return bytes;
+    }
+
+    bool BaseServer::ActivateClient( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( m_activeClientIndex[clientIndex] >= 0 )
+            return true;
+
+        yojimbo_assert( !m_clientMemory[clientIndex] );
+        yojimbo_assert( !m_clientAllocator[clientIndex] );
+        yojimbo_assert( !m_clientMessageFactory[clientIndex] );
+        yojimbo_assert( !m_clientConnection[clientIndex] );
+        yojimbo_assert( !m_clientEndpoint[clientIndex] );
+
+        if ( m_numFreeClients > 0 )
+        {
+            // reuse the resources of a client that disconnected earlier
+            m_numFreeClients--;
+            m_clientMemory[clientIndex] = m_freeClientMemory[m_numFreeClients];
+            m_clientAllocator[clientIndex] = m_freeClientAllocator[m_numFreeClients];
+            m_clientMessageFactory[clientIndex] = m_freeClientMessageFactory[m_numFreeClients];
+            m_clientConnection[clientIndex] = m_freeClientConnection[m_numFreeClients];
+        }
+        else if ( m_clientMemoryPool )
+        {
+            // channels can't handle allocations failing while they are constructed, so only create a client if the pool has room for as much as the clients created so far needed. see MeasureClientBaseMemoryBytes
+
+            if ( m_clientMemoryPool->GetBudgetBytes() - m_clientMemoryPool->GetUsedBytes() < m_clientBaseMemoryBytes )
+                return false;
+
+            const size_t usedBytes = m_clientMemoryPool->GetUsedBytes();
+
+            // the headroom check is an estimate, so the pool can still run out while the client is created
+
+            m_clientAllocator[clientIndex] = m_adapter->CreatePooledAllocator( *m_allocator, *m_clientMemoryPool, m_config.serverPerClientMemory );
+
+            if ( !CreateClientConnection( clientIndex ) )
+            {
+                DestroyClientResources( clientIndex );
+                return false;
+            }
+
+            m_clientBaseMemoryBytes = yojimbo_max( m_clientBaseMemoryBytes, m_clientMemoryPool->GetUsedBytes() - usedBytes );
+        }
+        else
+        {
+            m_clientMemory[clientIndex] = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverPerClientMemory );
+            if ( !m_clientMemory[clientIndex] )
+                return false;
+
+            m_clientAllocator[clientIndex] = m_adapter->CreateAllocator( *m_allocator, m_clientMemory[clientIndex], m_config.serverPerClientMemory );
+
+            if ( !CreateClientConnection( clientIndex ) )
+            {
+                DestroyClientResources( clientIndex );
+                return false;
+            }
+        }
+
+        reliable_config_t reliable_config;
+        reliable_default_config( &reliable_config );
+        strcpy( reliable_config.name, "server endpoint" );
+        reliable_config.context = (void*) this;
+        reliable_config.index = clientIndex;
+        reliable_config.max_packet_size = m_config.maxPacketSize;
+        reliable_config.fragment_above = m_config.fragmentPacketsAbove;
+        reliable_config.max_fragments = m_config.maxPacketFragments;
+        reliable_config.fragment_size = m_config.packetFragmentSize; 
+        reliable_config.ack_buffer_size = m_config.ackedPacketsBufferSize;
+        reliable_config.received_packets_buffer_size = m_config.receivedPacketsBufferSize;
+        reliable_config.fragment_reassembly_buffer_size = m_config.packetReassemblyBufferSize;
+        reliable_config.transmit_packet_function = BaseServer::StaticTransmitPacketFunction;
+        reliable_config.process_packet_function = BaseServer::StaticProcessPacketFunction;
+        // when packets are received in parallel, each endpoint allocates from its own client allocator, so endpoints never share an allocator across threads
+        reliable_config.allocator_context = m_config.serverParallelReceive ? m_clientAllocator[clientIndex] : &GetGlobalAllocator();
+        reliable_config.allocate_function = BaseServer::StaticAllocateFunction;
+        reliable_config.free_function = BaseServer::StaticFreeFunction;
+        m_clientEndpoint[clientIndex] = reliable_endpoint_create( &reliable_config, m_time );
+        if ( !m_clientEndpoint[clientIndex] || m_clientAllocator[clientIndex]->GetErrorLevel() != ALLOCATOR_ERROR_NONE )
+        {
+            // with parallel receive the endpoint allocates from the client allocator, so it can run out of memory like the rest of the client
+            if ( m_clientEndpoint[clientIndex] )
+                reliable_endpoint_destroy( m_clientEndpoint[clientIndex] );
+            m_clientEndpoint[clientIndex] = NULL;
+            DestroyClientResources( clientIndex );
+            return false;
+        }
+        reliable_endpoint_reset( m_clientEndpoint[clientIndex] );
+
+        m_activeClientIndex[clientIndex] = m_numActiveClients;
+        m_activeClients[m_numActiveClients++] = clientIndex;
+
+        return true;
+    }
+
+    bool BaseServer::CreateClientConnection( int clientIndex )
+    {
+        yojimbo_assert( !m_clientMessageFactory[clientIndex] );
+        yojimbo_assert( !m_clientConnection[clientIndex] );
+
+        Allocator * allocator = m_clientAllocator[clientIndex];
+        if ( !allocator )
+            return false;
+
+        m_clientMessageFactory[clientIndex] = m_adapter->CreateMessageFactory( *allocator );
+        if ( !m_clientMessageFactory[clientIndex] || m_clientMessageFactory[clientIndex]->GetErrorLevel() != MESSAGE_FACTORY_ERROR_NONE )
+            return false;
+
+        m_clientConnection[clientIndex] = YOJIMBO_NEW( *allocator, Connection, *allocator, *m_clientMessageFactory[clientIndex], m_config, m_time );
+        if ( !m_clientConnection[clientIndex] || m_clientConnection[clientIndex]->GetErrorLevel() != CONNECTION_ERROR_NONE )
+            return false;
+
+        return allocator->GetErrorLevel() == ALLOCATOR_ERROR_NONE;
+    }
+
+    void BaseServer::DestroyClientResources( int clientIndex )
+    {
+        if ( m_clientAllocator[clientIndex] )
+        {
+            YOJIMBO_DELETE( *m_clientAllocator[clientIndex], Connection, m_clientConnection[clientIndex] );
+            YOJIMBO_DELETE( *m_clientAllocator[clientIndex], MessageFactory, m_clientMessageFactory[clientIndex] );
+            YOJIMBO_DELETE( *m_allocator, Allocator, m_clientAllocator[clientIndex] );
+        }
+        yojimbo_assert( !m_clientMessageFactory[clientIndex] );
+        yojimbo_assert( !m_clientConnection[clientIndex] );
+        YOJIMBO_FREE( *m_allocator, m_clientMemory[clientIndex] );
+    }
+
+    void BaseServer::DeactivateClient( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        const int index = m_activeClientIndex[clientIndex];
+        if ( index < 0 )
+            return;
+        const int lastClientIndex = m_activeClients[--m_numActiveClients];
+        m_activeClients[index] = lastClientIndex;
+        m_activeClientIndex[lastClientIndex] = index;
+        m_activeClientIndex[clientIndex] = -1;
+
+        // the endpoint is specific to the client slot. everything else goes back to the free list for the next client to connect
+
+        reliable_endpoint_destroy( m_clientEndpoint[clientIndex] ); 
+        m_clientEndpoint[clientIndex] = NULL;
+
+        m_clientConnection[clientIndex]->Reset();
+        m_clientConnection[clientIndex]->SetPacketCapture( NULL );
+
+        // a client kicked because its allocator or message factory is in an error state would pass that error on to the next client to connect, so its resources are destroyed instead of reused
+
+        if ( m_clientAllocator[clientIndex]->GetErrorLevel() != ALLOCATOR_ERROR_NONE || m_clientMessageFactory[clientIndex]->GetErrorLevel() != MESSAGE_FACTORY_ERROR_NONE )
+        {
+            DestroyClientResources( clientIndex );
+            return;
+        }
+
+        yojimbo_assert( m_numFreeClients < m_maxClients );
+        m_freeClientMemory[m_numFreeClients] = m_clientMemory[clientIndex];
+        m_freeClientAllocator[m_numFreeClients] = m_clientAllocator[clientIndex];
+        m_freeClientMessageFactory[m_numFreeClients] = m_clientMessageFactory[clientIndex];
+        m_freeClientConnection[m_numFreeClients] = m_clientConnection[clientIndex];
+        m_numFreeClients++;
+
+        m_clientMemory[clientIndex] = NULL;
+        m_clientAllocator[clientIndex] = NULL;
+        m_clientMessageFactory[clientIndex] = NULL;
+        m_clientConnection[clientIndex] = NULL;
+    }
+
+    MessageFactory * BaseServer::GetClientMessageFactory( int clientIndex ) 
     { 
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        return *m_clientMessageFactory[clientIndex];
+        return m_clientMessageFactory[clientIndex];
     }
 
     reliable_endpoint_t * BaseServer::GetClientEndpoint( int clientIndex )
@@ -3776,6 +5515,8 @@ namespace yojimbo
     {
         if ( IsRunning() )
             Stop();
+
+        yojimbo_assert( maxClients <= NETCODE_MAX_CLIENTS );
         
         BaseServer::Start( maxClients );
         
@@ -3832,32 +5573,106 @@ namespace yojimbo
 
     void Server::SendPackets()
     {
-        if ( m_server )
+        if ( m_server && GetWorkerThreads() && m_config.serverParallelSend )
+        {
+            GetWorkerThreads()->Run( StaticSendPacketsWorkFunction, this, GetNumActiveClients() );
+        }
+        else if ( m_server )
         {
-            const int maxClients = GetMaxClients();
-            for ( int i = 0; i < maxClients; ++i )
+            const int numActiveClients = GetNumActiveClients();
+            const int * activeClients = GetActiveClients();
+            for ( int j = 0; j < numActiveClients; ++j )
             {
-                if ( IsClientConnected( i ) )
+                const int i = activeClients[j];
+                yojimbo_assert( IsClientConnected( i ) );
+                uint8_t * packetData = GetPacketBuffer();
+                int packetBytes;
+                uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetClientEndpoint(i) );
+                if ( GetClientConnection(i).GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
                 {
-                    uint8_t * packetData = GetPacketBuffer();
-                    int packetBytes;
-                    uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetClientEndpoint(i) );
-                    if ( GetClientConnection(i).GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
-                    {
-                        reliable_endpoint_send_packet( GetClientEndpoint(i), packetData, packetBytes );
-                    }
+                    reliable_endpoint_send_packet( GetClientEndpoint(i), packetData, packetBytes );
                 }
             }
         }
     }
 
+    void Server::SendPacketsWorkFunction( int threadIndex, int beginIndex, int endIndex )
+    {
+        // packets are generated and serialized in parallel. sending goes through the reliable endpoint fragmenter, the network simulator and the socket, which are shared, so it is done one thread at a time
+
+        WorkerThreads * workerThreads = GetWorkerThreads();
+        const int * activeClients = GetActiveClients();
+        uint8_t * packetData = GetWorkerPacketBuffer( threadIndex );
+        for ( int j = beginIndex; j < endIndex; ++j )
+        {
+            const int i = activeClients[j];
+            int packetBytes;
+            uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetClientEndpoint(i) );
+            if ( GetClientConnection(i).GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
+            {
+                workerThreads->Lock();
+                reliable_endpoint_send_packet( GetClientEndpoint(i), packetData, packetBytes );
+                workerThreads->Unlock();
+            }
+        }
+    }
+
+    void Server::StaticSendPacketsWorkFunction( void * context, int threadIndex, int beginIndex, int endIndex )
+    {
+        Server * server = (Server*) context;
+        server->SendPacketsWorkFunction( threadIndex, beginIndex, endIndex );
+    }
+
+    void Server::ReceivePacketsWorkFunction( int threadIndex, int beginIndex, int endIndex )
+    {
+        // packets are processed and messages deserialized in parallel. netcode.io's packet queues and allocator are shared, so they are accessed one thread at a time
+
+        (void) threadIndex;
+        WorkerThreads * workerThreads = GetWorkerThreads();
+        const int * activeClients = GetActiveClients();
+        for ( int j = beginIndex; j < endIndex; ++j )
+        {
+            const int clientIndex = activeClients[j];
+            while ( true )
+            {
+                int packetBytes;
+                uint64_t packetSequence;
+                workerThreads->Lock();
+                uint8_t * packetData = netcode_server_receive_packet( m_server, clientIndex, &packetBytes, &packetSequence );
+                workerThreads->Unlock();
+                if ( !packetData )
+                    break;
+                reliable_endpoint_receive_packet( GetClientEndpoint( clientIndex ), packetData, packetBytes );
+                workerThreads->Lock();
+                netcode_server_free_packet( m_server, packetData );
+                workerThreads->Unlock();
+            }
+        }
+    }
+
+    void Server::StaticReceivePacketsWorkFunction( void * context, int threadIndex, int beginIndex, int endIndex )
+    {
+        Server * server = (Server*) context;
+        server->ReceivePacketsWorkFunction( threadIndex, beginIndex, endIndex );
+    }
+
     void Server::ReceivePackets()
     {
-        if ( m_server )
+        if ( m_server && GetWorkerThreads() && m_config.serverParallelReceive )
+        {
+            // returns once every client's packets have been processed, so messages are ready to be received as before
+
+            GetWorkerThreads()->Run( StaticReceivePacketsWorkFunction, this, GetNumActiveClients() );
+        }
+        else if ( m_server )
         {
-            const int maxClients = GetMaxClients();
-            for ( int clientIndex = 0; clientIndex < maxClients; ++clientIndex )
+            // netcode.io only queues packets for connected clients
+
+            const int numActiveClients = GetNumActiveClients();
+            const int * activeClients = GetActiveClients();
+            for ( int j = 0; j < numActiveClients; ++j )
             {
+                const int clientIndex = activeClients[j];
                 while ( true )
                 {
                     int packetBytes;
@@ -3882,14 +5697,19 @@ namespace yojimbo
         NetworkSimulator * networkSimulator = GetNetworkSimulator();
         if ( networkSimulator && networkSimulator->IsActive() )
         {
-            uint8_t ** packetData = (uint8_t**) alloca( sizeof( uint8_t*) * m_config.maxSimulatorPackets );
-            int * packetBytes = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
-            int * to = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
-            int numPackets = networkSimulator->ReceivePackets( m_config.maxSimulatorPackets, packetData, packetBytes, to );
-            for ( int i = 0; i < numPackets; ++i )
+            uint8_t * packetData[SimulatorReceiveBatchSize];
+            int packetBytes[SimulatorReceiveBatchSize];
+            int to[SimulatorReceiveBatchSize];
+            while ( true )
             {
-                netcode_server_send_packet( m_server, to[i], (uint8_t*) packetData[i], packetBytes[i] );
-                YOJIMBO_FREE( networkSimulator->GetAllocator(), packetData[i] );
+                int numPackets = networkSimulator->ReceivePackets( SimulatorReceiveBatchSize, packetData, packetBytes, to );
+                for ( int i = 0; i < numPackets; ++i )
+                {
+                    netcode_server_send_packet( m_server, to[i], (uint8_t*) packetData[i], packetBytes[i] );
+                    networkSimulator->FreePacket( packetData[i] );
+                }
+                if ( numPackets < SimulatorReceiveBatchSize )
+                    break;
             }
         }
     }
@@ -3943,67 +5763,386 @@ namespace yojimbo
         }
     }
 
-    int Server::ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    int Server::ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        return (int) GetClientConnection(clientIndex).ProcessPacket( GetContext(), packetSequence, packetData, packetBytes );
+    }
+
+    void Server::ConnectDisconnectCallbackFunction( int clientIndex, int connected )
+    {
+        if ( connected == 0 )
+        {
+            if ( IsClientActive( clientIndex ) )
+            {
+                GetAdapter().OnServerClientDisconnected( clientIndex );
+                DeactivateClient( clientIndex );
+            }
+            NetworkSimulator * networkSimulator = GetNetworkSimulator();
+            if ( networkSimulator && networkSimulator->IsActive() )
+            {
+                networkSimulator->DiscardClientPackets( clientIndex );
+            }
+        }
+        else
+        {
+            if ( !ActivateClient( clientIndex ) )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to allocate resources for client %d. disconnecting client\n", clientIndex );
+                if ( IsLoopbackClient( clientIndex ) )
+                    DisconnectLoopbackClient( clientIndex );
+                else
+                    DisconnectClient( clientIndex );
+                return;
+            }
+            GetAdapter().OnServerClientConnected( clientIndex );
+        }
+    }
+
+    void Server::SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        GetAdapter().ServerSendLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
+    }
+
+    void Server::StaticConnectDisconnectCallbackFunction( void * context, int clientIndex, int connected )
+    {
+        Server * server = (Server*) context;
+        server->ConnectDisconnectCallbackFunction( clientIndex, connected );
+    }
+
+    void Server::StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        Server * server = (Server*) context;
+        server->SendLoopbackPacketCallbackFunction( clientIndex, packetData, packetBytes, packetSequence );
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    typedef std::thread Thread;
+
+    struct WorkerThreadsData
+    {
+        std::mutex mutex;                                       ///< Protects everything below.
+        std::mutex workMutex;                                   ///< The mutex returned by WorkerThreads::Lock.
+        std::condition_variable workReady;                      ///< Signalled when work is posted, or the threads should exit.
+        std::condition_variable workDone;                       ///< Signalled when the last worker thread finishes its share of the work.
+        Thread ** threads;                                      ///< The worker threads.
+        WorkerThreads::WorkFunction function;                   ///< The current work function.
+        void * context;                                         ///< The current work context.
+        int numItems;                                           ///< The number of items in the current work.
+        int numThreads;                                         ///< The number of worker threads.
+        int numThreadsWorking;                                  ///< The number of worker threads still working on the current work.
+        uint64_t generation;                                    ///< Incremented each time work is posted, so each thread works on it once.
+        bool quit;                                              ///< True when the threads should exit.
+    };
+
+    static void get_work_range( int numItems, int numShares, int share, int & beginIndex, int & endIndex )
+    {
+        beginIndex = (int) ( ( (int64_t) numItems * share ) / numShares );
+        endIndex = (int) ( ( (int64_t) numItems * ( share + 1 ) ) / numShares );
+    }
+
+    static void worker_thread_function( WorkerThreadsData * data, int threadIndex )
+    {
+        uint64_t generation = 0;
+
+        while ( true )
+        {
+            WorkerThreads::WorkFunction function;
+            void * context;
+            int numItems;
+
+            {
+                std::unique_lock<std::mutex> lock( data->mutex );
+                while ( !data->quit && data->generation == generation )
+                    data->workReady.wait( lock );
+                if ( data->quit )
+                    return;
+                generation = data->generation;
+                function = data->function;
+                context = data->context;
+                numItems = data->numItems;
+            }
+
+            int beginIndex, endIndex;
+            get_work_range( numItems, data->numThreads + 1, threadIndex, beginIndex, endIndex );
+            if ( beginIndex < endIndex )
+                function( context, threadIndex, beginIndex, endIndex );
+
+            {
+                std::unique_lock<std::mutex> lock( data->mutex );
+                if ( --data->numThreadsWorking == 0 )
+                    data->workDone.notify_one();
+            }
+        }
+    }
+
+    WorkerThreads::WorkerThreads( Allocator & allocator, int numThreads )
+    {
+        yojimbo_assert( numThreads > 0 );
+        m_allocator = &allocator;
+        m_numThreads = numThreads;
+        m_data = YOJIMBO_NEW( allocator, WorkerThreadsData );
+        m_data->function = NULL;
+        m_data->context = NULL;
+        m_data->numItems = 0;
+        m_data->numThreads = numThreads;
+        m_data->numThreadsWorking = 0;
+        m_data->generation = 0;
+        m_data->quit = false;
+        m_data->threads = (Thread**) YOJIMBO_ALLOCATE( allocator, sizeof( Thread* ) * numThreads );
+        for ( int i = 0; i < numThreads; ++i )
+        {
+            m_data->threads[i] = YOJIMBO_NEW( allocator, Thread, worker_thread_function, m_data, i + 1 );
+        }
+    }
+
+    WorkerThreads::~WorkerThreads()
+    {
+        {
+            std::unique_lock<std::mutex> lock( m_data->mutex );
+            m_data->quit = true;
+            m_data->workReady.notify_all();
+        }
+        for ( int i = 0; i < m_numThreads; ++i )
+        {
+            m_data->threads[i]->join();
+            YOJIMBO_DELETE( *m_allocator, Thread, m_data->threads[i] );
+        }
+        YOJIMBO_FREE( *m_allocator, m_data->threads );
+        YOJIMBO_DELETE( *m_allocator, WorkerThreadsData, m_data );
+        m_allocator = NULL;
+    }
+
+    void WorkerThreads::Run( WorkFunction function, void * context, int numItems )
+    {
+        yojimbo_assert( function );
+
+        if ( numItems <= 0 )
+            return;
+
+        {
+            std::unique_lock<std::mutex> lock( m_data->mutex );
+            yojimbo_assert( m_data->numThreadsWorking == 0 );
+            m_data->function = function;
+            m_data->context = context;
+            m_data->numItems = numItems;
+            m_data->numThreadsWorking = m_numThreads;
+            m_data->generation++;
+            m_data->workReady.notify_all();
+        }
+
+        // the calling thread works on the first share while the worker threads work on the rest
+
+        int beginIndex, endIndex;
+        get_work_range( numItems, m_numThreads + 1, 0, beginIndex, endIndex );
+        if ( beginIndex < endIndex )
+            function( context, 0, beginIndex, endIndex );
+
+        std::unique_lock<std::mutex> lock( m_data->mutex );
+        while ( m_data->numThreadsWorking > 0 )
+            m_data->workDone.wait( lock );
+    }
+
+    void WorkerThreads::Lock()
+    {
+        m_data->workMutex.lock();
+    }
+
+    void WorkerThreads::Unlock()
+    {
+        m_data->workMutex.unlock();
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    static bool set_network_link_profile_value( NetworkLinkProfile & profile, const char * name, const char * value )
+    {
+        float * floatValue = NULL;
+        int * intValue = NULL;
+        bool * boolValue = NULL;
+
+        if ( strcmp( name, "latency" ) == 0 )
+            floatValue = &profile.latency;
+        else if ( strcmp( name, "jitter" ) == 0 )
+            floatValue = &profile.jitter;
+        else if ( strcmp( name, "orderedJitter" ) == 0 )
+            boolValue = &profile.orderedJitter;
+        else if ( strcmp( name, "packetLoss" ) == 0 )
+            floatValue = &profile.packetLoss;
+        else if ( strcmp( name, "duplicates" ) == 0 )
+            floatValue = &profile.duplicates;
+        else if ( strcmp( name, "bandwidth" ) == 0 )
+            floatValue = &profile.bandwidth;
+        else if ( strcmp( name, "queueBytes" ) == 0 )
+            intValue = &profile.queueBytes;
+        else if ( strcmp( name, "packetOverheadBytes" ) == 0 )
+            intValue = &profile.packetOverheadBytes;
+        else if ( strcmp( name, "burstLossEnter" ) == 0 )
+            floatValue = &profile.burstLossEnter;
+        else if ( strcmp( name, "burstLossExit" ) == 0 )
+            floatValue = &profile.burstLossExit;
+        else if ( strcmp( name, "burstLoss" ) == 0 )
+            floatValue = &profile.burstLoss;
+        else
+            return false;
+
+        char * end = NULL;
+
+        if ( floatValue )
+        {
+            const double result = strtod( value, &end );
+            if ( end == value || *end != '\0' || result < 0.0 )
+                return false;
+            *floatValue = (float) result;
+        }
+        else if ( intValue )
+        {
+            const long result = strtol( value, &end, 10 );
+            if ( end == value || *end != '\0' || result < 0 || result > 0x7FFFFFFF )
+                return false;
+            *intValue = (int) result;
+        }
+        else
+        {
+            if ( strcmp( value, "true" ) == 0 || strcmp( value, "1" ) == 0 )
+                *boolValue = true;
+            else if ( strcmp( value, "false" ) == 0 || strcmp( value, "0" ) == 0 )
+                *boolValue = false;
+            else
+                return false;
+        }
+
+        return true;
+    }
+
+    static bool parse_network_link_profile_line( char * line, NetworkLinkProfile & profile )
     {
-        return (int) GetClientConnection(clientIndex).ProcessPacket( GetContext(), packetSequence, packetData, packetBytes );
+        char * comment = strchr( line, '#' );
+        if ( comment )
+            *comment = '\0';
+
+        char name[64];
+        char value[64];
+        char extra;
+
+        const int numFields = sscanf( line, " %63[A-Za-z] = %63s %c", name, value, &extra );
+
+        if ( numFields == EOF )
+            return true;
+
+        if ( numFields != 2 )
+            return false;
+
+        return set_network_link_profile_value( profile, name, value );
     }
 
-    void Server::ConnectDisconnectCallbackFunction( int clientIndex, int connected )
+    bool parse_network_link_profile( const char * text, NetworkLinkProfile & profile )
     {
-        if ( connected == 0 )
+        yojimbo_assert( text );
+
+        NetworkLinkProfile result = profile;
+
+        int lineNumber = 0;
+
+        while ( *text )
         {
-            GetAdapter().OnServerClientDisconnected( clientIndex );
-            reliable_endpoint_reset( GetClientEndpoint( clientIndex ) );
-            GetClientConnection( clientIndex ).Reset();
-            NetworkSimulator * networkSimulator = GetNetworkSimulator();
-            if ( networkSimulator && networkSimulator->IsActive() )
+            lineNumber++;
+
+            const char * lineEnd = text;
+            while ( *lineEnd && *lineEnd != '\n' )
+                lineEnd++;
+
+            char line[256];
+            const int lineLength = int( lineEnd - text );
+            if ( lineLength >= (int) sizeof( line ) )
             {
-                networkSimulator->DiscardClientPackets( clientIndex );
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: network link profile line %d is too long\n", lineNumber );
+                return false;
+            }
+
+            memcpy( line, text, lineLength );
+            line[lineLength] = '\0';
+
+            text = *lineEnd ? lineEnd + 1 : lineEnd;
+
+            if ( !parse_network_link_profile_line( line, result ) )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: network link profile line %d is invalid: %s\n", lineNumber, line );
+                return false;
             }
         }
-        else
-        {
-            GetAdapter().OnServerClientConnected( clientIndex );
-        }
-    }
 
-    void Server::SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
-    {
-        GetAdapter().ServerSendLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
-    }
+        profile = result;
 
-    void Server::StaticConnectDisconnectCallbackFunction( void * context, int clientIndex, int connected )
-    {
-        Server * server = (Server*) context;
-        server->ConnectDisconnectCallbackFunction( clientIndex, connected );
+        return true;
     }
 
-    void Server::StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    bool load_network_link_profile( const char * filename, NetworkLinkProfile & profile )
     {
-        Server * server = (Server*) context;
-        server->SendLoopbackPacketCallbackFunction( clientIndex, packetData, packetBytes, packetSequence );
+        yojimbo_assert( filename );
+
+        FILE * file = fopen( filename, "rb" );
+        if ( !file )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: could not open network link profile %s\n", filename );
+            return false;
+        }
+
+        char text[4096];
+        const size_t textBytes = fread( text, 1, sizeof( text ) - 1, file );
+        const bool truncated = !feof( file );
+        fclose( file );
+
+        if ( truncated )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: network link profile %s is too large\n", filename );
+            return false;
+        }
+
+        text[textBytes] = '\0';
+
+        return parse_network_link_profile( text, profile );
     }
-}
 
-// ---------------------------------------------------------------------------------
+    const int PacketBufferHeaderBytes = 16;
 
-namespace yojimbo
-{
-    NetworkSimulator::NetworkSimulator( Allocator & allocator, int numPackets, double time )
+    NetworkSimulator::NetworkSimulator( Allocator & allocator, int numPackets, double time, int packetBufferBytes )
     {
         yojimbo_assert( numPackets > 0 );
+        yojimbo_assert( packetBufferBytes >= 0 );
+        yojimbo_assert( sizeof( PacketBuffer ) <= PacketBufferHeaderBytes );
+        if ( packetBufferBytes == 0 )
+            packetBufferBytes = GetSimulatorPacketBufferBytes( ClientServerConfig() );
         m_allocator = &allocator;
-        m_currentIndex = 0;
         m_time = time;
-        m_latency = 0.0f;
-        m_jitter = 0.0f;
-        m_packetLoss = 0.0f;
-        m_duplicates = 0.0f;
+        m_seed = 0;
         m_active = false;
         m_numPacketEntries = numPackets;
         m_packetEntries = (PacketEntry*) YOJIMBO_ALLOCATE( allocator, sizeof( PacketEntry ) * numPackets );
+        m_heap = (int*) YOJIMBO_ALLOCATE( allocator, sizeof( int ) * numPackets );
         yojimbo_assert( m_packetEntries );
+        yojimbo_assert( m_heap );
         memset( m_packetEntries, 0, sizeof( PacketEntry ) * numPackets );
+        for ( int i = 0; i < numPackets; ++i )
+            m_packetEntries[i].next = ( i + 1 < numPackets ) ? i + 1 : -1;
+        m_numHeapEntries = 0;
+        m_freeEntry = 0;
+        m_destinationList = NULL;
+        m_linkStates = NULL;
+        m_numDestinations = 0;
+        m_sendIndex = 0;
+        m_numOverflowPackets = 0;
+        m_numQueueDropPackets = 0;
+        m_packetBufferBytes = ( packetBufferBytes + 15 ) & ~15;
+        m_numPacketBuffers = 0;
+        m_freePacketBuffers = NULL;
+        m_packetBufferSlabs = NULL;
     }
 
     NetworkSimulator::~NetworkSimulator()
@@ -4012,35 +6151,58 @@ namespace yojimbo
         yojimbo_assert( m_packetEntries );
         yojimbo_assert( m_numPacketEntries > 0 );
         DiscardPackets();
+        while ( m_packetBufferSlabs )
+        {
+            uint8_t * nextSlab = *( (uint8_t**) m_packetBufferSlabs );
+            YOJIMBO_FREE( *m_allocator, m_packetBufferSlabs );
+            m_packetBufferSlabs = nextSlab;
+        }
+        m_freePacketBuffers = NULL;
         YOJIMBO_FREE( *m_allocator, m_packetEntries );
+        YOJIMBO_FREE( *m_allocator, m_heap );
+        YOJIMBO_FREE( *m_allocator, m_destinationList );
+        YOJIMBO_FREE( *m_allocator, m_linkStates );
         m_numPacketEntries = 0;
+        m_numDestinations = 0;
         m_allocator = NULL;
     }
 
     void NetworkSimulator::SetLatency( float milliseconds )
     {
-        m_latency = milliseconds;
+        m_profile.latency = milliseconds;
         UpdateActive();
     }
 
     void NetworkSimulator::SetJitter( float milliseconds )
     {
-        m_jitter = milliseconds;
+        m_profile.jitter = milliseconds;
         UpdateActive();
     }
 
     void NetworkSimulator::SetPacketLoss( float percent )
     {
-        m_packetLoss = percent;
+        m_profile.packetLoss = percent;
         UpdateActive();
     }
 
     void NetworkSimulator::SetDuplicates( float percent )
     {
-        m_duplicates = percent;
+        m_profile.duplicates = percent;
+        UpdateActive();
+    }
+
+    void NetworkSimulator::SetLinkProfile( const NetworkLinkProfile & profile )
+    {
+        m_profile = profile;
         UpdateActive();
     }
 
+    void NetworkSimulator::Seed( uint64_t seed, uint64_t stream )
+    {
+        m_seed = seed;
+        m_random.Seed( seed, stream );
+    }
+
     bool NetworkSimulator::IsActive() const
     {
         return m_active;
@@ -4049,56 +6211,307 @@ namespace yojimbo
     void NetworkSimulator::UpdateActive()
     {
         bool previous = m_active;
-        m_active = m_latency != 0.0f || m_jitter != 0.0f || m_packetLoss != 0.0f || m_duplicates != 0.0f;
+        m_active = m_profile.latency != 0.0f || m_profile.jitter != 0.0f || m_profile.packetLoss != 0.0f || m_profile.duplicates != 0.0f || m_profile.bandwidth > 0.0f || m_profile.burstLossEnter > 0.0f;
         if ( previous && !m_active )
         {
             DiscardPackets();
         }
     }
 
+    bool NetworkSimulator::HeapLess( int a, int b ) const
+    {
+        const PacketEntry & entryA = m_packetEntries[a];
+        const PacketEntry & entryB = m_packetEntries[b];
+        if ( entryA.deliveryTime != entryB.deliveryTime )
+            return entryA.deliveryTime < entryB.deliveryTime;
+        return entryA.sendIndex < entryB.sendIndex;
+    }
+
+    void NetworkSimulator::HeapSiftUp( int heapIndex )
+    {
+        const int entryIndex = m_heap[heapIndex];
+        while ( heapIndex > 0 )
+        {
+            const int parentIndex = ( heapIndex - 1 ) / 2;
+            if ( !HeapLess( entryIndex, m_heap[parentIndex] ) )
+                break;
+            m_heap[heapIndex] = m_heap[parentIndex];
+            m_packetEntries[m_heap[heapIndex]].heapIndex = heapIndex;
+            heapIndex = parentIndex;
+        }
+        m_heap[heapIndex] = entryIndex;
+        m_packetEntries[entryIndex].heapIndex = heapIndex;
+    }
+
+    void NetworkSimulator::HeapSiftDown( int heapIndex )
+    {
+        const int entryIndex = m_heap[heapIndex];
+        while ( true )
+        {
+            int childIndex = heapIndex * 2 + 1;
+            if ( childIndex >= m_numHeapEntries )
+                break;
+            if ( childIndex + 1 < m_numHeapEntries && HeapLess( m_heap[childIndex+1], m_heap[childIndex] ) )
+                childIndex++;
+            if ( !HeapLess( m_heap[childIndex], entryIndex ) )
+                break;
+            m_heap[heapIndex] = m_heap[childIndex];
+            m_packetEntries[m_heap[heapIndex]].heapIndex = heapIndex;
+            heapIndex = childIndex;
+        }
+        m_heap[heapIndex] = entryIndex;
+        m_packetEntries[entryIndex].heapIndex = heapIndex;
+    }
+
+    uint8_t * NetworkSimulator::AllocatePacket( int packetBytes )
+    {
+        PacketBuffer * buffer = NULL;
+
+        if ( packetBytes <= m_packetBufferBytes )
+        {
+            if ( !m_freePacketBuffers )
+            {
+                const int bufferStride = PacketBufferHeaderBytes + m_packetBufferBytes;
+                uint8_t * slab = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, 16 + bufferStride * SimulatorPacketsPerSlab );
+                if ( !slab )
+                    return NULL;
+                *( (uint8_t**) slab ) = m_packetBufferSlabs;
+                m_packetBufferSlabs = slab;
+                for ( int i = SimulatorPacketsPerSlab - 1; i >= 0; --i )
+                {
+                    PacketBuffer * slabBuffer = (PacketBuffer*) ( slab + 16 + bufferStride * i );
+                    slabBuffer->pooled = 1;
+                    slabBuffer->next = m_freePacketBuffers;
+                    m_freePacketBuffers = slabBuffer;
+                }
+                m_numPacketBuffers += SimulatorPacketsPerSlab;
+            }
+            buffer = m_freePacketBuffers;
+            m_freePacketBuffers = buffer->next;
+        }
+        else
+        {
+            buffer = (PacketBuffer*) YOJIMBO_ALLOCATE( *m_allocator, PacketBufferHeaderBytes + packetBytes );
+            if ( !buffer )
+                return NULL;
+            buffer->pooled = 0;
+        }
+
+        buffer->next = NULL;
+
+        return ( (uint8_t*) buffer ) + PacketBufferHeaderBytes;
+    }
+
+    void NetworkSimulator::FreePacket( uint8_t * packetData )
+    {
+        if ( !packetData )
+            return;
+
+        PacketBuffer * buffer = (PacketBuffer*) ( packetData - PacketBufferHeaderBytes );
+
+        if ( buffer->pooled )
+        {
+#ifndef NDEBUG
+            // pooled buffers freed to the wrong simulator would be handed out again after their slab is freed
+            const int slabBytes = ( PacketBufferHeaderBytes + m_packetBufferBytes ) * SimulatorPacketsPerSlab;
+            bool ownsBuffer = false;
+            for ( uint8_t * slab = m_packetBufferSlabs; slab && !ownsBuffer; slab = *( (uint8_t**) slab ) )
+                ownsBuffer = (uint8_t*) buffer >= slab + 16 && (uint8_t*) buffer < slab + 16 + slabBytes;
+            yojimbo_assert( ownsBuffer );
+#endif // #ifndef NDEBUG
+
+            buffer->next = m_freePacketBuffers;
+            m_freePacketBuffers = buffer;
+        }
+        else
+        {
+            YOJIMBO_FREE( *m_allocator, buffer );
+        }
+    }
+
+    bool NetworkSimulator::ReserveDestination( int to )
+    {
+        yojimbo_assert( to >= 0 );
+
+        if ( to < m_numDestinations )
+            return true;
+
+        const int numDestinations = yojimbo_max( to + 1, yojimbo_max( m_numDestinations * 2, 64 ) );
+        int * destinationList = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * numDestinations );
+        LinkState * linkStates = (LinkState*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( LinkState ) * numDestinations );
+        if ( !destinationList || !linkStates )
+        {
+            YOJIMBO_FREE( *m_allocator, destinationList );
+            YOJIMBO_FREE( *m_allocator, linkStates );
+            return false;
+        }
+
+        memset( linkStates, 0, sizeof( LinkState ) * numDestinations );
+        for ( int i = 0; i < numDestinations; ++i )
+            destinationList[i] = ( i < m_numDestinations ) ? m_destinationList[i] : -1;
+        if ( m_numDestinations > 0 )
+            memcpy( linkStates, m_linkStates, sizeof( LinkState ) * m_numDestinations );
+
+        YOJIMBO_FREE( *m_allocator, m_destinationList );
+        YOJIMBO_FREE( *m_allocator, m_linkStates );
+        m_destinationList = destinationList;
+        m_linkStates = linkStates;
+        m_numDestinations = numDestinations;
+
+        return true;
+    }
+
+    int NetworkSimulator::AddPacket( int to, const uint8_t * packetData, int packetBytes, double deliveryTime )
+    {
+        yojimbo_assert( to >= 0 );
+
+        if ( m_freeEntry < 0 )
+        {
+            m_numOverflowPackets++;
+            return -1;
+        }
+
+        if ( !ReserveDestination( to ) )
+            return -1;
+
+        uint8_t * packetCopy = AllocatePacket( packetBytes );
+        if ( !packetCopy )
+            return -1;
+        memcpy( packetCopy, packetData, packetBytes );
+
+        const int entryIndex = m_freeEntry;
+        PacketEntry & entry = m_packetEntries[entryIndex];
+        m_freeEntry = entry.next;
+
+        entry.to = to;
+        entry.deliveryTime = deliveryTime;
+        entry.sendIndex = m_sendIndex++;
+        entry.packetData = packetCopy;
+        entry.packetBytes = packetBytes;
+
+        entry.previous = -1;
+        entry.next = m_destinationList[to];
+        if ( entry.next >= 0 )
+            m_packetEntries[entry.next].previous = entryIndex;
+        m_destinationList[to] = entryIndex;
+
+        m_heap[m_numHeapEntries] = entryIndex;
+        HeapSiftUp( m_numHeapEntries++ );
+
+        return entryIndex;
+    }
+
+    void NetworkSimulator::RemovePacket( int entryIndex )
+    {
+        PacketEntry & entry = m_packetEntries[entryIndex];
+
+        yojimbo_assert( entry.packetData == NULL );
+        yojimbo_assert( m_numHeapEntries > 0 );
+
+        const int heapIndex = entry.heapIndex;
+        const int lastEntryIndex = m_heap[--m_numHeapEntries];
+        if ( heapIndex < m_numHeapEntries )
+        {
+            m_heap[heapIndex] = lastEntryIndex;
+            m_packetEntries[lastEntryIndex].heapIndex = heapIndex;
+            if ( heapIndex > 0 && HeapLess( lastEntryIndex, m_heap[( heapIndex - 1 ) / 2] ) )
+                HeapSiftUp( heapIndex );
+            else
+                HeapSiftDown( heapIndex );
+        }
+
+        if ( entry.previous >= 0 )
+            m_packetEntries[entry.previous].next = entry.next;
+        else
+            m_destinationList[entry.to] = entry.next;
+        if ( entry.next >= 0 )
+            m_packetEntries[entry.next].previous = entry.previous;
+
+        entry.next = m_freeEntry;
+        m_freeEntry = entryIndex;
+    }
+
     void NetworkSimulator::SendPacket( int to, uint8_t * packetData, int packetBytes )
     {
         yojimbo_assert( m_allocator );
         yojimbo_assert( packetData );
         yojimbo_assert( packetBytes > 0 );
 
-        if ( random_float( 0.0f, 100.0f ) <= m_packetLoss )
-        {
+        if ( !ReserveDestination( to ) )
             return;
+
+        LinkState & link = m_linkStates[to];
+
+        // packets wait in a FIFO queue until the bandwidth limited link is free to send them. packets that don't fit in the queue are dropped
+
+        double sendTime = m_time;
+
+        if ( m_profile.bandwidth > 0.0f )
+        {
+            const int wireBytes = packetBytes + m_profile.packetOverheadBytes;
+
+            if ( m_profile.queueBytes > 0 && GetQueuedBytes( to ) + wireBytes > m_profile.queueBytes )
+            {
+                m_numQueueDropPackets++;
+                return;
+            }
+
+            const double bytesPerSecond = m_profile.bandwidth * 1000.0 / 8.0;
+            link.queueFreeTime = yojimbo_max( link.queueFreeTime, m_time ) + wireBytes / bytesPerSecond;
+            sendTime = link.queueFreeTime;
         }
 
-        PacketEntry & packetEntry = m_packetEntries[m_currentIndex];
+        // packets lost after the bandwidth limit still take their share of the bandwidth
+
+        if ( m_profile.burstLossEnter > 0.0f )
+        {
+            if ( link.burstLossBad )
+                link.burstLossBad = m_random.NextFloat( 0.0f, 100.0f ) >= m_profile.burstLossExit;
+            else
+                link.burstLossBad = m_random.NextFloat( 0.0f, 100.0f ) < m_profile.burstLossEnter;
+
+            if ( link.burstLossBad && m_random.NextFloat( 0.0f, 100.0f ) < m_profile.burstLoss )
+                return;
+        }
 
-        if ( packetEntry.packetData )
+        if ( m_random.NextFloat( 0.0f, 100.0f ) < m_profile.packetLoss )
         {
-            YOJIMBO_FREE( *m_allocator, packetEntry.packetData );
-            packetEntry = PacketEntry();
+            return;
         }
 
-        double delay = m_latency / 1000.0;
+        double delay = m_profile.latency / 1000.0;
+
+        if ( m_profile.jitter > 0 )
+            delay += m_random.NextFloat( -m_profile.jitter, +m_profile.jitter ) / 1000.0;
 
-        if ( m_jitter > 0 )
-            delay += random_float( -m_jitter, +m_jitter ) / 1000.0;
+        double deliveryTime = sendTime + delay;
 
-        packetEntry.to = to;
-        packetEntry.packetData = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, packetBytes );
-        memcpy( packetEntry.packetData, packetData, packetBytes );
-        packetEntry.packetBytes = packetBytes;
-        packetEntry.deliveryTime = m_time + delay;
-        m_currentIndex = ( m_currentIndex + 1 ) % m_numPacketEntries;
+        if ( m_profile.orderedJitter )
+        {
+            deliveryTime = yojimbo_max( deliveryTime, link.lastDeliveryTime );
+            link.lastDeliveryTime = deliveryTime;
+        }
 
-        if ( random_float( 0.0f, 100.0f ) <= m_duplicates )
+        AddPacket( to, packetData, packetBytes, deliveryTime );
+
+        if ( m_random.NextFloat( 0.0f, 100.0f ) < m_profile.duplicates )
         {
-            PacketEntry & nextPacketEntry = m_packetEntries[m_currentIndex];
-            nextPacketEntry.to = to;
-            nextPacketEntry.packetData = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, packetBytes );
-            memcpy( nextPacketEntry.packetData, packetData, packetBytes );
-            nextPacketEntry.packetBytes = packetBytes;
-            nextPacketEntry.deliveryTime = m_time + delay + random_float( 0, +1.0 );
-            m_currentIndex = ( m_currentIndex + 1 ) % m_numPacketEntries;
+            AddPacket( to, packetData, packetBytes, deliveryTime + m_random.NextFloat( 0.0f, 1.0f ) );
         }
     }
 
+    int NetworkSimulator::GetQueuedBytes( int to ) const
+    {
+        if ( m_profile.bandwidth <= 0.0f || to < 0 || to >= m_numDestinations )
+            return 0;
+
+        const double queueTime = m_linkStates[to].queueFreeTime - m_time;
+        if ( queueTime <= 0.0 )
+            return 0;
+
+        return (int) floor( queueTime * m_profile.bandwidth * 1000.0 / 8.0 + 0.5 );
+    }
+
     int NetworkSimulator::ReceivePackets( int maxPackets, uint8_t * packetData[], int packetBytes[], int to[] )
     {
         if ( !IsActive() )
@@ -4106,22 +6519,23 @@ namespace yojimbo
 
         int numPackets = 0;
 
-        for ( int i = 0; i < yojimbo_min( m_numPacketEntries, maxPackets ); ++i )
+        while ( numPackets < maxPackets && m_numHeapEntries > 0 )
         {
-            if ( !m_packetEntries[i].packetData )
-                continue;
+            const int entryIndex = m_heap[0];
+            PacketEntry & entry = m_packetEntries[entryIndex];
+
+            if ( entry.deliveryTime >= m_time )
+                break;
 
-            if ( m_packetEntries[i].deliveryTime < m_time )
+            packetData[numPackets] = entry.packetData;
+            packetBytes[numPackets] = entry.packetBytes;
+            if ( to )
             {
-                packetData[numPackets] = m_packetEntries[i].packetData;
-                packetBytes[numPackets] = m_packetEntries[i].packetBytes;
-                if ( to )
-                {
-                    to[numPackets] = m_packetEntries[i].to;
-                }
-                m_packetEntries[i].packetData = NULL;
-                numPackets++;
+                to[numPackets] = entry.to;
             }
+            entry.packetData = NULL;
+            RemovePacket( entryIndex );
+            numPackets++;
         }
 
         return numPackets;
@@ -4129,26 +6543,32 @@ namespace yojimbo
 
     void NetworkSimulator::DiscardPackets()
     {
-        for ( int i = 0; i < m_numPacketEntries; ++i )
+        while ( m_numHeapEntries > 0 )
         {
-            PacketEntry & packetEntry = m_packetEntries[i];
-            if ( !packetEntry.packetData )
-                continue;
-            YOJIMBO_FREE( *m_allocator, packetEntry.packetData );
-            packetEntry = PacketEntry();
+            const int entryIndex = m_heap[m_numHeapEntries-1];
+            FreePacket( m_packetEntries[entryIndex].packetData );
+            m_packetEntries[entryIndex].packetData = NULL;
+            RemovePacket( entryIndex );
         }
+
+        if ( m_numDestinations > 0 )
+            memset( m_linkStates, 0, sizeof( LinkState ) * m_numDestinations );
     }
 
     void NetworkSimulator::DiscardClientPackets( int clientIndex )
     {
-        for ( int i = 0; i < m_numPacketEntries; ++i )
+        if ( clientIndex < 0 || clientIndex >= m_numDestinations )
+            return;
+
+        while ( m_destinationList[clientIndex] >= 0 )
         {
-            PacketEntry & packetEntry = m_packetEntries[i];
-            if ( !packetEntry.packetData || packetEntry.to != clientIndex )
-                continue;
-            YOJIMBO_FREE( *m_allocator, packetEntry.packetData );
-            packetEntry = PacketEntry();
+            const int entryIndex = m_destinationList[clientIndex];
+            FreePacket( m_packetEntries[entryIndex].packetData );
+            m_packetEntries[entryIndex].packetData = NULL;
+            RemovePacket( entryIndex );
         }
+
+        memset( &m_linkStates[clientIndex], 0, sizeof( LinkState ) );
     }
 
     void NetworkSimulator::AdvanceTime( double time )
@@ -4538,6 +6958,188 @@ namespace yojimbo
         for (i = 1; (v >>= 7) != 0; i++) { yojimbo_assert(i < 10); }
         return i;
     }
+
+    // =============================================
+
+    // kernels for serialize_int_array and serialize_quantized_float_array. each processes 8 values at a time with AVX2, then 4 at a time with SSE2, then finishes one at a time. all paths give identical results
+
+    void offset_int_array( const int32_t * values, uint32_t * offsetValues, int numValues, int32_t min )
+    {
+        int i = 0;
+
+#if YOJIMBO_AVX2
+        const __m256i min8 = _mm256_set1_epi32( min );
+        for ( ; i + 8 <= numValues; i += 8 )
+        {
+            const __m256i value = _mm256_loadu_si256( (const __m256i*) ( values + i ) );
+            _mm256_storeu_si256( (__m256i*) ( offsetValues + i ), _mm256_sub_epi32( value, min8 ) );
+        }
+#endif // #if YOJIMBO_AVX2
+
+#if YOJIMBO_SSE2
+        const __m128i min4 = _mm_set1_epi32( min );
+        for ( ; i + 4 <= numValues; i += 4 )
+        {
+            const __m128i value = _mm_loadu_si128( (const __m128i*) ( values + i ) );
+            _mm_storeu_si128( (__m128i*) ( offsetValues + i ), _mm_sub_epi32( value, min4 ) );
+        }
+#endif // #if YOJIMBO_SSE2
+
+        for ( ; i < numValues; ++i )
+        {
+            offsetValues[i] = uint32_t( values[i] ) - uint32_t( min );
+        }
+    }
+
+    bool unoffset_int_array( const uint32_t * offsetValues, int32_t * values, int numValues, int32_t min, int32_t max )
+    {
+        yojimbo_assert( min < max );
+
+        const uint32_t maxOffset = uint32_t( int64_t( max ) - int64_t( min ) );
+
+        int i = 0;
+
+        // there is no unsigned compare before AVX-512, so flip the sign bit of both sides and compare signed
+
+#if YOJIMBO_AVX2
+        const __m256i min8 = _mm256_set1_epi32( min );
+        const __m256i signBit8 = _mm256_set1_epi32( (int32_t) 0x80000000 );
+        const __m256i maxOffset8 = _mm256_xor_si256( _mm256_set1_epi32( (int32_t) maxOffset ), signBit8 );
+        __m256i outOfRange8 = _mm256_setzero_si256();
+        for ( ; i + 8 <= numValues; i += 8 )
+        {
+            const __m256i offset = _mm256_loadu_si256( (const __m256i*) ( offsetValues + i ) );
+            outOfRange8 = _mm256_or_si256( outOfRange8, _mm256_cmpgt_epi32( _mm256_xor_si256( offset, signBit8 ), maxOffset8 ) );
+            _mm256_storeu_si256( (__m256i*) ( values + i ), _mm256_add_epi32( offset, min8 ) );
+        }
+        if ( !_mm256_testz_si256( outOfRange8, outOfRange8 ) )
+            return false;
+#endif // #if YOJIMBO_AVX2
+
+#if YOJIMBO_SSE2
+        const __m128i min4 = _mm_set1_epi32( min );
+        const __m128i signBit4 = _mm_set1_epi32( (int32_t) 0x80000000 );
+        const __m128i maxOffset4 = _mm_xor_si128( _mm_set1_epi32( (int32_t) maxOffset ), signBit4 );
+        __m128i outOfRange4 = _mm_setzero_si128();
+        for ( ; i + 4 <= numValues; i += 4 )
+        {
+            const __m128i offset = _mm_loadu_si128( (const __m128i*) ( offsetValues + i ) );
+            outOfRange4 = _mm_or_si128( outOfRange4, _mm_cmpgt_epi32( _mm_xor_si128( offset, signBit4 ), maxOffset4 ) );
+            _mm_storeu_si128( (__m128i*) ( values + i ), _mm_add_epi32( offset, min4 ) );
+        }
+        if ( _mm_movemask_epi8( outOfRange4 ) != 0 )
+            return false;
+#endif // #if YOJIMBO_SSE2
+
+        bool outOfRange = false;
+        for ( ; i < numValues; ++i )
+        {
+            outOfRange |= offsetValues[i] > maxOffset;
+            values[i] = int32_t( offsetValues[i] + uint32_t( min ) );
+        }
+
+        return !outOfRange;
+    }
+
+    void quantize_float_array( const float * values, uint32_t * quantizedValues, int numValues, float min, float max, uint32_t maxQuantized )
+    {
+        yojimbo_assert( min < max );
+        yojimbo_assert( maxQuantized > 0 );
+        yojimbo_assert( maxQuantized < ( 1U << 24 ) );
+
+        const float scale = float( maxQuantized ) / ( max - min );
+        const float maxQuantizedFloat = float( maxQuantized );
+
+        int i = 0;
+
+        // max( value, min ) and min( value, max ) are written so that NaN becomes min, matching _mm_max_ps and _mm_min_ps
+
+#if YOJIMBO_AVX2
+        const __m256 min8 = _mm256_set1_ps( min );
+        const __m256 max8 = _mm256_set1_ps( max );
+        const __m256 scale8 = _mm256_set1_ps( scale );
+        const __m256 half8 = _mm256_set1_ps( 0.5f );
+        const __m256 maxQuantized8 = _mm256_set1_ps( maxQuantizedFloat );
+        for ( ; i + 8 <= numValues; i += 8 )
+        {
+            __m256 value = _mm256_loadu_ps( values + i );
+            value = _mm256_min_ps( _mm256_max_ps( value, min8 ), max8 );
+            __m256 quantized = _mm256_add_ps( _mm256_mul_ps( _mm256_sub_ps( value, min8 ), scale8 ), half8 );
+            quantized = _mm256_min_ps( quantized, maxQuantized8 );
+            _mm256_storeu_si256( (__m256i*) ( quantizedValues + i ), _mm256_cvttps_epi32( quantized ) );
+        }
+#endif // #if YOJIMBO_AVX2
+
+#if YOJIMBO_SSE2
+        const __m128 min4 = _mm_set1_ps( min );
+        const __m128 max4 = _mm_set1_ps( max );
+        const __m128 scale4 = _mm_set1_ps( scale );
+        const __m128 half4 = _mm_set1_ps( 0.5f );
+        const __m128 maxQuantized4 = _mm_set1_ps( maxQuantizedFloat );
+        for ( ; i + 4 <= numValues; i += 4 )
+        {
+            __m128 value = _mm_loadu_ps( values + i );
+            value = _mm_min_ps( _mm_max_ps( value, min4 ), max4 );
+            __m128 quantized = _mm_add_ps( _mm_mul_ps( _mm_sub_ps( value, min4 ), scale4 ), half4 );
+            quantized = _mm_min_ps( quantized, maxQuantized4 );
+            _mm_storeu_si128( (__m128i*) ( quantizedValues + i ), _mm_cvttps_epi32( quantized ) );
+        }
+#endif // #if YOJIMBO_SSE2
+
+        for ( ; i < numValues; ++i )
+        {
+            float value = values[i];
+            value = ( value > min ) ? value : min;
+            value = ( value < max ) ? value : max;
+            float quantized = ( value - min ) * scale;
+            quantized = quantized + 0.5f;
+            quantized = ( quantized < maxQuantizedFloat ) ? quantized : maxQuantizedFloat;
+            quantizedValues[i] = uint32_t( int32_t( quantized ) );
+        }
+    }
+
+    void dequantize_float_array( const uint32_t * quantizedValues, float * values, int numValues, float min, float max, uint32_t maxQuantized )
+    {
+        yojimbo_assert( min < max );
+        yojimbo_assert( maxQuantized > 0 );
+        yojimbo_assert( maxQuantized < ( 1U << 24 ) );
+
+        const float scale = ( max - min ) / float( maxQuantized );
+
+        int i = 0;
+
+#if YOJIMBO_AVX2
+        const __m256 min8 = _mm256_set1_ps( min );
+        const __m256 max8 = _mm256_set1_ps( max );
+        const __m256 scale8 = _mm256_set1_ps( scale );
+        for ( ; i + 8 <= numValues; i += 8 )
+        {
+            const __m256 quantized = _mm256_cvtepi32_ps( _mm256_loadu_si256( (const __m256i*) ( quantizedValues + i ) ) );
+            const __m256 value = _mm256_add_ps( _mm256_mul_ps( quantized, scale8 ), min8 );
+            _mm256_storeu_ps( values + i, _mm256_min_ps( value, max8 ) );
+        }
+#endif // #if YOJIMBO_AVX2
+
+#if YOJIMBO_SSE2
+        const __m128 min4 = _mm_set1_ps( min );
+        const __m128 max4 = _mm_set1_ps( max );
+        const __m128 scale4 = _mm_set1_ps( scale );
+        for ( ; i + 4 <= numValues; i += 4 )
+        {
+            const __m128 quantized = _mm_cvtepi32_ps( _mm_loadu_si128( (const __m128i*) ( quantizedValues + i ) ) );
+            const __m128 value = _mm_add_ps( _mm_mul_ps( quantized, scale4 ), min4 );
+            _mm_storeu_ps( values + i, _mm_min_ps( value, max4 ) );
+        }
+#endif // #if YOJIMBO_SSE2
+
+        for ( ; i < numValues; ++i )
+        {
+            yojimbo_assert( quantizedValues[i] <= maxQuantized );
+            float value = float( int32_t( quantizedValues[i] ) ) * scale;
+            value = value + min;
+            values[i] = ( value < max ) ? value : max;
+        }
+    }
 }
 
 // ---------------------------------------------------------------------------------
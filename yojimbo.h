@@ -159,15 +159,21 @@ struct reliable_endpoint_t;
 
 namespace yojimbo
 {
-    const int MaxClients = 64;                                      ///< The maximum number of clients supported by this library. You can increase this if you want, but this library is designed around patterns that work best for [2,64] player games. If your game has less than 64 clients, reducing this will save memory.
+    const int MaxClients = 64;                                      ///< The default number of client slots used by the examples. Servers allocate their client tables when they start, so Server::Start accepts more than this, up to the netcode.io limit NETCODE_MAX_CLIENTS.
     const int MaxChannels = 64;                                     ///< The maximum number of message channels supported by this library. If you need less than 64 channels per-packet, reducing this will save memory.
     const int KeyBytes = 32;                                        ///< Size of encryption key for dedicated client/server in bytes. Must be equal to key size for libsodium encryption primitive. Do not change.
     const int ConnectTokenBytes = 2048;                             ///< Size of the encrypted connect token data return from the matchmaker. Must equal size of NETCODE_CONNECT_TOKEN_BYTE (2048).
     const uint32_t SerializeCheckValue = 0x12345678;                ///< The value written to the stream for serialize checks. See WriteStream::SerializeCheck and ReadStream::SerializeCheck.
+    const int SerializeArrayBatchSize = 256;                        ///< Number of values converted at a time on the stack by serialize_int_array and serialize_quantized_float_array.
     const int ConservativeMessageHeaderBits = 32;                   ///< Conservative number of bits per-message header.
     const int ConservativeFragmentHeaderBits = 64;                  ///< Conservative number of bits per-fragment header.
     const int ConservativeChannelHeaderBits = 32;                   ///< Conservative number of bits per-channel header.
     const int ConservativePacketHeaderBits = 16;                    ///< Conservative number of bits per-packet header.
+    const int MessageTypeBits = 14;                                 ///< Number of bits each message stores its type in. See Message::GetType.
+    const int MaxMessageTypes = 1 << MessageTypeBits;               ///< The maximum number of message types in a message factory.
+    const int MessagesPerPoolSlab = 64;                             ///< Number of messages allocated at a time when a message pool in the message factory runs out of free messages. See MessageFactory::GetPoolCounter.
+    const int SimulatorPacketsPerSlab = 64;                         ///< Number of packet buffers allocated at a time when the network simulator runs out of free packet buffers.
+    const int SimulatorPacketHeaderBytes = 32;                      ///< Extra bytes in each network simulator packet buffer for the packet and fragment headers added by the reliable endpoint.
 
     /// Determines the reliability and ordering guarantees for a channel.
 
@@ -216,8 +222,11 @@ namespace yojimbo
         int packetBudget;                                           ///< Maximum amount of message data to write to the packet for this channel (bytes). Specifying -1 means the channel can use up to the rest of the bytes remaining in the packet.
         int maxBlockSize;                                           ///< The size of the largest block that can be sent across this channel (bytes).
         int blockFragmentSize;                                      ///< Blocks are split up into fragments of this size (bytes). Reliable-ordered channel only.
+        int maxFragmentsPerPacket;                                  ///< Maximum number of block fragments to include in each packet. Will write up to this many fragments of the blocks being sent, provided they fit into the channel packet budget and the number of bytes remaining in the packet. Reliable-ordered channel only.
+        int maxBlocksInFlight;                                      ///< Maximum number of blocks being sent at the same time. With more than one block in flight, the next block starts sending without waiting for all fragments of the previous block to be acked, so throughput on high latency links is limited by bandwidth rather than round trip time. The receiver reserves maxBlockSize bytes to reassemble each block in flight. Reliable-ordered channel only.
         float messageResendTime;                                    ///< Minimum delay between message resends (seconds). Avoids sending the same message too frequently. Reliable-ordered channel only.
         float blockFragmentResendTime;                              ///< Minimum delay between block fragment resends (seconds). Avoids sending the same fragment too frequently. Reliable-ordered channel only.
+        bool zeroCopyBlockReceive;                                  ///< When a block finishes receiving, attach the reassembly buffer to the block message instead of copying the block into a new allocation. Saves a copy and halves peak memory for large blocks, but each received block holds onto maxBlockSize bytes until its message is released. Reliable-ordered channel only.
 
         ChannelConfig() : type ( CHANNEL_TYPE_RELIABLE_ORDERED )
         {
@@ -229,8 +238,11 @@ namespace yojimbo
             packetBudget = -1;
             maxBlockSize = 256 * 1024;
             blockFragmentSize = 1024;
+            maxFragmentsPerPacket = 16;
+            maxBlocksInFlight = 1;
             messageResendTime = 0.1f;
             blockFragmentResendTime = 0.25f;
+            zeroCopyBlockReceive = false;
         }
 
         int GetMaxFragmentsPerBlock() const
@@ -250,11 +262,13 @@ namespace yojimbo
         int numChannels;                                        ///< Number of message channels in [1,MaxChannels]. Each message channel must have a corresponding configuration below.
         int maxPacketSize;                                      ///< The maximum size of packets generated to transmit messages between client and server (bytes).
         ChannelConfig channel[MaxChannels];                     ///< Per-channel configuration. See ChannelConfig for details.
+        int baselineBufferSize;                                 ///< Number of packet entries kept for baseline messages sent and received. Baselines are only used while they are less than half this many packets old. Set to zero to always send baseline messages in full. See BaselineMessage.
 
         ConnectionConfig()
         {
             numChannels = 1;
             maxPacketSize = 8 * 1024;
+            baselineBufferSize = 256;
         }
     };
 
@@ -270,15 +284,21 @@ namespace yojimbo
         int timeout;                                            ///< Timeout value in seconds. Set to negative value to disable timeouts (for debugging only).
         int clientMemory;                                       ///< Memory allocated inside Client for packets, messages and stream allocations (bytes)
         int serverGlobalMemory;                                 ///< Memory allocated inside Server for global connection request and challenge response packets (bytes)
-        int serverPerClientMemory;                              ///< Memory allocated inside Server for packets, messages and stream allocations per-client (bytes)
+        int serverPerClientMemory;                              ///< Memory allocated inside Server for packets, messages and stream allocations per-client (bytes). When serverClientMemoryPool is set, this is the cap on each client's memory instead.
+        int serverClientMemoryPool;                             ///< If non-zero, per-client memory is not allocated up front. Each client's heap grows on demand from a memory pool of this size shared by all clients, up to serverPerClientMemory (bytes).
+        int serverClientMemoryPageSize;                         ///< Per-client heaps grow from the shared memory pool in multiples of this size (bytes).
         bool networkSimulator;                                  ///< If true then a network simulator is created for simulating latency, jitter, packet loss and duplicates.
         int maxSimulatorPackets;                                ///< Maximum number of packets that can be stored in the network simulator. Additional packets are dropped.
+        uint64_t networkSimulatorSeed;                          ///< Seed for the network simulator random generator. With the same seed and the same packets sent, the simulator drops, delays and duplicates the same packets. Zero picks a random seed. See NetworkSimulator::GetSeed.
         int fragmentPacketsAbove;                               ///< Packets above this size (bytes) are split apart into fragments and reassembled on the other side.
         int packetFragmentSize;                                 ///< Size of each packet fragment (bytes).
         int maxPacketFragments;                                 ///< Maximum number of fragments a packet can be split up into.
         int packetReassemblyBufferSize;                         ///< Number of packet entries in the fragmentation reassembly buffer.
         int ackedPacketsBufferSize;                             ///< Number of packet entries in the acked packet buffer. Consider your packet send rate and aim to have at least a few seconds worth of entries.
         int receivedPacketsBufferSize;                          ///< Number of packet entries in the received packet sequence buffer. Consider your packet send rate and aim to have at least a few seconds worth of entries.
+        int serverWorkerThreads;                                ///< Number of worker threads the server starts for per-client work, in addition to the thread calling into the server. Zero disables worker threads.
+        bool serverParallelSend;                                ///< If true and the server has worker threads, packets for different clients are generated in parallel in Server::SendPackets. IMPORTANT: Message serialize functions are then called from worker threads.
+        bool serverParallelReceive;                             ///< If true and the server has worker threads, packets received from different clients are processed in parallel in Server::ReceivePackets. IMPORTANT: Message serialize functions are then called from worker threads.
 
         ClientServerConfig()
         {
@@ -287,14 +307,20 @@ namespace yojimbo
             clientMemory = 10 * 1024 * 1024;
             serverGlobalMemory = 10 * 1024 * 1024;
             serverPerClientMemory = 10 * 1024 * 1024;
+            serverClientMemoryPool = 0;
+            serverClientMemoryPageSize = 64 * 1024;
             networkSimulator = true;
             maxSimulatorPackets = 4 * 1024;
+            networkSimulatorSeed = 0;
             fragmentPacketsAbove = 1024;
             packetFragmentSize = 1024;
             maxPacketFragments = (int) ceil( maxPacketSize / packetFragmentSize );
             packetReassemblyBufferSize = 64;
             ackedPacketsBufferSize = 256;
             receivedPacketsBufferSize = 256;
+            serverWorkerThreads = 0;
+            serverParallelSend = false;
+            serverParallelReceive = false;
         }
     };
 }
@@ -730,6 +756,175 @@ namespace yojimbo
         TLSF_Allocator & operator = ( const TLSF_Allocator & other );
     };
 
+    /**
+        A budget of memory shared between several allocators.
+        Memory is handed out in chunks that are a multiple of the page size, and the total handed out never exceeds the budget. Chunks come from the allocator passed in to the constructor.
+        This lets per-client heaps on the server grow on demand, so the sum of their caps can be larger than the budget while the memory actually used stays within it.
+        The memory pool is thread safe, so allocators on different threads can share it.
+        @see TLSF_PooledAllocator
+     */
+
+    class MemoryPool
+    {
+    public:
+
+        /**
+            Memory pool constructor.
+            @param allocator The allocator that chunks are allocated from.
+            @param budgetBytes The maximum number of bytes handed out at any time.
+            @param pageBytes The page size. Chunk sizes are rounded up to a multiple of this (bytes).
+         */
+
+        MemoryPool( Allocator & allocator, size_t budgetBytes, size_t pageBytes );
+
+        /**
+            Memory pool destructor.
+            All chunks must be freed before the memory pool is destroyed.
+         */
+
+        ~MemoryPool();
+
+        /**
+            Allocate a chunk of memory.
+            @param bytes The minimum size of the chunk (bytes).
+            @param chunkBytes Set to the actual size of the chunk, which is rounded up to a multiple of the page size (bytes).
+            @returns The chunk of memory, or NULL if allocating it would exceed the budget.
+         */
+
+        void * AllocateChunk( size_t bytes, size_t & chunkBytes );
+
+        /**
+            Return a chunk of memory to the pool.
+            @param chunk The chunk of memory. Must have been allocated from this pool.
+            @param chunkBytes The size of the chunk, as returned by AllocateChunk (bytes).
+         */
+
+        void FreeChunk( void * chunk, size_t chunkBytes );
+
+        /**
+            Round a size up to a multiple of the page size.
+            @param bytes The size to round up (bytes).
+            @returns The rounded size (bytes).
+         */
+
+        size_t RoundUpToPageSize( size_t bytes ) const { return ( ( bytes + m_pageBytes - 1 ) / m_pageBytes ) * m_pageBytes; }
+
+        /**
+            Get the page size.
+            @returns The page size (bytes).
+         */
+
+        size_t GetPageBytes() const { return m_pageBytes; }
+
+        /**
+            Get the budget.
+            @returns The maximum number of bytes handed out at any time.
+         */
+
+        size_t GetBudgetBytes() const { return m_budgetBytes; }
+
+        /**
+            Get the number of bytes currently handed out.
+            @returns The total size of all chunks that have been allocated and not yet freed (bytes).
+         */
+
+        size_t GetUsedBytes() const;
+
+    private:
+
+        Allocator * m_allocator;                                ///< Allocator that chunks are allocated from.
+        size_t m_budgetBytes;                                   ///< The maximum number of bytes handed out at any time.
+        size_t m_pageBytes;                                     ///< The page size. Chunk sizes are a multiple of this.
+        size_t m_usedBytes;                                     ///< The number of bytes currently handed out.
+        struct MemoryPoolData * m_data;                         ///< The mutex protecting the pool. Defined in yojimbo.cpp so the header does not depend on the threading library.
+
+        MemoryPool( const MemoryPool & other );
+        MemoryPool & operator = ( const MemoryPool & other );
+    };
+
+    /**
+        A TLSF allocator that grows on demand by taking chunks from a shared memory pool, up to a hard cap.
+        Chunks are added to the TLSF heap with tlsf_add_pool when an allocation doesn't fit, and given back to the memory pool when they are completely free. One empty single page chunk is kept in reserve, so an allocator that grows and shrinks across a chunk boundary doesn't take and return a chunk every time.
+        The server uses this when ClientServerConfig::serverClientMemoryPool is set, so a client streaming a large block can use memory that idle clients aren't using, without any one client being able to take more than its cap.
+        @see MemoryPool
+     */
+
+    class TLSF_PooledAllocator : public Allocator
+    {
+    public:
+
+        /**
+            Pooled TLSF allocator constructor.
+            Takes one page from the memory pool for the TLSF control structure and the first allocations. If the memory pool is exhausted, every allocation fails until the allocator is recreated.
+            @param pool The memory pool to take chunks from. Must outlive this allocator.
+            @param maxBytes The maximum number of bytes this allocator takes from the memory pool, including allocator overhead.
+         */
+
+        TLSF_PooledAllocator( MemoryPool & pool, size_t maxBytes );
+
+        /**
+            Pooled TLSF allocator destructor.
+            Returns all chunks to the memory pool. Checks for memory leaks in debug build. Free all memory allocated by this allocator before destroying.
+         */
+
+        ~TLSF_PooledAllocator();
+
+        /**
+            Allocates a block of memory using TLSF, taking another chunk from the memory pool if necessary.
+            IMPORTANT: Don't call this directly. Use the YOJIMBO_NEW or YOJIMBO_ALLOCATE macros instead, because they automatically pass in the source filename and line number for you.
+            @param size The size of the block of memory to allocate (bytes).
+            @param file The source code filename that is performing the allocation. Used for tracking allocations and reporting on memory leaks.
+            @param line The line number in the source code file that is performing the allocation.
+            @returns A block of memory of the requested size, or NULL if the allocation could not be performed. If NULL is returned, the error level is set to ALLOCATION_ERROR_FAILED_TO_ALLOCATE.
+         */
+
+        void * Allocate( size_t size, const char * file, int line );
+
+        /**
+            Free a block of memory using TLSF. If this leaves the chunk it was allocated from completely free, the chunk is returned to the memory pool, unless it is kept as the reserve chunk.
+            IMPORTANT: Don't call this directly. Use the YOJIMBO_DELETE or YOJIMBO_FREE macros instead, because they automatically pass in the source filename and line number for you.
+            @param p Pointer to the block of memory to free. Must be non-NULL block of memory that was allocated with this allocator. Will assert otherwise.
+            @param file The source code filename that is performing the free. Used for tracking allocations and reporting on memory leaks.
+            @param line The line number in the source code file that is performing the free.
+         */
+
+        void Free( void * p, const char * file, int line );
+
+        /**
+            Get the number of bytes this allocator has taken from the memory pool.
+            @returns The total size of the chunks held by this allocator (bytes).
+         */
+
+        size_t GetCommittedBytes() const { return m_committedBytes; }
+
+        /**
+            Get the cap on the number of bytes this allocator can take from the memory pool.
+            @returns The cap passed in to the constructor (bytes).
+         */
+
+        size_t GetMaxBytes() const { return m_maxBytes; }
+
+    private:
+
+        bool AddChunk( size_t bytes );
+
+        void ReleaseChunk( int index );
+
+        int FindChunk( void * p ) const;
+
+        MemoryPool * m_pool;                                    ///< The memory pool chunks are taken from.
+        size_t m_maxBytes;                                      ///< The maximum number of bytes taken from the memory pool.
+        size_t m_committedBytes;                                ///< The number of bytes currently taken from the memory pool.
+        struct PooledChunk ** m_chunks;                         ///< Chunks taken from the memory pool, sorted by address so the chunk an allocation belongs to is found with a binary search. Stored in the chunk holding the TLSF control structure.
+        int m_numChunks;                                        ///< Number of chunks taken from the memory pool.
+        int m_maxChunks;                                        ///< Capacity of the chunk array. Every chunk is at least one page, so this is the cap divided by the page size.
+        int m_numEmptyChunks;                                   ///< Number of chunks other than the control chunk with no allocations in them. At most one is kept in reserve.
+        tlsf_t m_tlsf;                                          ///< The TLSF allocator instance backing this allocator.
+
+        TLSF_PooledAllocator( const TLSF_PooledAllocator & other );
+        TLSF_PooledAllocator & operator = ( const TLSF_PooledAllocator & other );
+    };
+
     /**
         Generate cryptographically secure random data.
         @param data The buffer to store the random data.
@@ -772,6 +967,91 @@ namespace yojimbo
         return a + r;
     }
 
+    /**
+        Small and fast pseudo random number generator with its own state (PCG32).
+        Unlike random_int and random_float, the numbers generated depend only on the seed, so they are reproducible and unaffected by calls to rand() elsewhere in the program.
+        See http://www.pcg-random.org
+        IMPORTANT: This is not a cryptographically secure random. It's used in the network simulator.
+     */
+
+    class RandomGenerator
+    {
+    public:
+
+        /**
+            Create a random generator.
+            @param seed The seed value.
+            @param stream Selects one of 2^63 independent sequences. Generators with the same seed but different streams generate unrelated numbers.
+         */
+
+        explicit RandomGenerator( uint64_t seed = 0, uint64_t stream = 0 )
+        {
+            Seed( seed, stream );
+        }
+
+        /**
+            Reset the generator to the start of the sequence for a seed.
+            @param seed The seed value.
+            @param stream Selects one of 2^63 independent sequences.
+         */
+
+        void Seed( uint64_t seed, uint64_t stream = 0 )
+        {
+            m_state = 0;
+            m_increment = ( stream << 1 ) | 1;
+            NextUint32();
+            m_state += seed;
+            NextUint32();
+        }
+
+        /**
+            Generate a random 32 bit unsigned integer.
+            @returns A pseudo random integer value in [0,2^32-1].
+         */
+
+        uint32_t NextUint32()
+        {
+            const uint64_t previous = m_state;
+            m_state = previous * 6364136223846793005ULL + m_increment;
+            const uint32_t xorshifted = uint32_t( ( ( previous >> 18 ) ^ previous ) >> 27 );
+            const uint32_t rotation = uint32_t( previous >> 59 );
+            return ( xorshifted >> rotation ) | ( xorshifted << ( ( 32 - rotation ) & 31 ) );
+        }
+
+        /**
+            Generate a random integer between a and b (inclusive).
+            @param a The minimum integer value to generate.
+            @param b The maximum integer value to generate.
+            @returns A pseudo random integer value in [a,b].
+         */
+
+        int NextInt( int a, int b )
+        {
+            yojimbo_assert( a <= b );
+            const uint64_t range = uint64_t( int64_t( b ) - int64_t( a ) ) + 1;
+            return int( int64_t( a ) + int64_t( ( NextUint32() * range ) >> 32 ) );
+        }
+
+        /**
+            Generate a random float between a and b.
+            @param a The minimum float value to generate.
+            @param b The maximum float value to generate.
+            @returns A pseudo random float value in [a,b). Never b, so "NextFloat( 0.0f, 100.0f ) < percent" is always false for 0% and always true for 100%.
+         */
+
+        float NextFloat( float a, float b )
+        {
+            yojimbo_assert( a < b );
+            const float random = float( NextUint32() >> 8 ) * ( 1.0f / 16777216.0f );
+            return a + random * ( b - a );
+        }
+
+    private:
+
+        uint64_t m_state;                                       ///< Generator state. Advances with each number generated.
+        uint64_t m_increment;                                   ///< Odd increment selecting the stream.
+    };
+
     /**
         Calculates the population count of an unsigned 32 bit integer at compile time.
         Population count is the number of bits in the integer that set to 1.
@@ -1649,6 +1929,87 @@ namespace yojimbo
             m_bitsWritten += bits;
         }
 
+        /**
+            Write an array of values that all have the same number of bits.
+            Produces exactly the same bit stream as calling BitWriter::WriteBits for each value, but faster for values of 16 bits or less.
+            Those values are packed into 64 bit groups first, with independent shifts, so there is only one shift into the scratch and one flush check per group instead of per value. Full scratch values are flushed to memory 64 bits at a time.
+            Wider values only fit two to a group, which measured slower than writing them one at a time, so they go through BitWriter::WriteBits.
+            @param values The integer values to write to the buffer. Each must be in [0,(1<<bits)-1].
+            @param numValues The number of values to write.
+            @param bits The number of bits to encode each value with, in [1,32].
+            @see BitReader::ReadBitsArray
+         */
+
+        void WriteBitsArray( const uint32_t * values, int numValues, int bits )
+        {
+            yojimbo_assert( values || numValues == 0 );
+            yojimbo_assert( numValues >= 0 );
+            yojimbo_assert( bits > 0 );
+            yojimbo_assert( bits <= 32 );
+            yojimbo_assert( int64_t( m_bitsWritten ) + int64_t( numValues ) * bits <= m_numBits );
+            yojimbo_assert( m_scratchBits < 32 );
+
+            int i = 0;
+
+            if ( bits <= 16 )
+            {
+                const int valuesPerGroup = 64 / bits;
+                const int groupBits = valuesPerGroup * bits;
+
+                uint64_t scratch = m_scratch;
+                int scratchBits = m_scratchBits;
+                int wordIndex = m_wordIndex;
+
+                for ( ; i + valuesPerGroup <= numValues; i += valuesPerGroup )
+                {
+                    uint64_t group = 0;
+                    for ( int j = 0; j < valuesPerGroup; ++j )
+                    {
+                        yojimbo_assert( uint64_t( values[i+j] ) <= ( ( 1ULL << bits ) - 1 ) );
+                        group |= uint64_t( values[i+j] ) << ( j * bits );
+                    }
+
+                    // scratch holds less than 32 bits here, so at most 64 bits are flushed, and less than 32 bits are left over
+
+                    const uint64_t overflow = scratchBits ? ( group >> ( 64 - scratchBits ) ) : 0;
+                    scratch |= group << scratchBits;
+                    scratchBits += groupBits;
+
+                    if ( scratchBits >= 64 )
+                    {
+#if YOJIMBO_LITTLE_ENDIAN
+                        memcpy( &m_data[wordIndex], &scratch, 8 );
+#else // #if YOJIMBO_LITTLE_ENDIAN
+                        m_data[wordIndex] = host_to_network( uint32_t( scratch & 0xFFFFFFFF ) );
+                        m_data[wordIndex+1] = host_to_network( uint32_t( scratch >> 32 ) );
+#endif // #if YOJIMBO_LITTLE_ENDIAN
+                        wordIndex += 2;
+                        scratch = overflow;
+                        scratchBits -= 64;
+                    }
+                    else if ( scratchBits >= 32 )
+                    {
+                        m_data[wordIndex] = host_to_network( uint32_t( scratch & 0xFFFFFFFF ) );
+                        wordIndex++;
+                        scratch >>= 32;
+                        scratchBits -= 32;
+                    }
+                }
+
+                m_scratch = scratch;
+                m_scratchBits = scratchBits;
+                m_wordIndex = wordIndex;
+                m_bitsWritten += i * bits;
+            }
+
+            for ( ; i < numValues; ++i )
+            {
+                WriteBits( values[i], bits );
+            }
+
+            yojimbo_assert( m_wordIndex <= m_numWords );
+        }
+
         /**
             Write an alignment to the bit stream, padding zeros so the bit index becomes is a multiple of 8.
             This is useful if you want to write some data to a packet that should be byte aligned. For example, an array of bytes, or a string.
@@ -1884,6 +2245,78 @@ namespace yojimbo
             return output;
         }
 
+        /**
+            Read an array of values that all have the same number of bits.
+            Reads exactly the same bit stream as calling BitReader::ReadBits for each value, but faster.
+            On little endian hosts each value is read with an unaligned 64 bit load at its own bit position, so values don't depend on each other and the scratch is only rebuilt once at the end. Values too close to the end of the buffer for a 64 bit load are read with BitReader::ReadBits.
+            @param values The array to read the values into.
+            @param numValues The number of values to read.
+            @param bits The number of bits each value was encoded with, in [1,32].
+            @see BitWriter::WriteBitsArray
+         */
+
+        void ReadBitsArray( uint32_t * values, int numValues, int bits )
+        {
+            yojimbo_assert( values || numValues == 0 );
+            yojimbo_assert( numValues >= 0 );
+            yojimbo_assert( bits > 0 );
+            yojimbo_assert( bits <= 32 );
+            yojimbo_assert( int64_t( m_bitsRead ) + int64_t( numValues ) * bits <= m_numBits );
+
+            int i = 0;
+
+#if YOJIMBO_LITTLE_ENDIAN
+
+            // the buffer is rounded up to the next dword in memory, so 64 bit loads are safe up to that point
+
+            const uint8_t * data = (const uint8_t*) m_data;
+            const int64_t bufferBytes = ( ( m_numBytes + 3 ) / 4 ) * 4;
+            const uint64_t mask = ( uint64_t(1) << bits ) - 1;
+
+            const int64_t lastBitIndex = ( bufferBytes - 8 ) * 8 + 7;
+
+            int numFastValues = 0;
+            if ( lastBitIndex >= m_bitsRead )
+                numFastValues = (int) yojimbo_min( int64_t( numValues ), ( lastBitIndex - m_bitsRead ) / bits + 1 );
+
+            const int64_t startBitIndex = m_bitsRead;
+
+            for ( ; i < numFastValues; ++i )
+            {
+                const int64_t bitIndex = startBitIndex + int64_t( i ) * bits;
+                uint64_t value;
+                memcpy( &value, data + ( bitIndex >> 3 ), 8 );
+                values[i] = uint32_t( ( value >> ( bitIndex & 7 ) ) & mask );
+            }
+
+            if ( i > 0 )
+            {
+                // rebuild the scratch so it holds the rest of the current dword, exactly as if ReadBits had been called for each value
+
+                m_bitsRead = (int) ( startBitIndex + int64_t( i ) * bits );
+                m_wordIndex = m_bitsRead / 32;
+                const int bitsUsed = m_bitsRead % 32;
+                if ( bitsUsed != 0 )
+                {
+                    m_scratch = uint64_t( m_data[m_wordIndex] ) >> bitsUsed;
+                    m_scratchBits = 32 - bitsUsed;
+                    m_wordIndex++;
+                }
+                else
+                {
+                    m_scratch = 0;
+                    m_scratchBits = 0;
+                }
+            }
+
+#endif // #if YOJIMBO_LITTLE_ENDIAN
+
+            for ( ; i < numValues; ++i )
+            {
+                values[i] = ReadBits( bits );
+            }
+        }
+
         /**
             Read an align.
             Call this on read to correspond to a WriteAlign call when the bitpacked buffer was written. 
@@ -2013,6 +2446,8 @@ namespace yojimbo
     // #define yojimbo_getvarint yojimbo_get_varint
     // #define yojimbo_putvarint yojimbo_put_varint
 
+    class BaselineStore;
+
     /** 
         Functionality common to all stream classes.
      */
@@ -2026,7 +2461,7 @@ namespace yojimbo
             @param allocator The allocator to use for stream allocations. This lets you dynamically allocate memory as you read and write packets.
          */
 
-        explicit BaseStream( Allocator & allocator ) : m_allocator( &allocator ), m_context( NULL ) {}
+        explicit BaseStream( Allocator & allocator ) : m_allocator( &allocator ), m_context( NULL ), m_baselineStore( NULL ) {}
 
         /**
             Set a context on the stream.
@@ -2065,10 +2500,33 @@ namespace yojimbo
             return *m_allocator;
         }
 
+        /**
+            Set the baseline store on the stream.
+            The connection sets this when it reads packets, so baseline messages can find the baseline they were written relative to.
+            @param baselineStore The baseline store. May be NULL.
+            @see BaselineMessage
+         */
+
+        void SetBaselineStore( BaselineStore * baselineStore )
+        {
+            m_baselineStore = baselineStore;
+        }
+
+        /**
+            Get the baseline store set on the stream.
+            @returns The baseline store. May be NULL.
+         */
+
+        BaselineStore * GetBaselineStore() const
+        {
+            return m_baselineStore;
+        }
+
     private:
 
         Allocator * m_allocator;                    ///< The allocator passed into the constructor.
         void * m_context;                           ///< The context pointer set on the stream. May be NULL.
+        BaselineStore * m_baselineStore;            ///< The baseline store used to look up baselines when reading baseline messages. May be NULL.
     };
 
     /**
@@ -2162,6 +2620,23 @@ namespace yojimbo
             return true;
         }
 
+        /**
+            Serialize an array of values with the same number of bits (write).
+            @param values The unsigned integer values to serialize. Each must be in range [0,(1<<bits)-1].
+            @param numValues The number of values to write.
+            @param bits The number of bits to write per-value in [1,32].
+            @returns Always returns true. All checking is performed by debug asserts on write.
+            @see BitWriter::WriteBitsArray
+         */
+
+        bool SerializeBitsArray( const uint32_t * values, int numValues, int bits )
+        {
+            yojimbo_assert( bits > 0 );
+            yojimbo_assert( bits <= 32 );
+            m_writer.WriteBitsArray( values, numValues, bits );
+            return true;
+        }
+
         /**
             Serialize an array of bytes (write).
             @param data Array of bytes to be written.
@@ -2369,6 +2844,25 @@ namespace yojimbo
             return true;
         }
 
+        /**
+            Serialize an array of values with the same number of bits (read).
+            @param values The integer values read are stored here. Each will be in range [0,(1<<bits)-1].
+            @param numValues The number of values to read.
+            @param bits The number of bits to read per-value in [1,32].
+            @returns Returns true if the serialize read succeeded, false otherwise.
+            @see BitReader::ReadBitsArray
+         */
+
+        bool SerializeBitsArray( uint32_t * values, int numValues, int bits )
+        {
+            yojimbo_assert( bits > 0 );
+            yojimbo_assert( bits <= 32 );
+            if ( numValues < 0 || int64_t( numValues ) * bits > m_reader.GetBitsRemaining() )
+                return false;
+            m_reader.ReadBitsArray( values, numValues, bits );
+            return true;
+        }
+
         /**
             Serialize an array of bytes (read).
             @param data Array of bytes to read.
@@ -2544,6 +3038,37 @@ namespace yojimbo
             return true;
         }
 
+        /**
+            Serialize an array of values with the same number of bits (measure).
+            @param values The unsigned integer values to serialize. Not actually used or checked.
+            @param numValues The number of values to 'write'.
+            @param bits The number of bits to 'write' per-value in [1,32].
+            @returns Always returns true. All checking is performed by debug asserts on write.
+         */
+
+        bool SerializeBitsArray( const uint32_t * values, int numValues, int bits )
+        {
+            (void) values;
+            yojimbo_assert( numValues >= 0 );
+            yojimbo_assert( bits > 0 );
+            yojimbo_assert( bits <= 32 );
+            m_bitsWritten += numValues * bits;
+            return true;
+        }
+
+        /**
+            Account for an object with a static serialized size (measure).
+            @param bits The number of bits the object takes when serialized. See YOJIMBO_STATIC_SERIALIZED_BITS.
+            @returns Always returns true.
+         */
+
+        bool SerializeStaticBits( int bits )
+        {
+            yojimbo_assert( bits >= 0 );
+            m_bitsWritten += bits;
+            return true;
+        }
+
         /**
             Serialize an array of bytes (measure).
             @param data Array of bytes to 'write'. Not actually used.
@@ -3134,26 +3659,200 @@ namespace yojimbo
             }                                                                       \
         } while (0)
 
-    template <typename Stream> bool serialize_string_internal( Stream & stream, char * string, int buffer_size )
-    {
-        int length = 0;
-        if ( Stream::IsWriting )
-        {
-            length = (int) strlen( string );
-            yojimbo_assert( length < buffer_size );
-        }
-        serialize_int( stream, length, 0, buffer_size - 1 );
-        serialize_bytes( stream, (uint8_t*)string, length );
-        if ( Stream::IsReading )
-        {
-            string[length] = '\0';
-        }
-        return true;
-    }
-
     /**
-        Serialize a string to the stream (read/write/measure).
-        This is a helper macro to make writing unified serialize functions easier.
+        Convert signed integers in [min,max] to unsigned offsets from min, ready to be bitpacked.
+        Uses SSE2 or AVX2 when available.
+        @param values The integer values to convert. Each must be in [min,max].
+        @param offsetValues The offsets from min are stored here.
+        @param numValues The number of values.
+        @param min The minimum value.
+     */
+
+    void offset_int_array( const int32_t * values, uint32_t * offsetValues, int numValues, int32_t min );
+
+    /**
+        Convert unsigned offsets from min back to signed integers, checking they are in [min,max].
+        Uses SSE2 or AVX2 when available.
+        @param offsetValues The offsets from min, as read from the stream.
+        @param values The integer values are stored here.
+        @param numValues The number of values.
+        @param min The minimum value.
+        @param max The maximum value.
+        @returns True if all values are in [min,max], false otherwise. Values read from the network may be out of range if the packet is malicious.
+     */
+
+    bool unoffset_int_array( const uint32_t * offsetValues, int32_t * values, int numValues, int32_t min, int32_t max );
+
+    /**
+        Quantize floating point values in [min,max] to integers in [0,maxQuantized].
+        Values outside [min,max] are clamped. Uses SSE2 or AVX2 when available.
+        @param values The floating point values to quantize.
+        @param quantizedValues The quantized values are stored here.
+        @param numValues The number of values.
+        @param min The minimum value.
+        @param max The maximum value.
+        @param maxQuantized The quantized value that max maps to. Must be less than 2^24, so every quantized value is exactly representable as a float.
+     */
+
+    void quantize_float_array( const float * values, uint32_t * quantizedValues, int numValues, float min, float max, uint32_t maxQuantized );
+
+    /**
+        Convert quantized integers in [0,maxQuantized] back to floating point values in [min,max].
+        Uses SSE2 or AVX2 when available.
+        @param quantizedValues The quantized values. Each must be in [0,maxQuantized].
+        @param values The floating point values are stored here.
+        @param numValues The number of values.
+        @param min The minimum value.
+        @param max The maximum value.
+        @param maxQuantized The quantized value that max maps to. Must be less than 2^24.
+     */
+
+    void dequantize_float_array( const uint32_t * quantizedValues, float * values, int numValues, float min, float max, uint32_t maxQuantized );
+
+    /**
+        Serialize an array of unsigned integer values with the same number of bits (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Much faster than calling serialize_bits for each value, because the whole array is bitpacked at once. The bits written are identical.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param values Pointer to the uint32_t array to serialize.
+        @param num_values The number of values in the array.
+        @param bits The number of bits to serialize per-value in [1,32].
+     */
+
+    #define serialize_bits_array( stream, values, num_values, bits )                \
+        do                                                                          \
+        {                                                                           \
+            yojimbo_assert( bits > 0 );                                             \
+            yojimbo_assert( bits <= 32 );                                           \
+            if ( !stream.SerializeBitsArray( values, num_values, bits ) )           \
+            {                                                                       \
+                return false;                                                       \
+            }                                                                       \
+        } while (0)
+
+    template <typename Stream> bool serialize_int_array_internal( Stream & stream, int32_t * values, int numValues, int32_t min, int32_t max )
+    {
+        yojimbo_assert( min < max );
+        yojimbo_assert( numValues >= 0 );
+        const int bits = bits_required( min, max );
+        uint32_t offsetValues[SerializeArrayBatchSize];
+        for ( int i = 0; i < numValues; i += SerializeArrayBatchSize )
+        {
+            const int batchSize = yojimbo_min( numValues - i, SerializeArrayBatchSize );
+            if ( Stream::IsWriting )
+            {
+#ifndef NDEBUG
+                for ( int j = 0; j < batchSize; ++j )
+                {
+                    yojimbo_assert( values[i+j] >= min );
+                    yojimbo_assert( values[i+j] <= max );
+                }
+#endif // #ifndef NDEBUG
+                offset_int_array( values + i, offsetValues, batchSize, min );
+            }
+            if ( !stream.SerializeBitsArray( offsetValues, batchSize, bits ) )
+                return false;
+            if ( Stream::IsReading )
+            {
+                if ( !unoffset_int_array( offsetValues, values + i, batchSize, min, max ) )
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+        Serialize an array of integer values with the same range (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Writes exactly the same bits as calling serialize_int for each value, but converts and bitpacks the values in batches with SIMD kernels.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param values Pointer to the int32_t array to serialize. Each value must be in [min,max].
+        @param num_values The number of values in the array.
+        @param min The minimum value.
+        @param max The maximum value.
+     */
+
+    #define serialize_int_array( stream, values, num_values, min, max )                             \
+        do                                                                                          \
+        {                                                                                           \
+            if ( !yojimbo::serialize_int_array_internal( stream, values, num_values, min, max ) )   \
+            {                                                                                       \
+                return false;                                                                       \
+            }                                                                                       \
+        } while (0)
+
+    template <typename Stream> bool serialize_quantized_float_array_internal( Stream & stream, float * values, int numValues, float min, float max, int bits )
+    {
+        yojimbo_assert( min < max );
+        yojimbo_assert( numValues >= 0 );
+        yojimbo_assert( bits > 0 );
+        yojimbo_assert( bits <= 24 );
+        const uint32_t maxQuantized = ( 1U << bits ) - 1;
+        uint32_t quantizedValues[SerializeArrayBatchSize];
+        for ( int i = 0; i < numValues; i += SerializeArrayBatchSize )
+        {
+            const int batchSize = yojimbo_min( numValues - i, SerializeArrayBatchSize );
+            if ( Stream::IsWriting )
+            {
+                quantize_float_array( values + i, quantizedValues, batchSize, min, max, maxQuantized );
+            }
+            if ( !stream.SerializeBitsArray( quantizedValues, batchSize, bits ) )
+                return false;
+            if ( Stream::IsReading )
+            {
+                dequantize_float_array( quantizedValues, values + i, batchSize, min, max, maxQuantized );
+            }
+        }
+        return true;
+    }
+
+    /**
+        Serialize an array of floating point values, quantized to a fixed number of bits over [min,max] (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Values outside [min,max] are clamped on write. The values read back are within (max-min)/(2^bits-1)/2 of the values written. Quantization is done in batches with SIMD kernels.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param values Pointer to the float array to serialize.
+        @param num_values The number of values in the array.
+        @param min The minimum value.
+        @param max The maximum value.
+        @param bits The number of bits to serialize per-value in [1,24].
+     */
+
+    #define serialize_quantized_float_array( stream, values, num_values, min, max, bits )                           \
+        do                                                                                                          \
+        {                                                                                                           \
+            if ( !yojimbo::serialize_quantized_float_array_internal( stream, values, num_values, min, max, bits ) ) \
+            {                                                                                                       \
+                return false;                                                                                       \
+            }                                                                                                       \
+        } while (0)
+
+    template <typename Stream> bool serialize_string_internal( Stream & stream, char * string, int buffer_size )
+    {
+        int length = 0;
+        if ( Stream::IsWriting )
+        {
+            length = (int) strlen( string );
+            yojimbo_assert( length < buffer_size );
+        }
+        serialize_int( stream, length, 0, buffer_size - 1 );
+        serialize_bytes( stream, (uint8_t*)string, length );
+        if ( Stream::IsReading )
+        {
+            string[length] = '\0';
+        }
+        return true;
+    }
+
+    /**
+        Serialize a string to the stream (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
         Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
         IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
         @param stream The stream object. May be a read, write or measure stream.
@@ -3204,6 +3903,90 @@ namespace yojimbo
             }                                                                               \
         } while (0)
 
+    /**
+        Helper macro to declare that a type always serializes to the same number of bits, known at compile time.
+        Use it inside any class or struct with a templated serialize function. The size is usually a sum of constants like yojimbo::BitsRequired<min,max>::result, eg. YOJIMBO_STATIC_SERIALIZED_BITS( ( 16 + BitsRequired<0,255>::result ) ). Note the extra parentheses, which stop the comma in the template arguments from splitting the macro argument.
+        serialize_object adds this size to a measure stream instead of running the serialize function, and message types that use it skip measurement in the channels (see Message::GetSerializedBits).
+        IMPORTANT: The size must not be smaller than the number of bits actually written by the serialize function, including worst case alignment. This is checked in debug builds.
+        @param num_bits The number of bits the object takes when serialized. Must be a compile time constant.
+        @see yojimbo::StaticSerializedBits
+     */
+
+    #define YOJIMBO_STATIC_SERIALIZED_BITS( num_bits )                                                          \
+        enum { StaticSerializedBits = (num_bits) };                                                             \
+        int GetFixedSerializedBits() const { return StaticSerializedBits; }
+
+    /**
+        Determines at compile time whether a type declares its serialized size with YOJIMBO_STATIC_SERIALIZED_BITS.
+        @see yojimbo::StaticSerializedBits
+     */
+
+    template <typename T> struct HasStaticSerializedBits
+    {
+        typedef char Yes[1];
+        typedef char No[2];
+
+        template <typename U> static Yes & Test( char (*)[U::StaticSerializedBits + 1] );
+        template <typename U> static No & Test( ... );
+
+        enum { result = sizeof( Test<T>( 0 ) ) == sizeof( Yes ) };
+    };
+
+    template <typename T, bool HasStaticSize> struct StaticSerializedBitsHelper
+    {
+        enum { result = -1 };
+    };
+
+    template <typename T> struct StaticSerializedBitsHelper<T,true>
+    {
+        enum { result = T::StaticSerializedBits };
+    };
+
+    /**
+        Gets the number of bits a type takes when serialized at compile time.
+        The result is -1 if the type does not declare its size with YOJIMBO_STATIC_SERIALIZED_BITS.
+        @see yojimbo::HasStaticSerializedBits
+     */
+
+    template <typename T> struct StaticSerializedBits
+    {
+        enum { result = StaticSerializedBitsHelper<T, HasStaticSerializedBits<T>::result != 0>::result };
+    };
+
+    /**
+        Serialize an object to the stream (read/write).
+        @param stream The stream object.
+        @param object The object to serialize. Must have a serialize method on it.
+        @returns True if the object serialized successfully, false otherwise.
+     */
+
+    template <typename Stream, typename T> bool serialize_object_internal( Stream & stream, T & object )
+    {
+        return object.Serialize( stream );
+    }
+
+    /**
+        Serialize an object to the stream (measure).
+        Objects that declare their size with YOJIMBO_STATIC_SERIALIZED_BITS are measured without running their serialize function.
+        @param stream The measure stream.
+        @param object The object to measure. Must have a serialize method on it.
+        @returns True if the object measured successfully, false otherwise.
+     */
+
+    template <typename T> bool serialize_object_internal( MeasureStream & stream, T & object )
+    {
+        const int staticBits = StaticSerializedBits<T>::result;
+        if ( staticBits < 0 )
+            return object.Serialize( stream );
+#if YOJIMBO_DEBUG_MESSAGE_BUDGET
+        MeasureStream measureStream( stream.GetAllocator() );
+        measureStream.SetContext( stream.GetContext() );
+        object.Serialize( measureStream );
+        yojimbo_assert( measureStream.GetBitsProcessed() <= staticBits );
+#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
+        return stream.SerializeStaticBits( staticBits );
+    }
+
     /**
         Serialize an object to the stream (read/write/measure).
         This is a helper macro to make writing unified serialize functions easier.
@@ -3216,7 +3999,7 @@ namespace yojimbo
     #define serialize_object( stream, object )                                              \
         do                                                                                  \
         {                                                                                   \
-            if ( !object.Serialize( stream ) )                                              \
+            if ( !yojimbo::serialize_object_internal( stream, object ) )                    \
             {                                                                               \
                 return false;                                                               \
             }                                                                               \
@@ -3261,6 +4044,55 @@ namespace yojimbo
             }                                                                               \
         } while (0)
 
+    /**
+        A bucket of the relative integer encoding used by serialize_int_relative.
+        The difference between the current and previous value is encoded as a unary bucket index followed by ( difference - min ) in the bucket's bits.
+     */
+
+    struct IntRelativeBucket
+    {
+        uint32_t min;                                           ///< The smallest difference encoded in this bucket.
+        uint32_t max;                                           ///< The largest difference encoded in this bucket.
+        int bits;                                               ///< The number of bits used to encode ( difference - min ) in this bucket.
+    };
+
+    /**
+        The buckets of the relative integer encoding, in order. Differences past the last bucket are written as a full 32 bit value.
+        Both serialize_int_relative_internal and int_relative_bits read this table, so the encoding and its bit cost can't get out of sync.
+     */
+
+    const IntRelativeBucket IntRelativeBuckets[] = 
+    {
+        { 1, 1, 0 },
+        { 2, 6, BitsRequired<2,6>::result },
+        { 7, 23, BitsRequired<7,23>::result },
+        { 24, 280, BitsRequired<24,280>::result },
+        { 281, 4377, BitsRequired<281,4377>::result },
+        { 4378, 69914, BitsRequired<4378,69914>::result },
+    };
+
+    const int NumIntRelativeBuckets = sizeof( IntRelativeBuckets ) / sizeof( IntRelativeBuckets[0] );
+
+    /**
+        Get the number of bits serialize_int_relative takes to encode an integer value relative to another.
+        This is exactly the number of bits written by serialize_int_relative, so it can be used to price the encoding without doing any stream work.
+        @param previous The previous integer value.
+        @param current The current integer value. Must be greater than the previous value.
+        @returns The number of bits required to encode the current value relative to the previous value.
+     */
+
+    inline int int_relative_bits( uint32_t previous, uint32_t current )
+    {
+        yojimbo_assert( previous < current );
+        const uint32_t difference = current - previous;
+        for ( int i = 0; i < NumIntRelativeBuckets; ++i )
+        {
+            if ( difference <= IntRelativeBuckets[i].max )
+                return i + 1 + IntRelativeBuckets[i].bits;
+        }
+        return NumIntRelativeBuckets + 32;
+    }
+
     template <typename Stream, typename T> bool serialize_int_relative_internal( Stream & stream, T previous, T & current )
     {
         uint32_t difference = 0;
@@ -3270,99 +4102,35 @@ namespace yojimbo
             difference = current - previous;
         }
 
-        bool oneBit = false;
-        if ( Stream::IsWriting )
-        {
-            oneBit = difference == 1;
-        }
-        serialize_bool( stream, oneBit );
-        if ( oneBit )
-        {
-            if ( Stream::IsReading )
-            {
-                current = previous + 1;
-            }
-            return true;
-        }
-        
-        bool twoBits = false;
-        if ( Stream::IsWriting )
-        {
-            twoBits = difference <= 6;
-        }
-        serialize_bool( stream, twoBits );
-        if ( twoBits )
-        {
-            serialize_int( stream, difference, 2, 6 );
-            if ( Stream::IsReading )
-            {
-                current = previous + difference;
-            }
-            return true;
-        }
-        
-        bool fourBits = false;
-        if ( Stream::IsWriting )
-        {
-            fourBits = difference <= 23;
-        }
-        serialize_bool( stream, fourBits );
-        if ( fourBits )
-        {
-            serialize_int( stream, difference, 7, 23 );
-            if ( Stream::IsReading )
-            {
-                current = previous + difference;
-            }
-            return true;
-        }
-
-        bool eightBits = false;
-        if ( Stream::IsWriting )
+        for ( int i = 0; i < NumIntRelativeBuckets; ++i )
         {
-            eightBits = difference <= 280;
-        }
-        serialize_bool( stream, eightBits );
-        if ( eightBits )
-        {
-            serialize_int( stream, difference, 24, 280 );
-            if ( Stream::IsReading )
-            {
-                current = previous + difference;
-            }
-            return true;
-        }
+            const IntRelativeBucket & bucket = IntRelativeBuckets[i];
 
-        bool twelveBits = false;
-        if ( Stream::IsWriting )
-        {
-            twelveBits = difference <= 4377;
-        }
-        serialize_bool( stream, twelveBits );
-        if ( twelveBits )
-        {
-            serialize_int( stream, difference, 281, 4377 );
-            if ( Stream::IsReading )
+            bool inBucket = false;
+            if ( Stream::IsWriting )
             {
-                current = previous + difference;
+                inBucket = difference <= bucket.max;
             }
-            return true;
-        }
-
-        bool sixteenBits = false;
-        if ( Stream::IsWriting )
-        {
-            sixteenBits = difference <= 69914;
-        }
-        serialize_bool( stream, sixteenBits );
-        if ( sixteenBits )
-        {
-            serialize_int( stream, difference, 4378, 69914 );
-            if ( Stream::IsReading )
+            serialize_bool( stream, inBucket );
+            if ( inBucket )
             {
-                current = previous + difference;
+                uint32_t offset = 0;
+                if ( bucket.bits > 0 )
+                {
+                    if ( Stream::IsWriting )
+                    {
+                        offset = difference - bucket.min;
+                    }
+                    serialize_bits( stream, offset, bucket.bits );
+                }
+                if ( Stream::IsReading )
+                {
+                    if ( offset > bucket.max - bucket.min )
+                        return false;
+                    current = previous + bucket.min + offset;
+                }
+                return true;
             }
-            return true;
         }
 
         uint32_t value = current;
@@ -3394,6 +4162,24 @@ namespace yojimbo
             }                                                                               \
         } while (0)
 
+    const int AckRelativeMaxDelta = 64;                                             ///< Acks within this many sequence numbers of the current sequence are encoded relative to it. Read by both serialize_ack_relative and ack_relative_bits.
+    const int AckRelativeDeltaBits = BitsRequired<1,AckRelativeMaxDelta>::result;   ///< The number of bits used to encode an ack delta in [1,AckRelativeMaxDelta].
+
+    /**
+        Get the number of bits serialize_ack_relative takes to encode an ack relative to the current sequence number.
+        This is exactly the number of bits written by serialize_ack_relative, so it can be used to price the encoding without doing any stream work.
+        @param sequence The current sequence number.
+        @param ack The ack sequence number. Must not be equal to the current sequence number.
+        @returns The number of bits required to encode the ack relative to the sequence number.
+     */
+
+    inline int ack_relative_bits( uint16_t sequence, uint16_t ack )
+    {
+        const int ack_delta = ( ack < sequence ) ? ( sequence - ack ) : ( (int)sequence + 65536 - ack );
+        yojimbo_assert( ack_delta > 0 );
+        return 1 + ( ( ack_delta <= AckRelativeMaxDelta ) ? AckRelativeDeltaBits : 16 );
+    }
+
     template <typename Stream> bool serialize_ack_relative_internal( Stream & stream, uint16_t sequence, uint16_t & ack )
     {
         int ack_delta = 0;
@@ -3410,12 +4196,12 @@ namespace yojimbo
             }
             yojimbo_assert( ack_delta > 0 );
             yojimbo_assert( uint16_t( sequence - ack_delta ) == ack );
-            ack_in_range = ack_delta <= 64;
+            ack_in_range = ack_delta <= AckRelativeMaxDelta;
         }
         serialize_bool( stream, ack_in_range );
         if ( ack_in_range )
         {
-            serialize_int( stream, ack_delta, 1, 64 );
+            serialize_int( stream, ack_delta, 1, AckRelativeMaxDelta );
             if ( Stream::IsReading )
             {
                 ack = sequence - ack_delta;
@@ -3447,6 +4233,19 @@ namespace yojimbo
             }                                                                                       \
         } while (0)
 
+    /**
+        Get the number of bits serialize_sequence_relative takes to encode a sequence number relative to another.
+        This is exactly the number of bits written by serialize_sequence_relative, so it can be used to price the encoding without doing any stream work.
+        @param sequence1 The first sequence number to serialize relative to.
+        @param sequence2 The second sequence number to be encoded relative to the first. Must not be equal to the first sequence number.
+        @returns The number of bits required to encode the second sequence number relative to the first.
+     */
+
+    inline int sequence_relative_bits( uint16_t sequence1, uint16_t sequence2 )
+    {
+        return int_relative_bits( sequence1, sequence2 + ( ( sequence1 > sequence2 ) ? 65536 : 0 ) );
+    }
+
     template <typename Stream> bool serialize_sequence_relative_internal( Stream & stream, uint16_t sequence1, uint16_t & sequence2 )
     {
         if ( Stream::IsWriting )
@@ -3489,18 +4288,261 @@ namespace yojimbo
             }                                                                                       \
         } while (0)
 
-    // read macros corresponding to each serialize_*. useful when you want separate read and write functions.
+    /**
+        Serialize an integer relative to a baseline value (read/write/measure).
+        A single bit is written if the value is unchanged from the baseline. Otherwise the changed bit is followed by the value, bounded to [min,max].
+        @param stream The stream object. May be a read, write or measure stream.
+        @param value The integer value to serialize. When reading, this is set to the baseline value if it is unchanged.
+        @param baseline The baseline value. Must be the same value on the reader and the writer.
+        @param min The minimum value.
+        @param max The maximum value.
+        @returns True if the serialization was successful, false otherwise.
+        @see BaselineMessage
+     */
 
-    #define read_bits( stream, value, bits )                                                \
-    do                                                                                      \
-    {                                                                                       \
-        yojimbo_assert( bits > 0 );                                                         \
-        yojimbo_assert( bits <= 32 );                                                       \
-        uint32_t uint32_value= 0;                                                           \
-        if ( !stream.SerializeBits( uint32_value, bits ) )                                  \
-        {                                                                                   \
-            return false;                                                                   \
-        }                                                                                   \
+    template <typename Stream> bool serialize_int_delta_internal( Stream & stream, int32_t & value, int32_t baseline, int32_t min, int32_t max )
+    {
+        bool changed = Stream::IsWriting && value != baseline;
+        serialize_bool( stream, changed );
+        if ( changed )
+        {
+            serialize_int( stream, value, min, max );
+        }
+        else if ( Stream::IsReading )
+        {
+            value = baseline;
+        }
+        return true;
+    }
+
+    /**
+        Serialize an integer relative to a baseline value (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param value The integer value to serialize in [min,max].
+        @param baseline The baseline value.
+        @param min The minimum value.
+        @param max The maximum value.
+     */
+
+    #define serialize_int_delta( stream, value, baseline, min, max )                                    \
+        do                                                                                          \
+        {                                                                                           \
+            int32_t int32_value = Stream::IsWriting ? (int32_t) value : 0;                          \
+            if ( !yojimbo::serialize_int_delta_internal( stream, int32_value, baseline, min, max ) ) \
+            {                                                                                       \
+                return false;                                                                       \
+            }                                                                                       \
+            value = int32_value;                                                                    \
+        } while (0)
+
+    /**
+        Serialize bits relative to a baseline value (read/write/measure).
+        @param stream The stream object. May be a read, write or measure stream.
+        @param value The unsigned integer value to serialize. When reading, this is set to the baseline value if it is unchanged.
+        @param baseline The baseline value.
+        @param bits The number of bits to serialize in [1,32].
+        @returns True if the serialization was successful, false otherwise.
+        @see BaselineMessage
+     */
+
+    template <typename Stream> bool serialize_bits_delta_internal( Stream & stream, uint32_t & value, uint32_t baseline, int bits )
+    {
+        bool changed = Stream::IsWriting && value != baseline;
+        serialize_bool( stream, changed );
+        if ( changed )
+        {
+            serialize_bits( stream, value, bits );
+        }
+        else if ( Stream::IsReading )
+        {
+            value = baseline;
+        }
+        return true;
+    }
+
+    /**
+        Serialize bits relative to a baseline value (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param value The unsigned integer value to serialize.
+        @param baseline The baseline value.
+        @param bits The number of bits to serialize in [1,32].
+     */
+
+    #define serialize_bits_delta( stream, value, baseline, bits )                                       \
+        do                                                                                          \
+        {                                                                                           \
+            uint32_t uint32_value = Stream::IsWriting ? (uint32_t) value : 0;                       \
+            if ( !yojimbo::serialize_bits_delta_internal( stream, uint32_value, baseline, bits ) )  \
+            {                                                                                       \
+                return false;                                                                       \
+            }                                                                                       \
+            value = uint32_value;                                                                   \
+        } while (0)
+
+    /**
+        Serialize a floating point value relative to a baseline value (read/write/measure).
+        The value is compared bitwise with the baseline, so it is only sent when its representation changes.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param value The float value to serialize. When reading, this is set to the baseline value if it is unchanged.
+        @param baseline The baseline value.
+        @returns True if the serialization was successful, false otherwise.
+        @see BaselineMessage
+     */
+
+    template <typename Stream> bool serialize_float_delta_internal( Stream & stream, float & value, float baseline )
+    {
+        uint32_t int_value = 0;
+        uint32_t int_baseline;
+        if ( Stream::IsWriting )
+        {
+            memcpy( &int_value, &value, 4 );
+        }
+        memcpy( &int_baseline, &baseline, 4 );
+        if ( !serialize_bits_delta_internal( stream, int_value, int_baseline, 32 ) )
+            return false;
+        if ( Stream::IsReading )
+        {
+            memcpy( &value, &int_value, 4 );
+        }
+        return true;
+    }
+
+    /**
+        Serialize a floating point value relative to a baseline value (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param value The float value to serialize.
+        @param baseline The baseline value.
+     */
+
+    #define serialize_float_delta( stream, value, baseline )                                            \
+        do                                                                                          \
+        {                                                                                           \
+            if ( !yojimbo::serialize_float_delta_internal( stream, value, baseline ) )              \
+            {                                                                                       \
+                return false;                                                                       \
+            }                                                                                       \
+        } while (0)
+
+    /**
+        Serialize an array of integers relative to an array of baseline values (read/write/measure).
+        Writes one bit if no values changed. Otherwise writes a mask with one bit per value, followed by only the values that changed, each bounded to [min,max].
+        This is the common case for snapshots, where most entities have not changed since the baseline.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param values The integer values to serialize. When reading, values that did not change are set to their baseline values.
+        @param baselineValues The baseline values. Must be the same values on the reader and the writer.
+        @param numValues The number of values.
+        @param min The minimum value.
+        @param max The maximum value.
+        @returns True if the serialization was successful, false otherwise.
+        @see BaselineMessage
+     */
+
+    template <typename Stream> bool serialize_int_array_delta_internal( Stream & stream, int32_t * values, const int32_t * baselineValues, int numValues, int32_t min, int32_t max )
+    {
+        yojimbo_assert( values );
+        yojimbo_assert( baselineValues );
+        yojimbo_assert( numValues >= 0 );
+
+        bool anyChanged = false;
+        if ( Stream::IsWriting )
+        {
+            for ( int i = 0; i < numValues; ++i )
+            {
+                if ( values[i] != baselineValues[i] )
+                {
+                    anyChanged = true;
+                    break;
+                }
+            }
+        }
+
+        serialize_bool( stream, anyChanged );
+
+        if ( !anyChanged )
+        {
+            if ( Stream::IsReading )
+            {
+                for ( int i = 0; i < numValues; ++i )
+                    values[i] = baselineValues[i];
+            }
+            return true;
+        }
+
+        for ( int base = 0; base < numValues; base += 32 )
+        {
+            const int count = yojimbo_min( 32, numValues - base );
+
+            uint32_t changedMask = 0;
+            if ( Stream::IsWriting )
+            {
+                for ( int i = 0; i < count; ++i )
+                {
+                    if ( values[base+i] != baselineValues[base+i] )
+                        changedMask |= 1U << i;
+                }
+            }
+
+            serialize_bits( stream, changedMask, count );
+
+            for ( int i = 0; i < count; ++i )
+            {
+                if ( changedMask & ( 1U << i ) )
+                {
+                    serialize_int( stream, values[base+i], min, max );
+                }
+                else if ( Stream::IsReading )
+                {
+                    values[base+i] = baselineValues[base+i];
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+        Serialize an array of integers relative to an array of baseline values (read/write/measure).
+        This is a helper macro to make writing unified serialize functions easier.
+        Serialize macros returns false on error so we don't need to use exceptions for error handling on read. This is an important safety measure because packet data comes from the network and may be malicious.
+        IMPORTANT: This macro must be called inside a templated serialize function with template \<typename Stream\>. The serialize method must have a bool return value.
+        @param stream The stream object. May be a read, write or measure stream.
+        @param values The array of int32_t values to serialize.
+        @param baselineValues The array of int32_t baseline values.
+        @param numValues The number of values.
+        @param min The minimum value.
+        @param max The maximum value.
+     */
+
+    #define serialize_int_array_delta( stream, values, baselineValues, numValues, min, max )                        \
+        do                                                                                                      \
+        {                                                                                                       \
+            if ( !yojimbo::serialize_int_array_delta_internal( stream, values, baselineValues, numValues, min, max ) ) \
+            {                                                                                                   \
+                return false;                                                                                   \
+            }                                                                                                   \
+        } while (0)
+
+    // read macros corresponding to each serialize_*. useful when you want separate read and write functions.
+
+    #define read_bits( stream, value, bits )                                                \
+    do                                                                                      \
+    {                                                                                       \
+        yojimbo_assert( bits > 0 );                                                         \
+        yojimbo_assert( bits <= 32 );                                                       \
+        uint32_t uint32_value= 0;                                                           \
+        if ( !stream.SerializeBits( uint32_value, bits ) )                                  \
+        {                                                                                   \
+            return false;                                                                   \
+        }                                                                                   \
         value = uint32_value;                                                               \
     } while (0)
 
@@ -3661,10 +4703,11 @@ namespace yojimbo
             Message constructor.
             Don't call this directly, use a message factory instead.
             @param blockMessage 1 if this is a block message, 0 otherwise.
+            @param baselineMessage 1 if this is a baseline message, 0 otherwise.
             @see MessageFactory::Create
          */
 
-        Message( int blockMessage = 0 ) : m_refCount(1), m_id(0), m_type(0), m_blockMessage( blockMessage ) {}
+        Message( int blockMessage = 0, int baselineMessage = 0 ) : m_refCount(1), m_id(0), m_type(0), m_blockMessage( blockMessage ), m_baselineMessage( baselineMessage ), m_serializedBits(-1) {}
 
         /** 
             Set the message id.
@@ -3709,6 +4752,60 @@ namespace yojimbo
 
         bool IsBlockMessage() const { return m_blockMessage; }
 
+        /**
+            Is this a baseline message?
+            Baseline messages are of type BaselineMessage and can be serialized relative to a baseline the other side has already received.
+            @returns True if this is a baseline message, false otherwise.
+            @see BaselineMessage.
+         */
+
+        bool IsBaselineMessage() const { return m_baselineMessage; }
+
+        /**
+            Get the number of bits this message takes when serialized.
+            Message types that declare a fixed size with YOJIMBO_STATIC_SERIALIZED_BITS return that size without running any serialize code.
+            Otherwise the message is measured with a MeasureStream the first time this is called, and the result is cached on the message, so each message is measured at most once no matter how many times it is considered for inclusion in a packet.
+            IMPORTANT: Don't modify a message after sending it, or the cached size will no longer match what is written.
+            This does not include the message type or any block attached to the message. Those are accounted for by the channel.
+            @param allocator The allocator passed to the measure stream.
+            @param context The context passed to the measure stream. The same context that is passed to the stream when the message is written.
+            @returns The number of bits the message takes when serialized. This is a conservative estimate if the message serializes with alignment. See MeasureStream::SerializeAlign.
+         */
+
+        int GetSerializedBits( Allocator & allocator, void * context )
+        {
+            if ( m_serializedBits < 0 )
+            {
+                m_serializedBits = GetFixedSerializedBits();
+                if ( m_serializedBits < 0 )
+                {
+                    MeasureStream measureStream( allocator );
+                    measureStream.SetContext( context );
+                    SerializeInternal( measureStream );
+                    m_serializedBits = measureStream.GetBitsProcessed();
+                }
+#if YOJIMBO_DEBUG_MESSAGE_BUDGET
+                else
+                {
+                    MeasureStream measureStream( allocator );
+                    measureStream.SetContext( context );
+                    SerializeInternal( measureStream );
+                    yojimbo_assert( measureStream.GetBitsProcessed() <= m_serializedBits );
+                }
+#endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
+            }
+            return m_serializedBits;
+        }
+
+        /**
+            Get the fixed number of bits this message type takes when serialized.
+            Don't override this method directly, instead, use the YOJIMBO_STATIC_SERIALIZED_BITS macro in your derived message class to declare a fixed size for message types that always serialize to the same number of bits.
+            @returns The fixed number of bits for this message type, or -1 if the message must be measured.
+            @see Message::GetSerializedBits
+         */
+
+        virtual int GetFixedSerializedBits() const { return -1; }
+
         /**
             Virtual serialize function (read).
             Reads the message in from a bitstream.
@@ -3747,7 +4844,15 @@ namespace yojimbo
             @param type The message type.
          */
 
-        void SetType( int type ) { m_type = type; }
+        void SetType( int type ) { yojimbo_assert( type >= 0 ); yojimbo_assert( type < MaxMessageTypes ); m_type = type; }
+
+        /**
+            Forget the cached serialized size of the message, so it is measured again the next time it is needed.
+            Call this whenever something changes how the message serializes, for example attaching or clearing a baseline.
+            @see Message::GetSerializedBits
+         */
+
+        void ResetSerializedBits() { m_serializedBits = -1; }
 
         /**
             Add a reference to the message.
@@ -3784,8 +4889,10 @@ namespace yojimbo
 
         int m_refCount;                             ///< Number of references on this message object. Starts at 1. Message is destroyed when it reaches 0.
         uint32_t m_id : 16;                         ///< The message id. For messages sent over reliable-ordered channels, this starts at 0 and increases with each message sent. For unreliable-unordered channels this is set to the sequence number of the packet the message was included in.
-        uint32_t m_type : 15;                       ///< The message type. Corresponds to the type integer used when the message was created though the message factory.
+        uint32_t m_type : MessageTypeBits;          ///< The message type. Corresponds to the type integer used when the message was created though the message factory.
         uint32_t m_blockMessage : 1;                ///< 1 if this is a block message. 0 otherwise. If 1 then you can cast the Message* to BlockMessage*. Lightweight RTTI.
+        uint32_t m_baselineMessage : 1;             ///< 1 if this is a baseline message. 0 otherwise. If 1 then you can cast the Message* to BaselineMessage*. Lightweight RTTI.
+        int m_serializedBits;                       ///< Cached number of bits this message takes when serialized. -1 if the message has not been measured yet. @see Message::GetSerializedBits
     };
 
     /**
@@ -3913,6 +5020,100 @@ namespace yojimbo
         int m_blockSize;                            ///< The block size (bytes). 0 if no block is attached.
     };
 
+    class MessageFactory;
+
+    /**
+        A message which can be serialized relative to a baseline: an earlier message of the same type that the other side has already received.
+        Use this for snapshots and other state that is sent repeatedly and mostly unchanged, and send it over an unreliable-unordered channel.
+        When a baseline message is sent, the connection picks the most recent message of the same type that it sent and the other side acked, and attaches it as the baseline. 
+        On the other side, the same message is looked up from the packets it received and attached before the message is read.
+        In your serialize function, get the baseline with BaselineMessage::GetBaseline and serialize fields with serialize_int_delta, serialize_bits_delta, serialize_float_delta and serialize_int_array_delta.
+        When there is no baseline (eg. nothing has been acked yet), serialize relative to a default state instead, on both sides.
+        IMPORTANT: Don't modify baseline messages after sending or receiving them. They are kept as baselines for later messages.
+        @see Connection
+        @see BaselineStore
+        @see ConnectionConfig::baselineBufferSize
+     */
+
+    class BaselineMessage : public Message
+    {
+    public:
+
+        /**
+            Baseline message constructor.
+            Don't call this directly, use a message factory instead.
+            @see MessageFactory::CreateMessage
+         */
+
+        explicit BaselineMessage() : Message( 0, 1 ), m_messageFactory(NULL), m_baseline(NULL), m_baselineSequence(0) {}
+
+        /**
+            Attach a baseline to this message.
+            This is called by the connection. You don't need to call it yourself.
+            Any baseline already attached is released first.
+            @param messageFactory The message factory the baseline was created with.
+            @param baseline The baseline message. A reference is added to it while it is attached.
+            @param baselineSequence The sequence number of the packet the baseline was sent in.
+         */
+
+        void SetBaseline( MessageFactory & messageFactory, Message * baseline, uint16_t baselineSequence );
+
+        /**
+            Detach the baseline from this message, releasing the reference held on it.
+            The connection does this once the message has been written to or read from a packet, so baselines don't hold on to their own baselines.
+         */
+
+        void ClearBaseline();
+
+        /**
+            Get the baseline attached to this message.
+            This is set while the message is measured, written and read. Cast it to your message type.
+            @returns The baseline message. NULL if there is no baseline, in which case you should serialize relative to a default state.
+         */
+
+        const Message * GetBaseline() const
+        {
+            return m_baseline;
+        }
+
+        /**
+            Get the sequence number of the packet the baseline was sent in.
+            @returns The baseline packet sequence number. Only valid if a baseline is attached.
+         */
+
+        uint16_t GetBaselineSequence() const
+        {
+            return m_baselineSequence;
+        }
+
+        /**
+            Get the number of bits the channels write in front of this message to identify its baseline.
+            @returns The number of baseline header bits.
+         */
+
+        int GetBaselineHeaderBits() const
+        {
+            return m_baseline ? 1 + 16 : 1;
+        }
+
+    protected:
+
+        /**
+            If a baseline is attached to the message, it is released here.
+         */
+
+        ~BaselineMessage()
+        {
+            ClearBaseline();
+        }
+
+    private:
+
+        MessageFactory * m_messageFactory;          ///< The message factory the baseline was created with. NULL if no baseline is attached.
+        Message * m_baseline;                       ///< The baseline this message is serialized relative to. NULL if no baseline is attached.
+        uint16_t m_baselineSequence;                ///< The sequence number of the packet the baseline was sent in.
+    };
+
     /**
         Message factory error level.
      */
@@ -3923,6 +5124,20 @@ namespace yojimbo
         MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE,                       ///< Failed to allocate a message. Typically this means we ran out of memory on the allocator backing the message factory.
     };
 
+    /**
+        Message pool counters are used to track the memory used by messages of each type, for tuning.
+        @see MessageFactory::GetPoolCounter
+     */
+
+    enum MessagePoolCounters
+    {
+        MESSAGE_POOL_COUNTER_MESSAGES_IN_USE,                                   ///< Number of messages of this type currently in use.
+        MESSAGE_POOL_COUNTER_MESSAGES_FREE,                                     ///< Number of free messages of this type in the pool, ready to be reused without allocating.
+        MESSAGE_POOL_COUNTER_PEAK_MESSAGES_IN_USE,                              ///< The largest number of messages of this type that were in use at the same time.
+        MESSAGE_POOL_COUNTER_SLABS_ALLOCATED,                                   ///< Number of slabs allocated for this message type. Each slab holds MessagesPerPoolSlab messages.
+        MESSAGE_POOL_NUM_COUNTERS
+    };
+
     /**
         Defines the set of message types that can be created.
 
@@ -3943,14 +5158,24 @@ namespace yojimbo
             Message factory allocator.
             Pass in the number of message types for the message factory from the derived class.
             @param allocator The allocator used to create messages.
-            @param numTypes The number of message types. Valid types are in [0,numTypes-1].
+            @param numTypes The number of message types. Valid types are in [0,numTypes-1]. Must be no more than MaxMessageTypes.
          */
 
         MessageFactory( Allocator & allocator, int numTypes )
         {
+            yojimbo_assert( numTypes > 0 );
+            yojimbo_assert( numTypes <= MaxMessageTypes );
             m_allocator = &allocator;
             m_numTypes = numTypes;
             m_errorLevel = MESSAGE_FACTORY_ERROR_NONE;
+            m_pools = (MessagePool*) YOJIMBO_ALLOCATE( allocator, sizeof( MessagePool ) * numTypes );
+            if ( !m_pools )
+            {
+                // no messages can be created without pools, so the factory starts in the same error state as a failed CreateMessage
+                m_errorLevel = MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE;
+                return;
+            }
+            memset( m_pools, 0, sizeof( MessagePool ) * numTypes );
         }
 
         /**
@@ -3962,6 +5187,19 @@ namespace yojimbo
         {
             yojimbo_assert( m_allocator );
 
+            for ( int i = 0; m_pools && i < m_numTypes; ++i )
+            {
+                void * slab = m_pools[i].slabs;
+                while ( slab )
+                {
+                    void * next = *( (void**) slab );
+                    YOJIMBO_FREE( *m_allocator, slab );
+                    slab = next;
+                }
+            }
+
+            YOJIMBO_FREE( *m_allocator, m_pools );
+
             m_allocator = NULL;
 
             #if YOJIMBO_DEBUG_MESSAGE_LEAKS
@@ -3994,6 +5232,7 @@ namespace yojimbo
         {
             yojimbo_assert( type >= 0 );
             yojimbo_assert( type < m_numTypes );
+            yojimbo_assert( type < MaxMessageTypes );
             Message * message = CreateMessageInternal( type );
             if ( !message )
             {
@@ -4043,7 +5282,7 @@ namespace yojimbo
                 allocated_messages.erase( message );
                 #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
                 yojimbo_assert( m_allocator );
-                YOJIMBO_DELETE( *m_allocator, Message, message );
+                DestroyMessageInternal( message );
             }
         }
 
@@ -4087,6 +5326,23 @@ namespace yojimbo
             m_errorLevel = MESSAGE_FACTORY_ERROR_NONE;
         }
 
+        /**
+            Get a message pool counter.
+            Message factories declared with the YOJIMBO_MESSAGE_FACTORY_START macros keep a pool of messages for each type. Use these counters to tune the size of the allocator backing the message factory.
+            @param type The message type in [0,numTypes-1].
+            @param index The index of the counter to retrieve. See MessagePoolCounters.
+            @returns The value of the counter.
+         */
+
+        uint64_t GetPoolCounter( int type, int index ) const
+        {
+            yojimbo_assert( type >= 0 );
+            yojimbo_assert( type < m_numTypes );
+            yojimbo_assert( index >= 0 );
+            yojimbo_assert( index < MESSAGE_POOL_NUM_COUNTERS );
+            return m_pools ? m_pools[type].counters[index] : 0;
+        }
+
     protected:
 
         /**
@@ -4098,8 +5354,47 @@ namespace yojimbo
         virtual Message * CreateMessageInternal( int type ) { (void) type; return NULL; }
 
         /**
-            Set the message type of a message.
-            @param message The message object.
+            This method is overridden to destroy messages created by CreateMessageInternal.
+            Called when the reference count of a message reaches zero. The default implementation deletes the message with the message factory allocator.
+            @param message The message to destroy.
+         */
+
+        virtual void DestroyMessageInternal( Message * message ) { YOJIMBO_DELETE( *m_allocator, Message, message ); }
+
+        /**
+            Create a message of the specified class from the pool for its type.
+            Pools grow by MessagesPerPoolSlab messages at a time and never shrink, so once the pool is warm, creating a message is just a pop off a free list.
+            @param type The message type. All messages of a type must be the same class.
+            @returns The message created, or NULL if the pool for this type needed to grow and the allocator is out of memory.
+         */
+
+        template <typename T> Message * CreatePooledMessage( int type )
+        {
+            void * memory = AllocatePooledMessage( type, sizeof( T ) );
+            return memory ? new ( memory ) T() : NULL;
+        }
+
+        /**
+            Destroy a message created with CreatePooledMessage.
+            The message is returned to the pool for its type so the memory can be reused by the next message of that type.
+            @param message The message to destroy.
+         */
+
+        void DestroyPooledMessage( Message * message )
+        {
+            yojimbo_assert( message );
+            MessagePool & pool = m_pools[message->GetType()];
+            message->~Message();
+            *( (void**) message ) = pool.freeList;
+            pool.freeList = message;
+            yojimbo_assert( pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_IN_USE] > 0 );
+            pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_IN_USE]--;
+            pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_FREE]++;
+        }
+
+        /**
+            Set the message type of a message.
+            @param message The message object.
             @param type The message type to set.
          */
 
@@ -4107,6 +5402,74 @@ namespace yojimbo
 
     private:
 
+        /**
+            Allocate memory for a message from the pool for its type.
+            @param type The message type.
+            @param bytes The size of the message class (bytes).
+            @returns Pointer to memory for the message, or NULL if the allocator is out of memory.
+         */
+
+        void * AllocatePooledMessage( int type, int bytes )
+        {
+            yojimbo_assert( type >= 0 );
+            yojimbo_assert( type < m_numTypes );
+
+            if ( !m_pools )
+                return NULL;
+
+            MessagePool & pool = m_pools[type];
+
+            const int messageBytes = ( bytes + 15 ) & ~15;
+
+            yojimbo_assert( pool.messageBytes == 0 || pool.messageBytes == messageBytes );
+
+            if ( !pool.freeList )
+            {
+                // the first 16 bytes of each slab link it into the list of slabs for this pool
+
+                uint8_t * slab = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, 16 + messageBytes * MessagesPerPoolSlab );
+                if ( !slab )
+                    return NULL;
+
+                *( (void**) slab ) = pool.slabs;
+                pool.slabs = slab;
+                pool.messageBytes = messageBytes;
+
+                for ( int i = MessagesPerPoolSlab - 1; i >= 0; --i )
+                {
+                    void * entry = slab + 16 + i * messageBytes;
+                    *( (void**) entry ) = pool.freeList;
+                    pool.freeList = entry;
+                }
+
+                pool.counters[MESSAGE_POOL_COUNTER_SLABS_ALLOCATED]++;
+                pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_FREE] += MessagesPerPoolSlab;
+            }
+
+            void * memory = pool.freeList;
+            pool.freeList = *( (void**) memory );
+
+            pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_FREE]--;
+            pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_IN_USE]++;
+            if ( pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_IN_USE] > pool.counters[MESSAGE_POOL_COUNTER_PEAK_MESSAGES_IN_USE] )
+                pool.counters[MESSAGE_POOL_COUNTER_PEAK_MESSAGES_IN_USE] = pool.counters[MESSAGE_POOL_COUNTER_MESSAGES_IN_USE];
+
+            return memory;
+        }
+
+        /**
+            Per-type message pool.
+            Free messages are kept on an intrusive free list, so pooled message classes must be at least pointer sized (always true, since messages have a vtable).
+         */
+
+        struct MessagePool
+        {
+            int messageBytes;                                                   ///< Size of each message in the pool (bytes), rounded up to a multiple of 16. 0 until the first message of this type is created.
+            void * freeList;                                                    ///< Intrusive list of free messages in the pool.
+            void * slabs;                                                       ///< Intrusive list of slabs allocated for this pool. Freed when the message factory is destroyed.
+            uint64_t counters[MESSAGE_POOL_NUM_COUNTERS];                       ///< Counters for tuning. See MessagePoolCounters.
+        };
+
         #if YOJIMBO_DEBUG_MESSAGE_LEAKS
         std::map<void*,int> allocated_messages;                                 ///< The set of allocated messages for this factory. Used to track down message leaks.
         #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
@@ -4116,6 +5479,8 @@ namespace yojimbo
         int m_numTypes;                                                         ///< The number of message types.
         
         MessageFactoryErrorLevel m_errorLevel;                                  ///< The message factory error level.
+
+        MessagePool * m_pools;                                                  ///< Array of message pools, one per message type.
     };
 }
 
@@ -4123,7 +5488,7 @@ namespace yojimbo
     Start a definition of a new message factory.
     This is a helper macro to make declaring your own message factory class easier.
     @param factory_class The name of the message factory class to generate.
-    @param num_message_types The number of message types for this factory.
+    @param num_message_types The number of message types for this factory. Must be no more than yojimbo::MaxMessageTypes, or the factory class does not compile.
     See tests/shared.h for an example of usage.
  */
 
@@ -4131,8 +5496,10 @@ namespace yojimbo
                                                                                                                                         \
     class factory_class : public yojimbo::MessageFactory                                                                                \
     {                                                                                                                                   \
+        typedef char num_message_types_must_fit_in_message_type_bits[ ( num_message_types ) <= yojimbo::MaxMessageTypes ? 1 : -1 ];     \
     public:                                                                                                                             \
         factory_class( yojimbo::Allocator & allocator ) : MessageFactory( allocator, num_message_types ) {}                             \
+        void DestroyMessageInternal( yojimbo::Message * message ) { DestroyPooledMessage( message ); }                                  \
         yojimbo::Message * CreateMessageInternal( int type )                                                                            \
         {                                                                                                                               \
             yojimbo::Message * message;                                                                                                 \
@@ -4152,7 +5519,7 @@ namespace yojimbo
 #define YOJIMBO_DECLARE_MESSAGE_TYPE( message_type, message_class )                                                                     \
                                                                                                                                         \
                 case message_type:                                                                                                      \
-                    message = YOJIMBO_NEW( allocator, message_class );                                                                  \
+                    message = CreatePooledMessage<message_class>( message_type );                                                       \
                     if ( !message )                                                                                                     \
                         return NULL;                                                                                                    \
                     SetMessageType( message, message_type );                                                                            \
@@ -4179,6 +5546,7 @@ namespace yojimbo
         uint32_t initialized : 1;
         uint32_t blockMessage : 1;
         uint32_t messageFailedToSerialize : 1;
+        uint32_t ownsFragmentData : 1;
 
         struct MessageData
         {
@@ -4197,12 +5565,15 @@ namespace yojimbo
             int messageType;
         };
 
-        union
+        struct BlockFragmentData
         {
-            MessageData message;
-            BlockData block;
+            int numEntries;
+            BlockData * entries;
         };
 
+        MessageData message;
+        BlockFragmentData block;
+
         void Initialize();
 
         void Free( MessageFactory & messageFactory );
@@ -4355,6 +5726,15 @@ namespace yojimbo
 
         virtual void ProcessAck( uint16_t sequence ) = 0;
 
+        /**
+            Process a set of connection packet acks.
+            The default implementation calls ProcessAck for each ack. Channels can override this to do work once per set of acks instead of once per ack.
+            @param acks The sequence numbers of the connection packets that were acked.
+            @param numAcks The number of acks.
+         */
+
+        virtual void ProcessAcks( const uint16_t * acks, int numAcks );
+
     public:
 
         /**
@@ -4451,6 +5831,8 @@ namespace yojimbo
 
         void ProcessAck( uint16_t ack );
 
+        void ProcessAcks( const uint16_t * acks, int numAcks );
+
         /**
             Are there any unacked messages in the send queue?
             Messages are acked individually and remain in the send queue until acked.
@@ -4461,7 +5843,9 @@ namespace yojimbo
 
         /**
             Get messages to include in a packet.
-            Messages are measured to see how many bits they take, and only messages that fit within the channel packet budget will be included. See ChannelConfig::packetBudget.
+            Messages are measured once when they are sent, and only messages that fit within the channel packet budget will be included. See ChannelConfig::packetBudget.
+            Block messages that are being sent are skipped, so messages queued behind them can be sent in the space left over by their fragments. The scan stops at the first block message that is not being sent yet.
+            No stream work is done here. Message ids are priced with sequence_relative_bits, which matches what is written exactly.
             Takes care not to send messages too rapidly by respecting ChannelConfig::messageResendTime for each message, and to only include messages that that the receiver is able to buffer in their receive queue. In other words, won't run ahead of the receiver.
             @param messageIds Array of message ids to be filled [out]. Fills up to ChannelConfig::maxMessagesPerPacket messages, make sure your array is at least this size.
             @param numMessageIds The number of message ids written to the array.
@@ -4470,11 +5854,11 @@ namespace yojimbo
             @see GetMessagePacketData
          */
 
-        int GetMessagesToSend( uint16_t * messageIds, int & numMessageIds, int remainingPacketBits, void *context );
+        int GetMessagesToSend( uint16_t * messageIds, int & numMessageIds, int remainingPacketBits );
 
         /**
             Fill channel packet data with messages.
-            This is the payload function to fill packet data while sending regular messages (without blocks attached).
+            This is the payload function to fill packet data while sending regular messages (without blocks attached). The packet data must already be initialized, and may also carry block fragments. See GetFragmentPacketData.
             Messages have references added to them when they are added to the packet. They also have a reference while they are stored in a send or receive queue. Messages are cleaned up when they are no longer in a queue, and no longer referenced by any packets.
             @param packetData The packet data to fill [out]
             @param messageIds Array of message ids identifying which messages to add to the packet from the message send queue.
@@ -4487,6 +5871,7 @@ namespace yojimbo
         /**
             Add a packet entry for the set of messages included in a packet.
             This lets us look up the set of messages that were included in that packet later on when it is acked, so we can ack those messages individually.
+            Called for every packet the channel includes data in, even if the packet only carries block fragments, so it creates the packet entry. See AddFragmentPacketEntry.
             @param messageIds The set of message ids that were included in the packet.
             @param numMessageIds The number of message ids in the array.
             @param sequence The sequence number of the connection packet the messages were included in.
@@ -4514,61 +5899,75 @@ namespace yojimbo
         void UpdateOldestUnackedMessageId();
 
         /**
-            True if we are currently sending a block message.
+            Ack the messages and block fragments included in a connection packet.
+            Does not update the oldest unacked message id, so that it is only walked forward once per set of acks.
+            @param ack The sequence number of the connection packet that was acked.
+            @returns True if any messages were removed from the send queue.
+            @see ProcessAck
+            @see ProcessAcks
+         */
+
+        bool ProcessAckInternal( uint16_t ack );
+
+        /**
+            Find the block being sent for a block message.
             Block messages are treated differently to regular messages. 
             Regular messages are small so we try to fit as many into the packet we can. See ReliableChannelData::GetMessagesToSend.
             Blocks attached to block messages are usually larger than the maximum packet size or channel budget, so they are split up fragments. 
-            While in the mode of sending a block message, each channel packet data generated has exactly one fragment from the current block in it. Fragments keep getting included in packets until all fragments of that block are acked.
-            @returns True if currently sending a block message over the network, false otherwise.
+            The first ChannelConfig::maxBlocksInFlight block messages in the send queue are sent at the same time. Each channel packet data generated has as many fragments from these blocks in it as fit, up to ChannelConfig::maxFragmentsPerPacket. Fragments keep getting included in packets until all fragments of a block are acked.
+            @param messageId The id of the block message.
+            @returns The index of the block in the array of blocks being sent, or -1 if the block for that message is not being sent.
             @see BlockMessage
-            @see GetFragmentToSend
+            @see GetFragmentsToSend
          */
 
-        bool SendingBlockMessage();
+        int FindSendBlock( uint16_t messageId ) const;
 
         /**
-            Get the next block fragment to send.
-            The next block fragment is selected by scanning left to right over the set of fragments in the block, skipping over any fragments that have already been acked or have been sent within ChannelConfig::fragmentResendTime.
-            @param messageId The id of the message that the block is attached to [out].
-            @param fragmentId The id of the fragment to send [out].
-            @param fragmentBytes The size of the fragment in bytes.
-            @param numFragments The total number of fragments in this block.
-            @param messageType The type of message the block is attached to. See MessageFactory.
-            @returns Pointer to the fragment data.
+            Get the block fragments to include in the next packet.
+            Blocks in flight are visited in message id order, starting new blocks as slots become free. Fragments are selected by scanning left to right over the set of fragments in each block, skipping over any fragments that have already been acked or have been sent within ChannelConfig::blockFragmentResendTime, until the packet is full or ChannelConfig::maxFragmentsPerPacket fragments have been selected.
+            @param fragmentMessageIds Array of message ids to fill with the id of the block message each fragment belongs to [out]. Must have space for at least ChannelConfig::maxFragmentsPerPacket message ids.
+            @param fragmentIds Array of fragment ids to fill [out]. Must have space for at least ChannelConfig::maxFragmentsPerPacket fragment ids.
+            @param numFragmentIds The number of fragments written to the arrays [out].
+            @param availableBits The number of bits available in the packet.
+            @returns An estimate of the number of bits required to serialize the block messages and fragment data (upper bound).
          */
 
-        uint8_t * GetFragmentToSend( uint16_t & messageId, uint16_t & fragmentId, int & fragmentBytes, int & numFragments, int & messageType );
+        int GetFragmentsToSend( uint16_t * fragmentMessageIds, uint16_t * fragmentIds, int & numFragmentIds, int availableBits );
+
+        /**
+            Get the size of a fragment of a block being sent.
+            @param sendBlockIndex The index of the block being sent. See FindSendBlock.
+            @param fragmentId The fragment id in [0,numFragments-1].
+            @returns The size of the fragment (bytes). This is ChannelConfig::blockFragmentSize, except for the last fragment which holds the remainder of the block.
+         */
+
+        int GetFragmentBytes( int sendBlockIndex, int fragmentId ) const;
 
         /**
             Fill the packet data with block and fragment data.
-            This is the payload function that fills the channel packet data while we are sending a block message.
+            This is the payload function that fills the channel packet data while we are sending block messages. The packet data must already be initialized.
+            The fragment data is not copied. Each fragment points into the block attached to the block message, which stays in the send queue until all of its fragments are acked.
             @param packetData The packet data to fill [out]
-            @param messageId The id of the message that the block is attached to.
-            @param fragmentId The id of the block fragment being sent.
-            @param fragmentData The fragment data.
-            @param fragmentSize The size of the fragment data (bytes).
-            @param numFragments The number of fragments in the block.
-            @param messageType The type of message the block is attached to.
-            @returns An estimate of the number of bits required to serialize the block message and fragment data (upper bound).
+            @param fragmentMessageIds The ids of the messages that the blocks are attached to, one per fragment.
+            @param fragmentIds The ids of the block fragments to include in the packet.
+            @param numFragmentIds The number of fragments in the arrays.
+            @returns True if the packet data was filled, false if there was not enough memory to allocate it.
          */
 
-        int GetFragmentPacketData( ChannelPacketData & packetData, 
-                                   uint16_t messageId, 
-                                   uint16_t fragmentId, 
-                                   uint8_t * fragmentData, 
-                                   int fragmentSize, 
-                                   int numFragments, 
-                                   int messageType );
+        bool GetFragmentPacketData( ChannelPacketData & packetData, const uint16_t * fragmentMessageIds, const uint16_t * fragmentIds, int numFragmentIds );
 
         /**
-            Adds a packet entry for the fragment.
-            This lets us look up the fragment that was in the packet later on when it is acked, so we can ack that block fragment.
-            @param messageId The message id that the block was attached to.
-            @param fragmentId The fragment id.
-            @param sequence The sequence number of the packet the fragment was included in.
+            Adds the fragments to the packet entry.
+            This lets us look up the fragments that were in the packet later on when it is acked, so we can ack those block fragments.
+            Must be called after AddMessagePacketEntry for the same packet, which creates the packet entry.
+            @param fragmentMessageIds The ids of the messages that the blocks were attached to, one per fragment.
+            @param fragmentIds The fragment ids.
+            @param numFragmentIds The number of fragments in the arrays.
+            @param sequence The sequence number of the packet the fragments were included in.
          */
 
-        void AddFragmentPacketEntry( uint16_t messageId, uint16_t fragmentId, uint16_t sequence );
+        void AddFragmentPacketEntry( const uint16_t * fragmentMessageIds, const uint16_t * fragmentIds, int numFragmentIds, uint16_t sequence );
 
         /**
             Process a packet fragment.
@@ -4624,15 +6023,16 @@ namespace yojimbo
             uint16_t * messageIds;                                                      ///< Pointer to an array of message ids. Dynamically allocated because the user can configure the maximum number of messages in a packet per-channel with ChannelConfig::maxMessagesPerPacket.
             uint32_t numMessageIds : 16;                                                ///< The number of message ids in in the array.
             uint32_t acked : 1;                                                         ///< 1 if this packet has been acked.
-            uint64_t block : 1;                                                         ///< 1 if this packet contains a fragment of a block message.
-            uint64_t blockMessageId : 16;                                               ///< The block message id. Valid only if "block" is 1.
-            uint64_t blockFragmentId : 16;                                              ///< The block fragment id. Valid only if "block" is 1.
+            uint64_t block : 1;                                                         ///< 1 if this packet contains fragments of block messages.
+            uint64_t numBlockFragmentIds : 16;                                          ///< The number of block fragments in the arrays. Valid only if "block" is 1.
+            uint16_t * blockMessageIds;                                                 ///< Pointer to an array of block message ids, one per fragment. Valid only if "block" is 1.
+            uint16_t * blockFragmentIds;                                                ///< Pointer to an array of block fragment ids. Dynamically allocated because the user can configure the maximum number of fragments in a packet per-channel with ChannelConfig::maxFragmentsPerPacket. Valid only if "block" is 1.
         };
 
         /**
             Internal state for a block being sent across the reliable ordered channel.
             Stores the block data and tracks which fragments have been acked. The block send completes when all fragments have been acked.
-            IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only one data block can be in flights over the wire at a time.
+            IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only ChannelConfig::maxBlocksInFlight data blocks can be in flight over the wire at a time.
          */
 
         struct SendBlockData
@@ -4640,10 +6040,13 @@ namespace yojimbo
             SendBlockData( Allocator & allocator, int maxFragmentsPerBlock )
             {
                 m_allocator = &allocator;
+                m_maxFragmentsPerBlock = maxFragmentsPerBlock;
                 ackedFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
                 fragmentSendTime = (double*) YOJIMBO_ALLOCATE( allocator, sizeof( double) * maxFragmentsPerBlock );
+                sendQueue = (uint16_t*) YOJIMBO_ALLOCATE( allocator, sizeof( uint16_t ) * maxFragmentsPerBlock );
                 yojimbo_assert( ackedFragment );
                 yojimbo_assert( fragmentSendTime );
+                yojimbo_assert( sendQueue );
                 Reset();
             }
 
@@ -4651,6 +6054,7 @@ namespace yojimbo
             {
                 YOJIMBO_DELETE( *m_allocator, BitArray, ackedFragment );
                 YOJIMBO_FREE( *m_allocator, fragmentSendTime );
+                YOJIMBO_FREE( *m_allocator, sendQueue );
             }
 
             void Reset()
@@ -4660,6 +6064,42 @@ namespace yojimbo
                 numAckedFragments = 0;
                 blockMessageId = 0;
                 blockSize = 0;
+                sendQueueStart = 0;
+                sendQueueCount = 0;
+            }
+
+            /**
+                Add a fragment to the back of the send queue.
+                @param fragmentId The fragment id. Each fragment is in the send queue at most once.
+             */
+
+            void PushFragment( int fragmentId )
+            {
+                yojimbo_assert( sendQueueCount < m_maxFragmentsPerBlock );
+                sendQueue[ ( sendQueueStart + sendQueueCount ) % m_maxFragmentsPerBlock ] = uint16_t( fragmentId );
+                sendQueueCount++;
+            }
+
+            /**
+                Get the fragment at the front of the send queue.
+                @returns The fragment id.
+             */
+
+            int PeekFragment() const
+            {
+                yojimbo_assert( sendQueueCount > 0 );
+                return sendQueue[sendQueueStart];
+            }
+
+            /**
+                Remove the fragment at the front of the send queue.
+             */
+
+            void PopFragment()
+            {
+                yojimbo_assert( sendQueueCount > 0 );
+                sendQueueStart = ( sendQueueStart + 1 ) % m_maxFragmentsPerBlock;
+                sendQueueCount--;
             }
 
             bool active;                                                                ///< True if we are currently sending a block.
@@ -4669,10 +6109,14 @@ namespace yojimbo
             uint16_t blockMessageId;                                                    ///< The message id the block is attached to.
             BitArray * ackedFragment;                                                   ///< Has fragment n been received?
             double * fragmentSendTime;                                                  ///< Last time fragment was sent.
+            uint16_t * sendQueue;                                                       ///< Ring buffer of unacked fragment ids, in the order they were last sent. Acked fragments are discarded when they reach the front.
+            int sendQueueStart;                                                         ///< Index of the front of the send queue.
+            int sendQueueCount;                                                         ///< Number of fragment ids in the send queue.
 
         private:
 
             Allocator * m_allocator;                                                    ///< Allocator used to create the block data.
+            int m_maxFragmentsPerBlock;                                                 ///< Capacity of the send queue.
         
             SendBlockData( const SendBlockData & other );
             
@@ -4682,189 +6126,737 @@ namespace yojimbo
         /**
             Internal state for a block being received across the reliable ordered channel.
             Stores the fragments received over the network for the block, and completes once all fragments have been received.
-            IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only one data block can be in flights over the wire at a time.
+            IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only ChannelConfig::maxBlocksInFlight data blocks can be in flight over the wire at a time.
          */
 
         struct ReceiveBlockData
         {
-            ReceiveBlockData( Allocator & allocator, int maxBlockSize, int maxFragmentsPerBlock )
+            ReceiveBlockData( Allocator & allocator, Allocator & blockAllocator, int maxBlockSize, int maxFragmentsPerBlock )
             {
                 m_allocator = &allocator;
+                m_blockAllocator = &blockAllocator;
+                m_maxBlockSize = maxBlockSize;
                 receivedFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
-                blockData = (uint8_t*) YOJIMBO_ALLOCATE( allocator, maxBlockSize );
+                blockData = (uint8_t*) YOJIMBO_ALLOCATE( blockAllocator, maxBlockSize );
                 yojimbo_assert( receivedFragment && blockData );
                 blockMessage = NULL;
                 Reset();
             }
 
-            ~ReceiveBlockData()
-            {
-                YOJIMBO_DELETE( *m_allocator, BitArray, receivedFragment );
-                YOJIMBO_FREE( *m_allocator, blockData );
-            }
+            ~ReceiveBlockData()
+            {
+                YOJIMBO_DELETE( *m_allocator, BitArray, receivedFragment );
+                YOJIMBO_FREE( *m_blockAllocator, blockData );
+            }
+
+            /**
+                Take ownership of the reassembly buffer.
+                Used by ChannelConfig::zeroCopyBlockReceive to hand the buffer to the block message once all fragments have been received. The buffer is maxBlockSize bytes and must be freed with the block allocator.
+                A fresh buffer is allocated by AllocateBlockData when the next block starts receiving.
+                @returns The reassembly buffer.
+             */
+
+            uint8_t * DetachBlockData()
+            {
+                uint8_t * data = blockData;
+                blockData = NULL;
+                return data;
+            }
+
+            /**
+                Make sure there is a reassembly buffer to receive fragments into.
+                @returns True if the reassembly buffer is available, false if the block allocator is out of memory.
+             */
+
+            bool AllocateBlockData()
+            {
+                if ( !blockData )
+                    blockData = (uint8_t*) YOJIMBO_ALLOCATE( *m_blockAllocator, m_maxBlockSize );
+                return blockData != NULL;
+            }
+
+            void Reset()
+            {
+                active = false;
+                numFragments = 0;
+                numReceivedFragments = 0;
+                messageId = 0;
+                messageType = 0;
+                blockSize = 0;
+            }
+
+            bool active;                                                                ///< True if we are currently receiving a block.
+            int numFragments;                                                           ///< The number of fragments in this block
+            int numReceivedFragments;                                                   ///< The number of fragments received.
+            uint16_t messageId;                                                         ///< The message id corresponding to the block.
+            int messageType;                                                            ///< Message type of the block being received.
+            uint32_t blockSize;                                                         ///< Block size in bytes.
+            BitArray * receivedFragment;                                                ///< Has fragment n been received?
+            uint8_t * blockData;                                                        ///< Block data for receive.
+            BlockMessage * blockMessage;                                                ///< Block message (sent with fragment 0).
+
+        private:
+
+            Allocator * m_allocator;                                                    ///< Allocator used to free the data on shutdown.
+            Allocator * m_blockAllocator;                                               ///< Allocator for the reassembly buffer. This is the message factory allocator when blocks are received with zero copy, since the buffer ends up attached to a block message.
+            int m_maxBlockSize;                                                         ///< Size of the reassembly buffer (bytes).
+
+            ReceiveBlockData( const ReceiveBlockData & other );
+            
+            ReceiveBlockData & operator = ( const ReceiveBlockData & other );
+        };
+
+    private:
+
+        uint16_t m_sendMessageId;                                                       ///< Id of the next message to be added to the send queue.
+        uint16_t m_receiveMessageId;                                                    ///< Id of the next message to be added to the receive queue.
+        uint16_t m_oldestUnackedMessageId;                                              ///< Id of the oldest unacked message in the send queue.
+        SequenceBuffer<SentPacketEntry> * m_sentPackets;                                ///< Stores information per sent connection packet about messages and block data included in each packet. Used to walk from connection packet level acks to message and data block fragment level acks.
+        SequenceBuffer<MessageSendQueueEntry> * m_messageSendQueue;                     ///< Message send queue.
+        SequenceBuffer<MessageReceiveQueueEntry> * m_messageReceiveQueue;               ///< Message receive queue.
+        uint16_t * m_sentPacketMessageIds;                                              ///< Array of n message ids per sent connection packet. Allows the maximum number of messages per-packet to be allocated dynamically.
+        uint16_t * m_sentPacketBlockMessageIds;                                         ///< Array of n block message ids per sent connection packet, one per fragment. NULL if blocks are disabled.
+        uint16_t * m_sentPacketBlockFragmentIds;                                        ///< Array of n block fragment ids per sent connection packet. Allows the maximum number of fragments per-packet to be allocated dynamically. NULL if blocks are disabled.
+        int m_numSendQueueBlocks;                                                       ///< Number of block messages in the send queue. Lets the channel skip looking for blocks to send when there are none.
+        SendBlockData ** m_sendBlocks;                                                  ///< Data about the blocks currently being sent. Array of ChannelConfig::maxBlocksInFlight entries.
+        ReceiveBlockData ** m_receiveBlocks;                                            ///< Data about the blocks currently being received. Array of ChannelConfig::maxBlocksInFlight entries.
+
+    private:
+
+        ReliableOrderedChannel( const ReliableOrderedChannel & other );
+
+        ReliableOrderedChannel & operator = ( const ReliableOrderedChannel & other );
+    };
+
+    /**
+        Messages sent across this channel are not guaranteed to arrive, and may be received in a different order than they were sent.
+        This channel type is best used for time critical data like snapshots and object state.
+     */
+
+    class UnreliableUnorderedChannel : public Channel
+    {
+    public:
+
+        /** 
+            Reliable ordered channel constructor.
+            @param allocator The allocator to use.
+            @param messageFactory Message factory for creating and destroying messages.
+            @param config The configuration for this channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+         */
+
+        UnreliableUnorderedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
+
+        /**
+            Unreliable unordered channel destructor.
+            Any messages still in the send or receive queues will be released.
+         */
+
+        ~UnreliableUnorderedChannel();
+
+        void Reset();
+
+        bool CanSendMessage() const;
+
+        bool HasMessagesToSend() const;
+
+        void SendMessage( Message * message, void *context );
+
+        Message * ReceiveMessage();
+
+        void AdvanceTime( double time );
+
+        int GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits );
+
+        void ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence );
+
+        void ProcessAck( uint16_t ack );
+
+    protected:
+
+        Queue<Message*> * m_messageSendQueue;                   ///< Message send queue.
+        Queue<Message*> * m_messageReceiveQueue;                ///< Message receive queue.
+
+    private:
+
+        UnreliableUnorderedChannel( const UnreliableUnorderedChannel & other );
+
+        UnreliableUnorderedChannel & operator = ( const UnreliableUnorderedChannel & other );
+    };
+
+    /**
+        Keeps the baseline messages sent and received by a connection, keyed by the sequence number of the packet they were sent in and their message type.
+        On the send side, acks mark baselines as received by the other side. New baseline messages are serialized relative to the most recent acked baseline of the same type.
+        On the receive side, baselines are looked up by the packet sequence written in front of each baseline message, and the type of the message being read.
+        Every baseline message type in a packet is kept as a baseline. If a packet has more than one baseline message of the same type, only the last one is kept.
+        @see BaselineMessage
+        @see Connection
+     */
+
+    class BaselineStore
+    {
+    public:
+
+        /**
+            Baseline store constructor.
+            @param allocator The allocator to use.
+            @param messageFactory The message factory used to create the baseline messages. References held on baselines are released with it.
+            @param bufferSize The number of packet entries to keep for sent and received baselines.
+         */
+
+        BaselineStore( Allocator & allocator, MessageFactory & messageFactory, int bufferSize );
+
+        /**
+            Baseline store destructor.
+            Releases all baselines held by the store.
+         */
+
+        ~BaselineStore();
+
+        /**
+            Release all baselines and return to the initial state.
+         */
+
+        void Reset();
+
+        /**
+            Called when a packet is sent, before its baseline messages are added with AddSentBaseline.
+            Releases the baselines previously kept in the entry for this packet.
+            @param packetSequence The sequence number of the packet.
+         */
+
+        void AddSentPacket( uint16_t packetSequence );
+
+        /**
+            Add a baseline message included in a sent packet.
+            @param packetSequence The sequence number of the packet. Must be the last packet passed to AddSentPacket.
+            @param message The baseline message. Replaces any baseline message of the same type already added for this packet.
+         */
+
+        void AddSentBaseline( uint16_t packetSequence, Message * message );
+
+        /**
+            Process acks for sent packets.
+            Baselines sent in acked packets become available to serialize new baseline messages relative to.
+            @param acks Array of acked packet sequence numbers.
+            @param numAcks The number of acks.
+         */
+
+        void ProcessAcks( const uint16_t * acks, int numAcks );
+
+        /**
+            Get the baseline to serialize a new message relative to.
+            @param messageType The type of the message being sent.
+            @param baselineSequence The sequence number of the packet the baseline was sent in [out].
+            @returns The most recent acked baseline of this message type, or NULL if there is none, or it is too old to be sure the other side still has it.
+         */
+
+        Message * GetAckedBaseline( int messageType, uint16_t & baselineSequence );
+
+        /**
+            Called when a packet is received and read, before its baseline messages are added with AddReceivedBaseline.
+            Releases the baselines previously kept in the entry for this packet.
+            @param packetSequence The sequence number of the packet.
+         */
+
+        void AddReceivedPacket( uint16_t packetSequence );
+
+        /**
+            Add a baseline message read from a received packet.
+            @param packetSequence The sequence number of the packet. Must be the last packet passed to AddReceivedPacket.
+            @param message The baseline message. Replaces any baseline message of the same type already added for this packet.
+         */
+
+        void AddReceivedBaseline( uint16_t packetSequence, Message * message );
+
+        /**
+            Find a received baseline.
+            @param baselineSequence The sequence number of the packet the baseline was received in.
+            @param messageType The type of the message being read.
+            @returns The baseline message, or NULL if it is not in the store. This is counted as a missing baseline.
+         */
+
+        Message * FindReceivedBaseline( uint16_t baselineSequence, int messageType );
+
+        /**
+            Get the number of times a received baseline could not be found.
+            Packets with messages relative to a missing baseline can't be read, so they are dropped.
+            @returns The number of missing baselines.
+         */
+
+        uint64_t GetNumMissingBaselines() const { return m_numMissingBaselines; }
+
+    private:
+
+        struct BaselineEntry
+        {
+            Message ** messages;                                ///< The baseline messages in the packet, at most one per message type.
+            int numMessages;                                    ///< The number of baseline messages in the packet.
+            int maxMessages;                                    ///< The size of the messages array. Kept when the entry is reused, so steady state traffic doesn't allocate.
+            uint16_t sequence;                                  ///< The sequence number of the packet the baselines were sent in.
+            bool valid;                                         ///< True if the entry holds the baselines for the packet with this sequence number.
+            bool acked;                                         ///< True if the packet has been acked. Send side only.
+        };
+
+        struct AckedBaseline
+        {
+            uint16_t sequence;                                  ///< The most recent acked packet sequence with a baseline of this type in it.
+            bool valid;                                         ///< True if a baseline of this type has been acked.
+        };
+
+        void ClearEntry( BaselineEntry & entry, uint16_t sequence );
+
+        void AddEntryMessage( BaselineEntry & entry, Message * message );
+
+        Message * FindEntryMessage( const BaselineEntry & entry, int messageType ) const;
+
+        Allocator * m_allocator;                                ///< Allocator passed in to the constructor.
+        MessageFactory * m_messageFactory;                      ///< Message factory used to release baselines.
+        int m_bufferSize;                                       ///< The number of entries in the sent and received baseline buffers.
+        int m_numTypes;                                         ///< The number of message types in the message factory.
+        BaselineEntry * m_sentBaselines;                        ///< Baselines sent, indexed by packet sequence modulo buffer size.
+        BaselineEntry * m_receivedBaselines;                    ///< Baselines received, indexed by packet sequence modulo buffer size.
+        AckedBaseline * m_ackedBaselines;                       ///< The most recent acked baseline for each message type.
+        bool m_hasSentPacket;                                   ///< True if a packet has been sent.
+        uint16_t m_sentPacketSequence;                          ///< The most recent packet sequence sent.
+        uint64_t m_numMissingBaselines;                         ///< The number of received baselines that could not be found.
+
+        BaselineStore( const BaselineStore & other );
+        BaselineStore & operator = ( const BaselineStore & other );
+    };
+
+    /// Connection error level.
+
+    enum ConnectionErrorLevel
+    {
+        CONNECTION_ERROR_NONE = 0,                              ///< No error. All is well.
+        CONNECTION_ERROR_CHANNEL,                               ///< A channel is in an error state.
+        CONNECTION_ERROR_ALLOCATOR,                             ///< The allocator is an error state.
+        CONNECTION_ERROR_MESSAGE_FACTORY,                       ///< The message factory is in an error state.
+        CONNECTION_ERROR_READ_PACKET_FAILED,                    ///< Failed to read packet. Received an invalid packet?     
+    };
+
+    class PacketCapture;
+
+    /**
+        Sends and receives messages across a set of user defined channels.
+     */
+
+    class Connection
+    {
+    public:
+
+        Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time );
+
+        ~Connection();
+
+        void Reset();
+
+        bool CanSendMessage( int channelIndex ) const;
+
+        bool HasMessagesToSend( int channelIndex ) const;
+
+        void SendMessage( int channelIndex, Message * message, void *context = 0);
+
+        Message * ReceiveMessage( int channelIndex );
+
+        void ReleaseMessage( Message * message );
+
+        bool GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes );
+
+        bool ProcessPacket( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes );
+
+        void ProcessAcks( const uint16_t * acks, int numAcks );
+
+        void AdvanceTime( double time );
+
+        ConnectionErrorLevel GetErrorLevel() { return m_errorLevel; }
+
+        const BaselineStore * GetBaselineStore() const { return m_baselineStore; }
+
+        /**
+            Capture packets generated and processed by this connection, and the acks it processes.
+            @param capture The packet capture to write to. NULL stops capturing. The capture must stay open while it is set.
+         */
+
+        void SetPacketCapture( PacketCapture * capture ) { m_packetCapture = capture; }
+
+        PacketCapture * GetPacketCapture() const { return m_packetCapture; }
+
+    private:
+
+        Allocator * m_allocator;                                ///< Allocator passed in to the connection constructor.
+        MessageFactory * m_messageFactory;                      ///< Message factory for creating and destroying messages.
+        ConnectionConfig m_connectionConfig;                    ///< Connection configuration.
+        Channel * m_channel[MaxChannels];                       ///< Array of connection channels. Array size corresponds to m_connectionConfig.numChannels
+        ConnectionErrorLevel m_errorLevel;                      ///< The connection error level.
+        SequenceBuffer<uint64_t> * m_sentPacketChannels;        ///< Mask of the reliable channels that included data in each sent packet. Acks are only passed to these channels.
+        BaselineStore * m_baselineStore;                        ///< Baseline messages sent and received. NULL if ConnectionConfig::baselineBufferSize is zero.
+        PacketCapture * m_packetCapture;                        ///< Packet capture to write packets and acks to. NULL if not capturing.
+        double m_time;                                          ///< Current connection time. Packets and acks are captured with this time.
+    };
+
+    /// Types of record in a packet trace.
+
+    enum PacketTraceRecordType
+    {
+        PACKET_TRACE_SENT,                                      ///< A packet generated by Connection::GeneratePacket.
+        PACKET_TRACE_RECEIVED,                                  ///< A packet passed in to Connection::ProcessPacket.
+        PACKET_TRACE_ACKS,                                      ///< Acks passed in to Connection::ProcessAcks.
+        PACKET_TRACE_NUM_RECORD_TYPES
+    };
+
+    const uint32_t PacketTraceMagic = 0x54504A59;               ///< "YJPT". First four bytes of a packet trace file.
+    const uint32_t PacketTraceVersion = 1;                      ///< Packet trace file format version.
+
+    /**
+        Writes the packets and acks seen by a connection to a compact binary trace file.
+        The trace can be replayed offline with PacketReplay, which gives a deterministic benchmark of packet deserialization and message receive with real traffic.
+        Attach a capture to a connection with Connection::SetPacketCapture, Client::SetPacketCapture or Server::SetPacketCapture. Use a separate capture for each connection.
+        The file starts with a header: magic, version, number of channels and max packet size, each a little endian uint32.
+        Each record that follows is a type byte, then the time since the previous record as a varint in microseconds.
+        Packet records follow this with the packet sequence as a little endian uint16, the packet size as a varint and the packet data.
+        Ack records follow it with the number of acks as a varint, then each ack as a little endian uint16.
+     */
+
+    class PacketCapture
+    {
+    public:
+
+        /**
+            Packet capture constructor.
+            The capture starts closed. Call PacketCapture::Open to create the trace file.
+         */
+
+        PacketCapture();
+
+        /**
+            Closes the trace file if it is open.
+         */
+
+        ~PacketCapture();
+
+        /**
+            Create a trace file and write the trace header.
+            @param filename The trace filename. Any existing file is overwritten.
+            @param connectionConfig The configuration of the connection being captured. Replay needs a connection with the same configuration.
+            @returns True if the file was created, false otherwise.
+         */
+
+        bool Open( const char * filename, const ConnectionConfig & connectionConfig );
+
+        /**
+            Flush and close the trace file.
+         */
+
+        void Close();
+
+        /**
+            Is the trace file open?
+            @returns True if the trace file is open and records are being written to it.
+         */
+
+        bool IsOpen() const { return m_file != NULL; }
+
+        /**
+            Write a packet to the trace.
+            Called by the connection being captured.
+            @param type PACKET_TRACE_SENT or PACKET_TRACE_RECEIVED.
+            @param time The connection time (seconds).
+            @param packetSequence The packet sequence number.
+            @param packetData The packet data.
+            @param packetBytes The packet size (bytes).
+         */
+
+        void CapturePacket( PacketTraceRecordType type, double time, uint16_t packetSequence, const uint8_t * packetData, int packetBytes );
 
-            void Reset()
-            {
-                active = false;
-                numFragments = 0;
-                numReceivedFragments = 0;
-                messageId = 0;
-                messageType = 0;
-                blockSize = 0;
-            }
+        /**
+            Write acks to the trace.
+            Called by the connection being captured.
+            @param time The connection time (seconds).
+            @param acks The acked packet sequence numbers.
+            @param numAcks The number of acks.
+         */
 
-            bool active;                                                                ///< True if we are currently receiving a block.
-            int numFragments;                                                           ///< The number of fragments in this block
-            int numReceivedFragments;                                                   ///< The number of fragments received.
-            uint16_t messageId;                                                         ///< The message id corresponding to the block.
-            int messageType;                                                            ///< Message type of the block being received.
-            uint32_t blockSize;                                                         ///< Block size in bytes.
-            BitArray * receivedFragment;                                                ///< Has fragment n been received?
-            uint8_t * blockData;                                                        ///< Block data for receive.
-            BlockMessage * blockMessage;                                                ///< Block message (sent with fragment 0).
+        void CaptureAcks( double time, const uint16_t * acks, int numAcks );
 
-        private:
+        /**
+            Get the number of records written to the trace.
+            @returns The number of packet and ack records written since the trace was opened.
+         */
 
-            Allocator * m_allocator;                                                    ///< Allocator used to free the data on shutdown.
+        uint64_t GetNumRecords() const { return m_numRecords; }
 
-            ReceiveBlockData( const ReceiveBlockData & other );
-            
-            ReceiveBlockData & operator = ( const ReceiveBlockData & other );
-        };
+        /**
+            Get the size of the trace.
+            @returns The number of bytes written to the trace file, including the header.
+         */
+
+        uint64_t GetBytesWritten() const { return m_bytesWritten; }
 
     private:
 
-        uint16_t m_sendMessageId;                                                       ///< Id of the next message to be added to the send queue.
-        uint16_t m_receiveMessageId;                                                    ///< Id of the next message to be added to the receive queue.
-        uint16_t m_oldestUnackedMessageId;                                              ///< Id of the oldest unacked message in the send queue.
-        SequenceBuffer<SentPacketEntry> * m_sentPackets;                                ///< Stores information per sent connection packet about messages and block data included in each packet. Used to walk from connection packet level acks to message and data block fragment level acks.
-        SequenceBuffer<MessageSendQueueEntry> * m_messageSendQueue;                     ///< Message send queue.
-        SequenceBuffer<MessageReceiveQueueEntry> * m_messageReceiveQueue;               ///< Message receive queue.
-        uint16_t * m_sentPacketMessageIds;                                              ///< Array of n message ids per sent connection packet. Allows the maximum number of messages per-packet to be allocated dynamically.
-        SendBlockData * m_sendBlock;                                                    ///< Data about the block being currently sent.
-        ReceiveBlockData * m_receiveBlock;                                              ///< Data about the block being currently received.
+        void WriteRecordHeader( PacketTraceRecordType type, double time );
 
-    private:
+        void WriteVarint( uint64_t value );
 
-        ReliableOrderedChannel( const ReliableOrderedChannel & other );
+        void WriteUint16( uint16_t value );
 
-        ReliableOrderedChannel & operator = ( const ReliableOrderedChannel & other );
+        void WriteUint32( uint32_t value );
+
+        void WriteBytes( const uint8_t * data, int bytes );
+
+        FILE * m_file;                                          ///< The trace file. NULL if the capture is not open.
+        uint64_t m_time;                                        ///< Time of the last record written (microseconds).
+        uint64_t m_numRecords;                                  ///< Number of records written.
+        uint64_t m_bytesWritten;                                ///< Number of bytes written.
+
+        PacketCapture( const PacketCapture & other );
+        PacketCapture & operator = ( const PacketCapture & other );
     };
 
     /**
-        Messages sent across this channel are not guaranteed to arrive, and may be received in a different order than they were sent.
-        This channel type is best used for time critical data like snapshots and object state.
+        Replays a packet trace written by PacketCapture into a connection as fast as possible.
+        The whole trace is loaded and validated up front, so replay measures only the work done by the connection.
+        Replay does not measure ack processing. Acks in the trace refer to packets the captured connection sent, and the replay connection never sent them, so they find nothing in flight.
      */
 
-    class UnreliableUnorderedChannel : public Channel
+    class PacketReplay
     {
     public:
 
-        /** 
-            Reliable ordered channel constructor.
-            @param allocator The allocator to use.
-            @param messageFactory Message factory for creating and destroying messages.
-            @param config The configuration for this channel.
-            @param channelIndex The channel index in [0,numChannels-1].
+        /**
+            Packet replay constructor.
+            @param allocator The allocator used to hold the trace in memory.
          */
 
-        UnreliableUnorderedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
+        explicit PacketReplay( Allocator & allocator );
 
         /**
-            Unreliable unordered channel destructor.
-            Any messages still in the send or receive queues will be released.
+            Packet replay destructor.
+            Frees the loaded trace.
          */
 
-        ~UnreliableUnorderedChannel();
+        ~PacketReplay();
 
-        void Reset();
+        /**
+            Load a trace file.
+            @param filename The trace filename.
+            @returns True if the trace was loaded and is valid, false otherwise.
+         */
 
-        bool CanSendMessage() const;
+        bool Load( const char * filename );
 
-        bool HasMessagesToSend() const;
+        /**
+            Load a trace from memory. The data is copied.
+            @param data The trace data.
+            @param bytes The size of the trace data (bytes).
+            @returns True if the trace is valid, false otherwise.
+         */
 
-        void SendMessage( Message * message, void *context );
+        bool Load( const uint8_t * data, int bytes );
 
-        Message * ReceiveMessage();
+        /**
+            Replay the trace into a connection.
+            The connection should be freshly created, with the same configuration and message factory as the connection that was captured. See GetNumChannels and GetMaxPacketSize.
+            Time advances to the time of each record as it is replayed. Messages received are released immediately after each packet.
+            Replaying PACKET_TRACE_RECEIVED packets also passes the captured acks to Connection::ProcessAcks, but since the connection never sent those packets the acks only cost a lookup each. Replaying PACKET_TRACE_SENT packets makes the connection play the part of the other side, without acks.
+            @param connection The connection to replay the trace into.
+            @param type Which packets to replay: PACKET_TRACE_RECEIVED or PACKET_TRACE_SENT.
+            @param context The context passed to Connection::ProcessPacket.
+            @returns The number of packets replayed. -1 if the connection went into an error state.
+         */
 
-        void AdvanceTime( double time );
+        int Replay( Connection & connection, PacketTraceRecordType type = PACKET_TRACE_RECEIVED, void * context = NULL );
 
-        int GetPacketData( void *context, ChannelPacketData & packetData, uint16_t packetSequence, int availableBits );
+        /**
+            Get the number of channels of the captured connection.
+            @returns The number of channels in the connection config the trace was captured with.
+         */
 
-        void ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence );
+        int GetNumChannels() const { return m_numChannels; }
 
-        void ProcessAck( uint16_t ack );
+        /**
+            Get the max packet size of the captured connection.
+            @returns The max packet size in the connection config the trace was captured with (bytes).
+         */
 
-    protected:
+        int GetMaxPacketSize() const { return m_maxPacketSize; }
 
-        Queue<Message*> * m_messageSendQueue;                   ///< Message send queue.
-        Queue<Message*> * m_messageReceiveQueue;                ///< Message receive queue.
+        /**
+            Get the number of records of a type in the trace.
+            @param type The record type.
+            @returns The number of records of that type.
+         */
+
+        int GetNumRecords( PacketTraceRecordType type ) const { yojimbo_assert( type >= 0 ); yojimbo_assert( type < PACKET_TRACE_NUM_RECORD_TYPES ); return m_numRecords[type]; }
+
+        /**
+            Get the total size of the packets of a type in the trace.
+            @param type PACKET_TRACE_SENT or PACKET_TRACE_RECEIVED.
+            @returns The sum of the packet sizes (bytes).
+         */
+
+        uint64_t GetPacketBytes( PacketTraceRecordType type ) const { yojimbo_assert( type >= 0 ); yojimbo_assert( type < PACKET_TRACE_NUM_RECORD_TYPES ); return m_packetBytes[type]; }
 
     private:
 
-        UnreliableUnorderedChannel( const UnreliableUnorderedChannel & other );
+        void Clear();
 
-        UnreliableUnorderedChannel & operator = ( const UnreliableUnorderedChannel & other );
-    };
+        bool Validate();
 
-    /// Connection error level.
+        Allocator * m_allocator;                                ///< Allocator passed in to the constructor.
+        uint8_t * m_data;                                       ///< The trace data. NULL if no trace is loaded.
+        uint8_t * m_packetBuffer;                               ///< Packets are copied here before they are processed. Packets are read a dword at a time, so they must be aligned and padded.
+        int m_bytes;                                            ///< Size of the trace data (bytes).
+        int m_numChannels;                                      ///< Number of channels of the captured connection.
+        int m_maxPacketSize;                                    ///< Max packet size of the captured connection (bytes).
+        int m_numRecords[PACKET_TRACE_NUM_RECORD_TYPES];        ///< Number of records of each type.
+        uint64_t m_packetBytes[PACKET_TRACE_NUM_RECORD_TYPES];  ///< Total packet bytes of each record type.
 
-    enum ConnectionErrorLevel
-    {
-        CONNECTION_ERROR_NONE = 0,                              ///< No error. All is well.
-        CONNECTION_ERROR_CHANNEL,                               ///< A channel is in an error state.
-        CONNECTION_ERROR_ALLOCATOR,                             ///< The allocator is an error state.
-        CONNECTION_ERROR_MESSAGE_FACTORY,                       ///< The message factory is in an error state.
-        CONNECTION_ERROR_READ_PACKET_FAILED,                    ///< Failed to read packet. Received an invalid packet?     
+        PacketReplay( const PacketReplay & other );
+        PacketReplay & operator = ( const PacketReplay & other );
     };
 
     /**
-        Sends and receives messages across a set of user defined channels.
+        A fixed set of worker threads that split a range of work items between them.
+        The thread calling Run takes a share of the work too, so there are GetNumThreads() + 1 shares, identified by thread index 0 (the calling thread) through GetNumThreads().
+        The server uses this to run per-client work in parallel, since each client has its own allocator, message factory and connection.
      */
 
-    class Connection
+    class WorkerThreads
     {
     public:
 
-        Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time );
+        /**
+            Function called to do work on a range of items.
+            @param context The context passed in to Run.
+            @param threadIndex The index of the thread doing the work, in [0,GetNumThreads()].
+            @param beginIndex The first item to work on.
+            @param endIndex One past the last item to work on.
+         */
 
-        ~Connection();
+        typedef void (*WorkFunction)( void * context, int threadIndex, int beginIndex, int endIndex );
 
-        void Reset();
+        /**
+            Start the worker threads.
+            @param allocator The allocator to use.
+            @param numThreads The number of worker threads to start. Must be at least one.
+         */
 
-        bool CanSendMessage( int channelIndex ) const;
+        WorkerThreads( Allocator & allocator, int numThreads );
 
-        bool HasMessagesToSend( int channelIndex ) const;
+        /**
+            Stop the worker threads and wait for them to exit.
+         */
 
-        void SendMessage( int channelIndex, Message * message, void *context = 0);
+        ~WorkerThreads();
 
-        Message * ReceiveMessage( int channelIndex );
+        /**
+            Split items [0,numItems) into contiguous ranges and work on them in parallel.
+            Blocks until all items have been worked on.
+            @param function The function to call for each range of items.
+            @param context Context passed to the work function.
+            @param numItems The number of items.
+         */
 
-        void ReleaseMessage( Message * message );
+        void Run( WorkFunction function, void * context, int numItems );
 
-        bool GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes );
+        /**
+            Lock the mutex shared by the work functions.
+            Use this around work that must not run on more than one thread at a time.
+         */
 
-        bool ProcessPacket( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes );
+        void Lock();
 
-        void ProcessAcks( const uint16_t * acks, int numAcks );
+        /**
+            Unlock the mutex shared by the work functions.
+         */
 
-        void AdvanceTime( double time );
+        void Unlock();
 
-        ConnectionErrorLevel GetErrorLevel() { return m_errorLevel; }
+        /**
+            Get the number of worker threads.
+            @returns The number of worker threads, not including the thread calling Run.
+         */
+
+        int GetNumThreads() const { return m_numThreads; }
 
     private:
 
-        Allocator * m_allocator;                                ///< Allocator passed in to the connection constructor.
-        MessageFactory * m_messageFactory;                      ///< Message factory for creating and destroying messages.
-        ConnectionConfig m_connectionConfig;                    ///< Connection configuration.
-        Channel * m_channel[MaxChannels];                       ///< Array of connection channels. Array size corresponds to m_connectionConfig.numChannels
-        ConnectionErrorLevel m_errorLevel;                      ///< The connection error level.
+        Allocator * m_allocator;                                ///< Allocator passed in to the constructor.
+        int m_numThreads;                                       ///< Number of worker threads.
+        struct WorkerThreadsData * m_data;                      ///< Threads and synchronization primitives. Defined in yojimbo.cpp so the header does not depend on the threading library.
+
+        WorkerThreads( const WorkerThreads & other );
+        WorkerThreads & operator = ( const WorkerThreads & other );
+    };
+
+    /**
+        Network conditions applied by the network simulator to one direction of a link.
+        Each network simulator applies its profile on send, so a client's profile models the uplink (client to server) and the server's profile models the downlink (server to client). Set them differently to simulate asymmetric links.
+        The server applies its profile to each client separately. Every client has its own bandwidth queue and burst loss state.
+        The default profile applies no network conditions at all. NetworkSimulator::SetLatency, NetworkSimulator::SetJitter etc. set the corresponding values in the current profile.
+        Profiles can be loaded from a file with load_network_link_profile.
+     */
+
+    struct NetworkLinkProfile
+    {
+        float latency;                                          ///< Latency added to each packet (milliseconds).
+        float jitter;                                           ///< Random jitter added to latency, +/- this amount (milliseconds).
+        bool orderedJitter;                                     ///< If true, jitter never delivers a packet before a packet sent earlier to the same index. If false, jitter reorders packets.
+        float packetLoss;                                       ///< Percentage of packets lost at random, independent of burst loss.
+        float duplicates;                                       ///< Percentage chance of a packet duplicate being delivered up to 1 second later.
+        float bandwidth;                                        ///< Bandwidth of the link (kilobits per second). Packets wait in a FIFO queue until the link is free to send them. Zero for unlimited bandwidth.
+        int queueBytes;                                         ///< Size of the queue in front of the bandwidth limit (bytes). Packets that don't fit in the queue are dropped. Zero for an unlimited queue.
+        int packetOverheadBytes;                                ///< Bytes added to each packet when counting it against the bandwidth limit. 28 bytes covers IPv4 and UDP headers.
+        float burstLossEnter;                                   ///< Gilbert-Elliott burst loss: percentage chance per packet of the link going from the good state to the bad state. Zero disables burst loss.
+        float burstLossExit;                                    ///< Gilbert-Elliott burst loss: percentage chance per packet of the link going from the bad state back to the good state.
+        float burstLoss;                                        ///< Gilbert-Elliott burst loss: percentage of packets lost while the link is in the bad state.
+
+        NetworkLinkProfile()
+        {
+            latency = 0.0f;
+            jitter = 0.0f;
+            orderedJitter = false;
+            packetLoss = 0.0f;
+            duplicates = 0.0f;
+            bandwidth = 0.0f;
+            queueBytes = 0;
+            packetOverheadBytes = 28;
+            burstLossEnter = 0.0f;
+            burstLossExit = 0.0f;
+            burstLoss = 100.0f;
+        }
     };
 
+    /**
+        Parse a network link profile from text.
+        The text has one "name = value" per line. Names are the same as the NetworkLinkProfile members, eg. "bandwidth = 2000". Lines starting with '#' are comments.
+        Values not in the text keep the value already in the profile, so you can parse on top of the default profile, or on top of another profile.
+        @param text The profile text. Must be null terminated.
+        @param profile The profile to parse values into [in/out].
+        @returns True if the text was parsed successfully. False if a line is malformed or names an unknown value.
+     */
+
+    bool parse_network_link_profile( const char * text, NetworkLinkProfile & profile );
+
+    /**
+        Load a network link profile from a file.
+        See parse_network_link_profile for the file format.
+        @param filename The profile filename.
+        @param profile The profile to load values into [in/out].
+        @returns True if the file was loaded and parsed successfully, false otherwise.
+     */
+
+    bool load_network_link_profile( const char * filename, NetworkLinkProfile & profile );
+
     /**
         Simulates packet loss, latency, jitter and duplicate packets.
         This is useful during development, so your game is tested and played under real world conditions, instead of ideal LAN conditions.
         This simulator works on packet send. This means that if you want 125ms of latency (round trip), you must to add 125/2 = 62.5ms of latency to each side.
+        Bandwidth limits with queueing delay and burst loss can be simulated too. See NetworkLinkProfile.
+        Packets in flight are kept in a min-heap ordered by delivery time, and in a list per destination, so the cost of receiving packets is proportional to the number of packets delivered, not the number the simulator can hold.
      */
 
     class NetworkSimulator
@@ -4878,12 +6870,14 @@ namespace yojimbo
                 Jitter: 0ms
                 Packet Loss: 0%
                 Duplicates: 0%
+            The random generator is seeded with zero. See NetworkSimulator::Seed.
             @param allocator The allocator to use.
-            @param numPackets The maximum number of packets that can be stored in the simulator at any time.
+            @param numPackets The maximum number of packets that can be stored in the simulator at any time. Packets sent while the simulator is full are dropped.
             @param time The initial time value in seconds.
+            @param packetBufferBytes The size of the pooled buffers packets are copied into (bytes). Larger packets are still supported, but are allocated individually. If zero, buffers are sized for the largest packet sent by a client or server with the default ClientServerConfig.
          */
 
-        NetworkSimulator( Allocator & allocator, int numPackets, double time );
+        NetworkSimulator( Allocator & allocator, int numPackets, double time, int packetBufferBytes = 0 );
 
         /**
             Network simulator destructor.
@@ -4923,9 +6917,41 @@ namespace yojimbo
 
         void SetDuplicates( float percent );
 
+        /**
+            Set all network conditions at once.
+            Packets already in the simulator keep the delivery times they were sent with.
+            @param profile The network conditions to apply to packets sent from now on.
+         */
+
+        void SetLinkProfile( const NetworkLinkProfile & profile );
+
+        /**
+            Seed the random generator that decides which packets are lost, delayed and duplicated.
+            The random generator belongs to the network simulator, so it is not affected by calls to rand() elsewhere in your program.
+            @param seed The seed value.
+            @param stream The random generator stream. The client and server simulators use different streams, so the same seed does not give the same conditions in both directions.
+         */
+
+        void Seed( uint64_t seed, uint64_t stream = 0 );
+
+        /**
+            Get the seed the random generator was last seeded with.
+            Log this when the seed is picked at random, so a run can be reproduced. See ClientServerConfig::networkSimulatorSeed.
+            @returns The seed value.
+         */
+
+        uint64_t GetSeed() const { return m_seed; }
+
+        /**
+            Get the current network conditions.
+            @returns The current link profile, including values set with NetworkSimulator::SetLatency etc.
+         */
+
+        const NetworkLinkProfile & GetLinkProfile() const { return m_profile; }
+
         /**
             Is the network simulator active?
-            The network simulator is active when packet loss, latency, duplicates or jitter are non-zero values.
+            The network simulator is active when any network condition in the link profile is enabled.
             This is used by the transport to know whether it should shunt packets through the simulator, or send them directly to the network. This is a minor optimization.
          */
 
@@ -4934,6 +6960,7 @@ namespace yojimbo
         /**
             Queue a packet to send.
             IMPORTANT: Ownership of the packet data pointer is *not* transferred to the network simulator. It makes a copy of the data instead.
+            If the simulator already holds the maximum number of packets, the packet is dropped. See NetworkSimulator::GetNumOverflowPackets.
             @param to The slot index the packet should be sent to.
             @param packetData The packet data.
             @param packetBytes The packet size (bytes).
@@ -4943,7 +6970,9 @@ namespace yojimbo
 
         /**
             Receive packets sent to any address.
-            IMPORTANT: You take ownership of the packet data you receive and are responsible for freeing it. See NetworkSimulator::GetAllocator.
+            Packets are received in order of delivery time. Packets with the same delivery time are received in the order they were sent.
+            IMPORTANT: You take ownership of the packet data you receive and are responsible for freeing it with NetworkSimulator::FreePacket on this simulator.
+            Packet data comes from the simulator's packet buffer pool, not directly from its allocator, so never free it with YOJIMBO_FREE.
             @param maxPackets The maximum number of packets to receive.
             @param packetData Array of packet data pointers to be filled [out].
             @param packetBytes Array of packet sizes to be filled [out].
@@ -4976,12 +7005,60 @@ namespace yojimbo
         void AdvanceTime( double time );
 
         /**
-            Get the allocator to use to free packet data.
-            @returns The allocator that packet data is allocated with.
+            Return a packet received from the simulator to the packet buffer pool.
+            In debug builds, this asserts if the packet data was not received from this simulator.
+            @param packetData The packet data returned by NetworkSimulator::ReceivePackets. May be NULL.
+         */
+
+        void FreePacket( uint8_t * packetData );
+
+        /**
+            Get the allocator the network simulator allocates packet buffers with.
+            Packet data returned by NetworkSimulator::ReceivePackets is owned by the simulator's packet buffer pool. Free it with NetworkSimulator::FreePacket, not with this allocator.
+            @returns The allocator passed in to the constructor.
          */
 
         Allocator & GetAllocator() { yojimbo_assert( m_allocator ); return *m_allocator; }
 
+        /**
+            Get the number of packet buffers allocated by the pool.
+            Once the pool is warm, sending packets through the simulator does not allocate any memory.
+            @returns The number of pooled packet buffers, free or in use.
+         */
+
+        int GetNumPacketBuffers() const { return m_numPacketBuffers; }
+
+        /**
+            Get the number of packets currently held in the simulator.
+            @returns The number of packets waiting to be delivered.
+         */
+
+        int GetNumPackets() const { return m_numHeapEntries; }
+
+        /**
+            Get the number of packets dropped because the simulator was full when they were sent.
+            If this is non-zero, increase ClientServerConfig::maxSimulatorPackets.
+            @returns The number of packets dropped because the simulator was full.
+         */
+
+        uint64_t GetNumOverflowPackets() const { return m_numOverflowPackets; }
+
+        /**
+            Get the number of packets dropped because the bandwidth queue was full.
+            @returns The number of packets dropped by NetworkLinkProfile::queueBytes.
+         */
+
+        uint64_t GetNumQueueDropPackets() const { return m_numQueueDropPackets; }
+
+        /**
+            Get the number of bytes waiting in the bandwidth queue for a to index.
+            Divide by the bandwidth to get the queueing delay new packets sent to this index will see.
+            @param to The to index.
+            @returns The number of bytes queued, including per-packet overhead. Zero if there is no bandwidth limit.
+         */
+
+        int GetQueuedBytes( int to ) const;
+
     protected:
 
         /**
@@ -4994,34 +7071,72 @@ namespace yojimbo
     private:
 
         Allocator * m_allocator;                        ///< The allocator passed in to the constructor. It's used to allocate and free packet data.
-        float m_latency;                                ///< Latency in milliseconds
-        float m_jitter;                                 ///< Jitter in milliseconds +/-
-        float m_packetLoss;                             ///< Packet loss percentage.
-        float m_duplicates;                             ///< Duplicate packet percentage
-        bool m_active;                                  ///< True if network simulator is active, eg. if any of the network settings above are enabled.
+        NetworkLinkProfile m_profile;                   ///< The network conditions applied to packets on send.
+        RandomGenerator m_random;                       ///< Random generator deciding which packets are lost, delayed and duplicated.
+        uint64_t m_seed;                                ///< The seed the random generator was last seeded with.
+        bool m_active;                                  ///< True if network simulator is active, eg. if any of the network conditions in the profile are enabled.
 
         /// A packet buffered in the network simulator.
 
         struct PacketEntry
         {
-            PacketEntry()
-            {
-                to = 0;
-                deliveryTime = 0.0;
-                packetData = NULL;
-                packetBytes = 0;
-            }
-
             int to;                                     ///< To index this packet should be sent to (for server -> client packets).
             double deliveryTime;                        ///< Delivery time for this packet (seconds).
-            uint8_t * packetData;                       ///< Packet data (owns this pointer).
+            uint64_t sendIndex;                         ///< Increases with each packet sent. Orders packets with the same delivery time.
+            uint8_t * packetData;                       ///< Packet data (owns this pointer). NULL if the entry is free.
             int packetBytes;                            ///< Size of packet in bytes.
+            int heapIndex;                              ///< Index of this entry in the delivery heap.
+            int previous;                               ///< Previous entry in the list of packets sent to the same index. -1 if this is the first.
+            int next;                                   ///< Next entry in the list of packets sent to the same index, or the next free entry. -1 if this is the last.
+        };
+
+        /// Header in front of each packet buffer.
+
+        struct PacketBuffer
+        {
+            PacketBuffer * next;                        ///< Next free packet buffer in the pool.
+            int pooled;                                 ///< 1 if this buffer belongs to the pool. 0 if it was allocated individually because the packet is larger than pooled buffers.
+        };
+
+        /// Link state kept for each to index.
+
+        struct LinkState
+        {
+            double queueFreeTime;                       ///< Time the bandwidth limited link finishes sending the packets queued on it.
+            double lastDeliveryTime;                    ///< Delivery time of the last packet sent to this index. Used for ordered jitter.
+            bool burstLossBad;                          ///< True if the link is in the Gilbert-Elliott bad state.
         };
 
+        uint8_t * AllocatePacket( int packetBytes );
+
+        bool ReserveDestination( int to );
+
+        int AddPacket( int to, const uint8_t * packetData, int packetBytes, double deliveryTime );
+
+        void RemovePacket( int entryIndex );
+
+        bool HeapLess( int a, int b ) const;
+
+        void HeapSiftUp( int heapIndex );
+
+        void HeapSiftDown( int heapIndex );
+
         double m_time;                                  ///< Current time from last call to advance time.
-        int m_currentIndex;                             ///< Current index in the packet entry array. New packets are inserted here.
         int m_numPacketEntries;                         ///< Number of elements in the packet entry array.
         PacketEntry * m_packetEntries;                  ///< Pointer to dynamically allocated packet entries. This is where buffered packets are stored.
+        int * m_heap;                                   ///< Min-heap of packet entry indices, ordered by delivery time. The next packet to deliver is at the top.
+        int m_numHeapEntries;                           ///< Number of packets in the heap. This is the number of packets in the simulator.
+        int m_freeEntry;                                ///< First free packet entry. -1 if the simulator is full.
+        int * m_destinationList;                        ///< First packet entry sent to each to index. -1 if there are no packets for that index.
+        LinkState * m_linkStates;                       ///< Link state for each to index.
+        int m_numDestinations;                          ///< Number of entries in the destination list and link state arrays. Grows as packets are sent to higher to indices.
+        uint64_t m_sendIndex;                           ///< Send index assigned to the next packet.
+        uint64_t m_numOverflowPackets;                  ///< Number of packets dropped because the simulator was full.
+        uint64_t m_numQueueDropPackets;                 ///< Number of packets dropped because the bandwidth queue was full.
+        int m_packetBufferBytes;                        ///< Size of each pooled packet buffer, not including the buffer header (bytes).
+        int m_numPacketBuffers;                         ///< Number of pooled packet buffers allocated.
+        PacketBuffer * m_freePacketBuffers;             ///< Free list of pooled packet buffers.
+        uint8_t * m_packetBufferSlabs;                  ///< Slabs of pooled packet buffers. The first bytes of each slab point to the next slab.
     };
 
     /** 
@@ -5049,6 +7164,20 @@ namespace yojimbo
             return YOJIMBO_NEW( allocator, TLSF_Allocator, memory, bytes );
         }
 
+        /**
+            Override this function to specify your own custom allocator class for per-client memory drawn from a shared memory pool.
+            Only called when ClientServerConfig::serverClientMemoryPool is set.
+            @param allocator The base allocator that must be used to allocate your allocator instance.
+            @param pool The memory pool your allocator takes memory from.
+            @param maxBytes The maximum number of bytes your allocator may take from the memory pool.
+            @returns A pointer to the allocator instance you created.
+         */
+
+        virtual Allocator * CreatePooledAllocator( Allocator & allocator, MemoryPool & pool, size_t maxBytes )
+        {
+            return YOJIMBO_NEW( allocator, TLSF_PooledAllocator, pool, maxBytes );
+        }
+
         /**
             You must override this method to create the message factory used by the client and server.
             @param allocator The allocator that must be used to create your message factory instance via YOJIMBO_NEW
@@ -5110,6 +7239,7 @@ namespace yojimbo
 
         /**
             Override this to get a callback when a client disconnects from the server.
+            The client's message factory and allocator still exist during this callback, so release any messages and blocks held for the client here.
          */
 
         virtual void OnServerClientDisconnected( int clientIndex )
@@ -5157,7 +7287,7 @@ namespace yojimbo
         /**
             Start the server and allocate client slots.
             Each client that connects to this server occupies one of the client slots allocated by this function.
-            @param maxClients The number of client slots to allocate. Must be in range [1,MaxClients]
+            @param maxClients The number of client slots to allocate. Must be in range [1,NETCODE_MAX_CLIENTS]. Only small per-slot tables are allocated here. Per-client memory (ClientServerConfig::serverPerClientMemory) is allocated when a client first connects to a slot, and reused after it disconnects
             @see Server::Stop
          */
 
@@ -5258,8 +7388,10 @@ namespace yojimbo
 
         /**
             Create a message of the specified type for a specific client.
+            Per-client resources only exist while a client is connected. Messages and blocks for a client must be released by Adapter::OnServerClientDisconnected at the latest. After that, calls for the client slot do nothing and return NULL or false.
             @param clientIndex The index of the client this message belongs to. Determines which client heap is used to allocate the message.
             @param type The type of the message to create. The message types corresponds to the message factory created by the adaptor set on the server.
+            @returns The message created, or NULL if the message could not be allocated, or no client is connected in this slot.
          */
 
         virtual Message * CreateMessage( int clientIndex, int type ) = 0;
@@ -5269,13 +7401,14 @@ namespace yojimbo
             This is typically used to create blocks of data to attach to block messages. See BlockMessage for details.
             @param clientIndex The index of the client this message belongs to. Determines which client heap is used to allocate the data.
             @param bytes The number of bytes to allocate.
-            @returns The pointer to the data block. This must be attached to a message via Client::AttachBlockToMessage, or freed via Client::FreeBlock.
+            @returns The pointer to the data block, or NULL if the block could not be allocated, or no client is connected in this slot. This must be attached to a message via Client::AttachBlockToMessage, or freed via Client::FreeBlock.
          */
 
         virtual uint8_t * AllocateBlock( int clientIndex, int bytes ) = 0;
 
         /**
             Attach data block to message.
+            Does nothing if no client is connected in this slot.
             @param clientIndex The index of the client this block belongs to.
             @param message The message to attach the block to. This message must be derived from BlockMessage.
             @param block Pointer to the block of data to attach. Must be created via Client::AllocateBlock.
@@ -5286,6 +7419,7 @@ namespace yojimbo
 
         /**
             Free a block of memory.
+            Does nothing if no client is connected in this slot, so free blocks by Adapter::OnServerClientDisconnected at the latest.
             @param clientIndex The index of the client this block belongs to.
             @param block The block of memory created by Client::AllocateBlock.
          */
@@ -5296,13 +7430,14 @@ namespace yojimbo
             Can we send a message to a particular client on a channel?
             @param clientIndex The index of the client to send a message to.
             @param channelIndex The channel index in range [0,numChannels-1].
-            @returns True if a message can be sent over the channel, false otherwise.
+            @returns True if a message can be sent over the channel, false otherwise. False if no client is connected in this slot.
          */
 
         virtual bool CanSendMessage( int clientIndex, int channelIndex ) const = 0;
 
         /**
             Send a message to a client over a channel.
+            Does nothing if no client is connected in this slot.
             @param clientIndex The index of the client to send a message to.
             @param channelIndex The channel index in range [0,numChannels-1].
             @param message The message to send.
@@ -5314,7 +7449,7 @@ namespace yojimbo
             Receive a message from a client over a channel.
             @param clientIndex The index of the client to receive messages from.
             @param channelIndex The channel index in range [0,numChannels-1].
-            @returns The message received, or NULL if no message is available. Make sure to release this message by calling Server::ReleaseMessage.
+            @returns The message received, or NULL if no message is available or no client is connected in this slot. Make sure to release this message by calling Server::ReleaseMessage.
          */
 
         virtual Message * ReceiveMessage( int clientIndex, int channelIndex ) = 0;
@@ -5322,6 +7457,7 @@ namespace yojimbo
         /**
             Release a message.
             Call this for messages received by Server::ReceiveMessage.
+            Does nothing if no client is connected in this slot, so release messages by Adapter::OnServerClientDisconnected at the latest.
             @param clientIndex The index of the client that the message belongs to.
             @param message The message to release.
          */
@@ -5409,6 +7545,10 @@ namespace yojimbo
 
         void SetDuplicates( float percent );
 
+        void SetLinkProfile( const NetworkLinkProfile & profile );
+
+        void SetPacketCapture( int clientIndex, PacketCapture * capture );
+
         Message * CreateMessage( int clientIndex, int type );
 
         uint8_t * AllocateBlock( int clientIndex, int bytes );
@@ -5439,7 +7579,7 @@ namespace yojimbo
 
         Allocator & GetGlobalAllocator() { yojimbo_assert( m_globalAllocator ); return *m_globalAllocator; }
 
-        MessageFactory & GetClientMessageFactory( int clientIndex );
+        MessageFactory * GetClientMessageFactory( int clientIndex );
 
         NetworkSimulator * GetNetworkSimulator() { return m_networkSimulator; }
 
@@ -5447,6 +7587,61 @@ namespace yojimbo
 
         Connection & GetClientConnection( int clientIndex );
 
+        WorkerThreads * GetWorkerThreads() { return m_workerThreads; }
+
+        uint8_t * GetWorkerPacketBuffer( int threadIndex );
+
+        /**
+            Create the per-client resources for a client slot and add it to the list of active clients.
+            The per-client memory, allocator, message factory and connection are taken from the free list if a client disconnected earlier, otherwise they are created. The reliable endpoint is always created.
+            Per-client work done each tick only visits active clients, so its cost scales with the number of connected clients rather than max clients.
+            Call this when a client connects.
+            @param clientIndex The index of the client slot.
+            @returns True if the client is active. False if the per-client resources could not be created, or the shared client memory pool doesn't have room for another client. Anything created for the slot is destroyed.
+         */
+
+        bool ActivateClient( int clientIndex );
+
+        /**
+            Create the message factory and connection for a client slot with the client allocator already set for the slot.
+            @param clientIndex The index of the client slot.
+            @returns True if they were created. False if the allocator is missing, or it or the message factory went into an error state. Anything created is left in the slot for DestroyClientResources.
+         */
+
+        bool CreateClientConnection( int clientIndex );
+
+        /**
+            Destroy the per-client memory, allocator, message factory and connection of a client slot instead of putting them on the free list.
+            Any of them may be NULL, so this cleans up after a client that failed to be created part way through.
+            @param clientIndex The index of the client slot.
+         */
+
+        void DestroyClientResources( int clientIndex );
+
+        /**
+            Measure how much of the shared client memory pool one client takes while its allocator, message factory and connection are created.
+            This is done once when the server starts, using a scratch memory pool, so the first client is held to the same headroom check as the rest.
+            @returns The number of bytes taken from the scratch memory pool, including the TLSF control structure and chunk rounding.
+         */
+
+        size_t MeasureClientBaseMemoryBytes();
+
+        /**
+            Remove a client from the list of active clients and return its per-client resources to the free list.
+            If the client allocator or message factory is in an error state, the resources are destroyed instead, so the error isn't passed on to the next client.
+            Messages created for this client must be released before calling this.
+            Call this when a client disconnects.
+            @param clientIndex The index of the client slot.
+         */
+
+        void DeactivateClient( int clientIndex );
+
+        bool IsClientActive( int clientIndex ) const { yojimbo_assert( clientIndex >= 0 ); yojimbo_assert( clientIndex < m_maxClients ); return m_activeClientIndex[clientIndex] >= 0; }
+
+        int GetNumActiveClients() const { return m_numActiveClients; }
+
+        const int * GetActiveClients() const { return m_activeClients; }
+
         virtual void TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
 
         virtual int ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
@@ -5469,14 +7664,26 @@ namespace yojimbo
         bool m_running;                                             ///< True if server is currently running, eg. after "Start" is called, before "Stop".
         double m_time;                                              ///< Current server time in seconds.
         uint8_t * m_globalMemory;                                   ///< The block of memory backing the global allocator. Allocated with m_allocator.
-        uint8_t * m_clientMemory[MaxClients];                       ///< The block of memory backing the per-client allocators. Allocated with m_allocator.
+        uint8_t ** m_clientMemory;                                  ///< The block of memory backing the per-client allocators. Allocated with m_allocator.
         Allocator * m_globalAllocator;                              ///< The global allocator. Used for allocations that don't belong to a specific client.
-        Allocator * m_clientAllocator[MaxClients];                  ///< Array of per-client allocator. These are used for allocations related to connected clients.
-        MessageFactory * m_clientMessageFactory[MaxClients];        ///< Array of per-client message factories. This silos message allocations per-client slot.
-        Connection * m_clientConnection[MaxClients];                ///< Array of per-client connection classes. This is how messages are exchanged with clients.
-        reliable_endpoint_t * m_clientEndpoint[MaxClients];         ///< Array of per-client reliable.io endpoints.
+        Allocator ** m_clientAllocator;                             ///< Array of per-client allocator. These are used for allocations related to connected clients.
+        MessageFactory ** m_clientMessageFactory;                   ///< Array of per-client message factories. This silos message allocations per-client slot.
+        Connection ** m_clientConnection;                           ///< Array of per-client connection classes. This is how messages are exchanged with clients.
+        reliable_endpoint_t ** m_clientEndpoint;                    ///< Array of per-client reliable.io endpoints.
         NetworkSimulator * m_networkSimulator;                      ///< The network simulator used to simulate packet loss, latency, jitter etc. Optional. 
         uint8_t * m_packetBuffer;                                   ///< Buffer used when writing packets.
+        WorkerThreads * m_workerThreads;                            ///< Worker threads for per-client work. NULL unless ClientServerConfig::serverWorkerThreads is set.
+        uint8_t ** m_workerPacketBuffer;                            ///< Buffer used when writing packets, per-thread. Index zero is the thread calling into the server.
+        int m_numActiveClients;                                     ///< Number of entries in the active client list.
+        int * m_activeClients;                                      ///< Indices of the client slots with a connected client, in no particular order.
+        int * m_activeClientIndex;                                  ///< Position of each client slot in the active client list, or -1 if the client is not active.
+        int m_numFreeClients;                                       ///< Number of entries in the per-client resource free list.
+        uint8_t ** m_freeClientMemory;                              ///< Free list of per-client memory blocks, left by disconnected clients.
+        Allocator ** m_freeClientAllocator;                         ///< Free list of per-client allocators.
+        MessageFactory ** m_freeClientMessageFactory;               ///< Free list of per-client message factories.
+        Connection ** m_freeClientConnection;                       ///< Free list of per-client connections.
+        MemoryPool * m_clientMemoryPool;                            ///< Memory pool shared by per-client allocators. NULL unless ClientServerConfig::serverClientMemoryPool is set.
+        size_t m_clientBaseMemoryBytes;                             ///< The most memory a client has taken from the shared memory pool while its allocator, message factory and connection were created, starting from a measurement made when the server starts. New clients are only created if the pool has this much room.
     };
 
     /**
@@ -5535,6 +7742,14 @@ namespace yojimbo
 
         static void StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
 
+        void SendPacketsWorkFunction( int threadIndex, int beginIndex, int endIndex );
+
+        static void StaticSendPacketsWorkFunction( void * context, int threadIndex, int beginIndex, int endIndex );
+
+        void ReceivePacketsWorkFunction( int threadIndex, int beginIndex, int endIndex );
+
+        static void StaticReceivePacketsWorkFunction( void * context, int threadIndex, int beginIndex, int endIndex );
+
         ClientServerConfig m_config;
         netcode_server_t * m_server;
         Address m_address;                                  // original address passed to ctor
@@ -5814,6 +8029,10 @@ namespace yojimbo
 
         void SetDuplicates( float percent );
 
+        void SetLinkProfile( const NetworkLinkProfile & profile );
+
+        void SetPacketCapture( PacketCapture * capture );
+
         Message * CreateMessage( int type );
 
         uint8_t * AllocateBlock( int bytes );
@@ -5881,6 +8100,7 @@ namespace yojimbo
         reliable_endpoint_t * m_endpoint;                                   ///< reliable.io endpoint.
         MessageFactory * m_messageFactory;                                  ///< The client message factory. Created and destroyed on each connection attempt.
         Connection * m_connection;                                          ///< The client connection for exchanging messages with the server.
+        PacketCapture * m_packetCapture;                                    ///< Packet capture attached to the client connection whenever it is created. Optional.
         NetworkSimulator * m_networkSimulator;                              ///< The network simulator used to simulate packet loss, latency, jitter etc. Optional. 
         ClientState m_clientState;                                          ///< The current client state. See ClientInterface::GetClientState
         int m_clientIndex;                                                  ///< The client slot index on the server [0,maxClients-1]. -1 if not connected.